@@ -0,0 +1,78 @@
+/*
+  Per-file entry points of the Gust tools, for gust_batch
+  Copyright © 2021 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The main_utf8() of each tool parses its command line into the options below, and calls
+// <tool>_process_file(), which gust_batch also calls directly for each file it processes.
+// These return 0 on success or -1 on error, and never prompt for a key.
+// app_path is the path of the executable (argv[0]), that the tools locate their data from.
+// nb_threads is the number of threads a tool can use for a file, or 0 for its default.
+
+typedef struct {
+    const char*     app_path;
+    bool            list_only;
+    bool            use_index;
+    bool            incremental;
+    bool            binary_manifest;
+    uint32_t        nb_threads;
+    const char**    globs;      // -x
+    const char**    names;      // -n
+    uint32_t        nb_globs;
+    uint32_t        nb_names;
+} pak_options;
+int gust_pak_process_file(const char* path, const pak_options* opt);
+
+typedef struct {
+    bool            list_only;
+    bool            decompress_only;
+    bool            save_index;
+    uint32_t        nb_threads;
+    const char**    extract_names;
+    uint32_t        nb_extract_names;
+} elixir_options;
+int gust_elixir_process_file(const char* path, const elixir_options* opt);
+
+typedef struct {
+    bool            list_only;
+    bool            flip_image;
+    uint32_t        nb_threads;
+} g1t_options;
+int gust_g1t_process_file(const char* path, const g1t_options* opt);
+
+typedef struct {
+    bool            list_only;
+} gmpk_options;
+int gust_gmpk_process_file(const char* path, const gmpk_options* opt);
+
+typedef struct {
+    bool            merge;
+    bool            only_changed;
+    uint32_t        nb_threads;
+} ebm_options;
+int gust_ebm_process_file(const char* path, const ebm_options* opt);
+
+typedef struct {
+    const char*     app_path;
+    const char*     game_id;    // NULL for the default game, or "auto" to detect it
+    int32_t         level;      // Compression level, or -1 for the game's default
+} enc_options;
+int gust_enc_process_file(const char* path, const enc_options* opt);
@@ -0,0 +1,46 @@
+/*
+  Microbenchmark harness for the Gust tools kernels
+  Copyright © 2019-2021 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Each tool compiled with GUST_BENCH provides a <tool>_bench() function (see Makefile), that
+// times its kernels over synthetic buffers of bench_size bytes with bench_kernel(), and
+// returns false on error.
+// A kernel processes its whole input once per call, and returns false on error.
+typedef bool (*bench_fn)(void* ctx);
+
+extern uint32_t bench_size;
+
+// Fill a buffer with reproducible pseudorandom data, that is LZ compressible if requested
+void bench_fill(uint8_t* buf, size_t size, uint32_t seed, bool compressible);
+
+// Whether the kernel was selected with -k (so that tools can skip expensive setups)
+bool bench_selected(const char* name);
+
+// Time a kernel that processes size bytes per call. Returns false if the kernel failed.
+bool bench_kernel(const char* name, bench_fn fn, void* ctx, size_t size);
+
+bool gust_pak_bench(void);
+bool gust_elixir_bench(void);
+bool gust_g1t_bench(void);
+bool gust_enc_bench(void);
+bool gust_gmpk_bench(void);
@@ -0,0 +1,259 @@
+/*
+  gust_batch - Process all the Gust files from a directory tree, in a single process
+  Copyright © 2021 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf8.h"
+#include "util.h"
+#include "batch.h"
+
+// The tools we link with, which are compiled with GUST_BATCH (see Makefile). These wrappers
+// call their per-file entry points with the defaults of the command line tools, except for
+// the number of threads, since we already process one file per thread.
+typedef int (*tool_process)(const char* path, const char* app_path, const char* game_id);
+
+static int process_pak(const char* path, const char* app_path, const char* game_id)
+{
+    const pak_options opt = { app_path, false, false, false, false, 1, NULL, NULL, 0, 0 };
+    (void)game_id;
+    return gust_pak_process_file(path, &opt);
+}
+
+static int process_elixir(const char* path, const char* app_path, const char* game_id)
+{
+    const elixir_options opt = { false, false, false, 1, NULL, 0 };
+    (void)app_path;
+    (void)game_id;
+    return gust_elixir_process_file(path, &opt);
+}
+
+static int process_g1t(const char* path, const char* app_path, const char* game_id)
+{
+    const g1t_options opt = { false, false, 1 };
+    (void)app_path;
+    (void)game_id;
+    return gust_g1t_process_file(path, &opt);
+}
+
+static int process_gmpk(const char* path, const char* app_path, const char* game_id)
+{
+    const gmpk_options opt = { false };
+    (void)app_path;
+    (void)game_id;
+    return gust_gmpk_process_file(path, &opt);
+}
+
+static int process_ebm(const char* path, const char* app_path, const char* game_id)
+{
+    const ebm_options opt = { false, false, 1 };
+    (void)app_path;
+    (void)game_id;
+    return gust_ebm_process_file(path, &opt);
+}
+
+static int process_enc(const char* path, const char* app_path, const char* game_id)
+{
+    const enc_options opt = { app_path, game_id, -1 };
+    return gust_enc_process_file(path, &opt);
+}
+
+typedef struct {
+    const char*     name;       // Used for the application path, that the tool locates its JSON data from
+    const char*     extension;
+    uint32_t        magic;      // Little endian magic that also identifies the file (0 if none)
+    tool_process    process;
+} batch_tool;
+
+static const batch_tool tools[] = {
+    { "gust_pak",       ".pak",         0,          process_pak },
+    { "gust_elixir",    ".elixir",      0x45415243, process_elixir },   // 'EARC'
+    { "gust_elixir",    ".elixir.gz",   0,          process_elixir },
+    { "gust_g1t",       ".g1t",         0x47315447, process_g1t },      // 'G1TG'
+    { "gust_gmpk",      ".gmpk",        0x4B504D47, process_gmpk },     // 'GMPK'
+    { "gust_ebm",       ".ebm",         0,          process_ebm },
+    { "gust_enc",       ".e",           0,          process_enc },
+};
+
+typedef struct {
+    char*       path;
+    uint32_t    tool;
+    int         result;
+} batch_job;
+
+// Data needed by the batch workers
+typedef struct {
+    batch_job*  jobs;
+    char        (*tool_path)[PATH_MAX];
+    const char* game_id;    // Optional game id for gust_enc
+} batch_ctx;
+
+static bool has_extension(const char* path, const char* extension)
+{
+    size_t len = strlen(path), ext_len = strlen(extension);
+    return (len > ext_len) && (stricmp(&path[len - ext_len], extension) == 0);
+}
+
+// Find the tool that can process a file, from its extension or its magic
+static uint32_t get_tool(const char* path)
+{
+    for (uint32_t i = 0; i < array_size(tools); i++) {
+        if (has_extension(path, tools[i].extension))
+            return i;
+    }
+    uint8_t buf[sizeof(uint32_t)];
+    FILE* file = fopen_utf8(path, "rb");
+    if (file == NULL)
+        return UINT32_MAX;
+    bool read = (fread(buf, 1, sizeof(buf), file) == sizeof(buf));
+    fclose(file);
+    if (!read)
+        return UINT32_MAX;
+    uint32_t magic = getle32(buf);
+    for (uint32_t i = 0; i < array_size(tools); i++) {
+        if (tools[i].magic != 0 && (magic == tools[i].magic || magic == bswap_uint32(tools[i].magic)))
+            return i;
+    }
+    return UINT32_MAX;
+}
+
+static bool process_job(void* _ctx, uint32_t thread_index, uint32_t i)
+{
+    batch_ctx* ctx = (batch_ctx*)_ctx;
+    batch_job* job = &ctx->jobs[i];
+    (void)thread_index;
+
+    job->result = tools[job->tool].process(job->path, ctx->tool_path[job->tool], ctx->game_id);
+    // Keep going on errors, as they are reported once all the files have been processed
+    return true;
+}
+
+int main_utf8(int argc, char** argv)
+{
+    int r = -1, argi;
+    uint32_t nb_threads = get_nb_cpus(), nb_jobs = 0, max_jobs = 0, nb_failed = 0;
+    char (*tool_path)[PATH_MAX] = NULL;
+    const char* game_id = NULL;
+    batch_job* jobs = NULL;
+    bool print_usage = false;
+
+    for (argi = 1; (argi < argc) && (argv[argi][0] == '-') && !print_usage; argi++) {
+        switch (argv[argi][1]) {
+        case 'j':
+            if (++argi >= argc) {
+                print_usage = true;
+                break;
+            }
+            if (!parse_nb_threads(argv[argi], &nb_threads))
+                print_usage = true;
+            break;
+        case 'g':
+            if (++argi >= argc) {
+                print_usage = true;
+                break;
+            }
+            game_id = argv[argi];
+            break;
+        default:
+            print_usage = true;
+            break;
+        }
+    }
+
+    if (print_usage || argi >= argc) {
+        printf("%s %s (c) 2021 VitaSmith\n\n"
+            "Usage: %s [-j N] [-g GAME_ID] <file|dir> [<file|dir>...]\n\n"
+            "Extract or convert all the Gust files (.pak, .elixir[.gz], .g1t, .gmpk, .ebm, .e)\n"
+            "found in the specified files or directory trees, using a single process.\n\n"
+            "Options:\n"
+            "  -j N        Process N files concurrently (0 = one per CPU, the default)\n"
+            "  -g GAME_ID  Use the seeds of GAME_ID when decoding .e files ('auto' to detect them)\n\n",
+            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]));
+        return 0;
+    }
+
+    // The tools locate their JSON data from their application path, so use our directory
+    tool_path = calloc(array_size(tools), PATH_MAX);
+    if (tool_path == NULL)
+        goto out;
+    const char* dir_name = _dirname(argv[0]);
+    for (uint32_t i = 0; i < array_size(tools); i++)
+        snprintf(tool_path[i], PATH_MAX, "%s%c%s", dir_name, PATH_SEP, tools[i].name);
+
+    // Collect all the files we know how to process
+    for (; argi < argc; argi++) {
+        char **list = NULL, path[PATH_MAX];
+        uint32_t nb_files = 1;
+        bool is_dir = is_directory(argv[argi]);
+        if (is_dir) {
+            nb_files = list_files(argv[argi], &list);
+            if (nb_files == UINT32_MAX)
+                goto out;
+        }
+        for (uint32_t i = 0; i < nb_files; i++) {
+            if (is_dir)
+                snprintf(path, sizeof(path), "%s%c%s", argv[argi], PATH_SEP, list[i]);
+            else
+                snprintf(path, sizeof(path), "%s", argv[argi]);
+            uint32_t tool = get_tool(path);
+            if (tool == UINT32_MAX)
+                continue;
+            if (nb_jobs >= max_jobs) {
+                max_jobs = max(2 * max_jobs, 64);
+                batch_job* new_jobs = realloc(jobs, max_jobs * sizeof(batch_job));
+                if (new_jobs == NULL) {
+                    free_file_list(list, nb_files);
+                    goto out;
+                }
+                jobs = new_jobs;
+            }
+            jobs[nb_jobs].path = strdup(path);
+            jobs[nb_jobs].tool = tool;
+            jobs[nb_jobs].result = -1;
+            if (jobs[nb_jobs++].path == NULL) {
+                free_file_list(list, nb_files);
+                goto out;
+            }
+        }
+        free_file_list(list, nb_files);
+    }
+
+    batch_ctx ctx = { jobs, tool_path, game_id };
+    if (!run_jobs(nb_threads, nb_jobs, process_job, &ctx))
+        goto out;
+
+    for (uint32_t i = 0; i < nb_jobs; i++) {
+        if (jobs[i].result != 0) {
+            fprintf(stderr, "ERROR: %s failed to process '%s'\n", tools[jobs[i].tool].name, jobs[i].path);
+            nb_failed++;
+        }
+    }
+    printf("\n%d file(s) processed, %d error(s)\n", nb_jobs, nb_failed);
+    r = (nb_failed == 0) ? 0 : -1;
+
+out:
+    for (uint32_t i = 0; i < nb_jobs; i++)
+        free(jobs[i].path);
+    free(jobs);
+    free(tool_path);
+    return r;
+}
+
+CALL_MAIN
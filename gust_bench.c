@@ -0,0 +1,302 @@
+/*
+  gust_bench - Microbenchmarks for the Gust tools kernels
+  Copyright © 2019-2021 VitaSmith
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utf8.h"
+#include "util.h"
+#include "parson.h"
+#include "bench.h"
+
+#define DEFAULT_BENCH_SIZE  (4 * 1024 * 1024)
+#define DEFAULT_REPS        5
+#define DEFAULT_THRESHOLD   10.0
+// Calls are batched so that each timed repetition lasts at least this long
+#define MIN_REP_TIME        (20 * 1000 * 1000ULL)
+#define MAX_RESULTS         128
+
+typedef struct {
+    const char* name;
+    size_t      size;
+    double      ns_per_byte;    // Best of all the repetitions
+    double      spread;         // Relative difference between the median and the best repetition
+} bench_result;
+
+uint32_t bench_size = DEFAULT_BENCH_SIZE;
+static uint32_t bench_reps = DEFAULT_REPS;
+static const char* bench_filter = NULL;
+static bench_result results[MAX_RESULTS];
+static uint32_t nb_results = 0;
+static bool bench_failed = false;
+
+// xorshift32, so that the inputs are the same on every platform
+static __inline uint32_t next_random(uint32_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+void bench_fill(uint8_t* buf, size_t size, uint32_t seed, bool compressible)
+{
+    uint32_t state = seed * 0x9e3779b9 + 0x3b;
+    if (state == 0)
+        state = 1;
+    if (!compressible) {
+        for (size_t i = 0; i < size; i++)
+            buf[i] = (uint8_t)(next_random(&state) >> 24);
+        return;
+    }
+    // Alternate runs of literals from a reduced alphabet with copies of earlier data,
+    // which roughly compresses like game assets do.
+    for (size_t i = 0; i < size; ) {
+        uint32_t r = next_random(&state);
+        size_t len = 3 + (r & 0x3f);
+        size_t dist = 1 + ((r >> 8) & 0xfff);
+        len = min(len, size - i);
+        if ((r >> 28) < 10 && dist <= i) {
+            for (size_t j = 0; j < len; j++, i++)
+                buf[i] = buf[i - dist];
+        } else {
+            for (size_t j = 0; j < len && j < 8; j++, i++)
+                buf[i] = (uint8_t)(0x20 + ((next_random(&state) >> 24) & 0x3f));
+        }
+    }
+}
+
+bool bench_selected(const char* name)
+{
+    return (bench_filter == NULL || strstr(name, bench_filter) != NULL);
+}
+
+static int cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+bool bench_kernel(const char* name, bench_fn fn, void* ctx, size_t size)
+{
+    if (!bench_selected(name))
+        return true;
+    if (nb_results >= MAX_RESULTS) {
+        fprintf(stderr, "ERROR: Too many kernels\n");
+        bench_failed = true;
+        return false;
+    }
+
+    // The warm-up call also tells us how many calls each repetition needs
+    uint64_t start = get_time_ns();
+    if (!fn(ctx))
+        goto fail;
+    uint64_t elapsed = get_time_ns() - start;
+    uint64_t nb_calls = (elapsed >= MIN_REP_TIME) ? 1 : 1 + MIN_REP_TIME / max(elapsed, 1);
+
+    double* ns = calloc(bench_reps, sizeof(double));
+    if (ns == NULL)
+        goto fail;
+    for (uint32_t rep = 0; rep < bench_reps; rep++) {
+        start = get_time_ns();
+        for (uint64_t i = 0; i < nb_calls; i++) {
+            if (!fn(ctx)) {
+                free(ns);
+                goto fail;
+            }
+        }
+        ns[rep] = (double)(get_time_ns() - start) / (double)nb_calls;
+    }
+    qsort(ns, bench_reps, sizeof(double), cmp_double);
+
+    bench_result* res = &results[nb_results++];
+    res->name = name;
+    res->size = size;
+    res->ns_per_byte = (size == 0) ? 0.0 : ns[0] / (double)size;
+    res->spread = (ns[0] == 0.0) ? 0.0 : ns[bench_reps / 2] / ns[0] - 1.0;
+    free(ns);
+    printf("%-28s %10zu %10.3f %10.1f %7.1f%%\n", name, size, res->ns_per_byte,
+        (res->ns_per_byte == 0.0) ? 0.0 : 1.0e9 / (res->ns_per_byte * 1024.0 * 1024.0),
+        100.0 * res->spread);
+    fflush(stdout);
+    return true;
+
+fail:
+    fprintf(stderr, "ERROR: Kernel '%s' failed\n", name);
+    bench_failed = true;
+    return false;
+}
+
+static bool write_results(const char* path)
+{
+    JSON_Value* json = json_value_init_object();
+    JSON_Value* json_kernels = json_value_init_object();
+    if (json == NULL || json_kernels == NULL) {
+        json_value_free(json);
+        json_value_free(json_kernels);
+        return false;
+    }
+    JSON_Object* root = json_object(json);
+    json_object_set_number(root, "size", bench_size);
+    json_object_set_number(root, "reps", bench_reps);
+    json_object_set_value(root, "kernels", json_kernels);
+    for (uint32_t i = 0; i < nb_results; i++) {
+        JSON_Value* json_kernel = json_value_init_object();
+        JSON_Object* kernel = json_object(json_kernel);
+        json_object_set_number(kernel, "bytes", (double)results[i].size);
+        // Our JSON numbers are integers, so use picoseconds
+        json_object_set_number(kernel, "ps_per_byte", (double)(uint64_t)(results[i].ns_per_byte * 1000.0 + 0.5));
+        json_object_set_value(json_object(json_kernels), results[i].name, json_kernel);
+    }
+    bool r = (json_serialize_to_file_pretty(json, path) == JSONSuccess);
+    json_value_free(json);
+    if (!r)
+        fprintf(stderr, "ERROR: Can't write '%s'\n", path);
+    return r;
+}
+
+// Compare the results with a baseline from -o, and return the number of regressions
+static uint32_t compare_results(const char* path, double threshold)
+{
+    uint32_t nb_regressions = 0;
+    JSON_Value* json = json_parse_file_with_comments(path);
+    JSON_Object* kernels = json_object_get_object(json_object(json), "kernels");
+    if (kernels == NULL) {
+        fprintf(stderr, "ERROR: Can't read baseline '%s'\n", path);
+        json_value_free(json);
+        return UINT32_MAX;
+    }
+    if (json_object_get_uint32(json_object(json), "size") != bench_size)
+        fprintf(stderr, "WARNING: Baseline was created with a different size\n");
+
+    printf("\n%-28s %10s %10s %9s\n", "KERNEL", "BASE ns/B", "ns/B", "DELTA");
+    for (uint32_t i = 0; i < nb_results; i++) {
+        JSON_Object* kernel = json_object_get_object(kernels, results[i].name);
+        double base = json_object_get_number(kernel, "ps_per_byte") / 1000.0;
+        if (kernel == NULL || base <= 0.0) {
+            printf("%-28s %10s %10.3f %9s\n", results[i].name, "-", results[i].ns_per_byte, "new");
+            continue;
+        }
+        double delta = 100.0 * (results[i].ns_per_byte / base - 1.0);
+        bool regressed = (delta > threshold);
+        printf("%-28s %10.3f %10.3f %+8.1f%%%s\n", results[i].name, base, results[i].ns_per_byte,
+            delta, regressed ? "  REGRESSION" : "");
+        if (regressed)
+            nb_regressions++;
+    }
+    json_value_free(json);
+    return nb_regressions;
+}
+
+int main_utf8(int argc, char** argv)
+{
+    int r = -1, argi;
+    bool print_usage = false;
+    const char *output_path = NULL, *baseline_path = NULL;
+    double threshold = DEFAULT_THRESHOLD;
+
+    for (argi = 1; (argi < argc) && !print_usage; argi++) {
+        if (argv[argi][0] != '-' || argv[argi][1] == 0 || argv[argi][2] != 0 || argi + 1 >= argc) {
+            print_usage = true;
+            break;
+        }
+        const char* val = argv[++argi];
+        char* end;
+        switch (argv[argi - 1][1]) {
+        case 's':
+            bench_size = (uint32_t)strtoul(val, &end, 0);
+            if (*end == 'k' || *end == 'K')
+                bench_size *= 1024;
+            else if (*end == 'm' || *end == 'M')
+                bench_size *= 1024 * 1024;
+            // Keep the size a multiple of the largest block or pixel size that kernels use
+            bench_size &= ~0x3fU;
+            if (bench_size == 0 || bench_size > 256 * 1024 * 1024)
+                print_usage = true;
+            break;
+        case 'r':
+            bench_reps = (uint32_t)atoi(val);
+            if (bench_reps == 0)
+                print_usage = true;
+            break;
+        case 'k':
+            bench_filter = val;
+            break;
+        case 'o':
+            output_path = val;
+            break;
+        case 'c':
+            baseline_path = val;
+            break;
+        case 't':
+            threshold = atof(val);
+            break;
+        default:
+            print_usage = true;
+            break;
+        }
+    }
+
+    if (print_usage) {
+        printf("%s %s (c) 2019-2021 VitaSmith\n\n"
+            "Usage: %s [-s SIZE] [-r N] [-k NAME] [-o FILE] [-c FILE [-t PCT]]\n\n"
+            "Time the tools kernels over reproducible synthetic data.\n\n"
+            "Options:\n"
+            "  -s SIZE  Size of the input data, with an optional K or M suffix (default: 4M)\n"
+            "  -r N     Number of timed repetitions, after a warm-up call (default: %d)\n"
+            "  -k NAME  Only run the kernels whose name contains NAME\n"
+            "  -o FILE  Save the results to FILE, for use as a baseline\n"
+            "  -c FILE  Compare the results with the baseline from FILE\n"
+            "  -t PCT   Report a regression if a kernel is more than PCT%% slower (default: %.0f)\n\n"
+            "Each kernel is timed over batches of calls that last at least %d ms, and the\n"
+            "best repetition is reported. SPREAD is how much slower the median one is.\n",
+            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]), DEFAULT_REPS,
+            DEFAULT_THRESHOLD, (int)(MIN_REP_TIME / 1000000));
+        return 0;
+    }
+
+    printf("%-28s %10s %10s %10s %8s\n", "KERNEL", "BYTES", "ns/B", "MB/s", "SPREAD");
+    if (!gust_pak_bench() || !gust_elixir_bench() || !gust_g1t_bench() ||
+        !gust_enc_bench() || !gust_gmpk_bench() || bench_failed)
+        goto out;
+    if (nb_results == 0) {
+        fprintf(stderr, "ERROR: No kernel matches '%s'\n", bench_filter);
+        goto out;
+    }
+
+    if (output_path != NULL && !write_results(output_path))
+        goto out;
+    if (baseline_path != NULL) {
+        uint32_t nb_regressions = compare_results(baseline_path, threshold);
+        if (nb_regressions == UINT32_MAX)
+            goto out;
+        if (nb_regressions != 0) {
+            printf("\n%u kernel(s) regressed by more than %.1f%%\n", nb_regressions, threshold);
+            r = 1;
+            goto out;
+        }
+    }
+    r = 0;
+
+out:
+    return r;
+}
+
+CALL_MAIN
@@ -17,78 +17,329 @@
 */
 
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #include "utf8.h"
 #include "util.h"
 
-#define BUFFER_SIZE 65536
+#define BLOCK_SIZE 65536
 
-static uint64_t compare_files(const char* path1, const char* path2)
+typedef enum {
+    CMP_SAME = 0,
+    CMP_SIZE_DIFFERS,
+    CMP_DATA_DIFFERS,
+    CMP_ONLY_IN_FIRST,
+    CMP_ONLY_IN_SECOND,
+    CMP_ERROR,
+} cmp_result;
+
+typedef struct {
+    cmp_result  result;
+    uint64_t    offset;     // First differing offset for data mismatches
+    uint64_t    hash;
+    uint64_t    size;
+} cmp_status;
+
+static cmp_result compare_files(const char* path1, const char* path2, uint64_t* offset)
 {
-    uint64_t r = UINT64_MAX, pos = 0;
-    uint8_t buf1[BUFFER_SIZE], buf2[BUFFER_SIZE];
-    FILE *f1 = NULL, *f2 = NULL;
-    f1 = fopen_utf8(path1, "rb");
-    if (f1 == NULL) {
-        fprintf(stderr, "Cannot open '%s'\n", path1);
+    cmp_result r = CMP_ERROR;
+    file_view v1, v2 = { 0 };
+    if (!open_file_view(path1, &v1, false))
+        return CMP_ERROR;
+    if (!open_file_view(path2, &v2, false))
         goto out;
-    }
-    f2 = fopen_utf8(path2, "rb");
-    if (f2 == NULL) {
-        fprintf(stderr, "Cannot open '%s'\n", path2);
-        goto out;
-    }
 
-    _fseeki64(f1, 0L, SEEK_END);
-    _fseeki64(f2, 0L, SEEK_END);
-    if (_ftelli64(f1) != _ftelli64(f2)) {
-        fprintf(stderr, "Files differ in size\n");
+    r = CMP_SIZE_DIFFERS;
+    if (v1.size != v2.size)
         goto out;
-    }
-    _fseeki64(f1, 0L, SEEK_SET);
-    _fseeki64(f2, 0L, SEEK_SET);
-
-    while (1) {
-        size_t read1 = fread(buf1, 1, BUFFER_SIZE, f1);
-        size_t read2 = fread(buf2, 1, BUFFER_SIZE, f2);
-        if (read1 != read2) {
-            fprintf(stderr, "Read error\n");
-            goto out;
-        }
-        for (size_t i = 0; i < read1; i++) {
-            if (buf1[i] != buf2[i]) {
-                r = pos + i;
-                fprintf(stderr, "Files differ at offset 0x%09llx\n", r);
-                goto out;
-            }
-        }
-        if ((feof(f1) != 0) && (feof(f2) != 0))
+    r = CMP_SAME;
+    uint64_t start = stats_start();
+    // Compare whole blocks with memcmp(), and only look for the exact offset on mismatch
+    for (uint64_t pos = 0; pos < v1.size; pos += BLOCK_SIZE) {
+        size_t size = (size_t)min(v1.size - pos, BLOCK_SIZE);
+        if (memcmp(&v1.data[pos], &v2.data[pos], size) != 0) {
+            size_t i;
+            for (i = 0; v1.data[pos + i] == v2.data[pos + i]; i++);
+            *offset = pos + i;
+            r = CMP_DATA_DIFFERS;
             break;
+        }
     }
-    r = 0;
+    stats_stop("compare", start, 2 * v1.size);
 
 out:
-    if (f1 != NULL)
-        fclose(f1);
-    if (f2 != NULL)
-        fclose(f2);
+    close_file_view(&v1);
+    close_file_view(&v2);
     return r;
 }
 
+static bool hash_file(const char* path, uint64_t* hash, uint64_t* size)
+{
+    file_view v;
+    if (!open_file_view(path, &v, false))
+        return false;
+    uint64_t start = stats_start();
+    *hash = xxhash64(v.data, (size_t)v.size, 0);
+    stats_stop("hash", start, v.size);
+    *size = v.size;
+    close_file_view(&v);
+    return true;
+}
+
+// Data needed by the comparison/hashing workers
+typedef struct {
+    const char*     dir[2];     // Directories, or files if names is NULL
+    const char**    names;      // Relative path of each file
+    cmp_status*     status;
+    bool            hash_mode;
+} cmp_ctx;
+
+static void get_path(char* path, size_t size, const char* dir, const char** names, uint32_t i)
+{
+    if (names == NULL)
+        snprintf(path, size, "%s", dir);
+    else
+        snprintf(path, size, "%s%c%s", dir, PATH_SEP, names[i]);
+}
+
+static bool process_file(void* _ctx, uint32_t thread_index, uint32_t i)
+{
+    cmp_ctx* ctx = (cmp_ctx*)_ctx;
+    char path1[PATH_MAX], path2[PATH_MAX];
+    (void)thread_index;
+
+    // Files that only exist on one side have already been taken care of
+    if (ctx->status[i].result != CMP_SAME)
+        return true;
+    get_path(path1, sizeof(path1), ctx->dir[0], ctx->names, i);
+    if (ctx->hash_mode) {
+        if (!hash_file(path1, &ctx->status[i].hash, &ctx->status[i].size))
+            ctx->status[i].result = CMP_ERROR;
+    } else {
+        get_path(path2, sizeof(path2), ctx->dir[1], ctx->names, i);
+        ctx->status[i].result = compare_files(path1, path2, &ctx->status[i].offset);
+    }
+    return true;
+}
+
+// Manifests use '/' as separator, so that they can be shared between platforms
+static void to_manifest_name(char* name)
+{
+    for (size_t i = 0; name[i] != 0; i++)
+        if (name[i] == '\\')
+            name[i] = '/';
+}
+
+static void from_manifest_name(char* name)
+{
+    for (size_t i = 0; name[i] != 0; i++)
+        if (name[i] == '/')
+            name[i] = PATH_SEP;
+}
+
+static int strcmp_ptr(const void* a, const void* b)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+// Returns the index of name in the sorted list, or UINT32_MAX if not found
+static uint32_t find_file(const char** names, uint32_t nb_files, const char* path, const char* name)
+{
+    if (names == NULL)
+        return (strcmp(name, _basename(path)) == 0) ? 0 : UINT32_MAX;
+    const char** match = bsearch(&name, names, nb_files, sizeof(char*), strcmp_ptr);
+    return (match == NULL) ? UINT32_MAX : (uint32_t)(match - names);
+}
+
 int main_utf8(int argc, char** argv)
 {
-    if (argc != 3) {
+    int r = -1, argi;
+    uint32_t nb_threads = 1, nb_files = 0, nb_files1 = 0, nb_files2 = 0, nb_differ = 0;
+    char **list1 = NULL, **list2 = NULL, *manifest_path = NULL, line[PATH_MAX + 64];
+    const char** names = NULL;
+    cmp_status* status = NULL;
+    bool print_usage = false, write_manifest = false, check_manifest = false;
+    FILE* manifest = NULL;
+    cmp_ctx ctx = { { NULL, NULL }, NULL, NULL, false };
+
+    for (argi = 1; (argi < argc - 1) && (argv[argi][0] == '-') && !print_usage; argi++) {
+        switch (argv[argi][1]) {
+        case 'j':
+            if (++argi >= argc - 1) {
+                print_usage = true;
+                break;
+            }
+            if (!parse_nb_threads(argv[argi], &nb_threads))
+                print_usage = true;
+            break;
+        case 'w':
+        case 'c':
+            if (++argi >= argc - 1) {
+                print_usage = true;
+                break;
+            }
+            write_manifest = (argv[argi - 1][1] == 'w');
+            check_manifest = !write_manifest;
+            manifest_path = argv[argi];
+            break;
+        default:
+            print_usage = true;
+            break;
+        }
+    }
+    ctx.hash_mode = write_manifest || check_manifest;
+
+    if (print_usage || (argc - argi != (ctx.hash_mode ? 1 : 2))) {
         printf("%s %s (c) 2019-2021 VitaSmith\n\n"
-            "Usage: %s <file2> <file2>\n\n"
-            "Coompare two binary files.\n\n",
-            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]));
+            "Usage: %s [-j N] <file1|dir1> <file2|dir2>\n"
+            "       %s [-j N] -w|-c <manifest> <file|dir>\n\n"
+            "Compare two binary files, or two directory trees.\n\n"
+            "Options:\n"
+            "  -j N           Use N threads (0 = one thread per CPU)\n"
+            "  -w <manifest>  Write the hashes of the file(s) to <manifest>\n"
+            "  -c <manifest>  Check the file(s) against the hashes from <manifest>\n\n",
+            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]), _appname(argv[0]));
         return -1;
     }
+    ctx.dir[0] = argv[argi];
+    ctx.dir[1] = ctx.hash_mode ? NULL : argv[argi + 1];
+
+    if (!is_directory(ctx.dir[0])) {
+        // Single file: hash it or compare it, using the base name in manifests
+        nb_files = 1;
+        status = calloc(1, sizeof(cmp_status));
+        if (status == NULL)
+            goto out;
+    } else {
+        if (ctx.dir[1] != NULL && !is_directory(ctx.dir[1])) {
+            fprintf(stderr, "ERROR: '%s' is not a directory\n", ctx.dir[1]);
+            goto out;
+        }
+        nb_files1 = list_files(ctx.dir[0], &list1);
+        if (nb_files1 == UINT32_MAX)
+            goto out;
+        if (ctx.dir[1] != NULL) {
+            nb_files2 = list_files(ctx.dir[1], &list2);
+            if (nb_files2 == UINT32_MAX)
+                goto out;
+        }
+        // Merge both sorted lists, flagging the files that only exist on one side
+        names = calloc((size_t)nb_files1 + nb_files2 + 1, sizeof(char*));
+        status = calloc((size_t)nb_files1 + nb_files2 + 1, sizeof(cmp_status));
+        if (names == NULL || status == NULL)
+            goto out;
+        for (uint32_t i = 0, j = 0; i < nb_files1 || j < nb_files2; nb_files++) {
+            int c = (i >= nb_files1) ? 1 : ((j >= nb_files2) ? -1 : strcmp(list1[i], list2[j]));
+            if (c < 0 && ctx.dir[1] != NULL)
+                status[nb_files].result = CMP_ONLY_IN_FIRST;
+            else if (c > 0)
+                status[nb_files].result = CMP_ONLY_IN_SECOND;
+            names[nb_files] = (c > 0) ? list2[j] : list1[i];
+            if (c <= 0)
+                i++;
+            if (c >= 0)
+                j++;
+        }
+        ctx.names = names;
+    }
+    ctx.status = status;
+
+    if (!run_jobs(nb_threads, nb_files, process_file, &ctx))
+        goto out;
 
-    return (compare_files(argv[1], argv[2]) == 0) ? 0 : -1;
+    if (write_manifest) {
+        manifest = fopen_utf8(manifest_path, "w");
+        if (manifest == NULL) {
+            fprintf(stderr, "ERROR: Can't create '%s'\n", manifest_path);
+            goto out;
+        }
+    } else if (check_manifest) {
+        manifest = fopen_utf8(manifest_path, "r");
+        if (manifest == NULL) {
+            fprintf(stderr, "ERROR: Can't open '%s'\n", manifest_path);
+            goto out;
+        }
+    }
+
+    char name[PATH_MAX];
+    if (check_manifest) {
+        bool* seen = calloc(max(nb_files, 1), sizeof(bool));
+        if (seen == NULL)
+            goto out;
+        while (fgets(line, sizeof(line), manifest) != NULL) {
+            uint64_t hash, size;
+            int n = 0;
+            if (sscanf(line, "%" SCNx64 " %" SCNu64 " %n", &hash, &size, &n) != 2 || n == 0)
+                continue;
+            line[strcspn(line, "\r\n")] = 0;
+            snprintf(name, sizeof(name), "%s", &line[n]);
+            from_manifest_name(name);
+            uint32_t i = find_file(names, nb_files, ctx.dir[0], name);
+            if (i == UINT32_MAX) {
+                printf("Missing: %s\n", &line[n]);
+                nb_differ++;
+                continue;
+            }
+            seen[i] = true;
+            if (status[i].result == CMP_ERROR) {
+                nb_differ++;
+            } else if (status[i].hash != hash || status[i].size != size) {
+                printf("Differs: %s\n", &line[n]);
+                nb_differ++;
+            }
+        }
+        for (uint32_t i = 0; i < nb_files; i++) {
+            if (!seen[i]) {
+                printf("Not in manifest: %s\n", (names == NULL) ? _basename(ctx.dir[0]) : names[i]);
+                nb_differ++;
+            }
+        }
+        free(seen);
+    } else {
+        for (uint32_t i = 0; i < nb_files; i++) {
+            const char* file_name = (names == NULL) ? _basename(ctx.dir[0]) : names[i];
+            switch (status[i].result) {
+            case CMP_SAME:
+                if (write_manifest) {
+                    snprintf(name, sizeof(name), "%s", file_name);
+                    to_manifest_name(name);
+                    fprintf(manifest, "%016" PRIx64 " %" PRIu64 " %s\n", status[i].hash, status[i].size, name);
+                }
+                continue;
+            case CMP_SIZE_DIFFERS:
+                printf("Files differ in size: %s\n", file_name);
+                break;
+            case CMP_DATA_DIFFERS:
+                printf("Files differ at offset 0x%09" PRIx64 ": %s\n", status[i].offset, file_name);
+                break;
+            case CMP_ONLY_IN_FIRST:
+                printf("Only in '%s': %s\n", ctx.dir[0], file_name);
+                break;
+            case CMP_ONLY_IN_SECOND:
+                printf("Only in '%s': %s\n", ctx.dir[1], file_name);
+                break;
+            default:
+                break;
+            }
+            nb_differ++;
+        }
+    }
+    if (names != NULL)
+        printf("%d file(s) processed, %d difference(s)\n", nb_files, nb_differ);
+    r = (nb_differ == 0) ? 0 : -1;
+
+out:
+    if (manifest != NULL)
+        fclose(manifest);
+    free(names);
+    free(status);
+    free_file_list(list1, nb_files1);
+    free_file_list(list2, nb_files2);
+    return r;
 }
 
 CALL_MAIN
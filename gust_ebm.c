@@ -16,6 +16,7 @@
   along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -25,6 +26,7 @@
 #include "utf8.h"
 #include "util.h"
 #include "parson.h"
+#include "batch.h"
 
 #define JSON_VERSION            2
 #define MAX_STRING_SIZE         2048
@@ -44,213 +46,698 @@
     uint32_t duration2[]        // [OPTIONAL] Probably duration values. Used by NOA2, Ryza 2, Sophie 2
  */
 
-uint32_t duration1_length[] = { 0, 2 };
-uint32_t duration2_length[] = { 0, 1, 2 };
+static const uint32_t duration1_length[] = { 0, 2 };
+static const uint32_t duration2_length[] = { 0, 1, 2 };
 
-int main_utf8(int argc, char** argv)
+// Name of the JSON file that holds all the .ebm of a directory, when using -m
+#define MERGED_JSON_NAME        "ebm.json"
+
+typedef struct {
+    uint32_t    type;
+    uint32_t    voice_id;
+    uint32_t    unknown1;
+    uint32_t    name_id;
+    uint32_t    extra_id;
+    uint32_t    expr_id;
+    uint32_t    duration1[2];
+    uint32_t    msg_id;
+    uint32_t    unknown2;
+    uint32_t    msg_length;
+    const char* msg_string;     // Points into the file data
+    uint32_t    duration2[2];
+} ebm_message;
+
+typedef struct {
+    int32_t         nb_messages;
+    uint32_t        d1, d2;                 // Number of duration1 and duration2 values
+    ebm_message*    messages;
+    const uint8_t*  extra_data;
+    uint32_t        extra_data_count;       // In 32-bit words
+} ebm_data;
+
+// Scratch buffers, that are reused across files, so that bulk conversion doesn't
+// need any allocation per file or per message.
+enum {
+    SCRATCH_FILE,       // Content of the .ebm, followed by zero padding
+    SCRATCH_MESSAGES,   // Parsed messages
+    SCRATCH_OUTPUT,     // Re-encoded .ebm
+    SCRATCH_MAX
+};
+
+typedef struct {
+    uint8_t*    buf[SCRATCH_MAX];
+    size_t      size[SCRATCH_MAX];
+} scratch_arena;
+
+// Return a scratch buffer of at least size bytes. Its previous content is not preserved.
+static uint8_t* get_scratch(scratch_arena* arena, uint32_t slot, size_t size)
+{
+    if (size > arena->size[slot]) {
+        free(arena->buf[slot]);
+        arena->size[slot] = max(size, 2 * arena->size[slot]);
+        arena->buf[slot] = malloc(arena->size[slot]);
+        if (arena->buf[slot] == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate scratch buffer\n");
+            arena->size[slot] = 0;
+        }
+    }
+    return arena->buf[slot];
+}
+
+static void free_scratch(scratch_arena* arena)
+{
+    for (uint32_t i = 0; i < SCRATCH_MAX; i++)
+        free(arena->buf[i]);
+    memset(arena, 0, sizeof(scratch_arena));
+}
+
+static bool has_extension(const char* path, const char* extension)
+{
+    size_t len = strlen(path), ext_len = strlen(extension);
+    return (len > ext_len) && (stricmp(&path[len - ext_len], extension) == 0);
+}
+
+// Path of the file with the same name as path, but a different extension, in the same directory
+static void sibling_path(const char* path, const char* extension, char* sibling)
+{
+    size_t dir_len = get_trailing_slash(path);
+    snprintf(sibling, PATH_MAX, "%.*s%s", (int)dir_len, path, change_extension(path, extension));
+}
+
+// Read a whole .ebm into the file scratch buffer, with enough zero padding for a partial last word
+static uint8_t* read_ebm_file(const char* path, scratch_arena* arena, uint32_t* size)
 {
-    int r = -1;
     uint8_t* buf = NULL;
-    char *ebm_message, path[PATH_MAX];
-    FILE* file = NULL;
-    JSON_Value* json = NULL;
+    uint64_t file_size = get_file_size(path);
+    if (file_size >= UINT32_MAX - sizeof(uint32_t)) {
+        fprintf(stderr, "ERROR: Can't read '%s'\n", path);
+        return NULL;
+    }
+    FILE* file = fopen_utf8(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Can't open '%s'\n", path);
+        return NULL;
+    }
+    buf = get_scratch(arena, SCRATCH_FILE, (size_t)file_size + sizeof(uint32_t));
+    if (buf != NULL) {
+        uint64_t start = stats_start();
+        if (fread(buf, 1, (size_t)file_size, file) == (size_t)file_size) {
+            memset(&buf[file_size], 0, sizeof(uint32_t));
+            *size = (uint32_t)file_size;
+            stats_stop("read", start, file_size);
+        } else {
+            fprintf(stderr, "ERROR: Can't read '%s'\n", path);
+            buf = NULL;
+        }
+    }
+    fclose(file);
+    return buf;
+}
 
-    if (argc != 2) {
-        printf("%s %s (c) 2019-2022 VitaSmith\n\n"
-            "Usage: %s <file>\n\n"
-            "Convert a .ebm file to or from an editable JSON file.\n\n",
-            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]));
-        return 0;
+static bool parse_ebm(const uint8_t* buf, uint32_t buf_size, scratch_arena* arena, ebm_data* ebm)
+{
+    if (buf_size < sizeof(uint32_t)) {
+        fprintf(stderr, "ERROR: File is too small\n");
+        return false;
+    }
+    ebm->nb_messages = (int32_t)getle32(buf);
+    const uint32_t nb_messages = (uint32_t)abs(ebm->nb_messages);
+    // A message is at least 9 words, followed by its NUL terminated string
+    if ((buf_size - sizeof(uint32_t)) / (9 * sizeof(uint32_t) + 1) < nb_messages) {
+        fprintf(stderr, "ERROR: Invalid number of entries\n");
+        return false;
     }
 
-    if (strstr(argv[argc - 1], ".json") != NULL) {
-        json = json_parse_file_with_comments(argv[argc - 1]);
-        if (json == NULL) {
-            fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", argv[argc - 1]);
-            goto out;
+    // Detect the length of the structure we will work with
+    uint32_t d1, d2;
+    for (d1 = 0; d1 < array_size(duration1_length); d1++) {
+        for (d2 = 0; d2 < array_size(duration2_length); d2++) {
+            uint64_t pos = sizeof(uint32_t);
+            bool good_candidate = true;
+            for (uint32_t i = 0; i < nb_messages && good_candidate; i++) {
+                uint64_t str = pos + (9 + duration1_length[d1]) * sizeof(uint32_t);
+                if (str > buf_size) {
+                    good_candidate = false;
+                    break;
+                }
+                uint32_t len = getle32(&buf[str - sizeof(uint32_t)]);
+                good_candidate = (len != 0 && len <= MAX_STRING_SIZE && str + len <= buf_size);
+                if (!good_candidate)
+                    break;
+                for (uint32_t j = 0; (j < len - 1) && good_candidate; j++)
+                    good_candidate = (buf[str + j] != 0);
+                pos = str + len + duration2_length[d2] * sizeof(uint32_t);
+                good_candidate = good_candidate && (pos <= buf_size);
+            }
+            if (good_candidate)
+                goto detected;
         }
-        const uint32_t json_version = json_object_get_uint32(json_object(json), "json_version");
-        if (json_version != JSON_VERSION) {
-            fprintf(stderr, "ERROR: This utility is not compatible with the JSON file provided.\n"
-                "You need to (re)extract the '.ebm' using this application.\n");
-            goto out;
+    }
+detected:
+    if (d1 >= array_size(duration1_length) || d2 >= array_size(duration2_length)) {
+        fprintf(stderr, "ERROR: Failed to detect EBM record structure (Unsupported?)\n");
+        return false;
+    }
+    ebm->d1 = duration1_length[d1];
+    ebm->d2 = duration2_length[d2];
+
+    ebm->messages = (ebm_message*)get_scratch(arena, SCRATCH_MESSAGES, max(nb_messages, 1) * sizeof(ebm_message));
+    if (ebm->messages == NULL)
+        return false;
+    const uint8_t* p = &buf[sizeof(uint32_t)];
+    for (uint32_t i = 0; i < nb_messages; i++) {
+        ebm_message* m = &ebm->messages[i];
+        m->type = getle32(p); p += sizeof(uint32_t);
+        if (m->type > 0x10)
+            fprintf(stderr, "WARNING: Unexpected header type 0x%08x\n", m->type);
+        m->voice_id = getle32(p); p += sizeof(uint32_t);
+        m->unknown1 = getle32(p); p += sizeof(uint32_t);
+        m->name_id = getle32(p); p += sizeof(uint32_t);
+        m->extra_id = getle32(p); p += sizeof(uint32_t);
+        m->expr_id = getle32(p); p += sizeof(uint32_t);
+        for (uint32_t x = 0; x < ebm->d1; x++, p += sizeof(uint32_t))
+            m->duration1[x] = getle32(p);
+        m->msg_id = getle32(p); p += sizeof(uint32_t);
+        m->unknown2 = getle32(p); p += sizeof(uint32_t);
+        m->msg_length = getle32(p); p += sizeof(uint32_t);
+        m->msg_string = (const char*)p;
+        p += m->msg_length;
+        if (p[-1] != 0) {
+            fprintf(stderr, "ERROR: Unterminated message string\n");
+            return false;
         }
-        snprintf(path, sizeof(path), "%s%c%s", _dirname(argv[argc - 1]), PATH_SEP,
-            json_object_get_string(json_object(json), "name"));
-        printf("Creating '%s' from JSON...\n", path);
-        create_backup(path);
-        file = fopen_utf8(path, "wb");
-        if (file == NULL) {
-            fprintf(stderr, "ERROR: Cannot create file '%s'\n", path);
-            goto out;
+        for (uint32_t x = 0; x < ebm->d2; x++, p += sizeof(uint32_t))
+            m->duration2[x] = getle32(p);
+    }
+    ebm->extra_data = p;
+    ebm->extra_data_count = (uint32_t)((&buf[buf_size] - p + sizeof(uint32_t) - 1) / sizeof(uint32_t));
+    return true;
+}
+
+// The JSON data holds the extra data as 32-bit words, so a partial last word gets
+// re-encoded with zero padding. The hash covers the data the same way, so that the
+// hash of an unmodified JSON always matches the one that was recorded.
+static uint64_t hash_ebm(const uint8_t* buf, const ebm_data* ebm)
+{
+    return xxhash64(buf, (size_t)(ebm->extra_data - buf) + ebm->extra_data_count * sizeof(uint32_t), 0);
+}
+
+// Write the JSON object of a parsed .ebm. The hash is only recorded for bulk conversion.
+static void write_ebm_json(JSON_Writer* w, const ebm_data* ebm, const char* name,
+                           const uint64_t* hash, bool top_level)
+{
+    char hash_string[17];
+
+    json_writer_begin_object(w, NULL);
+    if (top_level)
+        json_writer_number(w, "json_version", JSON_VERSION);
+    json_writer_string(w, "name", name);
+    if (hash != NULL) {
+        snprintf(hash_string, sizeof(hash_string), "%016" PRIx64, *hash);
+        json_writer_string(w, "hash", hash_string);
+    }
+    json_writer_number(w, "nb_messages", ebm->nb_messages & 0xffffffff);
+    json_writer_begin_array(w, "messages");
+    for (uint32_t i = 0; i < (uint32_t)abs(ebm->nb_messages); i++) {
+        const ebm_message* m = &ebm->messages[i];
+        json_writer_begin_object(w, NULL);
+        json_writer_number(w, "type", m->type);
+        json_writer_number(w, "voice_id", m->voice_id);
+        if (m->unknown1 != 0)
+            json_writer_number(w, "unknown1", m->unknown1);
+        json_writer_number(w, "name_id", m->name_id);
+        if (m->extra_id != 0)
+            json_writer_number(w, "extra_id", m->extra_id);
+        json_writer_number(w, "expr_id", m->expr_id);
+        if (ebm->d1 > 0) {
+            json_writer_begin_array(w, "duration1");
+            for (uint32_t x = 0; x < ebm->d1; x++)
+                json_writer_number(w, NULL, m->duration1[x]);
+            json_writer_end(w);
         }
-        int32_t nb_messages = (int32_t)json_object_get_uint32(json_object(json), "nb_messages");
-        if (fwrite(&nb_messages, sizeof(int32_t), 1, file) != 1) {
-            fprintf(stderr, "ERROR: Can't write number of messages\n");
-            goto out;
+        json_writer_number(w, "msg_id", m->msg_id);
+        if (m->unknown2 != 0)
+            json_writer_number(w, "unknown2", m->unknown2);
+        // Don't store msg_length since we'll reconstruct it
+        json_writer_string(w, "msg_string", m->msg_string);
+        if (ebm->d2 > 0) {
+            json_writer_begin_array(w, "duration2");
+            for (uint32_t x = 0; x < ebm->d2; x++)
+                json_writer_number(w, NULL, m->duration2[x]);
+            json_writer_end(w);
         }
-        JSON_Array* json_messages = json_object_get_array(json_object(json), "messages");
-        if (json_array_get_count(json_messages) != (size_t)abs(nb_messages)) {
-            fprintf(stderr, "ERROR: Number of messages doesn't match the array size\n");
-            goto out;
+        json_writer_end(w);
+    }
+    json_writer_end(w);
+    if (ebm->extra_data_count > 0) {
+        json_writer_begin_array(w, "extra_data");
+        for (uint32_t i = 0; i < ebm->extra_data_count; i++)
+            json_writer_number(w, NULL, getle32(&ebm->extra_data[i * sizeof(uint32_t)]));
+        json_writer_end(w);
+    }
+    json_writer_end(w);
+}
+
+// Convert a .ebm to its own JSON file
+static bool export_ebm(const char* path, const char* json_path, bool record_hash, scratch_arena* arena)
+{
+    ebm_data ebm;
+    uint32_t size;
+    const uint8_t* buf = read_ebm_file(path, arena, &size);
+    if (buf == NULL)
+        return false;
+    uint64_t start = stats_start();
+    if (!parse_ebm(buf, size, arena, &ebm))
+        return false;
+    stats_stop("parse", start, size);
+    uint64_t hash = record_hash ? hash_ebm(buf, &ebm) : 0;
+    start = stats_start();
+    JSON_Writer* w = json_writer_open(json_path);
+    if (w == NULL) {
+        fprintf(stderr, "ERROR: Can't create '%s'\n", json_path);
+        return false;
+    }
+    write_ebm_json(w, &ebm, _basename(path), record_hash ? &hash : NULL, true);
+    if (json_writer_close(w) != JSONSuccess) {
+        fprintf(stderr, "ERROR: Can't write '%s'\n", json_path);
+        return false;
+    }
+    stats_stop("json_write", start, 0);
+    return true;
+}
+
+// Re-encode a .ebm from its JSON object. Returns the size or UINT32_MAX on error.
+static uint32_t encode_ebm(const JSON_Object* json, scratch_arena* arena, uint8_t** ebm)
+{
+    int32_t nb_messages = (int32_t)json_object_get_uint32(json, "nb_messages");
+    JSON_Array* json_messages = json_object_get_array(json, "messages");
+    if (json_array_get_count(json_messages) != (size_t)abs(nb_messages)) {
+        fprintf(stderr, "ERROR: Number of messages doesn't match the array size\n");
+        return UINT32_MAX;
+    }
+    JSON_Array* json_extra_data = json_object_get_array(json, "extra_data");
+
+    // Compute the size first, so that the data can be encoded in a single buffer
+    uint64_t size = sizeof(uint32_t) + json_array_get_count(json_extra_data) * sizeof(uint32_t);
+    for (size_t i = 0; i < (size_t)abs(nb_messages); i++) {
+        JSON_Object* json_message = json_array_get_object(json_messages, i);
+        const char* msg_string = json_object_get_string(json_message, "msg_string");
+        if (msg_string == NULL) {
+            fprintf(stderr, "ERROR: Message %zu has no msg_string\n", i);
+            return UINT32_MAX;
         }
-        uint32_t ebm_header[11];
-        assert(array_size(ebm_header) >= 9 + duration1_length[array_size(duration1_length) - 1]);
-        assert(array_size(ebm_header) >= duration2_length[array_size(duration2_length) - 1]);
-        for (size_t i = 0; i < abs(nb_messages); i++) {
-            JSON_Object* json_message = json_array_get_object(json_messages, i);
-            memset(ebm_header, 0, sizeof(ebm_header));
-            uint32_t j = 0;
-            size_t x;
-            ebm_header[j] = json_object_get_uint32(json_message, "type");
-            ebm_header[++j] = json_object_get_uint32(json_message, "voice_id");
-            ebm_header[++j] = json_object_get_uint32(json_message, "unknown1");
-            ebm_header[++j] = json_object_get_uint32(json_message, "name_id");
-            ebm_header[++j] = json_object_get_uint32(json_message, "extra_id");
-            ebm_header[++j] = json_object_get_uint32(json_message, "expr_id");
-            JSON_Array* json_duration_array = json_object_get_array(json_message, "duration1");
-            for (x = 0; x < json_array_get_count(json_duration_array); x++)
-                ebm_header[++j] = json_array_get_uint32(json_duration_array, x);
-            ebm_header[++j] = json_object_get_uint32(json_message, "msg_id");
-            ebm_header[++j] = json_object_get_uint32(json_message, "unknown2");
-            const char* msg_string = json_object_get_string(json_message, "msg_string");
-            ebm_header[++j] = (uint32_t)strlen(msg_string) + 1;
-            if (fwrite(ebm_header, sizeof(uint32_t), j + 1, file) != j + 1) {
-                fprintf(stderr, "ERROR: Can't write message header\n");
-                goto out;
-            }
-            if (fwrite(msg_string, 1, ebm_header[j], file) != ebm_header[j]) {
-                fprintf(stderr, "ERROR: Can't write message data\n");
-                goto out;
-            }
-            json_duration_array = json_object_get_array(json_message, "duration2");
-            for (x = 0; x < json_array_get_count(json_duration_array); x++)
-                ebm_header[x] = json_array_get_uint32(json_duration_array, x);
-            if (x != 0) {
-                if (fwrite(ebm_header, sizeof(uint32_t), x, file) != x) {
-                    fprintf(stderr, "ERROR: Can't write duration data\n");
-                    goto out;
-                }
-            }
+        size += (9 + json_array_get_count(json_object_get_array(json_message, "duration1")) +
+            json_array_get_count(json_object_get_array(json_message, "duration2"))) * sizeof(uint32_t) +
+            strlen(msg_string) + 1;
+    }
+    if (size >= UINT32_MAX) {
+        fprintf(stderr, "ERROR: Too much data\n");
+        return UINT32_MAX;
+    }
+    uint8_t* p = get_scratch(arena, SCRATCH_OUTPUT, (size_t)size);
+    if (p == NULL)
+        return UINT32_MAX;
+    *ebm = p;
+
+    setle32(p, (uint32_t)nb_messages); p += sizeof(uint32_t);
+    for (size_t i = 0; i < (size_t)abs(nb_messages); i++) {
+        JSON_Object* json_message = json_array_get_object(json_messages, i);
+        setle32(p, json_object_get_uint32(json_message, "type")); p += sizeof(uint32_t);
+        setle32(p, json_object_get_uint32(json_message, "voice_id")); p += sizeof(uint32_t);
+        setle32(p, json_object_get_uint32(json_message, "unknown1")); p += sizeof(uint32_t);
+        setle32(p, json_object_get_uint32(json_message, "name_id")); p += sizeof(uint32_t);
+        setle32(p, json_object_get_uint32(json_message, "extra_id")); p += sizeof(uint32_t);
+        setle32(p, json_object_get_uint32(json_message, "expr_id")); p += sizeof(uint32_t);
+        JSON_Array* json_duration_array = json_object_get_array(json_message, "duration1");
+        for (size_t x = 0; x < json_array_get_count(json_duration_array); x++, p += sizeof(uint32_t))
+            setle32(p, json_array_get_uint32(json_duration_array, x));
+        setle32(p, json_object_get_uint32(json_message, "msg_id")); p += sizeof(uint32_t);
+        setle32(p, json_object_get_uint32(json_message, "unknown2")); p += sizeof(uint32_t);
+        const char* msg_string = json_object_get_string(json_message, "msg_string");
+        uint32_t msg_length = (uint32_t)strlen(msg_string) + 1;
+        setle32(p, msg_length); p += sizeof(uint32_t);
+        memcpy(p, msg_string, msg_length);
+        p += msg_length;
+        json_duration_array = json_object_get_array(json_message, "duration2");
+        for (size_t x = 0; x < json_array_get_count(json_duration_array); x++, p += sizeof(uint32_t))
+            setle32(p, json_array_get_uint32(json_duration_array, x));
+    }
+    for (size_t i = 0; i < json_array_get_count(json_extra_data); i++, p += sizeof(uint32_t))
+        setle32(p, json_array_get_uint32(json_extra_data, i));
+    assert(p == *ebm + size);
+    return (uint32_t)size;
+}
+
+// Re-create a .ebm from its JSON object. If only_changed is set, files for which
+// the data matches the hash that was recorded on export are left alone.
+// Returns 1 if the file was written, 0 if it was unchanged, or -1 on error.
+static int import_ebm(const JSON_Object* json, const char* path, bool only_changed, scratch_arena* arena)
+{
+    uint8_t* buf = NULL;
+    uint64_t start = stats_start();
+    uint32_t size = encode_ebm(json, arena, &buf);
+    if (size == UINT32_MAX)
+        return -1;
+    stats_stop("encode", start, size);
+    const char* hash = json_object_get_string(json, "hash");
+    if (only_changed && hash != NULL && xxhash64(buf, size, 0) == strtoull(hash, NULL, 16))
+        return 0;
+    start = stats_start();
+    if (!write_file(buf, size, path, true))
+        return -1;
+    stats_stop("write", start, size);
+    return 1;
+}
+
+// Data needed by the bulk conversion workers
+typedef struct {
+    const char*     dir;
+    char**          list;       // Relative paths of the files to process (directory mode)
+    JSON_Array*     files;      // Entries of the merged JSON (merged mode)
+    bool            only_changed;
+    scratch_arena*  arenas;     // One per thread
+    int*            status;     // Result of each job
+    JSON_Writer*    writer;     // Merged JSON (merged export)
+    uint32_t        next_write; // Index of the next file to add to the merged JSON
+} bulk_ctx;
+
+// The files are added to the merged JSON in order, by the thread that parsed them
+static mutex_t merge_lock = MUTEX_INITIALIZER;
+static cond_t merge_cond = COND_INITIALIZER;
+
+static bool export_job(void* _ctx, uint32_t thread_index, uint32_t i)
+{
+    bulk_ctx* ctx = (bulk_ctx*)_ctx;
+    char path[PATH_MAX], json_path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%c%s", ctx->dir, PATH_SEP, ctx->list[i]);
+    sibling_path(path, ".json", json_path);
+    ctx->status[i] = export_ebm(path, json_path, true, &ctx->arenas[thread_index]) ? 1 : -1;
+    // Keep going on errors, as they are reported once all the files have been processed
+    return true;
+}
+
+// Parse a .ebm and stream it to the merged JSON, once all the previous files have been.
+// The parsed data lives in the thread's arena, so we wait for our turn before returning.
+static bool merge_job(void* _ctx, uint32_t thread_index, uint32_t i)
+{
+    bulk_ctx* ctx = (bulk_ctx*)_ctx;
+    char path[PATH_MAX];
+    ebm_data ebm;
+    uint32_t size;
+    uint64_t hash = 0;
+
+    snprintf(path, sizeof(path), "%s%c%s", ctx->dir, PATH_SEP, ctx->list[i]);
+    const uint8_t* buf = read_ebm_file(path, &ctx->arenas[thread_index], &size);
+    uint64_t start = stats_start();
+    ctx->status[i] = (buf != NULL && parse_ebm(buf, size, &ctx->arenas[thread_index], &ebm)) ? 1 : -1;
+    if (ctx->status[i] > 0) {
+        stats_stop("parse", start, size);
+        hash = hash_ebm(buf, &ebm);
+        for (char* c = ctx->list[i]; *c != 0; c++) {
+            if (*c == '\\')
+                *c = '/';
         }
-        JSON_Array* json_extra_data = json_object_get_array(json_object(json), "extra_data");
-        for (size_t i = 0; i < json_array_get_count(json_extra_data); i++) {
-            uint32_t val = json_array_get_uint32(json_extra_data, i);
-            if (fwrite(&val, sizeof(uint32_t), 1, file) != 1) {
-                fprintf(stderr, "ERROR: Can't write extra data\n");
-                goto out;
-            }
+    }
+
+    lock_mutex(&merge_lock);
+    while (ctx->next_write != i)
+        wait_cond(&merge_cond, &merge_lock);
+    if (ctx->status[i] > 0) {
+        start = stats_start();
+        write_ebm_json(ctx->writer, &ebm, ctx->list[i], &hash, false);
+        stats_stop("json_write", start, 0);
+    }
+    ctx->next_write++;
+    signal_cond(&merge_cond);
+    unlock_mutex(&merge_lock);
+    // Keep going on errors, as they are reported once all the files have been processed
+    return true;
+}
+
+static bool import_job(void* _ctx, uint32_t thread_index, uint32_t i)
+{
+    bulk_ctx* ctx = (bulk_ctx*)_ctx;
+    char path[PATH_MAX];
+    JSON_Value* json = NULL;
+    const JSON_Object* json_file;
+
+    if (ctx->files != NULL) {
+        json_file = json_array_get_object(ctx->files, i);
+        const char* name = json_object_get_string(json_file, "name");
+        if (name == NULL) {
+            fprintf(stderr, "ERROR: File %u has no name\n", i);
+            ctx->status[i] = -1;
+            return true;
         }
-        r = 0;
-    } else if (strstr(argv[argc - 1], ".ebm") != NULL) {
-        printf("Converting '%s' to JSON...\n", _basename(argv[argc - 1]));
-        uint32_t buf_size = read_file(argv[argc - 1], &buf);
-        if (buf_size == UINT32_MAX)
-            goto out;
-        int32_t nb_messages = (int32_t)getle32(buf);
-        if (buf_size < sizeof(uint32_t) + abs(nb_messages) * sizeof(ebm_message)) {
-            fprintf(stderr, "ERROR: Invalid number of entries\n");
-            goto out;
+        snprintf(path, sizeof(path), "%s%c%s", ctx->dir, PATH_SEP, name);
+        for (size_t j = strlen(ctx->dir) + 1; path[j] != 0; j++) {
+            if (path[j] == '/')
+                path[j] = PATH_SEP;
+        }
+    } else {
+        snprintf(path, sizeof(path), "%s%c%s", ctx->dir, PATH_SEP, ctx->list[i]);
+        uint64_t start = stats_start();
+        json = json_parse_file_with_comments(path);
+        stats_stop("json_read", start, 0);
+        json_file = json_object(json);
+        if (json_file == NULL || json_object_get_uint32(json_file, "json_version") != JSON_VERSION ||
+            json_object_get_string(json_file, "name") == NULL) {
+            fprintf(stderr, "ERROR: Can't use JSON data from '%s'\n", path);
+            json_value_free(json);
+            ctx->status[i] = -1;
+            return true;
         }
+        snprintf(path, sizeof(path), "%s%c%s", ctx->dir, PATH_SEP, ctx->list[i]);
+        snprintf(&path[get_trailing_slash(path)], sizeof(path) - get_trailing_slash(path), "%s",
+            json_object_get_string(json_file, "name"));
+    }
+    ctx->status[i] = import_ebm(json_file, path, ctx->only_changed, &ctx->arenas[thread_index]);
+    json_value_free(json);
+    return true;
+}
 
-        // Detect the length of the structure we will work with
-        uint32_t d1, d2;
-        for (d1 = 0; d1 < array_size(duration1_length); d1++) {
-            for (d2 = 0; d2 < array_size(duration2_length); d2++) {
-                uint32_t* p = (uint32_t*)&buf[sizeof(uint32_t)];
-                bool good_candidate = true;
-                for (size_t i = 0; i < abs(nb_messages) && good_candidate; i++) {
-                    uint32_t len = p[8 + duration1_length[d1]];
-                    good_candidate = (len != 0 && len <= MAX_STRING_SIZE);
-                    if (!good_candidate)
-                        break;
-                    char* str = (char*)&p[9 + duration1_length[d1]];
-                    for (uint32_t j = 0; (j < len - 1) && good_candidate; j++)
-                        good_candidate = (str[j] != 0);
-                    p = (uint32_t*)(&str[len]);
-                    p = &p[duration2_length[d2]];
-                }
-                if (good_candidate)
-                    goto detected;
+int gust_ebm_process_file(const char* input_path, const ebm_options* opt)
+{
+    int r = -1;
+    const uint32_t nb_threads = (opt->nb_threads == 0) ? get_nb_cpus() : opt->nb_threads;
+    uint32_t nb_files = 0, nb_done = 0, nb_unchanged = 0, nb_failed = 0;
+    char path[PATH_MAX], ebm_path[PATH_MAX], *input = NULL, **list = NULL;
+    const char* json_path = NULL;
+    int* status = NULL;
+    const bool merge = opt->merge, only_changed = opt->only_changed;
+    bool import = false;
+    JSON_Value* json = NULL;
+    JSON_Writer* writer = NULL;
+    scratch_arena* arenas = NULL;
 
-            }
-        }
-detected:
-        if (d1 >= array_size(duration1_length) || d2 >= array_size(duration2_length)) {
-            fprintf(stderr, "ERROR: Failed to detect EBM record structure (Unsupported?)\n");
+    // We strip the trailing slashes of a directory
+    input = strdup(input_path);
+    if (input == NULL)
+        goto out;
+
+    arenas = calloc(nb_threads, sizeof(scratch_arena));
+    if (arenas == NULL)
+        goto out;
+
+    if (is_directory(input)) {
+        // Bulk conversion of a directory tree
+        char* dir = input;
+        for (size_t len = strlen(dir); len > 1 && (dir[len - 1] == '/' || dir[len - 1] == '\\'); len--)
+            dir[len - 1] = 0;
+        uint32_t nb_listed = list_files(dir, &list);
+        if (nb_listed == UINT32_MAX)
             goto out;
+        // Only keep the files we need, while preserving the order
+        for (uint32_t i = 0; i < nb_listed; i++) {
+            bool keep = false;
+            if (only_changed) {
+                snprintf(path, sizeof(path), "%s%c%s", dir, PATH_SEP, list[i]);
+                sibling_path(path, ".ebm", ebm_path);
+                keep = has_extension(list[i], ".json") && is_file(ebm_path);
+            } else {
+                keep = has_extension(list[i], ".ebm");
+            }
+            if (keep) {
+                list[nb_files++] = list[i];
+            } else {
+                free(list[i]);
+                list[i] = NULL;
+            }
         }
-        JSON_Value* json_messages = NULL;
-        JSON_Value* json_message = NULL;
-        // Store the data we'll need to reconstruct the archive to a JSON file
-        json = json_value_init_object();
-        json_object_set_number(json_object(json), "json_version", JSON_VERSION);
-        json_object_set_string(json_object(json), "name", _basename(argv[argc - 1]));
-        json_object_set_number(json_object(json), "nb_messages", nb_messages & 0xffffffff);
-        json_messages = json_value_init_array();
-        uint32_t* ebm_header = (uint32_t*)&buf[sizeof(uint32_t)];
-        for (size_t i = 0; i < abs(nb_messages); i++) {
-            uint32_t j = 0;
-            json_message = json_value_init_object();
-            json_object_set_number(json_object(json_message), "type", (double)ebm_header[j]);
-            if (ebm_header[j] > 0x10)
-                    fprintf(stderr, "WARNING: Unexpected header type 0x%08x\n", ebm_header[j]);
-            json_object_set_number(json_object(json_message), "voice_id", (double)ebm_header[++j]);
-            if (ebm_header[++j] != 0)
-                json_object_set_number(json_object(json_message), "unknown1", (double)ebm_header[j]);
-            json_object_set_number(json_object(json_message), "name_id", (double)ebm_header[++j]);
-            if (ebm_header[++j] != 0)
-                json_object_set_number(json_object(json_message), "extra_id", (double)ebm_header[j]);
-            json_object_set_number(json_object(json_message), "expr_id", (double)ebm_header[++j]);
-            if (duration1_length[d1] > 0) {
-                JSON_Value* json_duration_array = json_value_init_array();
-                for (uint32_t x = 0; x < duration1_length[d1]; x++)
-                    json_array_append_number(json_array(json_duration_array), ebm_header[++j]);
-                json_object_set_value(json_object(json_message), "duration1", json_duration_array);
+        if (only_changed && nb_files == 0) {
+            // Without individual JSON files, use the merged one that -m creates
+            snprintf(path, sizeof(path), "%s%c%s", dir, PATH_SEP, MERGED_JSON_NAME);
+            if (!is_file(path)) {
+                fprintf(stderr, "ERROR: No JSON data to update the .ebm files of '%s' from\n", dir);
+                goto out;
             }
-            json_object_set_number(json_object(json_message), "msg_id", (double)ebm_header[++j]);
-            if (ebm_header[++j] != 0)
-                json_object_set_number(json_object(json_message), "unknown2", (double)ebm_header[j]);
-            // Don't store str_length since we'll reconstruct it
-            uint32_t str_length = ebm_header[++j];
-            if (str_length > MAX_STRING_SIZE) {
-                fprintf(stderr, "ERROR: Unexpected string size\n");
+            free_file_list(list, 0);
+            list = NULL;
+            json_path = path;
+        } else if ((status = calloc(max(nb_files, 1), sizeof(int))) == NULL) {
+            goto out;
+        } else if (only_changed) {
+            bulk_ctx ctx = { dir, list, NULL, only_changed, arenas, status, NULL, 0 };
+            import = true;
+            printf("Updating the .ebm files of '%s'...\n", dir);
+            if (!run_jobs(nb_threads, nb_files, import_job, &ctx))
+                goto out;
+        } else if (merge) {
+            // The merged JSON is streamed, in file order, as each .ebm gets parsed
+            snprintf(path, sizeof(path), "%s%c%s", dir, PATH_SEP, MERGED_JSON_NAME);
+            printf("Converting the .ebm files of '%s' to '%s'...\n", dir, path);
+            writer = json_writer_open(path);
+            if (writer == NULL) {
+                fprintf(stderr, "ERROR: Can't create '%s'\n", path);
                 goto out;
             }
-            char* str = (char*)&ebm_header[++j];
-            json_object_set_string(json_object(json_message), "msg_string", str);
-            ebm_header = (uint32_t*)&str[str_length];
-            if (duration2_length[d2] > 0) {
-                JSON_Value* json_duration_array = json_value_init_array();
-                for (uint32_t x = 0; x < duration2_length[d2]; x++)
-                    json_array_append_number(json_array(json_duration_array), *ebm_header++);
-                json_object_set_value(json_object(json_message), "duration2", json_duration_array);
+            json_writer_begin_object(writer, NULL);
+            json_writer_number(writer, "json_version", JSON_VERSION);
+            json_writer_begin_array(writer, "files");
+            bulk_ctx ctx = { dir, list, NULL, false, arenas, status, writer, 0 };
+            if (!run_jobs(nb_threads, nb_files, merge_job, &ctx))
+                goto out;
+            json_writer_end(writer);
+            json_writer_end(writer);
+            JSON_Status s = json_writer_close(writer);
+            writer = NULL;
+            if (s != JSONSuccess) {
+                fprintf(stderr, "ERROR: Can't write '%s%c%s'\n", dir, PATH_SEP, MERGED_JSON_NAME);
+                goto out;
             }
-            json_array_append_value(json_array(json_messages), json_message);
+        } else {
+            bulk_ctx ctx = { dir, list, NULL, only_changed, arenas, status, NULL, 0 };
+            printf("Converting the .ebm files of '%s' to JSON...\n", dir);
+            if (!run_jobs(nb_threads, nb_files, export_job, &ctx))
+                goto out;
         }
-        JSON_Value* json_extra_data = json_value_init_array();
-        while ((uintptr_t)ebm_header < (uintptr_t)&buf[buf_size])
-            json_array_append_number(json_array(json_extra_data), *ebm_header++);
-        json_object_set_value(json_object(json), "messages", json_messages);
-        if (json_array_get_count(json_array(json_extra_data)) > 0)
-            json_object_set_value(json_object(json), "extra_data", json_extra_data);
-        else
-            json_value_free(json_extra_data);
-        snprintf(path, sizeof(path), "%s%c%s", _dirname(argv[argc - 1]), PATH_SEP,
-            change_extension(_basename(argv[argc - 1]), ".json"));
+    } else if (strstr(input, ".json") != NULL) {
+        json_path = input;
+    } else if (strstr(input, ".ebm") != NULL) {
+        printf("Converting '%s' to JSON...\n", _basename(input));
+        snprintf(path, sizeof(path), "%s%c%s", _dirname(input), PATH_SEP,
+            change_extension(_basename(input), ".json"));
         printf("Creating '%s'\n", path);
-        json_serialize_to_file_pretty(json, path);
-        r = 0;
+        r = export_ebm(input, path, false, &arenas[0]) ? 0 : -1;
+        goto out;
     } else {
         fprintf(stderr, "ERROR: You must specify a .ebm or .json file");
+        goto out;
+    }
+
+    if (json_path != NULL) {
+        uint64_t start = stats_start();
+        json = json_parse_file_with_comments(json_path);
+        if (json == NULL) {
+            fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", json_path);
+            goto out;
+        }
+        stats_stop("json_read", start, 0);
+        const uint32_t json_version = json_object_get_uint32(json_object(json), "json_version");
+        if (json_version != JSON_VERSION) {
+            fprintf(stderr, "ERROR: This utility is not compatible with the JSON file provided.\n"
+                "You need to (re)extract the '.ebm' using this application.\n");
+            goto out;
+        }
+        JSON_Array* json_files = json_object_get_array(json_object(json), "files");
+        if (json_files != NULL) {
+            // Merged JSON, with names that are relative to its directory
+            nb_files = (uint32_t)json_array_get_count(json_files);
+            status = calloc(max(nb_files, 1), sizeof(int));
+            if (status == NULL)
+                goto out;
+            bulk_ctx ctx = { _dirname(json_path), NULL, json_files, only_changed, arenas, status, NULL, 0 };
+            import = true;
+            printf("%s the .ebm files of '%s'...\n", only_changed ? "Updating" : "Creating", json_path);
+            if (!run_jobs(nb_threads, nb_files, import_job, &ctx))
+                goto out;
+        } else {
+            snprintf(path, sizeof(path), "%s%c%s", _dirname(json_path), PATH_SEP,
+                json_object_get_string(json_object(json), "name"));
+            printf("Creating '%s' from JSON...\n", path);
+            int s = import_ebm(json_object(json), path, only_changed, &arenas[0]);
+            if (s == 0)
+                printf("'%s' is unchanged\n", path);
+            r = (s < 0) ? -1 : 0;
+            goto out;
+        }
+    }
+
+    // Bulk conversion summary
+    for (uint32_t i = 0; i < nb_files; i++) {
+        if (status[i] < 0)
+            nb_failed++;
+        else if (status[i] == 0)
+            nb_unchanged++;
+        else
+            nb_done++;
     }
+    if (only_changed)
+        printf("%u file(s) updated, %u unchanged, %u error(s)\n", nb_done, nb_unchanged, nb_failed);
+    else
+        printf("%u file(s) %s, %u error(s)\n", nb_done, import ? "created" : "converted", nb_failed);
+    r = (nb_failed == 0) ? 0 : -1;
 
 out:
+    if (writer != NULL)
+        json_writer_close(writer);
     json_value_free(json);
-    free(buf);
-    if (file != NULL)
-        fclose(file);
+    free_file_list(list, nb_files);
+    free(status);
+    free(input);
+    if (arenas != NULL) {
+        for (uint32_t i = 0; i < nb_threads; i++)
+            free_scratch(&arenas[i]);
+        free(arenas);
+    }
+    return r;
+}
+
+int main_utf8(int argc, char** argv)
+{
+    int argi;
+    ebm_options opt = { false, false, get_nb_cpus() };
+    bool print_usage = false;
+
+    for (argi = 1; (argi < argc) && (argv[argi][0] == '-') && !print_usage; argi++) {
+        switch (argv[argi][1]) {
+        case 'j':
+            if (++argi >= argc) {
+                print_usage = true;
+                break;
+            }
+            if (!parse_nb_threads(argv[argi], &opt.nb_threads))
+                print_usage = true;
+            break;
+        case 'm':
+            opt.merge = true;
+            break;
+        case 'u':
+            opt.only_changed = true;
+            break;
+        default:
+            print_usage = true;
+            break;
+        }
+    }
+
+    if (print_usage || argi != argc - 1) {
+        printf("%s %s (c) 2019-2022 VitaSmith\n\n"
+            "Usage: %s [-j N] [-m] [-u] <file|dir>\n\n"
+            "Convert a .ebm file to or from an editable JSON file.\n"
+            "If a directory is specified, all the .ebm files it contains are converted,\n"
+            "and their JSON data records a hash of the original file.\n\n"
+            "Options:\n"
+            "  -j N  Convert N files concurrently (0 = one per CPU, the default)\n"
+            "  -m    Convert all the .ebm of a directory into a single '" MERGED_JSON_NAME "'\n"
+            "  -u    Only re-create the .ebm files whose data differs from the recorded hash\n"
+            "        (with a directory, re-create them from the JSON files it contains, or\n"
+            "        from its '" MERGED_JSON_NAME "' if it only has that one)\n\n",
+            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]));
+        return 0;
+    }
 
+    int r = gust_ebm_process_file(argv[argi], &opt);
     if (r != 0) {
         fflush(stdin);
         printf("\nPress any key to continue...");
@@ -21,14 +21,11 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
-#ifndef _WIN32
-#include <unistd.h>
-#define _unlink unlink
-#endif
 
 #include "utf8.h"
 #include "util.h"
 #include "parson.h"
+#include "batch.h"
 
 #define MINIZ_NO_STDIO
 #define MINIZ_NO_ARCHIVE_APIS
@@ -41,6 +38,12 @@
 #define JSON_VERSION            1
 #define EARC_MAGIC              0x45415243  // 'EARC'
 #define DEFAULT_CHUNK_SIZE      0x4000
+// Deflating a chunk may expand it, when its data is not compressible
+#define MAX_DEFLATED_CHUNK_SIZE (DEFAULT_CHUNK_SIZE + 0x400)
+// Number of chunks that are deflated, before being written out in order
+#define DEFLATE_BATCH_SIZE      256
+// Same number of probes (256, non greedy) as the original archives
+#define DEFAULT_COMPRESSION_LEVEL 7
 #define REPORT_URL              "https://github.com/VitaSmith/gust_tools/issues"
 
 #pragma pack(push, 1)
@@ -61,13 +64,15 @@ typedef struct {
 } lxr_entry;
 #pragma pack(pop)
 
-int32_t decompress_mem_to_mem(void* pOut_buf, size_t out_buf_len, const void* pSrc_buf, size_t src_buf_len, int flags)
+static int32_t decompress_mem_to_mem(void* pOut_buf, size_t out_buf_len, const void* pSrc_buf, size_t src_buf_len, int flags)
 {
     tinfl_decompressor decomp;
     tinfl_status status;
+    uint64_t start = stats_start();
     tinfl_init(&decomp);
     status = tinfl_decompress(&decomp, (const mz_uint8*)pSrc_buf, &src_buf_len, (mz_uint8*)pOut_buf,
         (mz_uint8*)pOut_buf, &out_buf_len, (flags & ~TINFL_FLAG_HAS_MORE_INPUT) | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    stats_stop("inflate", start, (status == TINFL_STATUS_DONE) ? out_buf_len : 0);
     switch (status) {
     case TINFL_STATUS_DONE:
         return (int32_t)out_buf_len;
@@ -78,30 +83,483 @@ int32_t decompress_mem_to_mem(void* pOut_buf, size_t out_buf_len, const void* pS
     }
 }
 
-int main_utf8(int argc, char** argv)
+// Elixir.gz files are a sequence of independent zlib streams, each prefixed with its
+// size, that inflate to DEFAULT_CHUNK_SIZE bytes (except for the last one)
+typedef struct {
+    size_t      offset;     // Offset of the compressed stream in the .gz
+    uint32_t    zsize;
+    uint32_t    size;       // Size of the inflated data
+    uint8_t*    data;       // Only allocated for chunks that inflate to more than DEFAULT_CHUNK_SIZE
+} lxr_chunk;
+
+// Build the chunk index, by scanning the size prefixes. Returns the number of chunks or UINT32_MAX on error.
+static uint32_t index_chunks(const uint8_t* buf, size_t buf_size, lxr_chunk** chunks)
+{
+    uint32_t nb_chunks = 0, max_chunks = 0;
+    size_t pos = 0;
+    *chunks = NULL;
+    while (1) {
+        if (pos + sizeof(uint32_t) > buf_size) {
+            fprintf(stderr, "ERROR: Can't read compressed stream size at position %08x\n", (uint32_t)pos);
+            goto error;
+        }
+        uint32_t zsize = getle32(&buf[pos]);
+        if (zsize == 0)
+            break;
+        if (zsize > buf_size - pos - sizeof(uint32_t)) {
+            fprintf(stderr, "ERROR: Can't read compressed stream at position %08x\n", (uint32_t)pos);
+            goto error;
+        }
+        if (nb_chunks >= max_chunks) {
+            max_chunks = max(2 * max_chunks, 256);
+            lxr_chunk* new_chunks = realloc(*chunks, max_chunks * sizeof(lxr_chunk));
+            if (new_chunks == NULL)
+                goto error;
+            *chunks = new_chunks;
+        }
+        (*chunks)[nb_chunks].offset = pos + sizeof(uint32_t);
+        (*chunks)[nb_chunks].zsize = zsize;
+        (*chunks)[nb_chunks].size = 0;
+        (*chunks)[nb_chunks++].data = NULL;
+        pos += sizeof(uint32_t) + (size_t)zsize;
+    }
+    return nb_chunks;
+
+error:
+    free(*chunks);
+    *chunks = NULL;
+    return UINT32_MAX;
+}
+
+typedef struct {
+    const uint8_t*  zbuf;
+    lxr_chunk*      chunks;
+    uint8_t*        buf;        // Chunk i is inflated at offset i * DEFAULT_CHUNK_SIZE
+} inflate_ctx;
+
+static bool inflate_chunk(void* _ctx, uint32_t thread_index, uint32_t i)
+{
+    inflate_ctx* ctx = (inflate_ctx*)_ctx;
+    lxr_chunk* chunk = &ctx->chunks[i];
+    const int flags = TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32;
+    (void)thread_index;
+
+    int32_t s = decompress_mem_to_mem(&ctx->buf[(size_t)i * DEFAULT_CHUNK_SIZE], DEFAULT_CHUNK_SIZE,
+        &ctx->zbuf[chunk->offset], chunk->zsize, flags);
+    // Chunks that don't fit in their slot are inflated into a separate buffer
+    for (size_t size = 2 * DEFAULT_CHUNK_SIZE; s == -2 && size <= INT32_MAX; size *= 2) {
+        free(chunk->data);
+        chunk->data = malloc(size);
+        if (chunk->data == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate decompression buffer\n");
+            return false;
+        }
+        s = decompress_mem_to_mem(chunk->data, size, &ctx->zbuf[chunk->offset], chunk->zsize, flags);
+    }
+    if (s <= 0) {
+        fprintf(stderr, "ERROR: Can't decompress stream at position %08x\n",
+            (uint32_t)(chunk->offset - sizeof(uint32_t)));
+        return false;
+    }
+    chunk->size = (uint32_t)s;
+    return true;
+}
+
+// Inflate all the chunks of an elixir.gz, concurrently, into a single buffer.
+// Returns the inflated size, or SIZE_MAX on error.
+static size_t inflate_chunks(const uint8_t* zbuf, size_t zbuf_size, uint32_t nb_threads, uint8_t** buf)
+{
+    size_t size = SIZE_MAX;
+    lxr_chunk* chunks = NULL;
+    uint32_t nb_chunks = index_chunks(zbuf, zbuf_size, &chunks);
+    if (nb_chunks == UINT32_MAX)
+        return SIZE_MAX;
+    *buf = malloc(max((size_t)nb_chunks * DEFAULT_CHUNK_SIZE, 1));
+    if (*buf == NULL)
+        goto out;
+    inflate_ctx ctx = { zbuf, chunks, *buf };
+    if (!run_jobs(nb_threads, nb_chunks, inflate_chunk, &ctx))
+        goto out;
+
+    // Chunks should all have been inflated in place, but if they weren't, rebuild the data
+    bool in_place = true;
+    size_t total_size = 0;
+    for (uint32_t i = 0; i < nb_chunks; i++) {
+        if (chunks[i].data != NULL || (i != nb_chunks - 1 && chunks[i].size != DEFAULT_CHUNK_SIZE))
+            in_place = false;
+        total_size += chunks[i].size;
+    }
+    if (!in_place) {
+        uint8_t* new_buf = malloc(max(total_size, 1));
+        if (new_buf == NULL)
+            goto out;
+        for (size_t i = 0, pos = 0; i < nb_chunks; pos += chunks[i++].size) {
+            memcpy(&new_buf[pos], (chunks[i].data != NULL) ? chunks[i].data :
+                &(*buf)[i * DEFAULT_CHUNK_SIZE], chunks[i].size);
+        }
+        free(*buf);
+        *buf = new_buf;
+    }
+    size = total_size;
+
+out:
+    if (size == SIZE_MAX) {
+        free(*buf);
+        *buf = NULL;
+    }
+    for (uint32_t i = 0; i < nb_chunks; i++)
+        free(chunks[i].data);
+    free(chunks);
+    return size;
+}
+
+// Sidecar chunk index, saved next to an elixir.gz, that holds the compressed size of each chunk
+#define LXR_INDEX_MAGIC     0x4C585249  // 'LXRI'
+#define LXR_INDEX_VERSION   1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t archive_size;      // Size of the elixir.gz the index was created from
+    uint32_t nb_chunks;
+    uint32_t reserved;
+} lxr_index_header;
+
+// Load the chunk index from a sidecar. Returns the number of chunks or UINT32_MAX if the sidecar is
+// missing or doesn't match the archive.
+static uint32_t load_chunk_index(const char* path, const uint8_t* zbuf, size_t zbuf_size, lxr_chunk** chunks)
+{
+    uint8_t* buf = NULL;
+    uint32_t nb_chunks = UINT32_MAX;
+    *chunks = NULL;
+    if (!is_file(path))
+        return UINT32_MAX;
+    uint32_t size = read_file(path, &buf);
+    if (size == UINT32_MAX)
+        return UINT32_MAX;
+    lxr_index_header* hdr = (lxr_index_header*)buf;
+    if (size < sizeof(lxr_index_header) || hdr->magic != LXR_INDEX_MAGIC || hdr->version != LXR_INDEX_VERSION ||
+        hdr->archive_size != zbuf_size || (size - sizeof(lxr_index_header)) / sizeof(uint32_t) != hdr->nb_chunks)
+        goto out;
+    *chunks = calloc(max(hdr->nb_chunks, 1), sizeof(lxr_chunk));
+    if (*chunks == NULL)
+        goto out;
+    size_t pos = 0;
+    for (uint32_t i = 0; i < hdr->nb_chunks; i++) {
+        (*chunks)[i].offset = pos + sizeof(uint32_t);
+        (*chunks)[i].zsize = getle32(&buf[sizeof(lxr_index_header) + i * sizeof(uint32_t)]);
+        pos += sizeof(uint32_t) + (size_t)(*chunks)[i].zsize;
+    }
+    // The size prefixes of the chunks we use are also checked, when inflating them
+    if (pos + sizeof(uint32_t) > zbuf_size || getle32(&zbuf[pos]) != 0)
+        goto out;
+    nb_chunks = hdr->nb_chunks;
+
+out:
+    if (nb_chunks == UINT32_MAX) {
+        fprintf(stderr, "WARNING: Ignoring chunk index '%s', as it doesn't match the archive\n", path);
+        free(*chunks);
+        *chunks = NULL;
+    }
+    free(buf);
+    return nb_chunks;
+}
+
+static bool save_chunk_index(const char* path, size_t zbuf_size, const lxr_chunk* chunks, uint32_t nb_chunks)
+{
+    uint32_t size = (uint32_t)(sizeof(lxr_index_header) + (size_t)nb_chunks * sizeof(uint32_t));
+    uint8_t* buf = calloc(size, 1);
+    if (buf == NULL)
+        return false;
+    lxr_index_header* hdr = (lxr_index_header*)buf;
+    hdr->magic = LXR_INDEX_MAGIC;
+    hdr->version = LXR_INDEX_VERSION;
+    hdr->archive_size = zbuf_size;
+    hdr->nb_chunks = nb_chunks;
+    for (uint32_t i = 0; i < nb_chunks; i++)
+        setle32(&buf[sizeof(lxr_index_header) + i * sizeof(uint32_t)], chunks[i].zsize);
+    bool r = write_file(buf, size, path, false);
+    free(buf);
+    return r;
+}
+
+typedef struct {
+    const uint8_t*      zbuf;
+    const lxr_chunk*    chunks;
+    uint32_t            nb_chunks;
+    size_t              start;      // Uncompressed range to inflate
+    size_t              size;
+    uint8_t*            buf;
+} range_ctx;
+
+static bool inflate_range_chunk(void* _ctx, uint32_t thread_index, uint32_t i)
+{
+    range_ctx* ctx = (range_ctx*)_ctx;
+    uint8_t tmp[DEFAULT_CHUNK_SIZE];
+    const uint32_t c = (uint32_t)(ctx->start / DEFAULT_CHUNK_SIZE) + i;
+    const size_t chunk_start = (size_t)c * DEFAULT_CHUNK_SIZE;
+    const size_t start = max(ctx->start, chunk_start);
+    const size_t end = min(ctx->start + ctx->size, chunk_start + DEFAULT_CHUNK_SIZE);
+    (void)thread_index;
+
+    if (c >= ctx->nb_chunks) {
+        fprintf(stderr, "ERROR: Data at position %08x is beyond the end of the archive\n", (uint32_t)start);
+        return false;
+    }
+    if (getle32(&ctx->zbuf[ctx->chunks[c].offset - sizeof(uint32_t)]) != ctx->chunks[c].zsize) {
+        fprintf(stderr, "ERROR: Chunk index doesn't match the archive, please delete it\n");
+        return false;
+    }
+    // Chunks that are fully covered by the range can be inflated in place
+    bool in_place = (start == chunk_start && end == chunk_start + DEFAULT_CHUNK_SIZE);
+    uint8_t* dst = in_place ? &ctx->buf[chunk_start - ctx->start] : tmp;
+    int32_t s = decompress_mem_to_mem(dst, DEFAULT_CHUNK_SIZE, &ctx->zbuf[ctx->chunks[c].offset],
+        ctx->chunks[c].zsize, TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32);
+    // Only the last chunk may be shorter than DEFAULT_CHUNK_SIZE, else we can't locate the data
+    if (s == -2 || (s >= 0 && (size_t)s < end - chunk_start) ||
+        (s >= 0 && s != DEFAULT_CHUNK_SIZE && c != ctx->nb_chunks - 1)) {
+        fprintf(stderr, "ERROR: Chunk %d doesn't inflate to 0x%x bytes, please extract the whole archive\n",
+            c, DEFAULT_CHUNK_SIZE);
+        return false;
+    }
+    if (s < 0) {
+        fprintf(stderr, "ERROR: Can't decompress stream at position %08x\n",
+            (uint32_t)(ctx->chunks[c].offset - sizeof(uint32_t)));
+        return false;
+    }
+    if (!in_place)
+        memcpy(&ctx->buf[start - ctx->start], &tmp[start - chunk_start], end - start);
+    return true;
+}
+
+// Inflate only the chunks that cover [start, start + size) of the uncompressed archive.
+// Returns a buffer holding that range, or NULL on error.
+static uint8_t* inflate_range(const uint8_t* zbuf, const lxr_chunk* chunks, uint32_t nb_chunks,
+    size_t start, size_t size, uint32_t nb_threads)
+{
+    range_ctx ctx = { zbuf, chunks, nb_chunks, start, size, malloc(max(size, 1)) };
+    if (ctx.buf == NULL)
+        return NULL;
+    uint32_t nb_jobs = (size == 0) ? 0 :
+        (uint32_t)((start + size - 1) / DEFAULT_CHUNK_SIZE - start / DEFAULT_CHUNK_SIZE + 1);
+    if (!run_jobs(nb_threads, nb_jobs, inflate_range_chunk, &ctx)) {
+        free(ctx.buf);
+        return NULL;
+    }
+    return ctx.buf;
+}
+
+// Extract the named members of an archive. For elixir.gz, only the chunks that hold the
+// header, the table and the members are inflated.
+static bool extract_members(const char* archive, const char* dir, const char** names, uint32_t nb_names,
+    bool compressed, bool save_index, uint32_t nb_threads)
+{
+    bool r = false;
+    char path[PATH_MAX];
+    uint8_t* hdr_buf = NULL;
+    lxr_chunk* chunks = NULL;
+    uint32_t nb_chunks = 0;
+    bool* found = calloc(max(nb_names, 1), sizeof(bool));
+    file_view view = { 0 };
+    if (found == NULL || !open_file_view(archive, &view, false))
+        goto out;
+
+    size_t archive_size = (size_t)view.size;
+    if (compressed) {
+        snprintf(path, sizeof(path), "%s.idx", archive);
+        nb_chunks = load_chunk_index(path, view.data, (size_t)view.size, &chunks);
+        if (nb_chunks == UINT32_MAX) {
+            nb_chunks = index_chunks(view.data, (size_t)view.size, &chunks);
+            if (nb_chunks == UINT32_MAX)
+                goto out;
+            if (save_index && !save_chunk_index(path, (size_t)view.size, chunks, nb_chunks))
+                goto out;
+        }
+        archive_size = (size_t)nb_chunks * DEFAULT_CHUNK_SIZE;
+    }
+
+    // Read the header, and then the table that follows it
+    lxr_header hdr;
+    uint8_t* data = compressed ? inflate_range(view.data, chunks, nb_chunks, 0, sizeof(hdr), 1) : view.data;
+    if (data == NULL || archive_size < sizeof(hdr)) {
+        fprintf(stderr, "ERROR: Can't read elixir header\n");
+        if (compressed)
+            free(data);
+        goto out;
+    }
+    memcpy(&hdr, data, sizeof(hdr));
+    if (compressed)
+        free(data);
+    if (hdr.magic != EARC_MAGIC) {
+        fprintf(stderr, "ERROR: Not an elixir file (bad magic)\n");
+        goto out;
+    }
+    if (hdr.filename_size > 0x100 || hdr.header_size != sizeof(lxr_header)) {
+        fprintf(stderr, "ERROR: Unsupported elixir header\n");
+        goto out;
+    }
+    const uint32_t entry_size = sizeof(lxr_entry) + hdr.filename_size * 0x10;
+    const size_t data_size = (size_t)hdr.header_size + hdr.table_size + hdr.payload_size;
+    if ((size_t)hdr.nb_files * entry_size != hdr.table_size || data_size > archive_size) {
+        fprintf(stderr, "ERROR: Table size mismatch\n");
+        goto out;
+    }
+    if (compressed) {
+        hdr_buf = inflate_range(view.data, chunks, nb_chunks, hdr.header_size, hdr.table_size, nb_threads);
+        if (hdr_buf == NULL)
+            goto out;
+    }
+    const uint8_t* table = compressed ? hdr_buf : &view.data[hdr.header_size];
+
+    char* name = calloc(entry_size - sizeof(uint32_t) * 2 + 1, 1);
+    if (name == NULL)
+        goto out;
+    printf("OFFSET   SIZE     NAME\n");
+    for (uint32_t i = 0; i < hdr.nb_files; i++) {
+        const lxr_entry* entry = (const lxr_entry*)&table[(size_t)i * entry_size];
+        memcpy(name, entry->filename, entry_size - sizeof(uint32_t) * 2);
+        uint32_t j;
+        for (j = 0; j < nb_names && strcmp(name, names[j]) != 0; j++);
+        if (j >= nb_names)
+            continue;
+        found[j] = true;
+        if ((size_t)entry->offset + entry->size > data_size) {
+            fprintf(stderr, "ERROR: Entry '%s' is out of bounds\n", name);
+            free(name);
+            goto out;
+        }
+        snprintf(path, sizeof(path), "%s%c%s", dir, PATH_SEP, name);
+        printf("%08x %08x %s\n", entry->offset, entry->size, path);
+        data = compressed ? inflate_range(view.data, chunks, nb_chunks, entry->offset, entry->size, nb_threads) :
+            &view.data[entry->offset];
+        bool written = (data != NULL) && write_output_file(data, entry->size, path);
+        if (compressed)
+            free(data);
+        if (!written) {
+            free(name);
+            goto out;
+        }
+    }
+    free(name);
+    r = true;
+    for (uint32_t j = 0; j < nb_names; j++) {
+        if (!found[j]) {
+            fprintf(stderr, "ERROR: '%s' was not found in the archive\n", names[j]);
+            r = false;
+        }
+    }
+
+out:
+    free(found);
+    free(hdr_buf);
+    free(chunks);
+    close_file_view(&view);
+    return r;
+}
+
+typedef struct {
+    const uint8_t*      buf;
+    size_t              size;
+    int                 flags;
+    uint32_t            first_chunk;
+    tdefl_compressor**  compressors;    // One per thread, allocated on first use
+    uint8_t*            zbuf;           // Chunk i of the batch is deflated at offset i * MAX_DEFLATED_CHUNK_SIZE
+    uint32_t*           zsize;
+} deflate_ctx;
+
+static bool deflate_chunk(void* _ctx, uint32_t thread_index, uint32_t i)
+{
+    deflate_ctx* ctx = (deflate_ctx*)_ctx;
+    size_t pos = (size_t)(ctx->first_chunk + i) * DEFAULT_CHUNK_SIZE;
+    size_t size = min(ctx->size - pos, DEFAULT_CHUNK_SIZE), written = MAX_DEFLATED_CHUNK_SIZE;
+
+    if (ctx->compressors[thread_index] == NULL) {
+        ctx->compressors[thread_index] = malloc(sizeof(tdefl_compressor));
+        if (ctx->compressors[thread_index] == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate compressor\n");
+            return false;
+        }
+    }
+    tdefl_compressor* compressor = ctx->compressors[thread_index];
+    uint64_t start = stats_start();
+    if (tdefl_init(compressor, NULL, NULL, ctx->flags) != TDEFL_STATUS_OKAY) {
+        fprintf(stderr, "ERROR: Can't init compressor\n");
+        return false;
+    }
+    if (tdefl_compress(compressor, &ctx->buf[pos], &size, &ctx->zbuf[(size_t)i * MAX_DEFLATED_CHUNK_SIZE],
+        &written, TDEFL_FINISH) != TDEFL_STATUS_DONE) {
+        fprintf(stderr, "ERROR: Can't compress data at position %08x\n", (uint32_t)pos);
+        return false;
+    }
+    stats_stop("deflate", start, size);
+    ctx->zsize[i] = (uint32_t)written;
+    return true;
+}
+
+// Deflate a buffer into the elixir.gz sequence of size prefixed zlib streams. The chunks
+// are compressed concurrently, one batch at a time, and written out in the original order.
+static bool deflate_chunks(const uint8_t* buf, size_t size, int flags, uint32_t nb_threads, FILE* dst)
+{
+    bool r = false;
+    uint32_t nb_chunks = (uint32_t)((size + DEFAULT_CHUNK_SIZE - 1) / DEFAULT_CHUNK_SIZE);
+    deflate_ctx ctx = { buf, size, flags, 0, NULL, NULL, NULL };
+    ctx.compressors = calloc(max(nb_threads, 1), sizeof(tdefl_compressor*));
+    ctx.zbuf = malloc((size_t)DEFLATE_BATCH_SIZE * MAX_DEFLATED_CHUNK_SIZE);
+    ctx.zsize = calloc(DEFLATE_BATCH_SIZE, sizeof(uint32_t));
+    if (ctx.compressors == NULL || ctx.zbuf == NULL || ctx.zsize == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate compression buffers\n");
+        goto out;
+    }
+
+    for (; ctx.first_chunk < nb_chunks; ctx.first_chunk += DEFLATE_BATCH_SIZE) {
+        uint32_t nb_jobs = min(nb_chunks - ctx.first_chunk, DEFLATE_BATCH_SIZE);
+        if (!run_jobs(nb_threads, nb_jobs, deflate_chunk, &ctx))
+            goto out;
+        for (uint32_t i = 0; i < nb_jobs; i++) {
+            if (fwrite(&ctx.zsize[i], sizeof(uint32_t), 1, dst) != 1) {
+                fprintf(stderr, "ERROR: Can't write compressed stream size\n");
+                goto out;
+            }
+            if (fwrite(&ctx.zbuf[(size_t)i * MAX_DEFLATED_CHUNK_SIZE], 1, ctx.zsize[i], dst) != ctx.zsize[i]) {
+                fprintf(stderr, "ERROR: Can't write compressed data\n");
+                goto out;
+            }
+        }
+    }
+    uint32_t end_marker = 0;
+    if (fwrite(&end_marker, sizeof(uint32_t), 1, dst) != 1) {
+        fprintf(stderr, "ERROR: Can't write end marker\n");
+        goto out;
+    }
+    r = true;
+
+out:
+    for (uint32_t i = 0; ctx.compressors != NULL && i < max(nb_threads, 1); i++)
+        free(ctx.compressors[i]);
+    free(ctx.compressors);
+    free(ctx.zbuf);
+    free(ctx.zsize);
+    return r;
+}
+
+int gust_elixir_process_file(const char* input_path, const elixir_options* opt)
 {
     int r = -1;
-    char path[256];
-    uint8_t *buf = NULL, *zbuf = NULL;
+    char path[256], *input = NULL;
+    uint8_t *buf = NULL;
     uint32_t zsize, lxr_entry_size = sizeof(lxr_entry);
     FILE *file = NULL, *dst = NULL;
     JSON_Value* json = NULL;
-    tdefl_compressor* compressor = NULL;
     lxr_entry* table = NULL;
-    bool list_only = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'l');
-    bool decompress_only = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'd');
+    const bool list_only = opt->list_only, decompress_only = opt->decompress_only;
+    const uint32_t nb_threads = opt->nb_threads, nb_extract_names = opt->nb_extract_names;
 
-    if ((argc != 2) && !list_only && !decompress_only) {
-        printf("%s %s (c) 2019-2021 VitaSmith\n\n"
-            "Usage: %s [-d] [-l] <elixir[.gz]> file>\n\n"
-            "Extracts (file) or recreates (directory) a Gust .elixir archive.\n\n"
-            "Note: A backup (.bak) of the original is automatically created, when the target\n"
-            "is being overwritten for the first time.\n",
-            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]));
-        return 0;
-    }
+    // We alter the path
+    input = strdup(input_path);
+    if (input == NULL)
+        goto out;
 
-    if (is_directory(argv[argc - 1])) {
+    if (is_directory(input)) {
         if (list_only) {
             fprintf(stderr, "ERROR: Option -l is not supported when creating an archive\n");
             goto out;
@@ -110,16 +568,22 @@ int main_utf8(int argc, char** argv)
             fprintf(stderr, "ERROR: Option -d is not supported when creating an archive\n");
             goto out;
         }
-        snprintf(path, sizeof(path), "%s%celixir.json", argv[argc - 1], PATH_SEP);
+        if (nb_extract_names != 0) {
+            fprintf(stderr, "ERROR: Option -x is not supported when creating an archive\n");
+            goto out;
+        }
+        snprintf(path, sizeof(path), "%s%celixir.json", input, PATH_SEP);
         if (!is_file(path)) {
             fprintf(stderr, "ERROR: '%s' does not exist\n", path);
             goto out;
         }
+        uint64_t start = stats_start();
         json = json_parse_file_with_comments(path);
         if (json == NULL) {
             fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", path);
             goto out;
         }
+        stats_stop("json_read", start, 0);
         //const uint32_t json_version = json_object_get_uint32(json_object(json), "json_version");
         //if (json_version != JSON_VERSION) {
         //    fprintf(stderr, "ERROR: This utility is not compatible with the JSON file provided.\n"
@@ -131,17 +595,6 @@ int main_utf8(int argc, char** argv)
             goto out;
         printf("Creating '%s'...\n", filename);
         create_backup(filename);
-        // Work with a temporary file if we're going to compress it
-        if (json_object_get_boolean(json_object(json), "compressed"))
-            snprintf(path, sizeof(path), "%s.tmp", filename);
-        else
-            strncpy(path, filename, sizeof(path));
-        path[sizeof(path) - 1] = 0;
-        file = fopen_utf8(path, "wb+");
-        if (file == NULL) {
-            fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
-            goto out;
-        }
         lxr_header hdr = { 0 };
         hdr.magic = EARC_MAGIC;
         hdr.header_size = (uint32_t)sizeof(lxr_header);
@@ -159,190 +612,155 @@ int main_utf8(int argc, char** argv)
         hdr.filename_size = (max_filename_length - 0x20 + 0x0f) / 0x10;
         lxr_entry_size += hdr.filename_size * 0x10;
         hdr.table_size = hdr.nb_files * lxr_entry_size;
-        if (fwrite(&hdr, sizeof(hdr), 1, file) != 1) {
-            fprintf(stderr, "ERROR: Can't write header\n");
-            goto out;
-        }
         table = (lxr_entry*)calloc(hdr.nb_files, lxr_entry_size);
-        // Allocate the space in file - we'll update it later on
-        if (fwrite(table, lxr_entry_size, hdr.nb_files, file) != hdr.nb_files) {
-            fprintf(stderr, "ERROR: Can't write header table\n");
+        if (table == NULL)
             goto out;
-        }
-        printf("OFFSET   SIZE     NAME\n");
+
+        // Lay out the archive from the file sizes, so that it can be assembled in memory
+        uint64_t image_size = (uint64_t)hdr.header_size + hdr.table_size;
         lxr_entry* entry = table;
         const char* entry_name;
         for (uint32_t i = 0; i < hdr.nb_files; i++) {
             entry->size = 0;
-            entry->offset = ftell(file);
+            entry->offset = (uint32_t)image_size;
             entry_name = json_array_get_string(json_files_array, i);
-            snprintf(path, sizeof(path), "%s%c%s", _basename(argv[argc - 1]), PATH_SEP, entry_name);
+            snprintf(path, sizeof(path), "%s%c%s", _basename(input), PATH_SEP, entry_name);
             if (strcmp(entry_name, "dummy") != 0) {
-                entry->size = read_file(path, &buf);
-                if (entry->size == UINT32_MAX)
+                uint64_t size = get_file_size(path);
+                if (size >= UINT32_MAX)
                     goto out;
+                entry->size = (uint32_t)size;
             }
-            strncpy(entry->filename, json_array_get_string(json_files_array, i),
-                0x20 + ((size_t)hdr.filename_size * 0x10));
-            printf("%08x %08x %s\n", entry->offset, entry->size, path);
-            if ((entry->size != 0) && (fwrite(buf, 1, entry->size, file) != entry->size)) {
-                fprintf(stderr, "ERROR: Can't add file data\n");
+            strncpy(entry->filename, entry_name, 0x20 + ((size_t)hdr.filename_size * 0x10));
+            image_size += entry->size;
+            if (image_size >= UINT32_MAX) {
+                fprintf(stderr, "ERROR: Archive is too large\n");
                 goto out;
             }
-            free(buf);
-            buf = NULL;
             entry = (lxr_entry*) &((uint8_t*)entry)[lxr_entry_size];
         }
-        hdr.payload_size = ftell(file) - hdr.header_size - hdr.table_size;
-        fseek(file, 2 * sizeof(uint32_t), SEEK_SET);
-        if (fwrite(&hdr.payload_size, sizeof(uint32_t), 1, file) != 1) {
-            fprintf(stderr, "ERROR: Can't update file size\n");
+        hdr.payload_size = (uint32_t)image_size - hdr.header_size - hdr.table_size;
+        buf = malloc((size_t)image_size);
+        if (buf == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate archive buffer\n");
             goto out;
         }
-        fseek(file, hdr.header_size, SEEK_SET);
-        if (fwrite(table, lxr_entry_size, hdr.nb_files, file) != hdr.nb_files) {
-            fprintf(stderr, "ERROR: Can't write header table\n");
-            goto out;
+        memcpy(buf, &hdr, sizeof(hdr));
+        memcpy(&buf[hdr.header_size], table, hdr.table_size);
+
+        printf("OFFSET   SIZE     NAME\n");
+        entry = table;
+        for (uint32_t i = 0; i < hdr.nb_files; i++) {
+            entry_name = json_array_get_string(json_files_array, i);
+            snprintf(path, sizeof(path), "%s%c%s", _basename(input), PATH_SEP, entry_name);
+            printf("%08x %08x %s\n", entry->offset, entry->size, path);
+            if (entry->size != 0) {
+                start = stats_start();
+                file = fopen_utf8(path, "rb");
+                if (file == NULL) {
+                    fprintf(stderr, "ERROR: Can't open '%s'\n", path);
+                    goto out;
+                }
+                if (fread(&buf[entry->offset], 1, entry->size, file) != entry->size) {
+                    fprintf(stderr, "ERROR: Can't read from '%s'\n", path);
+                    goto out;
+                }
+                fclose(file);
+                file = NULL;
+                stats_stop("read", start, entry->size);
+            }
+            entry = (lxr_entry*) &((uint8_t*)entry)[lxr_entry_size];
         }
 
         if (json_object_get_boolean(json_object(json), "compressed")) {
-            printf("Compressing...\n");
-            compressor = calloc(1, sizeof(tdefl_compressor));
-            if (compressor == NULL)
+            int level = DEFAULT_COMPRESSION_LEVEL;
+            if (json_object_has_value_of_type(json_object(json), "compression_level", JSONNumber))
+                level = (int)json_object_get_number(json_object(json), "compression_level");
+            if (level < 0 || level > 10) {
+                fprintf(stderr, "ERROR: Compression level must be between 0 and 10\n");
                 goto out;
-            dst = fopen_utf8(filename, "wb");
+            }
+            printf("Compressing...\n");
+            dst = create_file(filename, 0);
             if (dst == NULL) {
                 fprintf(stderr, "ERROR: Can't create compressed file\n");
                 goto out;
             }
-            fseek(file, 0, SEEK_SET);
-            buf = malloc(DEFAULT_CHUNK_SIZE);
-            zbuf = malloc(DEFAULT_CHUNK_SIZE);
-            while (1) {
-                size_t written = DEFAULT_CHUNK_SIZE;
-                size_t read = fread(buf, 1, DEFAULT_CHUNK_SIZE, file);
-                if (read == 0)
-                    break;
-                tdefl_status status = tdefl_init(compressor, NULL, NULL,
-                    TDEFL_WRITE_ZLIB_HEADER | TDEFL_COMPUTE_ADLER32 | 256);
-                if (status != TDEFL_STATUS_OKAY) {
-                    fprintf(stderr, "ERROR: Can't init compressor\n");
-                    goto out;
-                }
-                status = tdefl_compress(compressor, buf, &read, zbuf, &written, TDEFL_FINISH);
-                if (status != TDEFL_STATUS_DONE) {
-                    fprintf(stderr, "ERROR: Can't compress data\n");
-                    goto out;
-                }
-                if (fwrite(&written, sizeof(uint32_t), 1, dst) != 1) {
-                    fprintf(stderr, "ERROR: Can't write compressed stream size\n");
-                    goto out;
-                }
-                if (fwrite(zbuf, 1, written, dst) != written) {
-                    fprintf(stderr, "ERROR: Can't write compressed data\n");
-                    goto out;
-                }
-            }
-            uint32_t end_marker = 0;
-            if (fwrite(&end_marker, sizeof(uint32_t), 1, dst) != 1) {
-                fprintf(stderr, "ERROR: Can't write end marker\n");
+            const int flags = (int)tdefl_create_comp_flags_from_zip_params(level, 15, 0) | TDEFL_COMPUTE_ADLER32;
+            if (!deflate_chunks(buf, (size_t)image_size, flags, nb_threads, dst))
                 goto out;
-            }
-            fclose(file);
-            file = NULL;
-            snprintf(path, sizeof(path), "%s.tmp", filename);
-            _unlink(path);
+        } else {
+            start = stats_start();
+            if (!write_file(buf, (uint32_t)image_size, filename, false))
+                goto out;
+            stats_stop("write", start, image_size);
         }
 
         r = 0;
     } else {
         printf("%s '%s'...\n", list_only ? "Listing" :
-            (decompress_only ? "Decompressing" : "Extracting"), _basename(argv[argc - 1]));
-        char* elixir_pos = strstr(argv[argc - 1], ".elixir");
+            (decompress_only ? "Decompressing" : "Extracting"), _basename(input));
+        char* elixir_pos = strstr(input, ".elixir");
         if (elixir_pos == NULL) {
             fprintf(stderr, "ERROR: File should have a '.elixir[.gz]' extension\n");
             goto out;
         }
-        char* gz_pos = strstr(argv[argc - 1], ".gz");
+        char* gz_pos = strstr(input, ".gz");
 
-        file = fopen_utf8(argv[argc - 1], "rb");
+        file = fopen_utf8(input, "rb");
         if (file == NULL) {
-            fprintf(stderr, "ERROR: Can't open elixir file '%s'", argv[argc - 1]);
+            fprintf(stderr, "ERROR: Can't open elixir file '%s'", input);
             goto out;
         }
 
         // Some elixir.gz files are actually uncompressed versions
         if (fread(&zsize, sizeof(zsize), 1, file) != 1) {
-            fprintf(stderr, "ERROR: Can't read from elixir file '%s'", argv[argc - 1]);
+            fprintf(stderr, "ERROR: Can't read from elixir file '%s'", input);
             goto out;
         }
         if ((zsize == EARC_MAGIC) && (gz_pos != NULL))
             gz_pos = NULL;
 
+        if (nb_extract_names != 0) {
+            if (list_only || decompress_only) {
+                fprintf(stderr, "ERROR: Option -x can't be used with -l or -d\n");
+                goto out;
+            }
+            fclose(file);
+            file = NULL;
+            snprintf(path, sizeof(path), "%.*s", (int)(elixir_pos - input), input);
+            if (extract_members(input, path, opt->extract_names, nb_extract_names,
+                (gz_pos != NULL), opt->save_index, nb_threads))
+                r = 0;
+            goto out;
+        }
+
         fseek(file, 0L, SEEK_END);
         size_t file_size = ftell(file);
         fseek(file, 0L, SEEK_SET);
 
         if (gz_pos != NULL) {
-            file_size *= 2;
-            buf = malloc(file_size);
-            if (buf == NULL)
+            // Index the compressed streams from a view of the file, then inflate them all at once
+            file_view view;
+            if (!open_file_view(input, &view, false))
+                goto out;
+            file_size = inflate_chunks(view.data, (size_t)view.size, nb_threads, &buf);
+            close_file_view(&view);
+            if (file_size == SIZE_MAX)
                 goto out;
-            size_t pos = 0;
-            int32_t s = 0;
-            while (1) {
-                uint32_t file_pos = (uint32_t)ftell(file);
-                if (fread(&zsize, sizeof(uint32_t), 1, file) != 1) {
-                    fprintf(stderr, "ERROR: Can't read compressed stream size at position %08x\n", file_pos);
-                    goto out;
-                }
-                if (zsize == 0)
-                    break;
-                zbuf = malloc(zsize);
-                if (zbuf == NULL)
-                    goto out;
-                if (fread(zbuf, 1, zsize, file) != zsize) {
-                    fprintf(stderr, "ERROR: Can't read compressed stream at position %08x\n", file_pos);
-                    goto out;
-                }
-increase_buf_size:
-                // Elixirs are inflated using a constant chunk size which simplifies overflow handling
-                if ((s == -2) || (pos + DEFAULT_CHUNK_SIZE > file_size)) {
-                    file_size *= 2;
-                    uint8_t* old_buf = buf;
-                    buf = realloc(buf, file_size);
-                    if (buf == NULL) {
-                        fprintf(stderr, "ERROR: Can't increase buffer size\n");
-                        buf = old_buf;
-                        goto out;
-                    }
-                }
-                s = decompress_mem_to_mem(&buf[pos], file_size - pos, zbuf, zsize,
-                    TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32);
-                if (s == -2)
-                    goto increase_buf_size;
-                if (s <= 0) {
-                    fprintf(stderr, "ERROR: Can't decompress stream at position %08x\n", file_pos);
-                    goto out;
-                }
-                free(zbuf);
-                zbuf = NULL;
-                pos += s;
-            } while (zsize != 0);
-            file_size = pos;
             if (decompress_only) {
                 *gz_pos = 0;
-                dst = fopen(argv[argc - 1], "wb");
+                dst = fopen(input, "wb");
                 if (dst == NULL) {
-                    fprintf(stderr, "ERROR: Can't create file '%s'\n", argv[argc - 1]);
+                    fprintf(stderr, "ERROR: Can't create file '%s'\n", input);
                     goto out;
                 }
                 if (fwrite(buf, 1, file_size, dst) != file_size) {
-                    fprintf(stderr, "ERROR: Can't write file '%s'\n", argv[argc - 1]);
+                    fprintf(stderr, "ERROR: Can't write file '%s'\n", input);
                     fclose(dst);
                     goto out;
                 }
-                printf("%08x %s\n", (uint32_t)file_size, _basename(argv[argc - 1]));
+                printf("%08x %s\n", (uint32_t)file_size, _basename(input));
                 r = 0;
                 goto out;
             }
@@ -350,21 +768,23 @@ increase_buf_size:
             buf = malloc(file_size);
             if (buf == NULL)
                 goto out;
+            uint64_t start = stats_start();
             if (fread(buf, 1, file_size, file) != file_size) {
                 fprintf(stderr, "ERROR: Can't read uncompressed data");
                 goto out;
             }
+            stats_stop("read", start, file_size);
         }
 
         // Now that we have an uncompressed .elixir file, extract the files
         json = json_value_init_object();
         json_object_set_number(json_object(json), "json_version", JSON_VERSION);
-        json_object_set_string(json_object(json), "name", _basename(argv[argc - 1]));
+        json_object_set_string(json_object(json), "name", _basename(input));
         if (gz_pos != NULL)
             json_object_set_boolean(json_object(json), "compressed", (gz_pos != NULL));
 
         *elixir_pos = 0;
-        if (!list_only && !create_path(argv[argc - 1]))
+        if (!list_only && !create_path(input))
             goto out;
 
         lxr_header* hdr = (lxr_header*)buf;
@@ -403,7 +823,7 @@ increase_buf_size:
                 goto out;
             memcpy(filename, entry->filename, 0x20 + hdr->filename_size * 0x10);
             json_array_append_string(json_array(json_files_array), filename);
-            snprintf(path, sizeof(path), "%s%c%s", argv[argc - 1], PATH_SEP, filename);
+            snprintf(path, sizeof(path), "%s%c%s", input, PATH_SEP, filename);
             free(filename);
             printf("%08x %08x %s\n", entry->offset, entry->size, path);
             if (list_only)
@@ -411,28 +831,99 @@ increase_buf_size:
             // No need to extract data for dummy entries
             if ((entry->size == 0) && (strcmp(entry->filename, "dummy") == 0))
                 continue;
-            if (!write_file(&buf[entry->offset], entry->size, path, false))
+            uint64_t start = stats_start();
+            if (!write_output_file(&buf[entry->offset], entry->size, path))
                 goto out;
+            stats_stop("write", start, entry->size);
         }
 
         json_object_set_value(json_object(json), "files", json_files_array);
-        snprintf(path, sizeof(path), "%s%celixir.json", argv[argc - 1], PATH_SEP);
-        if (!list_only)
+        snprintf(path, sizeof(path), "%s%celixir.json", input, PATH_SEP);
+        if (!list_only) {
+            uint64_t start = stats_start();
             json_serialize_to_file_pretty(json, path);
+            stats_stop("json_write", start, 0);
+        }
 
         r = 0;
     }
 
 out:
     json_value_free(json);
+    free(input);
     free(buf);
-    free(zbuf);
     free(table);
-    free(compressor);
     if (file != NULL)
         fclose(file);
     if (dst != NULL)
         fclose(dst);
+    return r;
+}
+
+int main_utf8(int argc, char** argv)
+{
+    int r = -1, argi;
+    bool print_usage = false;
+    elixir_options opt = { false, false, false, 1, calloc(argc, sizeof(char*)), 0 };
+
+    if (opt.extract_names == NULL)
+        return -1;
+
+    for (argi = 1; (argi < argc - 1) && (argv[argi][0] == '-') && !print_usage; argi++) {
+        switch (argv[argi][1]) {
+        case 'l':
+            opt.list_only = true;
+            break;
+        case 'd':
+            opt.decompress_only = true;
+            break;
+        case 'i':
+            opt.save_index = true;
+            break;
+        case 'x':
+            if (++argi >= argc - 1) {
+                print_usage = true;
+                break;
+            }
+            opt.extract_names[opt.nb_extract_names++] = argv[argi];
+            break;
+        case 'j':
+            if (++argi >= argc - 1) {
+                print_usage = true;
+                break;
+            }
+            if (!parse_nb_threads(argv[argi], &opt.nb_threads))
+                print_usage = true;
+            break;
+        default:
+            print_usage = true;
+            break;
+        }
+    }
+
+    if ((argi != argc - 1) || print_usage) {
+        printf("%s %s (c) 2019-2021 VitaSmith\n\n"
+            "Usage: %s [-d] [-l] [-j N] [-x NAME] [-i] <elixir[.gz] file|directory>\n\n"
+            "Extracts (file) or recreates (directory) a Gust .elixir archive.\n\n"
+            "Options:\n"
+            "  -d       Decompress an .elixir.gz into an .elixir, without extracting it\n"
+            "  -l       List the content of the archive only\n"
+            "  -j N     (De)compress using N threads (0 = one thread per CPU)\n"
+            "  -x NAME  Only extract NAME, inflating just the chunks it uses (can be repeated)\n"
+            "  -i       Save a chunk index (.idx) of the archive, to speed up further -x lookups\n\n"
+            "Note: A backup (.bak) of the original is automatically created, when the target\n"
+            "is being overwritten for the first time.\n"
+            "When recreating a compressed archive, a \"compression_level\" (0-10, default %d)\n"
+            "can be added to elixir.json, to trade archive size against compression speed.\n",
+            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]), DEFAULT_COMPRESSION_LEVEL);
+        r = 0;
+        goto out;
+    }
+
+    r = gust_elixir_process_file(argv[argc - 1], &opt);
+
+out:
+    free(opt.extract_names);
 
     if (r != 0) {
         fflush(stdin);
@@ -444,3 +935,81 @@ out:
 }
 
 CALL_MAIN
+
+#if defined(GUST_BENCH)
+#include "bench.h"
+
+typedef struct {
+    uint8_t*            buf;
+    uint8_t*            zbuf;       // Chunk i is deflated at offset i * MAX_DEFLATED_CHUNK_SIZE
+    uint32_t*           zsize;
+    uint32_t            nb_chunks;
+    int                 flags;
+    tdefl_compressor*   compressor;
+} elixir_bench;
+
+// Single threaded, so that we time the kernels rather than the job dispatching
+static bool bench_deflate(void* _ctx)
+{
+    elixir_bench* ctx = (elixir_bench*)_ctx;
+    for (uint32_t i = 0; i < ctx->nb_chunks; i++) {
+        size_t pos = (size_t)i * DEFAULT_CHUNK_SIZE;
+        size_t size = min(bench_size - pos, DEFAULT_CHUNK_SIZE), written = MAX_DEFLATED_CHUNK_SIZE;
+        if (tdefl_init(ctx->compressor, NULL, NULL, ctx->flags) != TDEFL_STATUS_OKAY ||
+            tdefl_compress(ctx->compressor, &ctx->buf[pos], &size, &ctx->zbuf[(size_t)i * MAX_DEFLATED_CHUNK_SIZE],
+                &written, TDEFL_FINISH) != TDEFL_STATUS_DONE)
+            return false;
+        ctx->zsize[i] = (uint32_t)written;
+    }
+    return true;
+}
+
+static bool bench_inflate(void* _ctx)
+{
+    elixir_bench* ctx = (elixir_bench*)_ctx;
+    const int flags = TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32;
+    for (uint32_t i = 0; i < ctx->nb_chunks; i++) {
+        size_t pos = (size_t)i * DEFAULT_CHUNK_SIZE;
+        int32_t size = (int32_t)min(bench_size - pos, DEFAULT_CHUNK_SIZE);
+        if (decompress_mem_to_mem(&ctx->buf[pos], DEFAULT_CHUNK_SIZE,
+            &ctx->zbuf[(size_t)i * MAX_DEFLATED_CHUNK_SIZE], ctx->zsize[i], flags) != size)
+            return false;
+    }
+    return true;
+}
+
+bool gust_elixir_bench(void)
+{
+    bool r = false;
+    if (!bench_selected("tdefl") && !bench_selected("tinfl"))
+        return true;
+
+    elixir_bench ctx = { 0 };
+    ctx.nb_chunks = (bench_size + DEFAULT_CHUNK_SIZE - 1) / DEFAULT_CHUNK_SIZE;
+    ctx.flags = (int)tdefl_create_comp_flags_from_zip_params(DEFAULT_COMPRESSION_LEVEL, 15, 0) | TDEFL_COMPUTE_ADLER32;
+    ctx.buf = malloc(bench_size);
+    ctx.zbuf = malloc((size_t)ctx.nb_chunks * MAX_DEFLATED_CHUNK_SIZE);
+    ctx.zsize = calloc(ctx.nb_chunks, sizeof(uint32_t));
+    ctx.compressor = malloc(sizeof(tdefl_compressor));
+    if (ctx.buf == NULL || ctx.zbuf == NULL || ctx.zsize == NULL || ctx.compressor == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate buffers\n");
+        goto out;
+    }
+    bench_fill(ctx.buf, bench_size, 3, true);
+
+    // Inflating needs the deflated chunks, even if deflating is not being timed
+    if (!bench_deflate(&ctx)) {
+        fprintf(stderr, "ERROR: Can't compress data\n");
+        goto out;
+    }
+    r = bench_kernel("tdefl", bench_deflate, &ctx, bench_size) &&
+        bench_kernel("tinfl", bench_inflate, &ctx, bench_size);
+
+out:
+    free(ctx.compressor);
+    free(ctx.zsize);
+    free(ctx.zbuf);
+    free(ctx.buf);
+    return r;
+}
+#endif
@@ -45,6 +45,7 @@
 #include "utf8.h"
 #include "util.h"
 #include "parson.h"
+#include "batch.h"
 
 #define E_HEADER_SIZE       0x10
 #define E_FOOTER_SIZE       0x10
@@ -70,11 +71,13 @@ typedef struct {
     uint16_t fence;
 } seed_data;
 
-// Bitmap list prime numbers below a specific value
-static uint8_t* prime_list = NULL;
-static uint32_t random_seed[2];
+// Bitmap list of the prime numbers up to PRIME_LIST_MAX, that is only computed once
+#define PRIME_LIST_MAX      0xffff
+static uint8_t prime_list[(PRIME_LIST_MAX + 1) / 8];
+static bool prime_list_ready = false;
+static THREAD_LOCAL uint32_t random_seed[2];
 // TODO: Use endianness handling from util.[h/c]
-static bool is_big_endian = true;
+static THREAD_LOCAL bool is_big_endian = true;
 #define getdata16(x) (is_big_endian ? getbe16(x) : getle16(x))
 #define getdata32(x) (is_big_endian ? getbe32(x) : getle32(x))
 #define setdata16(x, v) (is_big_endian ? setbe16(x, v): setle16(x, v))
@@ -111,6 +114,32 @@ static __inline uint16_t get_random_u16(void)
  * From there, they only differ in the manner with which they use the updated seed.
  */
 
+// Fenwick tree over the [0, size) positions that haven't been picked yet, so that the
+// x-th unused position can be found and removed in O(log(size)) rather than O(size).
+static void init_unused_positions(uint32_t* tree, uint32_t size)
+{
+    // All the positions start as unused, so each node simply counts the positions it covers
+    for (uint32_t i = 1; i <= size; i++)
+        tree[i] = i & (~i + 1);
+}
+
+static uint32_t pick_unused_position(uint32_t* tree, uint32_t size, uint32_t x)
+{
+    uint32_t pos = 0, step = 1;
+    while (step <= size / 2)
+        step <<= 1;
+    // Find the largest pos for which fewer than x + 1 positions are unused in [0, pos)
+    for (; step != 0; step >>= 1) {
+        if (pos + step <= size && tree[pos + step] <= x) {
+            pos += step;
+            x -= tree[pos];
+        }
+    }
+    for (uint32_t i = pos + 1; i <= size; i += i & (~i + 1))
+        tree[i]--;
+    return pos;
+}
+
 // Scramble individual bits between two semi-random bit positions within a slice.
 static bool bit_scrambler(uint8_t* chunk, uint32_t chunk_size, uint32_t slice_size,
                           bool descramble)
@@ -118,10 +147,10 @@ static bool bit_scrambler(uint8_t* chunk, uint32_t chunk_size, uint32_t slice_si
     // Table_size needs to be 8 * slice_size, to encompass all individual bit positions
     uint32_t x, table_size = slice_size << 3;
 
-    uint16_t* base_table = calloc(table_size, sizeof(uint16_t));
+    uint32_t* unused = calloc((size_t)table_size + 1, sizeof(uint32_t));
     uint16_t* scrambling_table = calloc(table_size, sizeof(uint16_t));
-    if ((table_size < 4) || (base_table == NULL) || (scrambling_table == NULL)) {
-        free(base_table);
+    if ((table_size < 4) || (unused == NULL) || (scrambling_table == NULL)) {
+        free(unused);
         free(scrambling_table);
         return false;
     }
@@ -131,17 +160,12 @@ static bool bit_scrambler(uint8_t* chunk, uint32_t chunk_size, uint32_t slice_si
         // Make sure we don't overflow our table, else we're going to pick
         // bits located outside our chunk
         table_size = min(table_size, chunk_size << 3);
-        // Create a base table of incremental 16-bit values
-        for (uint32_t i = 0; i < table_size; i++)
-            base_table[i] = (uint16_t)i;
-
-        // Now create a scrambled table from the above
+        // Create a scrambled table of all the bit positions
+        init_unused_positions(unused, table_size);
         for (uint32_t i = 0; i < table_size; i++) {
-            // Translate this semi-random value to a base_table index we haven't used yet
+            // Translate this semi-random value to a bit position we haven't used yet
             x = get_random_u15() % (table_size - i);
-            scrambling_table[i] = base_table[x];
-            // Now remove the value we used from base_table
-            memmove(&base_table[x], &base_table[x + 1], (size_t)(table_size - i - x) * 2);
+            scrambling_table[i] = (uint16_t)pick_unused_position(unused, table_size, x);
         }
 
         // This scrambler uses a pair of byte and bit positions that are derived from
@@ -175,57 +199,223 @@ static bool bit_scrambler(uint8_t* chunk, uint32_t chunk_size, uint32_t slice_si
         chunk_size -= slice_size;
     }
 
-    free(base_table);
+    free(unused);
     free(scrambling_table);
     return true;
 }
 
-// Sequentially scramble bytes by adding the updated seed and, depending on whether
-// the modulo with the current seed falls above or below a "fence", XORing the seed.
-static bool fenced_scrambler(uint8_t* buf, uint32_t buf_size, uint16_t fence,
-                             bool descramble, bool extra_fudge)
+/*
+ * The fenced and rotating scramblers are sequential, but since the seed update is the
+ * affine map s -> seed[0] * s + 0x2f09 (mod 2^32), the seed after n updates can be
+ * obtained in O(log(n)) by composing this map with itself. This allows us to split
+ * the buffers into ranges that are scrambled concurrently.
+ */
+#define SCRAMBLER_RANGE_SIZE    (256 * 1024)
+#define FENCED_CHUNK_STEPS      (1 << 20)
+// gust_batch already runs one tool instance per CPU, so we don't nest another pool there
+#if defined(GUST_BATCH) && !defined(GUST_BENCH)
+#define SCRAMBLER_THREADS       1
+#else
+#define SCRAMBLER_THREADS       get_nb_cpus()
+#endif
+
+// Return the seed obtained after n updates of seed, when using multiplier mult
+static uint32_t jump_random(uint32_t mult, uint32_t seed, uint64_t n)
+{
+    uint32_t a = 1, c = 0, step_a = mult, step_c = RANDOM_INCREMENT;
+    for (; n != 0; n >>= 1) {
+        if (n & 1) {
+            a *= step_a;
+            c = step_a * c + step_c;
+        }
+        step_c = step_a * step_c + step_c;
+        step_a *= step_a;
+    }
+    return a * seed + c;
+}
+
+typedef struct {
+    uint8_t*        buf;
+    uint32_t        buf_size;
+    uint32_t        mult;       // random_seed[0]
+    uint32_t        seed;       // random_seed[1], before the first update
+    bool            big_endian;
+    // Fenced scrambler
+    uint16_t        fence;
+    bool            descramble;
+    bool            extra_fudge;
+    uint64_t*       extra_draws;    // Bitmap of the updates that are followed by an extra draw
+    uint64_t*       range_start;    // Number of updates performed before each range
+    // Rotating scrambler
+    const seed_data* seeds;
+} scrambler_ctx;
+
+// With extra_fudge, a word consumes either one or two updates, depending on whether
+// the first one falls above the fence. So we flag these, concurrently, for all the
+// updates that we may perform, before looking for the update each range starts at.
+static bool flag_extra_draws(void* _ctx, uint32_t thread_index, uint32_t chunk)
+{
+    scrambler_ctx* ctx = (scrambler_ctx*)_ctx;
+    uint64_t n = (uint64_t)chunk * FENCED_CHUNK_STEPS;
+    uint64_t max_n = min(n + FENCED_CHUNK_STEPS, (uint64_t)ctx->buf_size + 1);
+    uint32_t seed = jump_random(ctx->mult, ctx->seed, n);
+    (void)thread_index;
+
+    for (; n < max_n; n += 64) {
+        uint64_t bits = 0;
+        for (uint32_t j = 0; j < 64; j++) {
+            seed = ctx->mult * seed + RANDOM_INCREMENT;
+            uint16_t x = (seed >> 16) & 0x7fff;
+            if (x % (ctx->fence * 2) >= ctx->fence)
+                bits |= 1ULL << j;
+        }
+        ctx->extra_draws[n / 64] = bits;
+    }
+    return true;
+}
+
+static bool fenced_range(void* _ctx, uint32_t thread_index, uint32_t range)
 {
-    for (uint32_t i = 0; i < buf_size; i += 2) {
-        uint16_t x = get_random_u15();
-        uint16_t w = getdata16(&buf[i]);
+    scrambler_ctx* ctx = (scrambler_ctx*)_ctx;
+    uint32_t start = range * SCRAMBLER_RANGE_SIZE;
+    uint32_t end = (uint32_t)min((uint64_t)start + SCRAMBLER_RANGE_SIZE, ctx->buf_size);
+    uint64_t n = ctx->extra_fudge ? ctx->range_start[range] : start / 2;
+    uint32_t seed = jump_random(ctx->mult, ctx->seed, n);
+    (void)thread_index;
+
+    for (uint32_t i = start; i < end; i += 2) {
+        seed = ctx->mult * seed + RANDOM_INCREMENT;
+        uint16_t x = (seed >> 16) & 0x7fff, y = x;
+        bool above_fence = ctx->extra_fudge ? ((ctx->extra_draws[n / 64] >> (n % 64)) & 1) :
+            (x % (ctx->fence * 2) >= ctx->fence);
+        n++;
+        if (above_fence && ctx->extra_fudge) {
+            seed = ctx->mult * seed + RANDOM_INCREMENT;
+            y = (seed >> 16) & 0x7fff;
+            n++;
+        }
+        uint16_t w = ctx->big_endian ? getbe16(&ctx->buf[i]) : getle16(&ctx->buf[i]);
         // The fence is a 12-bit prime number
-        if (descramble) {
-            if (x % (fence * 2) >= fence)
-                w ^= extra_fudge ? get_random_u15() : x;
+        if (ctx->descramble) {
+            if (above_fence)
+                w ^= y;
             w -= x;
         } else {
             w += x;
-            if (x % (fence * 2) >= fence)
-                w ^= extra_fudge ? get_random_u15() : x;
+            if (above_fence)
+                w ^= y;
         }
-        setdata16(&buf[i], w);
+        if (ctx->big_endian)
+            setbe16(&ctx->buf[i], w);
+        else
+            setle16(&ctx->buf[i], w);
     }
     return true;
 }
 
-// Sequentially scramble bytes by XORing them with a set of 3 rotated seeds.
-static bool rotating_scrambler(uint8_t* buf, uint32_t buf_size, const seed_data* seeds)
+// Sequentially scramble bytes by adding the updated seed and, depending on whether
+// the modulo with the current seed falls above or below a "fence", XORing the seed.
+static bool fenced_scrambler(uint8_t* buf, uint32_t buf_size, uint16_t fence,
+                             bool descramble, bool extra_fudge)
+{
+    bool r = false;
+    uint32_t nb_ranges = (buf_size + SCRAMBLER_RANGE_SIZE - 1) / SCRAMBLER_RANGE_SIZE;
+    scrambler_ctx ctx = { buf, buf_size, random_seed[0], random_seed[1], is_big_endian,
+                          fence, descramble, extra_fudge, NULL, NULL, NULL };
+
+    if (extra_fudge) {
+        // We perform at most 2 updates per 16-bit word
+        uint32_t nb_chunks = (buf_size + FENCED_CHUNK_STEPS) / FENCED_CHUNK_STEPS;
+        ctx.extra_draws = malloc((size_t)nb_chunks * (FENCED_CHUNK_STEPS / 8));
+        ctx.range_start = malloc(((size_t)nb_ranges + 1) * sizeof(uint64_t));
+        if (ctx.extra_draws == NULL || ctx.range_start == NULL)
+            goto out;
+        if (!run_jobs(SCRAMBLER_THREADS, nb_chunks, flag_extra_draws, &ctx))
+            goto out;
+        uint64_t n = 0;
+        for (uint32_t i = 0; i < buf_size; i += 2) {
+            if (i % SCRAMBLER_RANGE_SIZE == 0)
+                ctx.range_start[i / SCRAMBLER_RANGE_SIZE] = n;
+            n += 1 + ((ctx.extra_draws[n / 64] >> (n % 64)) & 1);
+        }
+    }
+    r = run_jobs(SCRAMBLER_THREADS, nb_ranges, fenced_range, &ctx);
+
+out:
+    free(ctx.extra_draws);
+    free(ctx.range_start);
+    return r;
+}
+
+// Position in the sequence of seeds used by the rotating scrambler
+typedef struct {
+    uint32_t seed;
+    uint32_t table[3];
+    uint32_t index;
+    uint32_t fudge;
+    uint32_t processed;
+} rotating_state;
+
+// Each seed from the table is only updated when it is in use, so we can skip to any
+// position by counting the updates that were applied to each seed until then.
+static void seek_rotating(const scrambler_ctx* ctx, uint32_t pos, rotating_state* state)
 {
-    // We're updating seed values in the table, so make sure we work on a copy
-    uint32_t seed_table[3] = { seeds->table[0], seeds->table[1], seeds->table[2] };
-    uint32_t seed_index = 0;
-    uint32_t seed_switch_fudge = 0;
-    uint32_t processed_for_this_seed = 0;
-    for (uint32_t i = 0; i < buf_size; i++) {
-        buf[i] ^= get_random_u16();
-        if (++processed_for_this_seed >= seeds->length[seed_index] + seed_switch_fudge) {
-            seed_table[seed_index++] = random_seed[1];
-            if (seed_index >= array_size(seed_table)) {
-                seed_index = 0;
-                seed_switch_fudge++;
+    const seed_data* seeds = ctx->seeds;
+    uint64_t nb_updates[3] = { 0, 0, 0 };
+    uint32_t index = 0, fudge = 0, len;
+    while (pos >= (len = max(seeds->length[index] + fudge, 1))) {
+        pos -= len;
+        nb_updates[index] += len;
+        if (++index >= array_size(nb_updates)) {
+            index = 0;
+            fudge++;
+        }
+    }
+    // The first seed from the table is replaced with the current one
+    for (uint32_t i = 0; i < array_size(state->table); i++)
+        state->table[i] = jump_random(ctx->mult, (i == 0) ? ctx->seed : seeds->table[i], nb_updates[i]);
+    state->seed = jump_random(ctx->mult, state->table[index], pos);
+    state->index = index;
+    state->fudge = fudge;
+    state->processed = pos;
+}
+
+static bool rotating_range(void* _ctx, uint32_t thread_index, uint32_t range)
+{
+    scrambler_ctx* ctx = (scrambler_ctx*)_ctx;
+    const seed_data* seeds = ctx->seeds;
+    uint32_t start = range * SCRAMBLER_RANGE_SIZE;
+    uint32_t end = (uint32_t)min((uint64_t)start + SCRAMBLER_RANGE_SIZE, ctx->buf_size);
+    rotating_state state;
+    (void)thread_index;
+
+    seek_rotating(ctx, start, &state);
+    uint32_t seed = state.seed;
+    for (uint32_t i = start; i < end; i++) {
+        seed = ctx->mult * seed + RANDOM_INCREMENT;
+        ctx->buf[i] ^= (uint8_t)(seed >> 16);
+        if (++state.processed >= seeds->length[state.index] + state.fudge) {
+            state.table[state.index++] = seed;
+            if (state.index >= array_size(state.table)) {
+                state.index = 0;
+                state.fudge++;
             }
-            random_seed[1] = seed_table[seed_index];
-            processed_for_this_seed = 0;
+            seed = state.table[state.index];
+            state.processed = 0;
         }
     }
     return true;
 }
 
+// Sequentially scramble bytes by XORing them with a set of 3 rotated seeds.
+static bool rotating_scrambler(uint8_t* buf, uint32_t buf_size, const seed_data* seeds)
+{
+    uint32_t nb_ranges = (buf_size + SCRAMBLER_RANGE_SIZE - 1) / SCRAMBLER_RANGE_SIZE;
+    scrambler_ctx ctx = { buf, buf_size, random_seed[0], random_seed[1], is_big_endian,
+                          0, false, false, NULL, NULL, seeds };
+    return run_jobs(SCRAMBLER_THREADS, nb_ranges, rotating_range, &ctx);
+}
+
 /*
   The following functions deal with the compression algorithm used by Gust, which
   looks like a derivative of LZSS that I am calling 'Glaze', for "Gust Lempel–Ziv".
@@ -234,29 +424,57 @@ typedef struct {
     uint8_t* buffer;
     uint32_t size;
     uint32_t pos;
-    int getbits_buffer;
-    int getbits_mask;
+    uint64_t bits;      // Bit buffer, with the next bit to read as MSB
+    uint32_t nb_bits;   // Number of valid bits in the bit buffer
 } getbits_ctx;
 
-#define GETBITS_EOF 0xffffffff
-static uint32_t getbits(getbits_ctx* ctx, int n)
+// Top up the bit buffer to at least 56 bits, unless we are at the end of the stream
+static __inline void refill_bits(getbits_ctx* ctx)
 {
-    int x = 0;
-
-    for (int i = 0; i < n; i++) {
-        if (ctx->getbits_mask == 0x00) {
-            if (ctx->pos >= ctx->size)
-                return GETBITS_EOF;
-            ctx->getbits_buffer = ctx->buffer[ctx->pos++];
-            ctx->getbits_mask = 0x80;
+    if (ctx->pos + sizeof(uint64_t) <= ctx->size) {
+        // Any bits we read past nb_bits are valid, so they can be ORed again on the next refill
+        ctx->bits |= getbe64(&ctx->buffer[ctx->pos]) >> ctx->nb_bits;
+        ctx->pos += (63 - ctx->nb_bits) >> 3;
+        ctx->nb_bits |= 56;
+    } else {
+        while ((ctx->nb_bits <= 56) && (ctx->pos < ctx->size)) {
+            ctx->bits |= (uint64_t)ctx->buffer[ctx->pos++] << (56 - ctx->nb_bits);
+            ctx->nb_bits += 8;
         }
-        x <<= 1;
-        if (ctx->getbits_buffer & ctx->getbits_mask)
-            x++;
-        ctx->getbits_mask >>= 1;
     }
+}
 
-    return x;
+/*
+  Codes are bit sequences of at most 15 bits, so we decode them all through a lookup
+  table, indexed by the next 15 bits of the bitstream, that provides (length << 8 | code).
+ */
+#define CODE_MAX_BITS   15
+static uint16_t code_lookup[1 << CODE_MAX_BITS];
+static bool code_lookup_ready = false;
+static mutex_t code_lookup_lock = MUTEX_INITIALIZER;
+
+static void init_code_lookup(void)
+{
+    lock_mutex(&code_lookup_lock);
+    if (code_lookup_ready) {
+        unlock_mutex(&code_lookup_lock);
+        return;
+    }
+    for (uint32_t i = 0; i < array_size(code_lookup); i++) {
+        // Bit sequence of l zeros, followed by a 1 and l more bits -> emit the last l + 1 bits
+        uint32_t l = 0;
+        while ((l < 8) && !(i & (1 << (CODE_MAX_BITS - 1 - l))))
+            l++;
+        if (l == 8) {
+            // Bit sequence of 8 zeros -> emit code 0x00
+            code_lookup[i] = 8 << 8;
+        } else {
+            uint32_t len = 2 * l + 1;
+            code_lookup[i] = (uint16_t)(len << 8 | (i >> (CODE_MAX_BITS - len)));
+        }
+    }
+    code_lookup_ready = true;
+    unlock_mutex(&code_lookup_lock);
 }
 
 // Boy with extended open hand, looking at butterfly: "Is this Huffman encoding?"
@@ -270,32 +488,68 @@ static uint8_t* build_code_table(uint8_t* bitstream, uint32_t bitstream_length)
     uint8_t* code_table = malloc(code_table_length);
     if (code_table == NULL)
         return NULL;
+    init_code_lookup();
     getbits_ctx ctx = { 0 };
     ctx.buffer = &bitstream[sizeof(uint32_t)];
     ctx.size = bitstream_length - sizeof(uint32_t);
 
-    for (uint32_t c = getbits(&ctx, 1), i = 0; i < code_table_length; c = getbits(&ctx, 1), i++) {
-        if (c == GETBITS_EOF) {
+    for (uint32_t i = 0; i < code_table_length; i++) {
+        if (ctx.nb_bits < CODE_MAX_BITS)
+            refill_bits(&ctx);
+        // Past the end of the stream, the buffer is zero padded, so we just need to check the length
+        uint16_t entry = code_lookup[ctx.bits >> (64 - CODE_MAX_BITS)];
+        uint32_t len = entry >> 8;
+        if (len > ctx.nb_bits)
             break;
-        } else if (c == 1) {
-            // Bit sequence starts with 1 -> emit code 0x01
-            code_table[i] = 1;
-        } else {
-            // Bit sequence starts with 0 -> get the length of code and emit it
-            int code_len = 0;
-            while ((++code_len < 8) && ((c = getbits(&ctx, 1)) == 0));
-            if (c == GETBITS_EOF)
-                break;
-            if (code_len < 8)
-                code_table[i] = (uint8_t)((c << code_len) | getbits(&ctx, code_len));
-            else
-                code_table[i] = 0;
-        }
+        code_table[i] = (uint8_t)entry;
+        ctx.bits <<= len;
+        ctx.nb_bits -= len;
     }
 
     return code_table;
 }
 
+// Duplicate len bytes from position -dist, where the source and destination may overlap
+static __inline uint8_t* copy_match(uint8_t* dst, uint32_t dist, uint32_t len, const uint8_t* dst_end)
+{
+    uint8_t* end = &dst[len];
+    // We may write up to 8 bytes past the match, so the slow path is used near the end of the buffer
+    if ((dist == 0) || ((size_t)(dst_end - dst) < (size_t)len + sizeof(uint64_t))) {
+        for (; dst < end; dst++)
+            *dst = dst[-(int)dist];
+        return end;
+    }
+    if (dist == 1) {
+        memset(dst, dst[-1], len);
+        return end;
+    }
+    if (dist < sizeof(uint64_t)) {
+        // Replicate the pattern over the first 8 bytes, after which we can copy 8 bytes
+        // at a time from the nearest multiple of the pattern length that is at least 8.
+        for (uint32_t i = 0; i < sizeof(uint64_t); i++)
+            dst[i] = dst[(int)i - (int)dist];
+        dist *= (sizeof(uint64_t) + dist - 1) / dist;
+        dst += sizeof(uint64_t);
+    }
+    for (; dst < end; dst += sizeof(uint64_t))
+        memcpy(dst, &dst[-(int)dist], sizeof(uint64_t));
+    return end;
+}
+
+// Copy len bytes from the dictionary, up to dst_max
+static __inline uint8_t* copy_literals(uint8_t* dst, uint8_t** dict, uint32_t len, const uint8_t* dst_max,
+                                       uint8_t bytecode)
+{
+    if (len > (size_t)(dst_max - dst)) {
+        uint32_t max_len = (uint32_t)(dst_max - dst);
+        fprintf(stderr, "WARNING: Dictionary overflow for bytecode 0x%02x (%d bytes)\n", bytecode, len - max_len);
+        len = max_len;
+    }
+    memcpy(dst, *dict, len);
+    *dict += len;
+    return &dst[len];
+}
+
 // Uncompress a glaze compressed buffer
 static uint32_t unglaze(uint8_t* src, uint32_t src_length, uint8_t* dst, uint32_t dst_length)
 {
@@ -348,6 +602,7 @@ static uint32_t unglaze(uint8_t* src, uint32_t src_length, uint8_t* dst, uint32_
 
     int l, d;
     uint8_t* dst_max = &dst[dec_length];
+    uint8_t* dst_end = &dst[dst_length];
     uint8_t* code = code_table;
     uint8_t* max_code = &code_table[code_len];
     while (dst < dst_max) {
@@ -365,51 +620,34 @@ static uint32_t unglaze(uint8_t* src, uint32_t src_length, uint8_t* dst, uint32_
         case 0x02:  // 2-byte code
             // Duplicate one byte from pos -d where d is provided by the code table
             d = *code++;
-            *dst++ = dst[-d];
+            *dst = dst[-d];
+            dst++;
             break;
         case 0x03:  // 3-byte code
             // Duplicate l bytes from position -(d + l) where both d and l are provided by the code table
             d = *code++;
             l = *code++;
-            d += l;
-            for (int i = ++l; i > 0; i--)
-                *dst++ = dst[-d];
+            dst = copy_match(dst, d + l, l + 1, dst_end);
             break;
         case 0x04:  // 2-byte code
             // Duplicate l bytes from position -(d + l) where l is provided by the code table and d by the source
             l = *code++;
             d = *dict++ + l;
-            for (int i = ++l; i > 0; i--)
-                *dst++ = dst[-d];
+            dst = copy_match(dst, d, l + 1, dst_end);
             break;
         case 0x05:  // 3-byte code
             // Same as above except with a 16-bit distance where the MSB is provided by the code table and LSB by the source
             d = *code++ << 8 | *dict++;
             l = *code++;
-            d += l;
-            for (int i = ++l; i > 0; i--)
-                *dst++ = dst[-d];
+            dst = copy_match(dst, d + l, l + 1, dst_end);
             break;
         case 0x06:  // 2-byte code
             // Copy l + 8 bytes from source where l is provided by the code table
-            l = *code++ + 8;
-            for (int i = l; i > 0; i--) {
-                *dst++ = *dict++;
-                if (dst > dst_max) {
-                    fprintf(stderr, "WARNING: Dictionary overflow for bytecode 0x06 (%d bytes)\n", i);
-                    break;
-                }
-            }
+            dst = copy_literals(dst, &dict, *code++ + 8, dst_max, 0x06);
             break;
         case 0x07:  // 1-byte code + 1 byte from length table
             // Copy l + 14 bytes from the source where l is provided by the (separate) length table
-            for (int i = *len++ + 14; i > 0; i--) {
-                *dst++ = *dict++;
-                if (dst > dst_max) {
-                    fprintf(stderr, "WARNING: Dictionary overflow for bytecode 0x07 (%d bytes)\n", i);
-                    break;
-                }
-            }
+            dst = copy_literals(dst, &dict, *len++ + 14, dst_max, 0x07);
             break;
         }
     }
@@ -418,20 +656,17 @@ static uint32_t unglaze(uint8_t* src, uint32_t src_length, uint8_t* dst, uint32_
     return dec_length;
 }
 
-// "Compress" a payload
-static uint32_t glaze(uint8_t* src, uint32_t src_size, uint8_t** dst)
+// "Compress" a payload, without looking for matches (compression level 0)
+static uint32_t glaze_store(uint8_t* src, uint32_t src_size, uint8_t** dst)
 {
-    // Now, there is no way in hell I'm going to craft a bona fide LZ compressor when
-    // I have a strong suspicion that this Glaze format that Gust uses comes from a
-    // known public compression algorithm, that we simply haven't identified yet.
     // Considering that we have a length table, allowing us to copy ~256 bytes of
-    // literals with a single bytecode, we're going to take a massive shortcut by:
+    // literals with a single bytecode, we can take a massive shortcut by:
     // - Copying all our decompressed data, as is, to the dictionary table
     // - Creating a length table for as many 256-byte blocks we need
     // - Creating a bytecode table, made of only 0x07's, so that only straight block
     //   copies from the dictionary are enacted.
-    // Of course, this means the resulting file won't be compressed in the slightest.
-    // But we don't really care about that for modding, do we?...
+    // Of course, this means the resulting file won't be compressed in the slightest,
+    // but it is the fastest option, and uses only the most basic of bytecodes.
 
     // Because we're exclusively working with blocks of [14-270] bytes for our
     // "compression" shortcut, we can't handle files that are smaller than 14 bytes...
@@ -440,7 +675,10 @@ static uint32_t glaze(uint8_t* src, uint32_t src_size, uint8_t** dst)
         return 0;
     }
 
-    bool short_last_block = (src_size % 256 <= 14);
+    // A last block of less than 14 bytes is merged with the previous (full) one, which
+    // then needs a length of up to 269 bytes (the most that length table values allow).
+    // Note that, when the size is a multiple of 256, the last block is a full one.
+    bool short_last_block = (src_size % 256 != 0 && src_size % 256 < 14);
     uint32_t num_blocks = ((src_size + 255) / 256);
     if (short_last_block)
         num_blocks--;
@@ -488,12 +726,371 @@ static uint32_t glaze(uint8_t* src, uint32_t src_size, uint8_t** dst)
     pos = &pos[sizeof(uint32_t)];
     memset(pos, 256 - 14, num_blocks - 1);
     pos = &pos[num_blocks - 1];
-    // Our last block can be 14 to 270 bytes in length (with the size offset by 14).
+    // Our last block can be 14 to 269 bytes in length (with the size offset by 14).
     if (short_last_block)
-        *pos = (256 - 14) + (src_size % 256);
+        *pos = (uint8_t)((256 - 14) + (src_size % 256));
+    else if (src_size % 256 == 0)
+        *pos = 256 - 14;
     else
-        *pos = (src_size % 256) - 14;
+        *pos = (uint8_t)((src_size % 256) - 14);
+
+    return compressed_size;
+}
+
+/*
+ * Glaze compressor, that produces the bytecodes that unglaze() understands:
+ * 0x01          copy 1 byte from the dictionary
+ * 0x02 d        copy 1 byte from distance d
+ * 0x03 d l      copy l + 1 bytes from distance d + l
+ * 0x04 l  [x]   copy l + 1 bytes from distance x + l, with x from the dictionary
+ * 0x05 h l [x]  copy l + 1 bytes from distance (h << 8 | x) + l, with x from the dictionary
+ * 0x06 l        copy l + 8 bytes from the dictionary
+ * 0x07 [l]      copy l + 14 bytes from the dictionary, with l from the length table
+ * Matches are found through hash chains and, since the bytecodes (and their operands)
+ * are stored as variable length bit sequences, we pick the ones that use the fewest bits.
+ */
+#define GLAZE_MAX_MATCH         256
+#define GLAZE_MAX_DISTANCE      (0xffff + GLAZE_MAX_MATCH - 1)
+#define GLAZE_WINDOW_SIZE       0x20000     // Must be a power of 2 larger than GLAZE_MAX_DISTANCE
+#define GLAZE_HASH_BITS         15
+#define GLAZE_NO_POS            UINT32_MAX
+#define GLAZE_LITERAL_BITS      8           // Approximate cost of a literal, in a run of literals
+#define GLAZE_MAX_LEVEL         9
+#define GLAZE_DEFAULT_LEVEL     6
+
+// Match finder settings for each compression level
+static const struct {
+    uint32_t    max_chain;      // Maximum number of match candidates to examine
+    uint32_t    nice_length;    // Stop looking for a better match once we have one this long
+    bool        lazy;           // Check whether the next position has a better match
+} glaze_levels[GLAZE_MAX_LEVEL + 1] = {
+    { 0, 0, false }, { 4, 16, false }, { 8, 32, false }, { 16, 64, false }, { 16, 64, true },
+    { 32, 128, true }, { 64, GLAZE_MAX_MATCH, true }, { 128, GLAZE_MAX_MATCH, true },
+    { 512, GLAZE_MAX_MATCH, true }, { 4096, GLAZE_MAX_MATCH, true },
+};
+
+typedef struct {
+    const uint8_t*  src;
+    uint32_t        src_size;
+    uint32_t        max_chain;
+    uint32_t        nice_length;
+    uint32_t*       head;       // Most recent position for each 3-byte hash
+    uint32_t*       prev;       // Previous position with the same hash, for each window position
+    uint32_t*       last2;      // Most recent position for each 2-byte sequence
+    uint8_t         bits[256];  // Number of bits used by each value in the bitstream
+    uint8_t*        codes;
+    uint32_t        nb_codes;
+    uint8_t*        dict;
+    uint32_t        dict_size;
+    uint8_t*        lengths;
+    uint32_t        nb_lengths;
+} glaze_ctx;
+
+typedef struct {
+    uint32_t        dist;
+    uint32_t        len;
+    int32_t         savings;    // Number of bits saved over emitting literals
+} glaze_match;
+
+// Number of bits used to encode v in the bitstream (see build_code_table())
+static uint8_t glaze_code_bits(uint32_t v)
+{
+    uint8_t l = 0;
+    if (v <= 1)
+        return (v == 1) ? 1 : 8;
+    while ((v >> (l + 1)) != 0)
+        l++;
+    return 2 * l + 1;
+}
+
+// Number of bits needed for a back-reference, or UINT32_MAX if it can't be encoded
+static uint32_t glaze_match_bits(const glaze_ctx* ctx, uint32_t dist, uint32_t len)
+{
+    if (len == 1)
+        return (dist <= 0xff) ? ctx->bits[0x02] + ctx->bits[dist] : UINT32_MAX;
+    // The distance that gets encoded is offset by the length
+    uint32_t l = len - 1;
+    if (dist < l)
+        return UINT32_MAX;
+    uint32_t d = dist - l;
+    if (d <= 0xff)
+        return min(ctx->bits[0x03] + ctx->bits[d], ctx->bits[0x04] + 8u) + ctx->bits[l];
+    if (d <= 0xffff)
+        return ctx->bits[0x05] + ctx->bits[d >> 8] + 8 + ctx->bits[l];
+    return UINT32_MAX;
+}
+
+static inline uint32_t glaze_hash(const uint8_t* p)
+{
+    return (((uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2]) * 0x9e3779b1) >> (32 - GLAZE_HASH_BITS);
+}
+
+static void glaze_insert(glaze_ctx* ctx, uint32_t pos)
+{
+    if (pos + 3 <= ctx->src_size) {
+        uint32_t h = glaze_hash(&ctx->src[pos]);
+        ctx->prev[pos & (GLAZE_WINDOW_SIZE - 1)] = ctx->head[h];
+        ctx->head[h] = pos;
+    }
+    if (pos + 2 <= ctx->src_size)
+        ctx->last2[getle16(&ctx->src[pos])] = pos;
+}
+
+static inline uint32_t glaze_match_length(const uint8_t* a, const uint8_t* b, uint32_t max_len)
+{
+    uint32_t len = 0;
+    while (len < max_len && a[len] == b[len])
+        len++;
+    return len;
+}
+
+static void glaze_consider(const glaze_ctx* ctx, glaze_match* best, uint32_t dist, uint32_t len)
+{
+    // Because of the way distances are encoded, a match can't overlap by more than one byte
+    len = min(len, dist + 1);
+    uint32_t bits = glaze_match_bits(ctx, dist, len);
+    if (bits == UINT32_MAX)
+        return;
+    int32_t savings = (int32_t)(len * GLAZE_LITERAL_BITS) - (int32_t)bits;
+    if (savings > best->savings) {
+        best->dist = dist;
+        best->len = len;
+        best->savings = savings;
+    }
+}
+
+// Find the back-reference that saves the most bits at pos
+static glaze_match glaze_find_match(const glaze_ctx* ctx, uint32_t pos)
+{
+    const uint8_t* src = ctx->src;
+    const uint32_t max_len = min(GLAZE_MAX_MATCH, ctx->src_size - pos);
+    glaze_match best = { 0, 0, 0 };
+    if (max_len >= 3) {
+        uint32_t q = ctx->head[glaze_hash(&src[pos])];
+        for (uint32_t chain = ctx->max_chain; chain > 0 && q != GLAZE_NO_POS && q < pos; chain--) {
+            uint32_t dist = pos - q;
+            if (dist > GLAZE_MAX_DISTANCE)
+                break;
+            // Only compare the candidates that can improve on our current best length
+            if (best.len < max_len && src[q + best.len] == src[pos + best.len]) {
+                uint32_t len = glaze_match_length(&src[q], &src[pos], max_len);
+                glaze_consider(ctx, &best, dist, len);
+                // A match that overlaps by more than a byte means that the data repeats with a
+                // period of dist, so try the multiple of dist that allows the whole length.
+                if (len > dist + 1) {
+                    uint32_t alt_dist = dist * ((len - 1 + dist - 1) / dist);
+                    if (alt_dist <= pos && alt_dist <= GLAZE_MAX_DISTANCE)
+                        glaze_consider(ctx, &best, alt_dist,
+                            glaze_match_length(&src[pos - alt_dist], &src[pos], max_len));
+                }
+                if (best.len >= ctx->nice_length || best.len >= max_len)
+                    break;
+            }
+            uint32_t next = ctx->prev[q & (GLAZE_WINDOW_SIZE - 1)];
+            // Entries may have been overwritten by more recent positions
+            if (next >= q)
+                break;
+            q = next;
+        }
+    }
+    if (best.len < 3) {
+        // Short matches are only worth it at short distances
+        if (max_len >= 2) {
+            uint32_t q = ctx->last2[getle16(&src[pos])];
+            if (q != GLAZE_NO_POS && q < pos)
+                glaze_consider(ctx, &best, pos - q, 2);
+        }
+        for (uint32_t dist = 1; dist <= min(pos, 7); dist++) {
+            if (src[pos - dist] == src[pos]) {
+                glaze_consider(ctx, &best, dist, 1);
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+static inline void glaze_code(glaze_ctx* ctx, uint8_t code)
+{
+    ctx->codes[ctx->nb_codes++] = code;
+}
+
+static void glaze_literals(glaze_ctx* ctx, uint32_t start, uint32_t count)
+{
+    memcpy(&ctx->dict[ctx->dict_size], &ctx->src[start], count);
+    ctx->dict_size += count;
+    while (count > 0) {
+        uint32_t n = min(count, 14 + 0xff);
+        if (n >= 14 && (n - 8 > 0xff || ctx->bits[0x07] + 8 < ctx->bits[0x06] + ctx->bits[n - 8])) {
+            glaze_code(ctx, 0x07);
+            ctx->lengths[ctx->nb_lengths++] = (uint8_t)(n - 14);
+        } else if (n >= 8 && ctx->bits[0x06] + ctx->bits[n - 8] < n * ctx->bits[0x01]) {
+            glaze_code(ctx, 0x06);
+            glaze_code(ctx, (uint8_t)(n - 8));
+        } else {
+            n = 1;
+            glaze_code(ctx, 0x01);
+        }
+        count -= n;
+    }
+}
+
+static void glaze_reference(glaze_ctx* ctx, uint32_t dist, uint32_t len)
+{
+    if (len == 1) {
+        glaze_code(ctx, 0x02);
+        glaze_code(ctx, (uint8_t)dist);
+        return;
+    }
+    uint32_t l = len - 1, d = dist - l;
+    if (d > 0xff) {
+        glaze_code(ctx, 0x05);
+        glaze_code(ctx, (uint8_t)(d >> 8));
+        glaze_code(ctx, (uint8_t)l);
+        ctx->dict[ctx->dict_size++] = (uint8_t)d;
+    } else if (ctx->bits[0x03] + ctx->bits[d] <= ctx->bits[0x04] + 8) {
+        glaze_code(ctx, 0x03);
+        glaze_code(ctx, (uint8_t)d);
+        glaze_code(ctx, (uint8_t)l);
+    } else {
+        glaze_code(ctx, 0x04);
+        glaze_code(ctx, (uint8_t)l);
+        ctx->dict[ctx->dict_size++] = (uint8_t)d;
+    }
+}
+
+// Compress a payload, using the compression level (0-9) to trade speed for size
+static uint32_t glaze(uint8_t* src, uint32_t src_size, uint32_t level, uint8_t** dst)
+{
+    uint32_t compressed_size = 0;
+    if (level == 0)
+        return glaze_store(src, src_size, dst);
+    level = min(level, GLAZE_MAX_LEVEL);
+
+    glaze_ctx ctx = { 0 };
+    ctx.src = src;
+    ctx.src_size = src_size;
+    ctx.max_chain = glaze_levels[level].max_chain;
+    ctx.nice_length = glaze_levels[level].nice_length;
+    ctx.head = malloc((1 << GLAZE_HASH_BITS) * sizeof(uint32_t));
+    ctx.prev = malloc(GLAZE_WINDOW_SIZE * sizeof(uint32_t));
+    ctx.last2 = malloc(0x10000 * sizeof(uint32_t));
+    // Each byte produces at most 2 codes (0x02 d), and all the literals go to the dictionary
+    ctx.codes = malloc(2 * (size_t)src_size + 1);
+    ctx.dict = malloc((size_t)src_size + 1);
+    ctx.lengths = malloc(src_size / 14 + 1);
+    *dst = NULL;
+    if (ctx.head == NULL || ctx.prev == NULL || ctx.last2 == NULL || ctx.codes == NULL ||
+        ctx.dict == NULL || ctx.lengths == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate Glaze compression buffers\n");
+        goto out;
+    }
+    memset(ctx.head, 0xff, (1 << GLAZE_HASH_BITS) * sizeof(uint32_t));
+    memset(ctx.last2, 0xff, 0x10000 * sizeof(uint32_t));
+    for (uint32_t i = 0; i < array_size(ctx.bits); i++)
+        ctx.bits[i] = glaze_code_bits(i);
+
+    uint32_t pos = 0, literal_start = 0;
+    glaze_match match = { 0, 0, 0 };
+    bool have_match = false;
+    while (pos < src_size) {
+        if (!have_match)
+            match = glaze_find_match(&ctx, pos);
+        have_match = false;
+        glaze_insert(&ctx, pos);
+        if (match.savings <= 0) {
+            pos++;
+            continue;
+        }
+        // With lazy matching, we emit a literal if the next position has a better match
+        if (glaze_levels[level].lazy && pos + 1 < src_size) {
+            glaze_match next = glaze_find_match(&ctx, pos + 1);
+            if (next.savings > match.savings + (int32_t)GLAZE_LITERAL_BITS) {
+                match = next;
+                have_match = true;
+                pos++;
+                continue;
+            }
+        }
+        glaze_literals(&ctx, literal_start, pos - literal_start);
+        glaze_reference(&ctx, match.dist, match.len);
+        for (uint32_t i = 1; i < match.len; i++)
+            glaze_insert(&ctx, pos + i);
+        pos += match.len;
+        literal_start = pos;
+    }
+    glaze_literals(&ctx, literal_start, pos - literal_start);
+
+    // A Glaze compressed file is structured as follows:
+    // [decompressed_size] [bistream_size] [bytecode_size] <...bitstream...>
+    // [dictionary_size] <...dictionary...> [length_table_size] <...length_table...>
+    uint64_t nb_bits = 0;
+    for (uint32_t i = 0; i < ctx.nb_codes; i++)
+        nb_bits += ctx.bits[ctx.codes[i]];
+    // unglaze() requires a bitstream that isn't empty
+    uint32_t bitstream_size = max((uint32_t)((nb_bits + 7) / 8), 1);
+    compressed_size = 3 * sizeof(uint32_t) + bitstream_size + sizeof(uint32_t) + ctx.dict_size +
+                      sizeof(uint32_t) + ctx.nb_lengths;
+    *dst = calloc(compressed_size, 1);
+    if (*dst == NULL) {
+        compressed_size = 0;
+        goto out;
+    }
+    uint8_t* p = *dst;
+    setdata32(p, src_size);
+    p = &p[sizeof(uint32_t)];
+    // The bitstream size includes the bytecode size field
+    setdata32(p, bitstream_size + sizeof(uint32_t));
+    p = &p[sizeof(uint32_t)];
+    setdata32(p, ctx.nb_codes);
+    p = &p[sizeof(uint32_t)];
+
+    // Codes are written MSB first as: 1 for 0x01, 8 zeros for 0x00 and, for other values
+    // with their most significant bit at position l, l zeros, 1 and then the low l bits.
+    uint64_t acc = 0;
+    uint32_t acc_bits = 0, out_pos = 0;
+    for (uint32_t i = 0; i < ctx.nb_codes; i++) {
+        uint32_t v = ctx.codes[i], n = ctx.bits[v], l = n / 2;
+        uint32_t bits = (v <= 1) ? v : ((1 << l) | (v & ((1 << l) - 1)));
+        acc = (acc << n) | bits;
+        acc_bits += n;
+        while (acc_bits >= 8) {
+            acc_bits -= 8;
+            p[out_pos++] = (uint8_t)(acc >> acc_bits);
+        }
+    }
+    if (acc_bits != 0)
+        p[out_pos] = (uint8_t)(acc << (8 - acc_bits));
+    p = &p[bitstream_size];
+
+    setdata32(p, ctx.dict_size);
+    p = &p[sizeof(uint32_t)];
+    memcpy(p, ctx.dict, ctx.dict_size);
+    p = &p[ctx.dict_size];
+    setdata32(p, ctx.nb_lengths);
+    p = &p[sizeof(uint32_t)];
+    memcpy(p, ctx.lengths, ctx.nb_lengths);
+
+    // Incompressible data may be better off stored
+    if (compressed_size > src_size && src_size >= 14) {
+        uint8_t* stored = NULL;
+        uint32_t stored_size = glaze_store(src, src_size, &stored);
+        if (stored_size != 0 && stored_size < compressed_size) {
+            free(*dst);
+            *dst = stored;
+            compressed_size = stored_size;
+        } else {
+            free(stored);
+        }
+    }
 
+out:
+    free(ctx.head);
+    free(ctx.prev);
+    free(ctx.last2);
+    free(ctx.codes);
+    free(ctx.dict);
+    free(ctx.lengths);
     return compressed_size;
 }
 
@@ -501,7 +1098,12 @@ static uint32_t glaze(uint8_t* src, uint32_t src_size, uint8_t** dst)
  * Checksum algorithms
  */
 #define ADLER32_MOD 65521
-static uint32_t adler32(const uint8_t* data, size_t size)
+// Largest n such that 255n(n+1)/2 + (n+1)(ADLER32_MOD-1) < 2^32, i.e. the number of
+// bytes we can process before the sums need to be reduced modulo ADLER32_MOD.
+#define ADLER32_NMAX 5552
+
+// Reference implementations, that the optimized kernels are validated against
+static uint32_t adler32_scalar(const uint8_t* data, size_t size)
 {
     uint32_t a = 1;
     uint32_t b = 0;
@@ -514,7 +1116,7 @@ static uint32_t adler32(const uint8_t* data, size_t size)
     return (b << 16) | a;
 }
 
-static uint32_t checksum_sub(uint8_t* buf, uint32_t buf_size)
+static uint32_t checksum_sub_scalar(const uint8_t* buf, uint32_t buf_size)
 {
     uint32_t checksum = 0;
     for (uint32_t i = 0; i < (buf_size & ~3); i += sizeof(uint32_t))
@@ -522,7 +1124,7 @@ static uint32_t checksum_sub(uint8_t* buf, uint32_t buf_size)
     return checksum;
 }
 
-static uint32_t checksum_xor(uint8_t* buf, uint32_t buf_size)
+static uint32_t checksum_xor_scalar(const uint8_t* buf, uint32_t buf_size)
 {
     uint32_t checksum = 0;
     for (uint32_t i = 0; i < (buf_size & ~3); i += sizeof(uint32_t))
@@ -530,6 +1132,324 @@ static uint32_t checksum_xor(uint8_t* buf, uint32_t buf_size)
     return checksum;
 }
 
+// Update the unreduced adler32 sums with up to ADLER32_NMAX bytes
+typedef void (*adler32_fn)(const uint8_t* data, size_t size, uint32_t* a, uint32_t* b);
+// Add or XOR the 32-bit words from buf, read with the endianness of the current game
+typedef uint32_t (*reduce_fn)(const uint8_t* buf, size_t nb_words);
+
+static void adler32_generic(const uint8_t* data, size_t size, uint32_t* a, uint32_t* b)
+{
+    uint32_t s1 = *a, s2 = *b;
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        s1 += data[i]; s2 += s1;
+        s1 += data[i + 1]; s2 += s1;
+        s1 += data[i + 2]; s2 += s1;
+        s1 += data[i + 3]; s2 += s1;
+    }
+    for (; i < size; i++) {
+        s1 += data[i];
+        s2 += s1;
+    }
+    *a = s1;
+    *b = s2;
+}
+
+static uint32_t sum_words_generic(const uint8_t* buf, size_t nb_words)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i < nb_words; i++)
+        sum += getdata32(&buf[i * sizeof(uint32_t)]);
+    return sum;
+}
+
+static uint32_t xor_words_generic(const uint8_t* buf, size_t nb_words)
+{
+    uint32_t x = 0;
+    for (size_t i = 0; i < nb_words; i++)
+        x ^= getdata32(&buf[i * sizeof(uint32_t)]);
+    return x;
+}
+
+/*
+  The vector kernels process blocks of 16 or 32 bytes. For a block of N bytes, the
+  second adler32 sum grows by N * a (with a the value of the first sum before the
+  block) plus the sum of the bytes weighted by N, N - 1, ... 1. We accumulate the
+  byte sums of the blocks, their running total and their weighted sums in separate
+  lanes, and only combine them at the end.
+  Since XOR is not affected by the order of the bytes, we can XOR the raw words and
+  swap the result, whereas sums need to have their words swapped for big endian.
+ */
+#if defined(USE_SSE2)
+#include <immintrin.h>
+
+static __inline uint32_t hsum_sse2(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0x4e));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, 0xb1));
+    return (uint32_t)_mm_cvtsi128_si32(v);
+}
+
+static __inline uint32_t hxor_sse2(__m128i v)
+{
+    v = _mm_xor_si128(v, _mm_shuffle_epi32(v, 0x4e));
+    v = _mm_xor_si128(v, _mm_shuffle_epi32(v, 0xb1));
+    return (uint32_t)_mm_cvtsi128_si32(v);
+}
+
+static void adler32_sse2(const uint8_t* data, size_t size, uint32_t* a, uint32_t* b)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+    const __m128i w_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+    __m128i v_s1 = zero, v_prev = zero, v_s2 = zero;
+    size_t nb_blocks = size / 16;
+    for (size_t i = 0; i < nb_blocks; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&data[16 * i]);
+        v_prev = _mm_add_epi32(v_prev, v_s1);
+        v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(v, zero));
+        v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), w_lo));
+        v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), w_hi));
+    }
+    *b += (uint32_t)(16 * nb_blocks) * *a + 16 * hsum_sse2(v_prev) + hsum_sse2(v_s2);
+    *a += hsum_sse2(v_s1);
+    adler32_generic(&data[16 * nb_blocks], size % 16, a, b);
+}
+
+static __inline __m128i bswap32_sse2(__m128i v)
+{
+    // Swap the bytes of each 16-bit word, then the words of each 32-bit one
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1);
+}
+
+static uint32_t sum_words_sse2(const uint8_t* buf, size_t nb_words)
+{
+    __m128i v_sum = _mm_setzero_si128();
+    size_t i = 0;
+    if (is_big_endian) {
+        for (; i + 4 <= nb_words; i += 4)
+            v_sum = _mm_add_epi32(v_sum, bswap32_sse2(_mm_loadu_si128((const __m128i*)&buf[4 * i])));
+    } else {
+        for (; i + 4 <= nb_words; i += 4)
+            v_sum = _mm_add_epi32(v_sum, _mm_loadu_si128((const __m128i*)&buf[4 * i]));
+    }
+    return hsum_sse2(v_sum) + sum_words_generic(&buf[4 * i], nb_words - i);
+}
+
+static uint32_t xor_words_sse2(const uint8_t* buf, size_t nb_words)
+{
+    __m128i v_xor = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 4 <= nb_words; i += 4)
+        v_xor = _mm_xor_si128(v_xor, _mm_loadu_si128((const __m128i*)&buf[4 * i]));
+    uint8_t x[sizeof(uint32_t)];
+    setle32(x, hxor_sse2(v_xor));
+    return getdata32(x) ^ xor_words_generic(&buf[4 * i], nb_words - i);
+}
+
+TARGET_AVX2 static __inline uint32_t hsum_avx2(__m256i v)
+{
+    return hsum_sse2(_mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+}
+
+TARGET_AVX2 static void adler32_avx2(const uint8_t* data, size_t size, uint32_t* a, uint32_t* b)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    const __m256i w = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+                                       16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    __m256i v_s1 = zero, v_prev = zero, v_s2 = zero;
+    size_t nb_blocks = size / 32;
+    for (size_t i = 0; i < nb_blocks; i++) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)&data[32 * i]);
+        v_prev = _mm256_add_epi32(v_prev, v_s1);
+        v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(v, zero));
+        v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(v, w), ones));
+    }
+    *b += (uint32_t)(32 * nb_blocks) * *a + 32 * hsum_avx2(v_prev) + hsum_avx2(v_s2);
+    *a += hsum_avx2(v_s1);
+    adler32_generic(&data[32 * nb_blocks], size % 32, a, b);
+}
+
+TARGET_AVX2 static uint32_t sum_words_avx2(const uint8_t* buf, size_t nb_words)
+{
+    const __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i v_sum = _mm256_setzero_si256();
+    size_t i = 0;
+    if (is_big_endian) {
+        for (; i + 8 <= nb_words; i += 8)
+            v_sum = _mm256_add_epi32(v_sum,
+                _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)&buf[4 * i]), swap));
+    } else {
+        for (; i + 8 <= nb_words; i += 8)
+            v_sum = _mm256_add_epi32(v_sum, _mm256_loadu_si256((const __m256i*)&buf[4 * i]));
+    }
+    return hsum_avx2(v_sum) + sum_words_generic(&buf[4 * i], nb_words - i);
+}
+
+TARGET_AVX2 static uint32_t xor_words_avx2(const uint8_t* buf, size_t nb_words)
+{
+    __m256i v_xor = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= nb_words; i += 8)
+        v_xor = _mm256_xor_si256(v_xor, _mm256_loadu_si256((const __m256i*)&buf[4 * i]));
+    uint8_t x[sizeof(uint32_t)];
+    setle32(x, hxor_sse2(_mm_xor_si128(_mm256_castsi256_si128(v_xor), _mm256_extracti128_si256(v_xor, 1))));
+    return getdata32(x) ^ xor_words_generic(&buf[4 * i], nb_words - i);
+}
+#elif defined(USE_NEON)
+#include <arm_neon.h>
+
+static void adler32_neon(const uint8_t* data, size_t size, uint32_t* a, uint32_t* b)
+{
+    static const uint8_t weights[16] = { 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1 };
+    const uint8x16_t w = vld1q_u8(weights);
+    uint32x4_t v_s1 = vdupq_n_u32(0), v_prev = vdupq_n_u32(0), v_s2 = vdupq_n_u32(0);
+    size_t nb_blocks = size / 16;
+    for (size_t i = 0; i < nb_blocks; i++) {
+        uint8x16_t v = vld1q_u8(&data[16 * i]);
+        v_prev = vaddq_u32(v_prev, v_s1);
+        v_s1 = vpadalq_u16(v_s1, vpaddlq_u8(v));
+        uint16x8_t m = vmull_u8(vget_low_u8(v), vget_low_u8(w));
+        m = vmlal_u8(m, vget_high_u8(v), vget_high_u8(w));
+        v_s2 = vpadalq_u16(v_s2, m);
+    }
+    *b += (uint32_t)(16 * nb_blocks) * *a + 16 * vaddvq_u32(v_prev) + vaddvq_u32(v_s2);
+    *a += vaddvq_u32(v_s1);
+    adler32_generic(&data[16 * nb_blocks], size % 16, a, b);
+}
+
+static uint32_t sum_words_neon(const uint8_t* buf, size_t nb_words)
+{
+    uint32x4_t v_sum = vdupq_n_u32(0);
+    size_t i = 0;
+    if (is_big_endian) {
+        for (; i + 4 <= nb_words; i += 4)
+            v_sum = vaddq_u32(v_sum, vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(&buf[4 * i]))));
+    } else {
+        for (; i + 4 <= nb_words; i += 4)
+            v_sum = vaddq_u32(v_sum, vreinterpretq_u32_u8(vld1q_u8(&buf[4 * i])));
+    }
+    return vaddvq_u32(v_sum) + sum_words_generic(&buf[4 * i], nb_words - i);
+}
+
+static uint32_t xor_words_neon(const uint8_t* buf, size_t nb_words)
+{
+    uint32x4_t v_xor = vdupq_n_u32(0);
+    size_t i = 0;
+    for (; i + 4 <= nb_words; i += 4)
+        v_xor = veorq_u32(v_xor, vreinterpretq_u32_u8(vld1q_u8(&buf[4 * i])));
+    uint8_t x[sizeof(uint32_t)];
+    setle32(x, vgetq_lane_u32(v_xor, 0) ^ vgetq_lane_u32(v_xor, 1) ^
+               vgetq_lane_u32(v_xor, 2) ^ vgetq_lane_u32(v_xor, 3));
+    return getdata32(x) ^ xor_words_generic(&buf[4 * i], nb_words - i);
+}
+#endif
+
+static adler32_fn adler32_kernel = adler32_generic;
+static reduce_fn sum_words = sum_words_generic;
+static reduce_fn xor_words = xor_words_generic;
+
+static uint32_t adler32_with(adler32_fn kernel, const uint8_t* data, size_t size)
+{
+    uint32_t a = 1, b = 0;
+    while (size > 0) {
+        size_t n = min(size, ADLER32_NMAX);
+        kernel(data, n, &a, &b);
+        a %= ADLER32_MOD;
+        b %= ADLER32_MOD;
+        data += n;
+        size -= n;
+    }
+    return (b << 16) | a;
+}
+
+static uint32_t checksum_sub_with(reduce_fn kernel, const uint8_t* buf, uint32_t buf_size)
+{
+    return 0 - kernel(buf, buf_size / sizeof(uint32_t));
+}
+
+static uint32_t checksum_xor_with(reduce_fn kernel, const uint8_t* buf, uint32_t buf_size)
+{
+    // XORing an even number of inverted words is the same as XORing the words
+    uint32_t nb_words = buf_size / sizeof(uint32_t);
+    return kernel(buf, nb_words) ^ ((nb_words & 1) ? 0xffffffff : 0);
+}
+
+#define adler32(data, size) adler32_with(adler32_kernel, data, size)
+#define checksum_sub(buf, buf_size) checksum_sub_with(sum_words, buf, buf_size)
+#define checksum_xor(buf, buf_size) checksum_xor_with(xor_words, buf, buf_size)
+
+// Select the fastest checksum kernels for this platform, after validating them against
+// the scalar versions. This is only done once per process.
+static mutex_t checksum_lock = MUTEX_INITIALIZER;
+static bool checksum_initialized = false;
+static void init_checksums(void)
+{
+    lock_mutex(&checksum_lock);
+    if (checksum_initialized) {
+        unlock_mutex(&checksum_lock);
+        return;
+    }
+    adler32_fn adler32_candidates[3] = { NULL, NULL, adler32_generic };
+    reduce_fn sum_candidates[3] = { NULL, NULL, sum_words_generic };
+    reduce_fn xor_candidates[3] = { NULL, NULL, xor_words_generic };
+#if defined(USE_SSE2)
+    if (cpu_has_avx2()) {
+        adler32_candidates[0] = adler32_avx2;
+        sum_candidates[0] = sum_words_avx2;
+        xor_candidates[0] = xor_words_avx2;
+    }
+    adler32_candidates[1] = adler32_sse2;
+    sum_candidates[1] = sum_words_sse2;
+    xor_candidates[1] = xor_words_sse2;
+#elif defined(USE_NEON)
+    adler32_candidates[1] = adler32_neon;
+    sum_candidates[1] = sum_words_neon;
+    xor_candidates[1] = xor_words_neon;
+#endif
+    // Use all 0xff bytes then pseudorandom ones, with sizes that cross the ADLER32_NMAX boundary
+    static uint8_t data[3 * ADLER32_NMAX + 37];
+    const uint32_t sizes[] = { 0, 1, 4, 15, 16, 31, 33, 100, 255, ADLER32_NMAX, ADLER32_NMAX + 1,
+                               2 * ADLER32_NMAX + 7, sizeof(data) - 3 };
+    bool saved_is_big_endian = is_big_endian;
+    for (uint32_t c = 0; c < array_size(adler32_candidates); c++) {
+        bool adler32_valid = (adler32_candidates[c] != NULL);
+        bool sum_valid = (sum_candidates[c] != NULL), xor_valid = (xor_candidates[c] != NULL);
+        for (uint32_t pass = 0; pass < 2; pass++) {
+            for (uint32_t i = 0; i < sizeof(data); i++)
+                data[i] = (pass == 0) ? 0xff : (uint8_t)((i * 0x9d + 0x3b) ^ (i >> 7));
+            for (uint32_t s = 0; s < array_size(sizes); s++) {
+                // Use an odd offset, to check that unaligned data is processed properly
+                const uint8_t* buf = &data[s & 3];
+                if (adler32_valid)
+                    adler32_valid = (adler32_with(adler32_candidates[c], buf, sizes[s]) == adler32_scalar(buf, sizes[s]));
+                for (uint32_t e = 0; e < 2; e++) {
+                    is_big_endian = (e != 0);
+                    if (sum_valid)
+                        sum_valid = (checksum_sub_with(sum_candidates[c], buf, sizes[s]) ==
+                                     checksum_sub_scalar(buf, sizes[s]));
+                    if (xor_valid)
+                        xor_valid = (checksum_xor_with(xor_candidates[c], buf, sizes[s]) ==
+                                     checksum_xor_scalar(buf, sizes[s]));
+                }
+            }
+        }
+        // Candidates are in order of preference, so only keep the first valid one
+        if (adler32_valid && adler32_kernel == adler32_generic)
+            adler32_kernel = adler32_candidates[c];
+        if (sum_valid && sum_words == sum_words_generic)
+            sum_words = sum_candidates[c];
+        if (xor_valid && xor_words == xor_words_generic)
+            xor_words = xor_candidates[c];
+    }
+    is_big_endian = saved_is_big_endian;
+    checksum_initialized = true;
+    unlock_mutex(&checksum_lock);
+}
+
 static bool scramble(uint8_t* payload, uint32_t payload_size, char* path, seed_data* seeds,
                      uint32_t working_size, uint32_t version)
 {
@@ -543,18 +1463,24 @@ static bool scramble(uint8_t* payload, uint32_t payload_size, char* path, seed_d
         return false;
     uint8_t* main_payload = &buf[E_HEADER_SIZE];
     memcpy(main_payload, payload, payload_size);
+    uint64_t start = stats_start();
     adler_sum = adler32(payload, payload_size);
+    stats_stop("adler32", start, payload_size);
 
     // Optionally scramble the beginning of the file
     if (version == 2) {
         init_random(adler_sum, seeds->main[2]);
+        start = stats_start();
         if (!bit_scrambler(main_payload, min(payload_size, 0x800), 0x80, false))
             goto out;
+        stats_stop("bit_scrambler", start, min(payload_size, 0x800));
     }
 
     // Compute the checksums
+    start = stats_start();
     checksum[0] = checksum_sub(main_payload, payload_size);
     checksum[1] = checksum_xor(main_payload, payload_size);
+    stats_stop("checksums", start, payload_size);
     switch (version) {
     case 2:
 #if !defined(VALIDATE_CHECKSUM)
@@ -577,8 +1503,10 @@ static bool scramble(uint8_t* payload, uint32_t payload_size, char* path, seed_d
 
     // Call the main scrambler
     init_random(checksum[2], seeds->table[0]);
+    start = stats_start();
     if (!rotating_scrambler(main_payload, payload_size, seeds))
         goto out;
+    stats_stop("rotating_scrambler", start, payload_size);
 
     // Add the end of payload marker
     main_payload[payload_size] = 0xff;
@@ -588,23 +1516,29 @@ static bool scramble(uint8_t* payload, uint32_t payload_size, char* path, seed_d
 
     // Call first scrambler
     init_random(0, seeds->main[1]);
+    start = stats_start();
     if (!fenced_scrambler(main_payload, main_payload_size, seeds->fence, false, (version == 3)))
         goto out;
+    stats_stop("fenced_scrambler", start, main_payload_size);
 
     // Apply optional extra scrambling to the end of the file
     if (version == 2) {
         init_random(0, seeds->main[0]);
         uint8_t* chunk = &main_payload[main_payload_size - min(main_payload_size, 0x800)];
+        start = stats_start();
         if (!bit_scrambler(chunk, min(main_payload_size, 0x800), 0x100, false))
             goto out;
+        stats_stop("bit_scrambler", start, min(main_payload_size, 0x800));
     }
 
     // Populate the header data
     setdata32(buf, version);
     setdata32(&buf[4], working_size);
 
+    start = stats_start();
     if (!write_file(buf, main_payload_size + E_HEADER_SIZE, path, true))
         goto out;
+    stats_stop("write", start, main_payload_size + E_HEADER_SIZE);
 
     r = true;
 
@@ -613,14 +1547,22 @@ out:
     return r;
 }
 
-static uint32_t unscramble(uint8_t* payload, uint32_t payload_size, seed_data* seeds,
-                           uint32_t* working_size, uint32_t expected_version)
+// Read the version of an .e file, along with its endianness
+static uint32_t get_e_version(const uint8_t* buf, bool* big_endian)
 {
-    uint32_t version = getbe32(payload);
+    uint32_t version = getbe32(buf);
+    *big_endian = true;
     if ((version & 0x00ffffff) == 0) {
         version >>= 24;
-        is_big_endian = false;
+        *big_endian = false;
     }
+    return version;
+}
+
+static uint32_t unscramble(uint8_t* payload, uint32_t payload_size, seed_data* seeds,
+                           uint32_t* working_size, uint32_t expected_version)
+{
+    uint32_t version = get_e_version(payload, &is_big_endian);
     if ((version != 2) && (version != 3)) {
         fprintf(stderr, "ERROR: Unsupported encoding version: 0x%08x\n", version);
         return 0;
@@ -641,14 +1583,18 @@ static uint32_t unscramble(uint8_t* payload, uint32_t payload_size, seed_data* s
     if (version == 2) {
         uint8_t* chunk = &payload[payload_size - min(payload_size, 0x800)];
         init_random(0, seeds->main[0]);
+        uint64_t start = stats_start();
         if (!bit_scrambler(chunk, min(payload_size, 0x800), 0x100, true))
             return 0;
+        stats_stop("bit_scrambler", start, min(payload_size, 0x800));
     }
 
     // Now call the fenced scrambler on the whole payload
     init_random(0, seeds->main[1]);
+    uint64_t start = stats_start();
     if (!fenced_scrambler(payload, payload_size, seeds->fence, true, (version == 3)))
         return 0;
+    stats_stop("fenced_scrambler", start, payload_size);
 
     // Read the descrambled checksums footer (16 bytes)
     uint32_t* footer = (uint32_t*)&payload[payload_size - E_FOOTER_SIZE];
@@ -679,12 +1625,16 @@ static uint32_t unscramble(uint8_t* payload, uint32_t payload_size, seed_data* s
 
     // Now call the rotating scrambler on the actual payload
     init_random(checksum[2], seeds->table[0]);
+    start = stats_start();
     if (!rotating_scrambler(payload, payload_size, seeds))
         return 0;
+    stats_stop("rotating_scrambler", start, payload_size);
 
     // Validate the checksums
+    start = stats_start();
     checksum[0] -= checksum_sub(payload, payload_size);
     checksum[1] ^= checksum_xor(payload, payload_size);
+    stats_stop("checksums", start, payload_size);
     if ((checksum[0] != 0) || (checksum[1] != 0)) {
         fprintf(stderr, "ERROR: Descrambler checksum mismatch\n");
         return 0;
@@ -697,8 +1647,10 @@ static uint32_t unscramble(uint8_t* payload, uint32_t payload_size, seed_data* s
     // Revert the optional bit scrambling applied to the start of the file
     if (version == 2) {
         init_random(checksum[2], seeds->main[2]);
+        start = stats_start();
         if (!bit_scrambler(payload, min(payload_size, 0x800), 0x80, true))
             return 0;
+        stats_stop("bit_scrambler", start, min(payload_size, 0x800));
     }
 
     return payload_size;
@@ -734,106 +1686,159 @@ static inline uint32_t lsqrt(uint32_t y)
     return x_old;
 }
 
-// Returns true if 'n' is a prime number recorded in the table
-static inline int is_prime (uint32_t n)
-{
-    uint16_t bit = (uint16_t)n & 0x07;
-    return prime_list[n >> 3] & (1 << bit);
-}
-
 // Record 'n' as a prime number in the table
-static inline void set_prime (uint32_t n)
+static inline void set_prime(uint32_t n)
 {
     uint16_t bit = (uint16_t)n & 0x07;
     prime_list[n >> 3] |= (1 << bit);
 }
 
-// Check whether 'n' is a prime number.
-static bool check_for_prime(uint32_t n)
-{
-    uint32_t i = 0;
-    uint8_t* p;
-    uint32_t last_value;
-    bool small_n = ((n & 0xffff0000) == 0);
-
-    // We can stop when we have checked all prime numbers below sqrt(n)
-    last_value = lsqrt(n);
-
-    // Scan the bitmap of prime numbers and divide 'n' by the corresponding
-    // prime to see if it's a multiple of it.
-    p = prime_list;
-    do {
-        uint8_t val = *p++;
-        if (val) {
-            uint16_t q = (uint16_t)i;
-            for (uint16_t j = 1; val && j <= 0x80; j <<= 1, q++) {
-                if (val & j) {
-                    val &= ~j;
-                    // Use 16-bit division if 'n' is small enough.
-                    if (small_n) {
-                        uint16_t r = (uint16_t)n % (uint16_t)q;
-                        if (r == 0)
-                            return false;
-                    } else {
-                        uint32_t r = n % q;
-                        if (r == 0)
-                            return false;
-                    }
-                }
-            }
+// Number of odd values processed at once by the sieve, so that a segment stays in L1
+#define SIEVE_SEGMENT_SIZE  (16 * 1024)
+
+// Segmented Sieve of Eratosthenes, that only considers odd numbers
+static void compute_prime_list(void)
+{
+    // sqrt(PRIME_LIST_MAX) is lower than 0x100
+    uint8_t base[0x100], segment[SIEVE_SEGMENT_SIZE];
+    const uint32_t root = lsqrt(PRIME_LIST_MAX);
+
+    // Start with the primes up to sqrt(PRIME_LIST_MAX), from a simple sieve
+    memset(base, 1, sizeof(base));
+    for (uint32_t p = 3; p * p <= root; p += 2) {
+        if (base[p]) {
+            for (uint32_t m = p * p; m <= root; m += 2 * p)
+                base[m] = 0;
         }
-        i += 8;
-    } while (i < last_value);
-    return true;
+    }
+
+    memset(prime_list, 0, sizeof(prime_list));
+    set_prime(0);
+    set_prime(1);
+    set_prime(2);
+    for (uint32_t low = 3; low <= PRIME_LIST_MAX; low += 2 * SIEVE_SEGMENT_SIZE) {
+        // segment[j] is for value low + 2 * j
+        uint32_t count = min(SIEVE_SEGMENT_SIZE, (PRIME_LIST_MAX - low) / 2 + 1);
+        uint32_t high = low + 2 * (count - 1);
+        memset(segment, 1, count);
+        for (uint32_t p = 3; p <= root && p * p <= high; p += 2) {
+            if (!base[p])
+                continue;
+            // First odd multiple of p in the segment, that isn't p itself
+            uint32_t m = max(p * p, ((low + p - 1) / p) * p);
+            if ((m & 1) == 0)
+                m += p;
+            for (; m <= high; m += 2 * p)
+                segment[(m - low) / 2] = 0;
+        }
+        for (uint32_t j = 0; j < count; j++) {
+            if (segment[j])
+                set_prime(low + 2 * j);
+        }
+    }
 }
 
-static void compute_prime_list(uint32_t max_value)
+static uint32_t pow_mod(uint32_t b, uint32_t e, uint32_t m)
 {
-    uint32_t i, cnt = 2;
+    uint64_t r = 1, x = b % m;
+    for (; e != 0; e >>= 1) {
+        if (e & 1)
+            r = (r * x) % m;
+        x = (x * x) % m;
+    }
+    return (uint32_t)r;
+}
 
-    prime_list = calloc((max_value + 7) / 8, 1);
-    for (i = 2; i <= max_value; i++) {
-        if (check_for_prime(i)) {
-            set_prime(i);
-            cnt++;
+// Deterministic Miller-Rabin test. Bases 2, 7 and 61 are enough for all 32-bit values.
+static bool miller_rabin(uint32_t n)
+{
+    static const uint32_t bases[] = { 2, 7, 61 };
+    if (n < 2)
+        return false;
+    for (size_t i = 0; i < array_size(bases); i++) {
+        if (n % bases[i] == 0)
+            return (n == bases[i]);
+    }
+    uint32_t d = n - 1, s = 0;
+    for (; (d & 1) == 0; d >>= 1, s++);
+    for (size_t i = 0; i < array_size(bases); i++) {
+        uint64_t x = pow_mod(bases[i], d, n);
+        if (x == 1 || x == n - 1)
+            continue;
+        uint32_t r;
+        for (r = 1; r < s; r++) {
+            x = (x * x) % n;
+            if (x == n - 1)
+                break;
         }
+        if (r == s)
+            return false;
     }
-    set_prime(0);
-    set_prime(1);
+    return true;
 }
 
-int main_utf8(int argc, char** argv)
+// Returns true if 'n' is a prime number, using the table for the values it covers
+static bool is_prime(uint32_t n)
 {
-    seed_data seeds;
-    char path[PATH_MAX];
-    uint32_t src_size, dst_size;
-    uint8_t *src = NULL, *dst = NULL;
-    int r = -1;
-    const char* app_name = _appname(argv[0]);
-    const char* dir_name = _dirname(argv[0]);
-    if ((argc < 2) || ((argc == 3) && (*argv[1] != '-'))) {
-        printf("%s %s (c) 2019-2021 VitaSmith\n\nUsage: %s [-GAME_ID] <file>\n\n"
-            "Encode or decode a Gust .e file.\n\n"
-            "If GAME_ID is not provided, then the default game ID from '%s.json' is used.\n"
-            "Note: A backup (.bak) of the original is automatically created, when the target\n"
-            "is being overwritten for the first time.\n",
-            app_name, GUST_TOOLS_VERSION_STR, app_name, app_name);
-        return 0;
+    if (n > PRIME_LIST_MAX)
+        return miller_rabin(n);
+    if (!prime_list_ready) {
+        compute_prime_list();
+        prime_list_ready = true;
     }
+    uint16_t bit = (uint16_t)n & 0x07;
+    return prime_list[n >> 3] & (1 << bit);
+}
 
-    // Populate the descrambling seeds from the JSON file
-    snprintf(path, sizeof(path), "%s%c%s.json", dir_name, PATH_SEP, app_name);
+// Seeds of the games being processed, which are only loaded and validated once,
+// so that they can be reused when processing multiple files
+#define MAX_SEEDS           32
+#define DETECT_CACHE_MAX_SIZE (64 * 1024)
+typedef struct {
+    char        id[64];         // Requested seeds id ("" for the JSON default)
+    char        name[128];
+    char        path[PATH_MAX]; // JSON file the seeds were read from
+    seed_data   seeds;
+    uint32_t    version;
+    uint32_t    glaze_level;    // Default compression level
+} seed_info;
+static seed_info cached_seeds[MAX_SEEDS];
+static uint32_t nb_cached_seeds = 0;
+static mutex_t seeds_lock = MUTEX_INITIALIZER;
+
+// The ids of all the games from our JSON data, along with the default one
+typedef struct {
+    char        default_id[64];
+    char        id[MAX_SEEDS][64];
+    uint32_t    nb_ids;
+} seed_list;
+static seed_list cached_list;
+static bool cached_list_valid = false;
+
+static JSON_Value* load_seeds_json(const char* app_name, const char* dir_name, char* path)
+{
+    snprintf(path, PATH_MAX, "%s%c%s.json", dir_name, PATH_SEP, app_name);
     JSON_Value* json = json_parse_file_with_comments(path);
     if (json == NULL) {
         // Fall back to default directory if dir_name didn't work
-        snprintf(path, sizeof(path), "%s.json", app_name);
+        snprintf(path, PATH_MAX, "%s.json", app_name);
         json = json_parse_file_with_comments(path);
-        if (json == NULL) {
+        if (json == NULL)
             fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", path);
-            goto out;
-        }
     }
-    const char* seeds_id = (argc == 3) ? &argv[1][1] : json_object_get_string(json_object(json), "seeds_id");
+    return json;
+}
+
+static bool parse_seeds(const char* app_name, const char* dir_name, const char* id, seed_info* info)
+{
+    bool r = false;
+    char* path = info->path;
+
+    // Populate the descrambling seeds from the JSON file
+    JSON_Value* json = load_seeds_json(app_name, dir_name, path);
+    if (json == NULL)
+        return false;
+    const char* seeds_id = (id[0] != 0) ? id : json_object_get_string(json_object(json), "seeds_id");
     JSON_Array* seeds_array = json_object_get_array(json_object(json), "seeds");
     JSON_Object* seeds_entry = NULL;
     for (size_t i = 0; i < json_array_get_count(seeds_array); i++) {
@@ -844,78 +1849,302 @@ int main_utf8(int argc, char** argv)
     }
     if (seeds_entry == NULL) {
         fprintf(stderr, "ERROR: Can't find the seeds for \"%s\" in '%s'\n", seeds_id, path);
-        json_value_free(json);
         goto out;
     }
-
-    printf("Using the scrambling seeds for %s", json_object_get_string(seeds_entry, "name"));
-    if (argc < 3)
-        printf(" (edit '%s' to change)\n", path);
-    else
-        printf("\n");
+    snprintf(info->name, sizeof(info->name), "%s", json_object_get_string(seeds_entry, "name"));
 
     // Get the scrambler version to use
-    uint32_t version = json_object_get_uint32(seeds_entry, "version");
-    if (version == 3)
-        is_big_endian = false;
-    uint32_t max_seed_value = 0;
-    for (size_t i = 0; i < array_size(seeds.main); i++) {
-        seeds.main[i] = (uint32_t)json_array_get_number(json_object_get_array(seeds_entry, "main"), i);
-        if (seeds.main[i] > max_seed_value)
-            max_seed_value = seeds.main[i];
-        seeds.table[i] = (uint32_t)json_array_get_number(json_object_get_array(seeds_entry, "table"), i);
-        if (seeds.table[i] > max_seed_value)
-            max_seed_value = seeds.table[i];
-        seeds.length[i] = (uint32_t)json_array_get_number(json_object_get_array(seeds_entry, "length"), i);
-    }
-    seeds.fence = (uint16_t)json_object_get_number(seeds_entry, "fence");
-    bool validate_primes = json_object_get_boolean(json_object(json), "validate_primes");
-    json_value_free(json);
+    seed_data* seeds = &info->seeds;
+    info->version = json_object_get_uint32(seeds_entry, "version");
+    for (size_t i = 0; i < array_size(seeds->main); i++) {
+        seeds->main[i] = (uint32_t)json_array_get_number(json_object_get_array(seeds_entry, "main"), i);
+        seeds->table[i] = (uint32_t)json_array_get_number(json_object_get_array(seeds_entry, "table"), i);
+        seeds->length[i] = (uint32_t)json_array_get_number(json_object_get_array(seeds_entry, "length"), i);
+    }
+    seeds->fence = (uint16_t)json_object_get_number(seeds_entry, "fence");
+    info->glaze_level = json_object_has_value(json_object(json), "compression_level") ?
+        min(json_object_get_uint32(json_object(json), "compression_level"), GLAZE_MAX_LEVEL) : GLAZE_DEFAULT_LEVEL;
 
     // Validate the primes. You can disable this check by setting validate_primes to false in JSON.
-    if (validate_primes) {
-        compute_prime_list(max_seed_value);
-        for (size_t i = 0; i < array_size(seeds.main); i++) {
-            if (!is_prime(seeds.main[i])) {
-                printf("ERROR: main[%d] (0x%04x) is not prime!\n", (uint32_t)i, seeds.main[i]);
+    // Note that this is called with seeds_lock held, which also protects the prime table.
+    if (json_object_get_boolean(json_object(json), "validate_primes")) {
+        for (size_t i = 0; i < array_size(seeds->main); i++) {
+            if (!is_prime(seeds->main[i])) {
+                printf("ERROR: main[%d] (0x%04x) is not prime!\n", (uint32_t)i, seeds->main[i]);
                 goto out;
             }
-            if (!is_prime(seeds.table[i])) {
-                printf("ERROR: table[%d] (0x%04x) is not prime!\n", (uint32_t)i, seeds.table[i]);
+            if (!is_prime(seeds->table[i])) {
+                printf("ERROR: table[%d] (0x%04x) is not prime!\n", (uint32_t)i, seeds->table[i]);
                 goto out;
             }
-            if (!is_prime(seeds.length[i])) {
-                printf("ERROR: length[%d] (0x%02x) is not prime!\n", (uint32_t)i, seeds.length[i]);
+            if (!is_prime(seeds->length[i])) {
+                printf("ERROR: length[%d] (0x%02x) is not prime!\n", (uint32_t)i, seeds->length[i]);
                 goto out;
             }
-            if (!is_prime(seeds.fence)) {
-                printf("ERROR: fence (0x%04x) is not prime!\n", seeds.fence);
+            if (!is_prime(seeds->fence)) {
+                printf("ERROR: fence (0x%04x) is not prime!\n", seeds->fence);
                 goto out;
             }
         }
     }
+    r = true;
+
+out:
+    json_value_free(json);
+    return r;
+}
+
+// Get the seeds for id, or for the default game if id is empty
+static bool get_seeds(const char* app_name, const char* dir_name, const char* id, seed_info* info)
+{
+    bool r = true;
+    lock_mutex(&seeds_lock);
+    uint32_t i;
+    for (i = 0; (i < nb_cached_seeds) && (strcmp(cached_seeds[i].id, id) != 0); i++);
+    if (i < nb_cached_seeds) {
+        *info = cached_seeds[i];
+    } else {
+        snprintf(info->id, sizeof(info->id), "%s", id);
+        r = parse_seeds(app_name, dir_name, id, info);
+        if (r && nb_cached_seeds < array_size(cached_seeds))
+            cached_seeds[nb_cached_seeds++] = *info;
+    }
+    unlock_mutex(&seeds_lock);
+    return r;
+}
+
+static bool get_seed_list(const char* app_name, const char* dir_name, seed_list* list)
+{
+    char path[PATH_MAX];
+    lock_mutex(&seeds_lock);
+    if (!cached_list_valid) {
+        JSON_Value* json = load_seeds_json(app_name, dir_name, path);
+        if (json != NULL) {
+            const char* default_id = json_object_get_string(json_object(json), "seeds_id");
+            snprintf(cached_list.default_id, sizeof(cached_list.default_id), "%s",
+                     (default_id == NULL) ? "" : default_id);
+            JSON_Array* seeds_array = json_object_get_array(json_object(json), "seeds");
+            cached_list.nb_ids = 0;
+            for (size_t i = 0; i < json_array_get_count(seeds_array) && cached_list.nb_ids < MAX_SEEDS; i++) {
+                const char* id = json_object_get_string(json_array_get_object(seeds_array, i), "id");
+                if (id != NULL)
+                    snprintf(cached_list.id[cached_list.nb_ids++], sizeof(cached_list.id[0]), "%s", id);
+            }
+            json_value_free(json);
+            cached_list_valid = true;
+        }
+    }
+    if (cached_list_valid)
+        *list = cached_list;
+    unlock_mutex(&seeds_lock);
+    return cached_list_valid;
+}
+
+/*
+ * Game detection: A file can only be descrambled with the seeds of the right game, which
+ * we check by only descrambling the few bytes that are enough to reject a wrong guess.
+ */
+static bool probe_seeds(const uint8_t* src, uint32_t src_size, seed_info* info)
+{
+    uint8_t buf[0x800];
+    bool r = false, saved_is_big_endian = is_big_endian;
+    seed_data* seeds = &info->seeds;
+    if (((src_size % 4) != 0) || (src_size <= E_HEADER_SIZE + E_FOOTER_SIZE))
+        return false;
+    if (get_e_version(src, &is_big_endian) != info->version)
+        goto out;
+    uint32_t working_size = getdata32(&src[4]);
+    const uint8_t* payload = &src[E_HEADER_SIZE];
+    uint32_t payload_size = src_size - E_HEADER_SIZE;
+
+    if (info->version == 2) {
+        // Descramble the end of the file, and check that the footer starts with one of
+        // the values that unscramble() accepts. Since v2 fenced scramblers always update
+        // the seed once per 16-bit word, we can jump straight to the footer.
+        uint32_t size = min(payload_size, sizeof(buf));
+        memcpy(buf, &payload[payload_size - size], size);
+        init_random(0, seeds->main[0]);
+        if (!bit_scrambler(buf, size, 0x100, true))
+            goto out;
+        init_random(0, seeds->main[1]);
+        random_seed[1] = jump_random(random_seed[0], random_seed[1], (payload_size - E_FOOTER_SIZE) / 2);
+        uint8_t* footer = &buf[size - E_FOOTER_SIZE];
+        if (!fenced_scrambler(footer, E_FOOTER_SIZE, seeds->fence, true, false))
+            goto out;
+        uint32_t value = getdata32(footer);
+        r = (value == 0) || (value == 0x000000ff) || (value == 0xff000000);
+    } else {
+        // With v3 the position of the footer depends on all the seeds that were drawn
+        // before it, so check that the start of the payload looks like a Glaze header.
+        memcpy(buf, payload, E_FOOTER_SIZE);
+        init_random(0, seeds->main[1]);
+        if (!fenced_scrambler(buf, E_FOOTER_SIZE, seeds->fence, true, true))
+            goto out;
+        init_random(seeds->main[0], seeds->table[0]);
+        if (!rotating_scrambler(buf, E_FOOTER_SIZE, seeds))
+            goto out;
+        uint32_t dec_length = getdata32(buf), bitstream_length = getdata32(&buf[4]);
+        r = (dec_length != 0) && (dec_length <= working_size) &&
+            (bitstream_length > sizeof(uint32_t)) && (bitstream_length < payload_size);
+    }
+
+out:
+    is_big_endian = saved_is_big_endian;
+    return r;
+}
+
+// The last game detected for each directory is kept in a cache, so that the other
+// files from the same directory can skip detection
+static mutex_t detect_cache_lock = MUTEX_INITIALIZER;
+
+// Directories are recorded as absolute paths, so that the same one matches regardless
+// of the current directory or of how it was specified
+static void get_cache_dir(const char* file_path, char* dir, size_t dir_size)
+{
+    char* full_path = realpath_utf8(_dirname(file_path));
+    snprintf(dir, dir_size, "%s", (full_path != NULL) ? full_path : _dirname(file_path));
+    free(full_path);
+}
+
+static bool lookup_detected_id(const char* cache_path, const char* dir, char* id, size_t id_size)
+{
+    char line[PATH_MAX + 64], entry_id[64];
+    bool found = false;
+    lock_mutex(&detect_cache_lock);
+    FILE* file = fopen_utf8(cache_path, "r");
+    if (file != NULL) {
+        while (fgets(line, sizeof(line), file) != NULL) {
+            int n = 0;
+            line[strcspn(line, "\r\n")] = 0;
+            if (sscanf(line, "%63s %n", entry_id, &n) == 1 && n != 0 && strcmp(&line[n], dir) == 0) {
+                snprintf(id, id_size, "%s", entry_id);
+                found = true;
+            }
+        }
+        fclose(file);
+    }
+    unlock_mutex(&detect_cache_lock);
+    return found;
+}
+
+static void record_detected_id(const char* cache_path, const char* dir, const char* id)
+{
+    lock_mutex(&detect_cache_lock);
+    uint64_t size = is_file(cache_path) ? get_file_size(cache_path) : 0;
+    FILE* file = fopen_utf8(cache_path, (size < DETECT_CACHE_MAX_SIZE) ? "a" : "w");
+    // Not being able to cache the id is not an error
+    if (file != NULL) {
+        fprintf(file, "%s %s\n", id, dir);
+        fclose(file);
+    }
+    unlock_mutex(&detect_cache_lock);
+}
+
+// Find the game that the .e file from src belongs to
+static bool detect_seeds(const char* app_name, const char* dir_name, const char* cache_path,
+                         const char* file_path, const uint8_t* src, uint32_t src_size, seed_info* info)
+{
+    char file_dir[PATH_MAX], id[64];
+    seed_list list;
+    get_cache_dir(file_path, file_dir, sizeof(file_dir));
+    if (lookup_detected_id(cache_path, file_dir, id, sizeof(id)) &&
+        get_seeds(app_name, dir_name, id, info) && probe_seeds(src, src_size, info))
+        return true;
+    if (!get_seed_list(app_name, dir_name, &list))
+        return false;
+    for (uint32_t i = 0; i < list.nb_ids; i++) {
+        if (get_seeds(app_name, dir_name, list.id[i], info) && probe_seeds(src, src_size, info)) {
+            record_detected_id(cache_path, file_dir, list.id[i]);
+            return true;
+        }
+    }
+    fprintf(stderr, "ERROR: Could not detect the game that '%s' belongs to\n", _basename(file_path));
+    return false;
+}
+
+int gust_enc_process_file(const char* input_path, const enc_options* opt)
+{
+    seed_info info;
+    char path[PATH_MAX], app_name[PATH_MAX], dir_name[PATH_MAX], cache_path[PATH_MAX], *input = NULL;
+    uint32_t src_size, dst_size;
+    uint8_t *src = NULL, *dst = NULL;
+    int r = -1;
+    const char* game_id = (opt->game_id == NULL) ? "" : opt->game_id;
+    int32_t level = opt->level;
+    // These use static buffers, that we don't want to see overwritten
+    snprintf(app_name, sizeof(app_name), "%s", _appname(opt->app_path));
+    snprintf(dir_name, sizeof(dir_name), "%s", _dirname(opt->app_path));
+    snprintf(cache_path, sizeof(cache_path), "%s%c%s.cache", _dirname(opt->app_path), PATH_SEP, _appname(opt->app_path));
+    // We truncate the extension of the file we decode
+    input = strdup(input_path);
+    if (input == NULL)
+        goto out;
+
+    seed_list list;
+    if (!get_seed_list(app_name, dir_name, &list))
+        goto out;
+    bool use_default = (game_id[0] == 0);
+    if (use_default)
+        game_id = list.default_id;
 
     // Read the source file
-    src_size = read_file(argv[argc - 1], &src);
+    uint64_t start = stats_start();
+    src_size = read_file(input, &src);
     if (src_size == UINT32_MAX)
         goto out;
+    stats_stop("read", start, src_size);
+
+    char* e_pos = strstr(input, ".e");
+    if (stricmp(game_id, "auto") != 0) {
+        if (!get_seeds(app_name, dir_name, game_id, &info))
+            goto out;
+    } else if (e_pos != NULL) {
+        start = stats_start();
+        if (!detect_seeds(app_name, dir_name, cache_path, input, src, src_size, &info))
+            goto out;
+        stats_stop("seed_detection", start, 0);
+    } else {
+        char id[64];
+        get_cache_dir(input, path, sizeof(path));
+        if (!lookup_detected_id(cache_path, path, id, sizeof(id))) {
+            fprintf(stderr, "ERROR: No game was detected for '%s' yet, please specify a GAME_ID\n", path);
+            goto out;
+        }
+        if (!get_seeds(app_name, dir_name, id, &info))
+            goto out;
+    }
+    if (level < 0)
+        level = (int32_t)info.glaze_level;
+    seed_data* seeds = &info.seeds;
+    uint32_t version = info.version;
+    is_big_endian = (version != 3);
+    init_checksums();
+
+    printf("Using the scrambling seeds for %s", info.name);
+    if (stricmp(game_id, "auto") == 0)
+        printf(" (detected)\n");
+    else if (use_default)
+        printf(" (edit '%s' to change)\n", info.path);
+    else
+        printf("\n");
 
-    char* e_pos = strstr(argv[argc - 1], ".e");
     if (e_pos == NULL) {
-        printf("Encoding '%s'...\n", _basename(argv[argc - 1]));
+        printf("Encoding '%s'...\n", _basename(input));
         // Compress and scramble a file
 #if defined(USE_GLAZED)
         dst = malloc(src_size);
         memcpy(dst, src, src_size);
         dst_size = src_size;
 #else
-        dst_size = glaze(src, src_size, &dst);
+        start = stats_start();
+        dst_size = glaze(src, src_size, (uint32_t)level, &dst);
         if (dst_size == 0)
             goto out;
+        stats_stop("glaze", start, src_size);
 #endif
 
 #if defined(CREATE_EXTRA_FILES)
-        snprintf(path, sizeof(path), "%s.glaze", basename(argv[argc - 1]));
+        snprintf(path, sizeof(path), "%s.glaze", basename(input));
         write_file(dst, dst_size, path, false);
 #endif
 
@@ -930,13 +2159,13 @@ int main_utf8(int argc, char** argv)
         // is largest (because this buffer will be zeroed for the size of the compressed stream
         // plus the size of the bytecode table once decompression is complete).
         uint32_t working_size = max(src_size, dst_size + getdata32(&dst[2 * sizeof(uint32_t)]));
-        snprintf(path, sizeof(path), "%s.e", argv[argc - 1]);
-        if (!scramble(dst, dst_size, path, &seeds, working_size, version))
+        snprintf(path, sizeof(path), "%s.e", input);
+        if (!scramble(dst, dst_size, path, seeds, working_size, version))
             goto out;
 
         r = 0;
     } else {
-        printf("Decoding '%s'...\n", _basename(argv[argc - 1]));
+        printf("Decoding '%s'...\n", _basename(input));
         // Decode a file
         if (((src_size % 4) != 0) || (src_size <= E_HEADER_SIZE + E_FOOTER_SIZE)) {
             fprintf(stderr, "ERROR: Invalid file size\n");
@@ -945,32 +2174,36 @@ int main_utf8(int argc, char** argv)
 
         // Descramble the data
         uint32_t working_size = 0;
-        uint32_t payload_size = unscramble(src, src_size, &seeds, &working_size, version);
+        uint32_t payload_size = unscramble(src, src_size, seeds, &working_size, version);
         if ((payload_size == 0) || (working_size == 0))
             goto out;
 
 #if defined(CREATE_EXTRA_FILES)
-        snprintf(path, sizeof(path), "%s.glaze", argv[argc - 1]);
+        snprintf(path, sizeof(path), "%s.glaze", input);
         write_file(&src[E_HEADER_SIZE], payload_size, path, false);
 #endif
 
 #if defined(VALIDATE_CHECKSUM)
         // "We can rebuild (it), we have the technology."
-        snprintf(path, sizeof(path), "%s.rebuilt", argv[argc - 1]);
-        scramble(&src[E_HEADER_SIZE], payload_size, path, &seeds, working_size, version);
+        snprintf(path, sizeof(path), "%s.rebuilt", input);
+        scramble(&src[E_HEADER_SIZE], payload_size, path, seeds, working_size, version);
 #endif
 
         // Uncompress descrambled data
         dst = malloc(working_size);
         if (dst == NULL)
             goto out;
+        start = stats_start();
         dst_size = unglaze(&src[E_HEADER_SIZE], payload_size, dst, working_size);
         if (dst_size == 0)
             goto out;
+        stats_stop("unglaze", start, dst_size);
 
         *e_pos = 0;
-        if (!write_file(dst, dst_size, argv[argc - 1], true))
+        start = stats_start();
+        if (!write_file(dst, dst_size, input, true))
             goto out;
+        stats_stop("write", start, dst_size);
         r = 0;
     }
 
@@ -979,10 +2212,38 @@ int main_utf8(int argc, char** argv)
     // even more interesting than playing your games! :)))
 
 out:
-    free(prime_list);
     free(dst);
     free(src);
+    free(input);
+    return r;
+}
+
+int main_utf8(int argc, char** argv)
+{
+    enc_options opt = { argv[0], NULL, -1 };
+    bool print_usage = (argc < 2);
+    for (int i = 1; i < argc - 1; i++) {
+        if (argv[i][0] != '-')
+            print_usage = true;
+        else if (argv[i][1] >= '0' && argv[i][1] <= '9' && argv[i][2] == 0)
+            opt.level = argv[i][1] - '0';
+        else
+            opt.game_id = &argv[i][1];
+    }
+    if (print_usage) {
+        printf("%s %s (c) 2019-2021 VitaSmith\n\nUsage: %s [-GAME_ID] [-LEVEL] <file>\n\n"
+            "Encode or decode a Gust .e file.\n\n"
+            "If GAME_ID is not provided, then the default game ID from '%s.json' is used.\n"
+            "If GAME_ID is 'auto', the game is detected when decoding, and the last game that was\n"
+            "detected for the same directory is used when encoding.\n"
+            "LEVEL is the compression level to use when encoding, from 0 (none) to 9 (best).\n"
+            "Note: A backup (.bak) of the original is automatically created, when the target\n"
+            "is being overwritten for the first time.\n",
+            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]), _appname(argv[0]));
+        return 0;
+    }
 
+    int r = gust_enc_process_file(argv[argc - 1], &opt);
     if (r != 0) {
         fflush(stdin);
         printf("\nPress any key to continue...");
@@ -993,3 +2254,179 @@ out:
 }
 
 CALL_MAIN
+
+#if defined(GUST_BENCH)
+#include "bench.h"
+
+// Atelier Ryza seeds, from gust_enc.json
+static const seed_data bench_seeds = {
+    { 0x6d3f, 0xcb53, 0x74b9 }, { 0xa83b, 0xb11d, 0x88a5 }, { 0x1d, 0x13, 0x0b }, 0x0a31
+};
+
+typedef struct {
+    uint8_t*    buf;
+    uint32_t    size;
+    uint32_t    param;          // Slice size, scrambler version or compression level
+    uint8_t*    glazed;
+    uint32_t    glazed_size;
+    uint8_t*    dst;
+} enc_bench;
+
+static bool bench_adler32(void* _ctx)
+{
+    enc_bench* ctx = (enc_bench*)_ctx;
+    // Make sure the call can't be optimized away
+    ctx->param += adler32(ctx->buf, ctx->size);
+    return true;
+}
+
+static bool bench_adler32_scalar(void* _ctx)
+{
+    enc_bench* ctx = (enc_bench*)_ctx;
+    ctx->param += adler32_scalar(ctx->buf, ctx->size);
+    return true;
+}
+
+static bool bench_checksum_sub(void* _ctx)
+{
+    enc_bench* ctx = (enc_bench*)_ctx;
+    ctx->param += checksum_sub(ctx->buf, ctx->size);
+    return true;
+}
+
+static bool bench_checksum_xor(void* _ctx)
+{
+    enc_bench* ctx = (enc_bench*)_ctx;
+    ctx->param += checksum_xor(ctx->buf, ctx->size);
+    return true;
+}
+
+static bool bench_bit_scrambler(void* _ctx)
+{
+    enc_bench* ctx = (enc_bench*)_ctx;
+    init_random(0, bench_seeds.main[2]);
+    return bit_scrambler(ctx->buf, ctx->size, ctx->param, false);
+}
+
+static bool bench_fenced_scrambler(void* _ctx)
+{
+    enc_bench* ctx = (enc_bench*)_ctx;
+    init_random(0, bench_seeds.main[1]);
+    return fenced_scrambler(ctx->buf, ctx->size, bench_seeds.fence, false, (ctx->param == 3));
+}
+
+static bool bench_rotating_scrambler(void* _ctx)
+{
+    enc_bench* ctx = (enc_bench*)_ctx;
+    init_random(0, bench_seeds.table[0]);
+    return rotating_scrambler(ctx->buf, ctx->size, &bench_seeds);
+}
+
+static bool bench_glaze(void* _ctx)
+{
+    enc_bench* ctx = (enc_bench*)_ctx;
+    uint8_t* dst = NULL;
+    uint32_t size = glaze(ctx->buf, ctx->size, ctx->param, &dst);
+    free(dst);
+    return (size != 0);
+}
+
+static bool bench_unglaze(void* _ctx)
+{
+    enc_bench* ctx = (enc_bench*)_ctx;
+    return (unglaze(ctx->glazed, ctx->glazed_size, ctx->dst, ctx->size) == ctx->size);
+}
+
+// Round trip data that is stored as is, either with level 0 or as the fallback for
+// incompressible data, since the handling of its last block is easy to get wrong
+static bool check_glaze_store(void)
+{
+    static const uint32_t sizes[] = { 14, 255, 256, 269, 270, 512, 1536, 4096, 65536, 262144, 1600000 };
+    static const uint32_t levels[] = { 0, GLAZE_MAX_LEVEL };
+    const uint32_t max_size = sizes[array_size(sizes) - 1];
+    bool r = false;
+    uint8_t *src = malloc(max_size), *dst = NULL, *out = malloc(max_size);
+    if (src == NULL || out == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate buffers\n");
+        goto out;
+    }
+    for (uint32_t i = 0; i < array_size(sizes); i++) {
+        bench_fill(src, sizes[i], 7 + i, false);
+        for (uint32_t l = 0; l < array_size(levels); l++) {
+            uint32_t size = glaze(src, sizes[i], levels[l], &dst);
+            if (size == 0 || unglaze(dst, size, out, sizes[i]) != sizes[i] || memcmp(src, out, sizes[i]) != 0) {
+                fprintf(stderr, "ERROR: Glaze round trip failed for %u bytes at level %u\n", sizes[i], levels[l]);
+                goto out;
+            }
+            free(dst);
+            dst = NULL;
+        }
+    }
+    r = true;
+
+out:
+    free(dst);
+    free(out);
+    free(src);
+    return r;
+}
+
+bool gust_enc_bench(void)
+{
+    // The bit scrambler only ever processes the first and last 0x800 bytes of a file
+    static const struct {
+        const char* name;
+        bench_fn    fn;
+        uint32_t    param;
+        uint32_t    size;
+        bool        compressible;
+    } kernels[] = {
+        { "adler32",                bench_adler32,              0,                      0,      false },
+        { "adler32_scalar",         bench_adler32_scalar,       0,                      0,      false },
+        { "checksum_sub",           bench_checksum_sub,         0,                      0,      false },
+        { "checksum_xor",           bench_checksum_xor,         0,                      0,      false },
+        { "bit_scrambler/0x80",     bench_bit_scrambler,        0x80,                   0x800,  false },
+        { "bit_scrambler/0x100",    bench_bit_scrambler,        0x100,                  0x800,  false },
+        { "fenced_scrambler/v2",    bench_fenced_scrambler,     2,                      0,      false },
+        { "fenced_scrambler/v3",    bench_fenced_scrambler,     3,                      0,      false },
+        { "rotating_scrambler",     bench_rotating_scrambler,   0,                      0,      false },
+        { "glaze",                  bench_glaze,                GLAZE_DEFAULT_LEVEL,    0,      true },
+        { "unglaze",                bench_unglaze,              0,                      0,      true },
+    };
+    bool r = false;
+    enc_bench ctx = { 0 };
+    ctx.buf = malloc(bench_size);
+    ctx.dst = malloc(bench_size);
+    if (ctx.buf == NULL || ctx.dst == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate buffers\n");
+        goto out;
+    }
+    init_checksums();
+    if (bench_selected("glaze") && !check_glaze_store())
+        goto out;
+
+    for (uint32_t i = 0; i < array_size(kernels); i++) {
+        if (!bench_selected(kernels[i].name))
+            continue;
+        ctx.size = (kernels[i].size == 0) ? bench_size : min(kernels[i].size, bench_size);
+        ctx.param = kernels[i].param;
+        bench_fill(ctx.buf, ctx.size, 5, kernels[i].compressible);
+        if (kernels[i].fn == bench_unglaze) {
+            ctx.glazed_size = glaze(ctx.buf, ctx.size, GLAZE_DEFAULT_LEVEL, &ctx.glazed);
+            if (ctx.glazed_size == 0) {
+                fprintf(stderr, "ERROR: Can't compress data\n");
+                goto out;
+            }
+        }
+        if (!bench_kernel(kernels[i].name, kernels[i].fn, &ctx, ctx.size))
+            goto out;
+    }
+    r = true;
+
+out:
+    free(ctx.glazed);
+    free(ctx.dst);
+    free(ctx.buf);
+    return r;
+}
+#endif
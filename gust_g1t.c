@@ -25,6 +25,7 @@
 #include "utf8.h"
 #include "util.h"
 #include "parson.h"
+#include "batch.h"
 #include "dds.h"
 
 #define JSON_VERSION            2
@@ -89,8 +90,8 @@ typedef struct {
 #pragma pack(pop)
 
 // Same order as enum DDS_FORMAT
-const char* argb_name[] = { NULL, "ABGR", "ARGB", "GRAB", "RGBA",
-                                  "ABGR", "ARGB", "GRAB", "RGBA" };
+static const char* argb_name[] = { NULL, "ABGR", "ARGB", "GRAB", "RGBA",
+                                         "ABGR", "ARGB", "GRAB", "RGBA" };
 
 static inline const char* platform_to_name(uint32_t platform)
 {
@@ -198,7 +199,7 @@ static void json_to_flags(uint64_t* flags, JSON_Array* json_flags_array)
 static JSON_Value* flags_to_json(uint64_t* flags)
 {
     JSON_Value* json_flags_array = json_value_init_array();
-    static char str[64] = { 0 };
+    static THREAD_LOCAL char str[64] = { 0 };
     uint64_t flags_copy[2] = { flags[0], flags[1] };
 
     // Named flags
@@ -374,42 +375,228 @@ static size_t write_dds_header(FILE* fd, enum DDS_FORMAT format, uint32_t width,
     return r;
 }
 
-static void rgba_convert(const enum DDS_FORMAT format, const char* in,
-                         const char* out, uint8_t* buf, const uint32_t size)
+// Scratch buffers, that are reused across mipmaps and textures, so that the texture
+// transforms don't need to allocate and free a full size temporary every time.
+enum {
+    SCRATCH_PAYLOAD,    // Texture data, once flipped or swizzled
+    SCRATCH_MIPMAP,     // Padded or (un)tiled mipmap
+    SCRATCH_OUTPUT,     // DDS payload, in the order it gets written
+    SCRATCH_TABLES,     // Morton offset tables
+    SCRATCH_MAX
+};
+
+typedef struct {
+    uint8_t*    buf[SCRATCH_MAX];
+    size_t      size[SCRATCH_MAX];
+} scratch_arena;
+
+// Return a scratch buffer of at least size bytes. Its previous content is not preserved.
+static uint8_t* get_scratch(scratch_arena* arena, uint32_t slot, size_t size)
 {
-    uint32_t bits_per_pixel = dds_bpp(format);
-    assert(bits_per_pixel % 8 == 0);
-    assert(format >= DDS_FORMAT_ABGR4 && format <= DDS_FORMAT_RGBA8);
+    if (size > arena->size[slot]) {
+        free(arena->buf[slot]);
+        arena->size[slot] = max(size, 2 * arena->size[slot]);
+        arena->buf[slot] = malloc(arena->size[slot]);
+        if (arena->buf[slot] == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate scratch buffer\n");
+            arena->size[slot] = 0;
+        }
+    }
+    return arena->buf[slot];
+}
 
-    const int rgba[4] = { 'R', 'G', 'B', 'A' };
-    if (strcmp(in, out) == 0)
-        return;
+static void free_scratch(scratch_arena* arena)
+{
+    for (uint32_t i = 0; i < SCRATCH_MAX; i++)
+        free(arena->buf[i]);
+    memset(arena, 0, sizeof(scratch_arena));
+}
+
+// Channel conversion parameters for 8-bit (32 bpp) or 4-bit (16 bpp) ARGB formats. Masks and shifts
+// apply to little endian pixel values, and shuffle holds the equivalent byte permutation of 4 pixels.
+typedef struct {
+    uint32_t    bytes_per_pixel;
+    uint32_t    mask[4];
+    int         shift[4];           // Left shift, or right shift if negative
+    uint8_t     shuffle[16];
+} rgba_swizzle;
+
+// Kernels convert as many pixels as they can, and return the number of bytes they processed
+typedef uint32_t (*rgba_kernel_fn)(uint8_t* buf, const uint32_t size, const rgba_swizzle* swz);
 
-    uint32_t mask[4];
-    int rot[4];
+static void get_rgba_swizzle(const enum DDS_FORMAT format, const char* in, const char* out, rgba_swizzle* swz)
+{
+    // Bit position of each nibble of a big endian 16-bit pixel, once loaded as little endian
+    const int nibble_pos[4] = { 4, 0, 12, 8 };
+    const int rgba[4] = { 'R', 'G', 'B', 'A' };
+    swz->bytes_per_pixel = dds_bpp(format) / 8;
     for (uint32_t i = 0; i < 4; i++) {
-        uint32_t pos_in = 3 - (uint32_t)((uintptr_t)strchr(in, rgba[i]) - (uintptr_t)in);
-        uint32_t pos_out = 3 - (uint32_t)((uintptr_t)strchr(out, rgba[i]) - (uintptr_t)out);
-        mask[i] = ((1 << (bits_per_pixel / 4)) - 1) << (pos_in * 8);
-        rot[i] = (pos_out - pos_in) * 8;
-    }
-
-    for (uint32_t j = 0; j < size; j += 4) {
-        uint32_t s;
-        switch (bits_per_pixel) {
-        case 16: s = getbe16(&buf[j]); break;
-        case 24: s = getbe24(&buf[j]); break;
-        default: s = getbe32(&buf[j]); break;
+        int pos_in = (int)((uintptr_t)strchr(in, rgba[i]) - (uintptr_t)in);
+        int pos_out = (int)((uintptr_t)strchr(out, rgba[i]) - (uintptr_t)out);
+        if (swz->bytes_per_pixel == 4) {
+            swz->mask[i] = 0xffU << (8 * pos_in);
+            swz->shift[i] = 8 * (pos_out - pos_in);
+        } else {
+            swz->mask[i] = 0x0fU << nibble_pos[pos_in];
+            swz->shift[i] = nibble_pos[pos_out] - nibble_pos[pos_in];
         }
-        uint32_t d = 0;
+        for (uint32_t j = 0; j < 16; j += 4)
+            swz->shuffle[j + pos_out] = (uint8_t)(j + pos_in);
+    }
+}
+
+static uint32_t rgba_convert_generic(uint8_t* buf, const uint32_t size, const rgba_swizzle* swz)
+{
+    uint32_t j;
+    for (j = 0; j + swz->bytes_per_pixel <= size; j += swz->bytes_per_pixel) {
+        uint32_t s = (swz->bytes_per_pixel == 4) ? getle32(&buf[j]) : getle16(&buf[j]), d = 0;
         for (uint32_t i = 0; i < 4; i++)
-            d |= (rot[i] > 0) ? ((s & mask[i]) << rot[i]) : ((s & mask[i]) >> -rot[i]);
-        switch (bits_per_pixel) {
-        case 16: setbe16(&buf[j], (uint16_t)d); break;
-        case 24: setbe24(&buf[j], d); break;
-        default: setbe32(&buf[j], d); break;
+            d |= (swz->shift[i] > 0) ? ((s & swz->mask[i]) << swz->shift[i]) : ((s & swz->mask[i]) >> -swz->shift[i]);
+        if (swz->bytes_per_pixel == 4)
+            setle32(&buf[j], d);
+        else
+            setle16(&buf[j], (uint16_t)d);
+    }
+    return j;
+}
+
+#if defined(USE_SSE2)
+#include <immintrin.h>
+
+// SSE2 has no byte shuffle, so both pixel sizes use masks and shifts
+static uint32_t rgba_convert_sse2(uint8_t* buf, const uint32_t size, const rgba_swizzle* swz)
+{
+    __m128i mask[4], count[4];
+    uint32_t j;
+    for (uint32_t i = 0; i < 4; i++) {
+        mask[i] = (swz->bytes_per_pixel == 4) ? _mm_set1_epi32((int)swz->mask[i]) : _mm_set1_epi16((short)swz->mask[i]);
+        count[i] = _mm_cvtsi32_si128(abs(swz->shift[i]));
+    }
+    for (j = 0; j + 16 <= size; j += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i*)&buf[j]), d = _mm_setzero_si128();
+        for (uint32_t i = 0; i < 4; i++) {
+            __m128i c = _mm_and_si128(s, mask[i]);
+            if (swz->bytes_per_pixel == 4)
+                c = (swz->shift[i] > 0) ? _mm_sll_epi32(c, count[i]) : _mm_srl_epi32(c, count[i]);
+            else
+                c = (swz->shift[i] > 0) ? _mm_sll_epi16(c, count[i]) : _mm_srl_epi16(c, count[i]);
+            d = _mm_or_si128(d, c);
+        }
+        _mm_storeu_si128((__m128i*)&buf[j], d);
+    }
+    return j;
+}
+
+TARGET_AVX2 static uint32_t rgba_convert_avx2(uint8_t* buf, const uint32_t size, const rgba_swizzle* swz)
+{
+    const __m256i shuffle = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)swz->shuffle));
+    uint32_t j;
+    for (j = 0; j + 32 <= size; j += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i*)&buf[j]);
+        _mm256_storeu_si256((__m256i*)&buf[j], _mm256_shuffle_epi8(s, shuffle));
+    }
+    return j;
+}
+#elif defined(USE_NEON)
+#include <arm_neon.h>
+
+static uint32_t rgba_convert_neon(uint8_t* buf, const uint32_t size, const rgba_swizzle* swz)
+{
+    uint32_t j = 0;
+    if (swz->bytes_per_pixel == 4) {
+        const uint8x16_t shuffle = vld1q_u8(swz->shuffle);
+        for (; j + 16 <= size; j += 16)
+            vst1q_u8(&buf[j], vqtbl1q_u8(vld1q_u8(&buf[j]), shuffle));
+    } else {
+        uint16x8_t mask[4];
+        int16x8_t shift[4];
+        for (uint32_t i = 0; i < 4; i++) {
+            mask[i] = vdupq_n_u16((uint16_t)swz->mask[i]);
+            shift[i] = vdupq_n_s16((int16_t)swz->shift[i]);
+        }
+        for (; j + 16 <= size; j += 16) {
+            uint16x8_t s = vld1q_u16((const uint16_t*)&buf[j]), d = vdupq_n_u16(0);
+            for (uint32_t i = 0; i < 4; i++)
+                d = vorrq_u16(d, vshlq_u16(vandq_u16(s, mask[i]), shift[i]));
+            vst1q_u16((uint16_t*)&buf[j], d);
         }
     }
+    return j;
+}
+#endif
+
+static rgba_kernel_fn rgba8_kernel = rgba_convert_generic, rgba4_kernel = rgba_convert_generic;
+
+// Select the fastest channel conversion kernels, after validating them against the generic version.
+// This is only done once per process.
+static mutex_t rgba_kernel_lock = MUTEX_INITIALIZER;
+static bool rgba_kernel_initialized = false;
+static void init_rgba_kernels(void)
+{
+    lock_mutex(&rgba_kernel_lock);
+    if (rgba_kernel_initialized) {
+        unlock_mutex(&rgba_kernel_lock);
+        return;
+    }
+    // Candidates for 4-bit (index 0) and 8-bit (index 1) channels. AVX2 is only used for the latter.
+    rgba_kernel_fn candidates[2][3] = { { NULL, NULL, rgba_convert_generic }, { NULL, NULL, rgba_convert_generic } };
+    rgba_kernel_fn* kernel[2] = { &rgba4_kernel, &rgba8_kernel };
+    const enum DDS_FORMAT format[2] = { DDS_FORMAT_ARGB4, DDS_FORMAT_ARGB8 };
+#if defined(USE_SSE2)
+    if (cpu_has_avx2())
+        candidates[1][0] = rgba_convert_avx2;
+    candidates[0][1] = candidates[1][1] = rgba_convert_sse2;
+#elif defined(USE_NEON)
+    candidates[0][1] = candidates[1][1] = rgba_convert_neon;
+#endif
+    uint8_t src[3 * 32 + 8], ref[sizeof(src)], out[sizeof(src)];
+    for (uint32_t i = 0; i < sizeof(src); i++)
+        src[i] = (uint8_t)(i * 0x9d + 0x3b);
+    for (uint32_t k = 0; k < array_size(kernel); k++) {
+        for (uint32_t c = 0; c < array_size(candidates[k]); c++) {
+            if (candidates[k][c] == NULL)
+                continue;
+            bool valid = true;
+            for (uint32_t i = 1; i < array_size(argb_name) && valid; i++) {
+                for (uint32_t o = 1; o < array_size(argb_name) && valid; o++) {
+                    rgba_swizzle swz;
+                    get_rgba_swizzle(format[k], argb_name[i], argb_name[o], &swz);
+                    // Use different sizes and alignments, to exercise both the vectors and the tail
+                    for (uint32_t size = 0; size <= sizeof(src) - 8 && valid; size += 14) {
+                        uint32_t offset = size % 8;
+                        memcpy(ref, &src[offset], size);
+                        memcpy(out, &src[offset], size);
+                        rgba_convert_generic(ref, size, &swz);
+                        uint32_t done = candidates[k][c](out, size, &swz);
+                        rgba_convert_generic(&out[done], size - done, &swz);
+                        valid = (memcmp(ref, out, size) == 0);
+                    }
+                }
+            }
+            if (valid) {
+                *kernel[k] = candidates[k][c];
+                break;
+            }
+        }
+    }
+    rgba_kernel_initialized = true;
+    unlock_mutex(&rgba_kernel_lock);
+}
+
+// Convert the channel order of 8-bit or 4-bit ARGB pixels, which is a fixed permutation within each pixel
+static void rgba_convert(const enum DDS_FORMAT format, const char* in,
+                         const char* out, uint8_t* buf, const uint32_t size)
+{
+    assert(dds_bpp(format) == 16 || dds_bpp(format) == 32);
+    assert(format >= DDS_FORMAT_ABGR4 && format <= DDS_FORMAT_RGBA8);
+
+    if (strcmp(in, out) == 0)
+        return;
+
+    rgba_swizzle swz;
+    get_rgba_swizzle(format, in, out, &swz);
+    uint32_t done = ((swz.bytes_per_pixel == 4) ? rgba8_kernel : rgba4_kernel)(buf, size, &swz);
+    rgba_convert_generic(&buf[done], size - done, &swz);
 }
 
 // "Inflate" a 32 bit value by interleaving 0 bits at odd positions.
@@ -447,10 +634,39 @@ static __inline void morton_to_xy(uint32_t z, uint32_t* x, uint32_t* y)
     *y = deflate_bits(z >> 0);
 }
 
-// Apply or reverse a Morton transformation, a.k.a. a Z-order curve, to a texture.
+// Copy the elements of a texture between linear and Morton tiled order, using per-column (mx) and
+// per-row (my) Morton offset tables. To keep both sides in cache, tiles are processed one at a time,
+// in blocks of up to 8x8 elements, which map to a contiguous run of Morton ordered elements.
+static __inline void morton_copy(uint8_t* dst, const uint8_t* src, const uint32_t bytes_per_element,
+                                 uint32_t width, uint32_t height, uint32_t tile_width,
+                                 const uint32_t* mx, const uint32_t* my, const bool reverse)
+{
+    const uint32_t block = min(tile_width, 8);
+    size_t tile_base = 0;
+    for (uint32_t ty = 0; ty < height; ty += tile_width) {
+        for (uint32_t tx = 0; tx < width; tx += tile_width, tile_base += (size_t)tile_width * tile_width) {
+            for (uint32_t by = 0; by < tile_width; by += block) {
+                for (uint32_t bx = 0; bx < tile_width; bx += block) {
+                    for (uint32_t y = by; y < by + block; y++) {
+                        const size_t linear = (size_t)(ty + y) * width + tx;
+                        for (uint32_t x = bx; x < bx + block; x++) {
+                            const size_t morton = tile_base + (mx[x] | my[y]);
+                            if (reverse)
+                                memcpy(&dst[(linear + x) * bytes_per_element], &src[morton * bytes_per_element], bytes_per_element);
+                            else
+                                memcpy(&dst[morton * bytes_per_element], &src[(linear + x) * bytes_per_element], bytes_per_element);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Apply or reverse a Morton transformation, a.k.a. a Z-order curve, to a texture, from src to dst.
 // If morton_order is negative, a reverse Morton transformation is applied.
-static void mortonize(const enum DDS_FORMAT format, const int16_t morton_order,
-                      uint32_t width, uint32_t height, uint8_t* buf, const uint32_t size, uint32_t wf)
+static bool mortonize(const enum DDS_FORMAT format, const int16_t morton_order, uint32_t width, uint32_t height,
+                      uint8_t* dst, const uint8_t* src, const uint32_t size, uint32_t wf, scratch_arena* arena)
 {
     const uint32_t bits_per_element = dds_bpp(format) * dds_bwh(format) * dds_bwh(format) * wf;
     const uint32_t bytes_per_element = bits_per_element / 8;
@@ -474,32 +690,56 @@ static void mortonize(const enum DDS_FORMAT format, const int16_t morton_order,
     uint32_t tile_width = 1 << k;
     uint32_t tile_size = tile_width * tile_width;
     uint32_t mask = tile_size - 1;
-    uint8_t* tmp_buf = (uint8_t*)malloc(size);
-    for (uint32_t i = 0; i < num_elements; i++) {
-        uint32_t j, x, y;
-        if (reverse) {  // Morton value to an (x,y) pair
-            // Recover (x,y) for the Morton tile
-            morton_to_xy(i & mask, &x, &y);
-            // Now apply untiling by offsetting (x,y) with the tile positiom
-            x += ((i / tile_size) % (width / tile_width)) * tile_width;
-            y += ((i / tile_size) / (width / tile_width)) * tile_width;
-            j = y * width + x;
-        } else {        // Morton value from an (x,y) pair
-            x = i % width; y = i / width;
-            j = xy_to_morton(x, y) & mask;
-            // Now, apply tiling. This is accomplished by offseting our value
-            // with the current tile position multiplied by the tile size.
-            j += ((y / tile_width) * (width / tile_width) + (x / tile_width)) * tile_size;
+    uint32_t* mx = (uint32_t*)get_scratch(arena, SCRATCH_TABLES, 2 * tile_width * sizeof(uint32_t));
+    if (mx == NULL)
+        return false;
+    uint32_t* my = &mx[tile_width];
+    for (uint32_t i = 0; i < tile_width; i++) {
+        mx[i] = inflate_bits(i) << 1;
+        my[i] = inflate_bits(i) << 0;
+    }
+
+    // Use specialized copies for the element sizes of RGBA8 and BC formats on PS4/PSV/Switch
+    switch (bytes_per_element) {
+    case 4:
+        morton_copy(dst, src, 4, width, height, tile_width, mx, my, reverse);
+        break;
+    case 8:
+        morton_copy(dst, src, 8, width, height, tile_width, mx, my, reverse);
+        break;
+    case 16:
+        morton_copy(dst, src, 16, width, height, tile_width, mx, my, reverse);
+        break;
+    case 32:
+        morton_copy(dst, src, 32, width, height, tile_width, mx, my, reverse);
+        break;
+    default:
+        for (uint32_t i = 0; i < num_elements; i++) {
+            uint32_t j, x, y;
+            if (reverse) {  // Morton value to an (x,y) pair
+                // Recover (x,y) for the Morton tile
+                morton_to_xy(i & mask, &x, &y);
+                // Now apply untiling by offsetting (x,y) with the tile positiom
+                x += ((i / tile_size) % (width / tile_width)) * tile_width;
+                y += ((i / tile_size) / (width / tile_width)) * tile_width;
+                j = y * width + x;
+            } else {        // Morton value from an (x,y) pair
+                x = i % width; y = i / width;
+                j = xy_to_morton(x, y) & mask;
+                // Now, apply tiling. This is accomplished by offseting our value
+                // with the current tile position multiplied by the tile size.
+                j += ((y / tile_width) * (width / tile_width) + (x / tile_width)) * tile_size;
+            }
+            assert(j < num_elements);
+            memcpy(&dst[j * bytes_per_element], &src[i * bytes_per_element], bytes_per_element);
         }
-        assert(j < num_elements);
-        memcpy(&tmp_buf[j * bytes_per_element], &buf[i * bytes_per_element], bytes_per_element);
+        break;
     }
-    memcpy(buf, tmp_buf, size);
-    free(tmp_buf);
+    return true;
 }
 
 static void tile(const enum DDS_FORMAT format, uint32_t tile_size, uint32_t width,
-                 uint8_t* buf, const uint32_t size)
+                 uint8_t* dst, const uint8_t* src, const uint32_t size)
 {
     const uint32_t bytes_per_element = dds_bpb(format);
     assert(tile_size % dds_bwh(format) == 0);
@@ -511,25 +751,20 @@ static void tile(const enum DDS_FORMAT format, uint32_t tile_size, uint32_t widt
     assert(size % (tile_size * tile_size) == 0);
     assert(width % tile_size == 0);
 
-    uint8_t* tmp_buf = (uint8_t*)malloc(size);
-
     for (uint32_t i = 0; i < size / bytes_per_element / tile_size / tile_size; i++) {
         uint32_t tile_row = i / (width / tile_size);
         uint32_t tile_column = i % (width / tile_size);
         uint32_t tile_start = tile_row * width * tile_size + tile_column * tile_size;
         for (uint32_t j = 0; j < tile_size; j++) {
-            memcpy(&tmp_buf[bytes_per_element * (i * tile_size * tile_size + j * tile_size)],
-                &buf[bytes_per_element * (tile_start + j * width)],
+            memcpy(&dst[bytes_per_element * (i * tile_size * tile_size + j * tile_size)],
+                &src[bytes_per_element * (tile_start + j * width)],
                 (size_t)tile_size * bytes_per_element);
         }
     }
-
-    memcpy(buf, tmp_buf, size);
-    free(tmp_buf);
 }
 
 static void untile(const enum DDS_FORMAT format, uint32_t tile_size, uint32_t width,
-                   uint8_t* buf, const uint32_t size)
+                   uint8_t* dst, const uint8_t* src, const uint32_t size)
 {
     const uint32_t bytes_per_element = dds_bpb(format);
     assert(tile_size % dds_bwh(format) == 0);
@@ -541,77 +776,767 @@ static void untile(const enum DDS_FORMAT format, uint32_t tile_size, uint32_t wi
     assert(size % (tile_size * tile_size) == 0);
     assert(width % tile_size == 0);
 
-    uint8_t* tmp_buf = (uint8_t*)malloc(size);
-
     for (uint32_t i = 0; i < size / bytes_per_element / tile_size / tile_size; i++) {
         uint32_t tile_row = i / (width / tile_size);
         uint32_t tile_column = i % (width / tile_size);
         uint32_t tile_start = tile_row * width * tile_size + tile_column * tile_size;
         for (uint32_t j = 0; j < tile_size; j++) {
-            memcpy(&tmp_buf[bytes_per_element * (tile_start + j * width)],
-                &buf[bytes_per_element * (i * tile_size * tile_size + j * tile_size)],
+            memcpy(&dst[bytes_per_element * (tile_start + j * width)],
+                &src[bytes_per_element * (i * tile_size * tile_size + j * tile_size)],
                 (size_t)tile_size * bytes_per_element);
         }
     }
-
-    memcpy(buf, tmp_buf, size);
-    free(tmp_buf);
 }
 
-static void flip(uint32_t bits_per_pixel, uint8_t* buf, const uint32_t size, uint32_t width)
+// Copy size bytes, from position start, of the vertically flipped version of src into dst.
+// This allows flipping to happen as part of another copy.
+static void flip_copy(uint32_t bits_per_pixel, uint8_t* dst, const uint8_t* src, const uint32_t src_size,
+                      uint32_t width, uint32_t start, uint32_t size)
 {
     assert(bits_per_pixel % 8 == 0);
     const uint32_t line_size = width * (bits_per_pixel / 8);
-    assert(size % line_size == 0);
-    const uint32_t max_line = (size / line_size) - 1;
+    assert(src_size % line_size == 0);
+    assert(start + size <= src_size);
+    const uint32_t max_line = (src_size / line_size) - 1;
+
+    while (size > 0) {
+        uint32_t line = start / line_size, pos = start % line_size;
+        uint32_t len = min(size, line_size - pos);
+        memcpy(dst, &src[(max_line - line) * line_size + pos], len);
+        dst = &dst[len];
+        start += len;
+        size -= len;
+    }
+}
+
+// Set the default ARGB format for the platform
+static uint32_t get_default_texture_format(uint32_t platform)
+{
+    switch (platform) {
+    case NINTENDO_DS:
+    case NINTENDO_3DS:
+    case SONY_PS4:
+        return DDS_FORMAT_GRAB8;
+    case SONY_PSV:
+    case NINTENDO_SWITCH:
+        return DDS_FORMAT_ARGB8;
+    default:    // PC and other platforms
+        return DDS_FORMAT_RGBA8;
+    }
+}
+
+// A texture converted by a creation worker, as it will be written in the G1T
+typedef struct {
+    uint8_t*    data;       // Texture header, extended data and mipmaps
+    uint32_t    size;
+    uint32_t    flags;      // Global flags
+    uint32_t    data_size;  // Size of the extended data
+    uint8_t     type;
+    char        line[320];  // Listing line, minus the type, offset and size
+} created_texture;
+
+// Data needed by the creation workers
+typedef struct {
+    JSON_Array*         json_textures_array;
+    const char*         dir;
+    const char*         base_name;
+    uint32_t            platform;
+    endianness          data_endianness;
+    bool                flip_image;
+    scratch_arena*      arenas;     // One per thread
+    created_texture*    textures;
+} create_ctx;
+
+static bool create_texture(void* _ctx, uint32_t thread_index, uint32_t i)
+{
+    create_ctx* ctx = (create_ctx*)_ctx;
+    scratch_arena* arena = &ctx->arenas[thread_index];
+    created_texture* texture = &ctx->textures[i];
+    uint8_t* buf = NULL;
+    char path[256];
+    bool r = false;
+
+    data_endianness = ctx->data_endianness;
+    JSON_Object* texture_entry = json_array_get_object(ctx->json_textures_array, i);
+    g1t_tex_header tex = { 0 };
+    tex.type = json_object_get_uint8(texture_entry, "type");
+    tex.z_mipmaps = json_object_get_uint8(texture_entry, "z_mipmaps");
+    const char* depth_str = json_object_get_string(texture_entry, "depth");
+    float depth = (depth_str == NULL) ? 0.0f : (float)atof(depth_str);
+    uint64_t flags[2];
+    json_to_flags(flags, json_object_get_array(texture_entry, "flags"));
+    for (size_t j = 0; j < array_size(tex.flags); j++)
+        tex.flags[array_size(tex.flags) - j - 1] = (uint8_t)(flags[0] >> (8 * j));
+    texture->flags = (uint32_t)(flags[0] >> 40);
+    uint32_t nb_frames = json_object_get_uint32(texture_entry, "nb_frames");
+    flags[1] |= ((uint64_t)nb_frames & 0x0f) << 28 | ((uint64_t)nb_frames & 0xf0) << 12;
+    if (nb_frames == 0)
+        nb_frames = 1;
+    // Read the DDS file
+    snprintf(path, sizeof(path), "%s%s%c%s", ctx->dir, ctx->base_name, PATH_SEP,
+        json_object_get_string(texture_entry, "name"));
+    uint64_t start = stats_start();
+    uint32_t texture_size = read_file(path, &buf);
+    if (texture_size == UINT32_MAX)
+        goto out;
+    stats_stop("read", start, texture_size);
+    if (texture_size <= sizeof(DDS_HEADER)) {
+        fprintf(stderr, "ERROR: '%s' is too small\n", path);
+        goto out;
+    }
+    if (*((uint32_t*)buf) != DDS_MAGIC) {
+        fprintf(stderr, "ERROR: '%s' is not a DDS file\n", path);
+        goto out;
+    }
+    DDS_HEADER* dds_header = (DDS_HEADER*)&buf[sizeof(uint32_t)];
+    texture_size -= sizeof(uint32_t) + sizeof(DDS_HEADER);
+    uint8_t* dds_payload = (uint8_t*)&buf[sizeof(uint32_t) + sizeof(DDS_HEADER)];
+    // We may have a DXT10 additional header
+    if (dds_header->ddspf.fourCC == get_fourCC(DDS_FORMAT_DX10)) {
+        texture_size -= sizeof(DDS_HEADER_DXT10);
+        dds_payload = &dds_payload[sizeof(DDS_HEADER_DXT10)];
+    }
+    tex.mipmaps = json_object_get_uint8(texture_entry, "mipmaps");
+    if (tex.mipmaps == 0) {
+        tex.mipmaps = (uint8_t)dds_header->mipMapCount;
+    } else if ((uint8_t)dds_header->mipMapCount < tex.mipmaps) {
+        fprintf(stderr, "WARNING: Number of mipmaps from imported texture is smaller than original\n");
+        tex.mipmaps = (uint8_t)dds_header->mipMapCount;
+    } else if ((uint8_t)dds_header->mipMapCount > tex.mipmaps) {
+        fprintf(stderr, "NOTE: Truncating number of mipmaps from %d to %d\n", dds_header->mipMapCount, tex.mipmaps);
+    }
+    // Are both width and height a power of two?
+    // TODO: Also check if height/width are larger than what we can represent with dx/dy
+    bool po2_sizes = is_power_of_2(dds_header->width) && is_power_of_2(dds_header->height);
+    if (!po2_sizes && !(flags[0] & G1T_FLAG_EXTENDED_DATA)) {
+        fprintf(stderr, "ERROR: Extended data flag must be set for textures with dimensions that aren't a power of two\n");
+        goto out;
+    }
+    if (po2_sizes) {
+        tex.dx = (uint8_t)find_msb(dds_header->width);
+        tex.dy = (uint8_t)find_msb(dds_header->height);
+    }
+    // Keep the texture header as it must be written
+    g1t_tex_header tex_header = tex;
+    if (data_endianness == big_endian) {
+        tex_header.dx = tex.dy;
+        tex_header.dy = tex.dx;
+        tex_header.z_mipmaps = tex.mipmaps;
+        tex_header.mipmaps = tex.z_mipmaps;
+    } else {
+        for (size_t j = 0; j < array_size(tex.flags); j++)
+            tex_header.flags[j] = tex.flags[j] >> 4 | tex.flags[j] << 4;
+    }
+    // Extended data
+    uint32_t data[5], data_size = 0;
+    if (flags[0] & G1T_FLAG_EXTENDED_DATA) {
+        data[1] = getv32(*((uint32_t*)&depth));
+        setbe32(&data[2], (uint32_t)flags[1]);
+        data[3] = getv32(dds_header->width);
+        data[4] = getv32(dds_header->height);
+        if (!is_power_of_2(dds_header->width) || !is_power_of_2(dds_header->height))
+            data_size = 5;
+        else
+            data_size = 3;
+        data[0] = getv32(data_size * sizeof(uint32_t));
+    }
+    texture->data_size = data_size * sizeof(uint32_t);
+
+    uint32_t texture_format = get_default_texture_format(ctx->platform);
+    bool swizzled = false;
+    switch (tex.type) {
+    case 0x00: break;   // ???
+    case 0x01: break;   // ???
+    case 0x02: break;   // ???
+    case 0x03: texture_format = DDS_FORMAT_ARGB16; break;
+    case 0x04: texture_format = DDS_FORMAT_ARGB32; break;
+    case 0x06: texture_format = DDS_FORMAT_DXT1; break; // PS2??, PS3
+    case 0x07: texture_format = DDS_FORMAT_DXT3; break;
+    case 0x08: texture_format = DDS_FORMAT_DXT5; break; // PS3
+    case 0x09: swizzled = true; break;  // PS4
+//    case 0x0A: swizzled = true; break;
+    case 0x10: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;    // PSV
+    case 0x11: texture_format = DDS_FORMAT_DXT3; swizzled = true; break;    // PSV
+    case 0x12: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;    // PSV
+    case 0x21: break;   // Switch
+    // 0x3C and 0x3D are definitely 16bpp, but after that...
+    case 0x3C: texture_format = DDS_FORMAT_ARGB4; break; // 3DS
+    case 0x3D: texture_format = DDS_FORMAT_ARGB4; break; // 3DS
+    case 0x45: texture_format = DDS_FORMAT_BGR8; swizzled = true; break; // 3DS
+    case 0x59: texture_format = DDS_FORMAT_DXT1; break; // Win
+    case 0x5A: texture_format = DDS_FORMAT_DXT3; break; // Win
+    case 0x5B: texture_format = DDS_FORMAT_DXT5; break; // Win
+    case 0x5C: texture_format = DDS_FORMAT_BC4; break;  // Win
+//    case 0x5D: texture_format = DDS_FORMAT_ATI1; break;
+    case 0x5E: texture_format = DDS_FORMAT_BC6H; break; // Win
+    case 0x5F: texture_format = DDS_FORMAT_BC7; break;  // Win
+    case 0x60: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;    // PS4
+    case 0x61: texture_format = DDS_FORMAT_DXT3; swizzled = true; break;    // PS4
+    case 0x62: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;    // PS4
+//    case 0x63: texture_format = DDS_FORMAT_BC4; swizzled = true; break;
+//    case 0x64: texture_format = DDS_FORMAT_BC5; swizzled = true; break;
+//    case 0x65: texture_format = DDS_FORMAT_BC6; swizzled = true; break;
+//    case 0x66: texture_format = DDS_FORMAT_BC7; swizzled = true; break;
+    case 0x72: texture_format = DDS_FORMAT_BC7; break;   // Win
+    default:
+        fprintf(stderr, "ERROR: Unsupported texture type 0x%02x\n", tex.type);
+        goto out;
+    }
 
-    uint8_t* tmp_buf = (uint8_t*)malloc(size);
+    uint32_t expected_texture_size = 0;
+    uint32_t min_mipmap_size = dds_bpb(texture_format);
+    if (ctx->platform == NINTENDO_WIIU)
+        min_mipmap_size = 0x40 * dds_bpb(texture_format);
+    for (int j = 0; j < tex.mipmaps; j++)
+        expected_texture_size += MIPMAP_SIZE(texture_format, j, dds_header->width, dds_header->height);
+    expected_texture_size *= nb_frames;
+    bool cubemap = dds_header->caps & DDS_SURFACE_FLAGS_CUBEMAP && dds_header->caps2 & DDS_CUBEMAP_ALLFACES;
+    if (cubemap) {
+        if ((dds_header->caps2 & DDS_CUBEMAP_ALLFACES) != DDS_CUBEMAP_ALLFACES) {
+            fprintf(stderr, "ERROR: Cannot handle cube maps with missing faces\n");
+            goto out;
+        }
+        expected_texture_size *= 6;
+    }
+    if (expected_texture_size > texture_size) {
+        fprintf(stderr, "ERROR: expected_texture_size %8x > %8x\n", expected_texture_size, texture_size);
+        goto out;
+    }
+    if ((texture_size * 8) % dds_bpp(texture_format) != 0) {
+        fprintf(stderr, "ERROR: Texture size should be a multiple of %d bits\n", dds_bpp(texture_format));
+        goto out;
+    }
+    if (expected_texture_size < texture_size) {
+        // Only display the warning if we aren't truncating mipmaps
+        if ((uint8_t)dds_header->mipMapCount <= tex.mipmaps)
+            fprintf(stderr, "WARNING: Reducing texture size\n");
+        texture_size = expected_texture_size;
+    }
 
-    for (uint32_t i = 0; i <= max_line; i++)
-        memcpy(&tmp_buf[i * line_size], &buf[(max_line - i) * line_size], line_size);
+    switch (dds_header->ddspf.flags & (DDS_ALPHAPIXELS | DDS_FOURCC | DDS_RGB)) {
+    case DDS_RGBA:
+        if ((dds_header->ddspf.RGBBitCount != 16) && (dds_header->ddspf.RGBBitCount != 32) &&
+            (dds_header->ddspf.RGBBitCount != 64) && (dds_header->ddspf.RGBBitCount != 128)) {
+            fprintf(stderr, "ERROR: '%s' is not an ARGB texture we support\n", path);
+            goto out;
+        }
+        break;
+    case DDS_RGB:
+        if ((dds_header->ddspf.RGBBitCount != 24) ||
+            (dds_header->ddspf.RBitMask != 0x00ff0000) || (dds_header->ddspf.GBitMask != 0x0000ff00) ||
+            (dds_header->ddspf.BBitMask != 0x000000ff) || (dds_header->ddspf.ABitMask != 0x00000000)) {
+            fprintf(stderr, "ERROR: '%s' is not an RGB texture we support\n", path);
+            goto out;
+        }
+    case DDS_FOURCC:
+        break;
+    default:
+        fprintf(stderr, "ERROR: '%s' is not a texture we support\n", path);
+        goto out;
+    }
+
+    if (ctx->flip_image || ((ctx->platform == NINTENDO_3DS) && (tex.type == 0x09 || tex.type == 0x45))) {
+        uint8_t* flipped_data = get_scratch(arena, SCRATCH_OUTPUT, texture_size);
+        if (flipped_data == NULL)
+            goto out;
+        flip_copy(dds_bpp(texture_format), flipped_data, dds_payload, texture_size, dds_header->width,
+            0, texture_size);
+        dds_payload = flipped_data;
+    }
 
-    memcpy(buf, tmp_buf, size);
-    free(tmp_buf);
+    if (swizzled) {
+        int16_t mo = 0;     // Morton order
+        uint32_t wf = 1;    // Width factor
+        uint32_t awf = 1;   // Additional width factor
+        switch (ctx->platform) {
+        case SONY_PS4:
+        case NINTENDO_3DS:
+            mo = 3;
+            wf = 2;
+            break;
+        case NINTENDO_WIIU:
+            mo = 1;        // Same for all mipmaps
+            wf = 16 / dds_bpb(texture_format);
+            awf = 8;
+            break;
+        default:
+            mo = (int16_t)log2(min(dds_header->width / dds_bwh(texture_format) / wf,
+                    dds_header->height / dds_bwh(texture_format)));
+            break;
+        }
+        uint8_t* swizzled_data = get_scratch(arena, SCRATCH_PAYLOAD, texture_size);
+        if (swizzled_data == NULL)
+            goto out;
+        start = stats_start();
+        uint32_t offset = 0;
+        assert(mo != 0);
+        // TODO: We'll need to handle morton for texture arrays & cubemaps
+        for (int j = 0; j < tex.mipmaps && mo != 0; j++) {
+            uint32_t mipmap_size = MIPMAP_SIZE(texture_format, j, dds_header->width, dds_header->height);
+            uint32_t padded_size = max(mipmap_size, min_mipmap_size);
+            uint32_t mw = max(awf * dds_bwh(texture_format), dds_header->width / (1 << j));
+            uint32_t mh = max(awf * dds_bwh(texture_format), dds_header->height / (1 << j));
+            const uint8_t* mipmap_src = &dds_payload[offset];
+            uint8_t* mipmap_dst = &swizzled_data[offset];
+            // Mipmaps that are padded or tiled are small, so they go through the scratch buffer
+            bool tiled = (dds_header->width / (1 << j) < mw);
+            if (padded_size > mipmap_size || tiled) {
+                uint8_t* mipmap_buf = get_scratch(arena, SCRATCH_MIPMAP, 3 * (size_t)padded_size);
+                if (mipmap_buf == NULL)
+                    goto out;
+                memcpy(mipmap_buf, mipmap_src, mipmap_size);
+                memset(&mipmap_buf[mipmap_size], 0, padded_size - mipmap_size);
+                mipmap_src = mipmap_buf;
+                if (tiled) {
+                    untile(texture_format, dds_header->width / (1 << j), mw, &mipmap_buf[padded_size],
+                        mipmap_buf, padded_size);
+                    mipmap_src = &mipmap_buf[padded_size];
+                }
+                if (padded_size > mipmap_size)
+                    mipmap_dst = &mipmap_buf[2 * padded_size];
+            }
+            if (!mortonize(texture_format, mo, mw, mh, mipmap_dst, mipmap_src, padded_size, wf, arena))
+                goto out;
+            if (mipmap_dst != &swizzled_data[offset])
+                memcpy(&swizzled_data[offset], mipmap_dst, mipmap_size);
+            offset += mipmap_size;
+            if (ctx->platform != NINTENDO_WIIU)
+                mo += (mo > 0) ? -1 : +1;
+        }
+        // Mipmaps that are past the Morton order are copied as is
+        memcpy(&swizzled_data[offset], &dds_payload[offset], texture_size - offset);
+        dds_payload = swizzled_data;
+        stats_stop("swizzle", start, texture_size);
+    }
+    if (texture_format >= DDS_FORMAT_ABGR4 && texture_format <= DDS_FORMAT_RGBA8) {
+        start = stats_start();
+        rgba_convert(texture_format, "ARGB", argb_name[texture_format], dds_payload, texture_size);
+        stats_stop("rgba_convert", start, texture_size);
+    }
+
+    char dims[16] = { 0 }, props[8] = { 0 };
+    snprintf(dims, sizeof(dims), "%dx%d", dds_header->width, dds_header->height);
+    if (nb_frames > 1)
+        strcat(props, "A");     // Array
+    if (data_endianness == big_endian)
+        strcat(props, "B");
+    if (cubemap)
+        strcat(props, "C");     // Cubemap
+    if (depth != 0.0f)
+        strcat(props, "D");
+    if (props[0] == 0)
+        props[0] = '-';
+    texture->type = tex.type;
+    snprintf(texture->line, sizeof(texture->line), "%s %-10s %-7d %s\n", path, dims, tex.mipmaps, props);
+
+    if (cubemap)
+        nb_frames *= 6;     // Adjust effective nb_frames for cubemaps
+    // Now that we know the final size of the texture, lay it out the way it is written
+    texture->size = (uint32_t)sizeof(g1t_tex_header) + texture->data_size;
+    for (uint32_t l = 0; l < tex.mipmaps; l++)
+        texture->size += nb_frames *
+            max(MIPMAP_SIZE(texture_format, l, dds_header->width, dds_header->height), min_mipmap_size);
+    texture->data = malloc(texture->size);
+    if (texture->data == NULL) {
+        fprintf(stderr, "ERROR: Alloc error\n");
+        goto out;
+    }
+    memcpy(texture->data, &tex_header, sizeof(g1t_tex_header));
+    memcpy(&texture->data[sizeof(g1t_tex_header)], data, texture->data_size);
+    // Inverse operation from the one we carry when extracting DDS
+    uint32_t f_size = texture_size / nb_frames, pos = (uint32_t)sizeof(g1t_tex_header) + texture->data_size;
+    for (uint32_t l = 0, offset = 0; l < tex.mipmaps; l++) {
+        uint32_t mipmap_size = MIPMAP_SIZE(texture_format, l, dds_header->width, dds_header->height);
+        for (uint32_t f = 0; f < nb_frames; f++) {
+            memcpy(&texture->data[pos], &dds_payload[f * f_size + offset], mipmap_size);
+            pos += mipmap_size;
+            if (mipmap_size < min_mipmap_size) {
+                memset(&texture->data[pos], 0, min_mipmap_size - mipmap_size);
+                pos += min_mipmap_size - mipmap_size;
+            }
+        }
+        offset += mipmap_size;
+    }
+    assert(pos == texture->size);
+    r = true;
+
+out:
+    free(buf);
+    return r;
 }
 
-int main_utf8(int argc, char** argv)
+// A texture processed by an extraction worker
+typedef struct {
+    JSON_Value* json;       // Texture entry for the JSON data
+    char        line[320];  // Listing line, if we got that far
+    bool        done;
+    bool        fatal;      // Error that prevents the JSON data from being saved
+} extracted_texture;
+
+// Data needed by the extraction workers
+typedef struct {
+    uint8_t*            buf;
+    uint32_t            size;
+    const g1t_header*   hdr;
+    const char*         dir;
+    const char*         base_name;
+    endianness          data_endianness;
+    bool                flip_image;
+    bool                list_only;
+    scratch_arena*      arenas;     // One per thread
+    extracted_texture*  textures;
+} extract_ctx;
+
+static bool extract_texture(void* _ctx, uint32_t thread_index, uint32_t i)
+{
+    extract_ctx* ctx = (extract_ctx*)_ctx;
+    const g1t_header* hdr = ctx->hdr;
+    uint8_t* buf = ctx->buf;
+    const uint32_t* x_offset_table = (uint32_t*)&buf[hdr->header_size];
+    scratch_arena* arena = &ctx->arenas[thread_index];
+    extracted_texture* texture = &ctx->textures[i];
+    FILE* dst = NULL;
+    char path[256];
+
+    data_endianness = ctx->data_endianness;
+    uint32_t nb_frames = 0, pos = hdr->header_size + getv32(x_offset_table[i]);
+    g1t_tex_header* tex = (g1t_tex_header*)&buf[pos];
+    float depth = 0.0f;
+    if (data_endianness == big_endian) {
+        uint8_t swap_tmp = tex->dx;
+        tex->dx = tex->dy;
+        tex->dy = swap_tmp;
+        swap_tmp = tex->z_mipmaps;
+        tex->z_mipmaps = tex->mipmaps;
+        tex->mipmaps = swap_tmp;
+    } else {
+        for (size_t j = 0; j < array_size(tex->flags); j++)
+            tex->flags[j] = tex->flags[j] >> 4 | tex->flags[j] << 4;
+    }
+    if (tex->mipmaps == 0) {
+        fprintf(stderr, "ERROR: Number of mipmaps is 0\n");
+        fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
+        goto out;
+    }
+    // We're going to assume that the global flags (the ones after the G1T global header)
+    // never see a value higher than 0x00ffffff, so that we can concatenate all the main
+    // texture flags together. We're also going to assume that the 4 bytes in the extra
+    // data (after the extra data size and the depth) are additionnal flags in big-endian.
+    uint64_t flags[2] = { 0 };
+    flags[0] = (uint64_t)getp32(&buf[(uint32_t)sizeof(g1t_header) + 4 * i]);
+    if (flags[0] & 0xff000000ULL) {
+        fprintf(stderr, "ERROR: Global flags 0x%08x don't match our assertion\n", (uint32_t)flags[0]);
+        fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
+        goto out;
+    }
+    for (size_t j = 0; j < array_size(tex->flags); j++)
+        flags[0] = flags[0] << 8 | (uint64_t)tex->flags[j];
+    pos += sizeof(g1t_tex_header);
+    uint32_t width = 1 << tex->dx;
+    uint32_t height = 1 << tex->dy;
+    uint32_t data_size = (flags[0] & G1T_FLAG_EXTENDED_DATA) ? getp32(&buf[pos]) : 0;
+    if (data_size != 0 && data_size != 0x0c && data_size != 0x10 && data_size != 0x14) {
+        fprintf(stderr, "ERROR: Extra flags size of 0x%x doesn't match our assertion\n", data_size);
+        fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
+        goto out;
+    }
+    // Extra flags, including the number of frames, may be provided
+    if (data_size >= 0x0c) {
+        uint32_t _depth = getp32(&buf[pos + 4]);
+        depth = *((float*)&_depth);
+        flags[1] = getbe32(&buf[pos + 8]);
+        nb_frames = GET_NB_FRAMES(flags[1]);
+    }
+    if (nb_frames == 0)
+        nb_frames = 1;
+    // Non power-of-two width and height may be provided in the data
+    if (data_size >= 0x10)
+        width = getp32(&buf[pos + 0x0c]);
+    if (data_size >= 0x14)
+        height = getp32(&buf[pos + 0x10]);
+
+    texture->json = json_value_init_object();
+    JSON_Object* json_texture = json_object(texture->json);
+    snprintf(path, sizeof(path), "%03d.dds", i);
+    json_object_set_string(json_texture, "name", path);
+    json_object_set_number(json_texture, "type", tex->type);
+    if (tex->mipmaps != 1)
+        json_object_set_number(json_texture, "mipmaps", tex->mipmaps);
+    if (tex->z_mipmaps != 0)
+        json_object_set_number(json_texture, "z_mipmaps", tex->z_mipmaps);
+    if (nb_frames > 1)
+        json_object_set_number(json_texture, "nb_frames", nb_frames);
+    if (depth != 0.0f) {
+        char depth_str[16];
+        snprintf(depth_str, sizeof(depth_str), "%f", depth);
+        json_object_set_string(json_texture, "depth", depth_str);
+    }
+    uint32_t texture_format = get_default_texture_format(hdr->platform);
+    bool swizzled = false;
+    switch (tex->type) {
+    case 0x00: break;
+    case 0x01: break;
+    case 0x02: break;
+    case 0x03: texture_format = DDS_FORMAT_ARGB16; break;
+    case 0x04: texture_format = DDS_FORMAT_ARGB32; break;
+    case 0x06: texture_format = DDS_FORMAT_DXT1; break;
+//    case 0x07: texture_format = DDS_FORMAT_DXT3; break;
+    case 0x08: texture_format = DDS_FORMAT_DXT5; break;
+    case 0x09: swizzled = true; break;
+//    case 0x0A: swizzled = true; break;
+    case 0x10: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;
+    case 0x12: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;
+    case 0x21: break;
+    case 0x3C: texture_format = DDS_FORMAT_ARGB4; break;
+    case 0x3D: texture_format = DDS_FORMAT_ARGB4; break;
+    case 0x45: texture_format = DDS_FORMAT_BGR8; swizzled = true; break;
+    case 0x59: texture_format = DDS_FORMAT_DXT1; break;
+    case 0x5B: texture_format = DDS_FORMAT_DXT5; break;
+    case 0x5C: texture_format = DDS_FORMAT_BC4; break;
+//    case 0x5D: texture_format = DDS_FORMAT_ATI1; break;
+    case 0x5E: texture_format = DDS_FORMAT_BC6H; break;
+    case 0x5F: texture_format = DDS_FORMAT_BC7; break;
+    case 0x60: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;
+    case 0x62: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;
+//    case 0x63: texture_format = DDS_FORMAT_BC4; swizzled = true; break;
+//    case 0x64: texture_format = DDS_FORMAT_BC5; swizzled = true; break;
+//    case 0x65: texture_format = DDS_FORMAT_BC6; swizzled = true; break;
+//    case 0x66: texture_format = DDS_FORMAT_BC7; swizzled = true; break;
+    // 0x72 is not actually BC7, but that's the closest we get to semi-recognizable output
+    case 0x72: texture_format = DDS_FORMAT_BC7; break;
+    default:
+        fprintf(stderr, "ERROR: Unsupported texture type (0x%02X)\n", tex->type);
+        fprintf(stderr, "Please visit: https://github.com/VitaSmith/gust_tools/issues/51\n");
+        texture->fatal = true;
+        goto out;
+    }
+    uint32_t expected_texture_size = 0;
+    uint32_t min_mipmap_size = dds_bpb(texture_format);
+    if (hdr->platform == NINTENDO_WIIU)
+        min_mipmap_size = 0x40 * dds_bpb(texture_format);
+    for (int j = 0; j < tex->mipmaps; j++)
+        expected_texture_size += nb_frames * max(MIPMAP_SIZE(texture_format, j, width, height), min_mipmap_size);
+    uint32_t texture_size = ((i + 1 == hdr->nb_textures) ?
+        ctx->size - hdr->header_size : getv32(x_offset_table[i + 1])) - getv32(x_offset_table[i]);
+    texture_size -= (uint32_t)sizeof(g1t_tex_header);
+    if (flags[0] & G1T_FLAG_EXTENDED_DATA) {
+        assert(pos + data_size < ctx->size);
+        if ((data_size != 0x0c) && (data_size != 0x10) && (data_size != 0x14)) {
+            fprintf(stderr, "ERROR: Can't handle local extra_data of size 0x%08x\n", data_size);
+            goto out;
+        }
+        pos += data_size;
+        texture_size -= data_size;
+    }
+    if (texture_size < expected_texture_size) {
+        fprintf(stderr, "ERROR: Actual texture size is smaller than expected size\n");
+        goto out;
+    } else if (texture_size > expected_texture_size) {
+        if (texture_size % expected_texture_size != 0) {
+            fprintf(stderr, "WARNING: Actual texture size is larger than expected size by 0x%x\n",
+                texture_size - expected_texture_size);
+        } else if (texture_size / expected_texture_size == 6) {
+            // A cubemap is composed of one texture for each face
+            flags[1] |= G1T_FLAG_CUBE_MAP;
+        } else {
+            fprintf(stderr, "ERROR: Texture array with a factor of %d doesn't match our assertion\n",
+                texture_size / expected_texture_size);
+            fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
+            goto out;
+        }
+        expected_texture_size = texture_size;
+    }
+    json_object_set_value(json_texture, "flags", flags_to_json(flags));
+
+    snprintf(path, sizeof(path), "%s%s%c%03d.dds", ctx->dir, ctx->base_name, PATH_SEP, i);
+    char dims[16] = { 0 }, props[8] = { 0 };
+    snprintf(dims, sizeof(dims), "%dx%d", width, height);
+    if (flags[1] & G1T_FLAG_TEXTURE_ARRAY)
+        strcat(props, "A");
+    if (data_endianness == big_endian)
+        strcat(props, "B");
+    if (flags[1] & G1T_FLAG_CUBE_MAP)
+        strcat(props, "C");
+    if (depth != 0)
+        strcat(props, "D");
+    if (props[0] == 0)
+        props[0] = '-';
+    snprintf(texture->line, sizeof(texture->line), "0x%02x 0x%08x 0x%08x %s %-10s %-7d %s\n", tex->type,
+        hdr->header_size + hdr->extra_size + getv32(x_offset_table[i]),
+        texture_size, &path[strlen(ctx->dir)], dims, tex->mipmaps, props);
+    if (ctx->list_only) {
+        texture->done = true;
+        goto out;
+    }
+    dst = fopen_utf8(path, "wb");
+    if (dst == NULL) {
+        fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
+        goto out;
+    }
+    uint32_t dds_magic = DDS_MAGIC;
+    if (fwrite(&dds_magic, sizeof(dds_magic), 1, dst) != 1) {
+        fprintf(stderr, "ERROR: Can't write magic\n");
+        goto out;
+    }
+    if (write_dds_header(dst, texture_format, width, height,
+                         tex->mipmaps, flags) != 1) {
+        fprintf(stderr, "ERROR: Can't write DDS header\n");
+        goto out;
+    }
+
+    // Non ARGB textures require conversion to be applied, since
+    // tools like Visual Studio or PhotoShop can't be bothered
+    // to honour the pixel format from the DDS header and instead
+    // insist on using ARGB always...
+    uint64_t start;
+    if (texture_format >= DDS_FORMAT_ABGR4 && texture_format <= DDS_FORMAT_RGBA8) {
+        start = stats_start();
+        rgba_convert(texture_format, argb_name[texture_format], "ARGB", &buf[pos], expected_texture_size);
+        stats_stop("rgba_convert", start, expected_texture_size);
+    }
+    const uint8_t* data = &buf[pos];
+    if (swizzled) {
+        int16_t mo = 0;     // Morton order
+        uint32_t wf = 1;    // Width factor
+        uint32_t awf = 1;   // Additional width factor
+        switch (hdr->platform) {
+        case SONY_PS4:
+        case NINTENDO_3DS:
+            mo = -3;
+            wf = 2;
+            break;
+        case NINTENDO_WIIU:
+            mo = -1;        // Same for all mipmaps
+            wf = 16 / dds_bpb(texture_format);
+            awf = 8;
+            break;
+        default:
+            mo = -1 * (int16_t)log2(min(width / dds_bwh(texture_format) / wf,
+                height / dds_bwh(texture_format)));
+            break;
+        }
+        // Swizzle from the G1T data into a scratch buffer, rather than in place
+        uint8_t* swizzled_data = get_scratch(arena, SCRATCH_PAYLOAD, expected_texture_size);
+        start = stats_start();
+        uint32_t offset = 0;
+        assert(mo != 0);
+        for (int j = 0; j < tex->mipmaps && mo != 0 && swizzled_data != NULL; j++) {
+            uint32_t mipmap_size = max(MIPMAP_SIZE(texture_format, j, width, height), min_mipmap_size);
+            uint32_t mw = max(awf * dds_bwh(texture_format), width / (1 << j));
+            uint32_t mh = max(awf * dds_bwh(texture_format), height / (1 << j));
+            bool tiled = (width / (1 << j) < mw);
+            uint8_t* mipmap_buf = tiled ? get_scratch(arena, SCRATCH_MIPMAP, mipmap_size) : &swizzled_data[offset];
+            if (mipmap_buf == NULL ||
+                !mortonize(texture_format, mo, mw, mh, mipmap_buf, &data[offset], mipmap_size, wf, arena))
+                swizzled_data = NULL;
+            else if (tiled)
+                tile(texture_format, width / (1 << j), mw, &swizzled_data[offset], mipmap_buf, mipmap_size);
+            offset += mipmap_size;
+            if (hdr->platform != NINTENDO_WIIU)
+                mo += (mo > 0) ? -1 : +1;
+        }
+        if (swizzled_data == NULL)
+            goto out;
+        // Mipmaps that are past the Morton order are copied as is
+        memcpy(&swizzled_data[offset], &data[offset], expected_texture_size - offset);
+        data = swizzled_data;
+        stats_stop("swizzle", start, expected_texture_size);
+    }
+    bool flip_texture = ctx->flip_image ||
+        ((hdr->platform == NINTENDO_3DS) && (tex->type == 0x09 || tex->type == 0x45));
+    // DDS expects the mipmaps of a texture array or cubemap to immediately follow
+    // the main one, but G1T instead stores all mains, then all L1 mipmaps, then
+    // all L2 mipmaps and so on... Thus we need to manually reorder the mipmaps.
+    // This is done, along with flipping, as a single copy into the DDS payload,
+    // which we can skip altogether if the G1T data is already in DDS order.
+    if (flags[1] & G1T_FLAG_CUBE_MAP)
+        nb_frames *= 6;     // Adjust effective nb_frames for cubemaps
+    uint32_t dds_size = 0;
+    bool in_order = !flip_texture && (nb_frames == 1);
+    for (uint32_t l = 0; l < tex->mipmaps; l++) {
+        dds_size += nb_frames * MIPMAP_SIZE(texture_format, l, width, height);
+        if (MIPMAP_SIZE(texture_format, l, width, height) < min_mipmap_size)
+            in_order = false;
+    }
+    const uint8_t* dds_data = data;
+    if (!in_order) {
+        uint8_t* dds_buf = get_scratch(arena, SCRATCH_OUTPUT, dds_size);
+        if (dds_buf == NULL)
+            goto out;
+        start = stats_start();
+        for (uint32_t f = 0, dds_pos = 0; f < nb_frames; f++) {
+            for (uint32_t l = 0, offset = 0; l < tex->mipmaps; l++) {
+                uint32_t mipmap_size = max(MIPMAP_SIZE(texture_format, l, width, height), min_mipmap_size);
+                uint32_t size = MIPMAP_SIZE(texture_format, l, width, height);
+                offset += f * mipmap_size;
+                if (flip_texture)
+                    flip_copy(dds_bpp(texture_format), &dds_buf[dds_pos], data, expected_texture_size,
+                        width, offset, size);
+                else
+                    memcpy(&dds_buf[dds_pos], &data[offset], size);
+                dds_pos += size;
+                offset += (nb_frames - f) * mipmap_size;
+            }
+        }
+        dds_data = dds_buf;
+        stats_stop(flip_texture ? "flip" : "reorder", start, dds_size);
+    }
+    start = stats_start();
+    if (fwrite(dds_data, 1, dds_size, dst) != dds_size) {
+        fprintf(stderr, "ERROR: Can't write DDS data\n");
+        texture->fatal = true;
+        goto out;
+    }
+    stats_stop("write", start, dds_size);
+    texture->done = true;
+
+out:
+    if (dst != NULL)
+        fclose(dst);
+    return texture->done;
+}
+
+int gust_g1t_process_file(const char* input_path, const g1t_options* opt)
 {
     int r = -1;
     FILE *file = NULL;
     uint8_t* buf = NULL;
     uint32_t *offset_table = NULL, *flag_table = NULL;
-    uint32_t magic;
-    char path[256], *dir = NULL;
+    uint32_t magic, nb_textures = 0, nb_arenas = 0;
+    char path[256], *input = NULL, *dir = NULL, *base_name = NULL, *g1t_name = NULL;
     JSON_Value* json = NULL;
-    bool list_only = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'l');
-    bool flip_image = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'f');
-    bool no_prompt = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'y');
-
-    if ((argc != 2) && !list_only && !flip_image && !no_prompt) {
-        printf("%s %s (c) 2019-2022 VitaSmith\n\n"
-            "Usage: %s [-l] [-f] [-y] <file or directory>\n\n"
-            "Extracts (file) or recreates (directory) a Gust .g1t texture archive.\n\n"
-            "Note: A backup (.bak) of the original is automatically created, when the target\n"
-            "is being overwritten for the first time.\n",
-            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]));
-        return 0;
-    }
-
-    if (is_directory(argv[argc - 1])) {
+    JSON_Writer* writer = NULL;
+    scratch_arena* arenas = NULL;
+    created_texture* created_textures = NULL;
+    extracted_texture* extracted_textures = NULL;
+    const bool list_only = opt->list_only;
+    const uint32_t nb_threads = opt->nb_threads;
+    bool flip_image = opt->flip_image;
+
+    // We alter the path, and the endianness may remain from a previous file of this thread
+    input = strdup(input_path);
+    if (input == NULL)
+        goto out;
+    data_endianness = little_endian;
+    init_rgba_kernels();
+
+    if (is_directory(input)) {
         if (list_only) {
             fprintf(stderr, "ERROR: Option -l is not supported when creating an archive\n");
             goto out;
         }
-        snprintf(path, sizeof(path), "%s%cg1t.json", argv[argc - 1], PATH_SEP);
+        snprintf(path, sizeof(path), "%s%cg1t.json", input, PATH_SEP);
         if (!is_file(path)) {
             fprintf(stderr, "ERROR: '%s' does not exist\n", path);
             goto out;
         }
+        uint64_t start = stats_start();
         json = json_parse_file_with_comments(path);
         if (json == NULL) {
             fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", path);
             goto out;
         }
+        stats_stop("json_read", start, 0);
         const uint32_t json_version = json_object_get_uint32(json_object(json), "json_version");
         if (json_version != JSON_VERSION) {
             fprintf(stderr, "ERROR: This utility is not compatible with the JSON file provided.\n"
@@ -629,7 +1554,7 @@ int main_utf8(int argc, char** argv)
         }
         JSON_Array* json_extra_data_array = json_object_get_array(json_object(json), "extra_data");
 
-        strcpy(path, argv[argc - 1]);
+        strcpy(path, input);
         if (get_trailing_slash(path) != 0)
             path[get_trailing_slash(path)] = 0;
         else
@@ -638,11 +1563,6 @@ int main_utf8(int argc, char** argv)
         path[sizeof(path) - 1] = 0;
         printf("Creating '%s'...\n", path);
         create_backup(path);
-        file = fopen_utf8(path, "wb+");
-        if (file == NULL) {
-            fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
-            goto out;
-        }
         g1t_header hdr = { 0 };
         if (name_to_platform(json_object_get_string(json_object(json), "platform")) == UINT32_MAX)
             hdr.platform = json_object_get_uint32(json_object(json), "platform");
@@ -654,35 +1574,74 @@ int main_utf8(int argc, char** argv)
         char version_string[6] = { 0 };
         snprintf(version_string, sizeof(version_string), "%04d", version);
         hdr.version = getbe32(version_string);
-        hdr.total_size = 0;  // To be rewritten when we're done
         hdr.nb_textures = (uint32_t)json_array_get_count(json_textures_array);
-
         hdr.extra_size = (uint32_t)json_array_get_count(json_extra_data_array) * sizeof(uint16_t);
         hdr.header_size = sizeof(hdr) + hdr.nb_textures * sizeof(uint32_t);
+
+        if (!flip_image)
+            flip_image = json_object_get_boolean(json_object(json), "flip");
+
+        printf("TYPE OFFSET     SIZE       NAME");
+        dir = strdup(input);
+        base_name = strdup(_basename(input));
+        if (dir == NULL || base_name == NULL) {
+            fprintf(stderr, "ERROR: Alloc error\n");
+            goto out;
+        }
+        dir[get_trailing_slash(dir)] = 0;
+        for (size_t i = 0; i < strlen(base_name); i++)
+            putchar(' ');
+        printf("     DIMENSIONS MIPMAPS PROPS\n");
+
+        // Convert all the DDS files into their G1T layout, then compute the offsets
+        nb_textures = hdr.nb_textures;
+        nb_arenas = max(min(nb_threads, nb_textures), 1);
+        arenas = calloc(nb_arenas, sizeof(scratch_arena));
+        created_textures = calloc(max(nb_textures, 1), sizeof(created_texture));
+        flag_table = calloc(max(nb_textures, 1), sizeof(uint32_t));
+        offset_table = calloc(max(nb_textures, 1), sizeof(uint32_t));
+        if (arenas == NULL || created_textures == NULL || flag_table == NULL || offset_table == NULL) {
+            fprintf(stderr, "ERROR: Alloc error\n");
+            goto out;
+        }
+        create_ctx ctx = { json_textures_array, dir, base_name, hdr.platform, data_endianness,
+            flip_image, arenas, created_textures };
+        bool converted = run_jobs(nb_threads, nb_textures, create_texture, &ctx);
+        uint32_t offset = hdr.nb_textures * sizeof(uint32_t) + hdr.extra_size;
+        for (uint32_t i = 0; i < nb_textures && created_textures[i].data != NULL; i++) {
+            offset_table[i] = offset;
+            flag_table[i] = created_textures[i].flags;
+            printf("0x%02x 0x%08x 0x%08x %s", created_textures[i].type, hdr.header_size + offset_table[i],
+                created_textures[i].data_size, created_textures[i].line);
+            offset += created_textures[i].size;
+        }
+        if (!converted)
+            goto out;
+        hdr.total_size = hdr.header_size + offset;
+
+        // Now write the whole archive in a single pass
+        start = stats_start();
+        file = create_file(path, hdr.total_size);
+        if (file == NULL) {
+            fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
+            goto out;
+        }
         fix_endian32(&hdr, sizeof(hdr) / sizeof(uint32_t));
         if (fwrite(&hdr, sizeof(uint32_t), sizeof(hdr) / sizeof(uint32_t), file) != sizeof(hdr) / sizeof(uint32_t)) {
             fprintf(stderr, "ERROR: Can't write header\n");
             goto out;
         }
         fix_endian32(&hdr, sizeof(hdr) / sizeof(uint32_t));
-
-        if (!flip_image)
-            flip_image = json_object_get_boolean(json_object(json), "flip");
-
-        // Create the placeholders for the global flags and offset table
-        flag_table = calloc(hdr.nb_textures, sizeof(uint32_t));
-        if (fwrite(flag_table, sizeof(uint32_t), hdr.nb_textures, file) != hdr.nb_textures) {
+        fix_endian32(flag_table, nb_textures);
+        if (fwrite(flag_table, sizeof(uint32_t), nb_textures, file) != nb_textures) {
             fprintf(stderr, "ERROR: Can't write global flags\n");
             goto out;
         }
-
-        offset_table = calloc(hdr.nb_textures, sizeof(uint32_t));
-        offset_table[0] = hdr.nb_textures * sizeof(uint32_t);
-        if (fwrite(offset_table, sizeof(uint32_t), hdr.nb_textures, file) != hdr.nb_textures) {
+        fix_endian32(offset_table, nb_textures);
+        if (fwrite(offset_table, sizeof(uint32_t), nb_textures, file) != nb_textures) {
             fprintf(stderr, "ERROR: Can't write texture offsets\n");
             goto out;
         }
-
         // Deal with the global extra data array
         for (size_t i = 0; i < json_array_get_count(json_extra_data_array); i++) {
             uint16_t extra_data = getv16(json_array_get_uint16(json_extra_data_array, i));
@@ -691,353 +1650,32 @@ int main_utf8(int argc, char** argv)
                 goto out;
             }
         }
-
-        printf("TYPE OFFSET     SIZE       NAME");
-        dir = strdup(argv[argc - 1]);
-        if (dir == NULL) {
-            fprintf(stderr, "ERROR: Alloc error\n");
-            goto out;
-        }
-        dir[get_trailing_slash(dir)] = 0;
-        for (size_t i = 0; i < strlen(_basename(argv[argc - 1])); i++)
-            putchar(' ');
-        printf("     DIMENSIONS MIPMAPS PROPS\n");
-        for (uint32_t i = 0; i < hdr.nb_textures; i++) {
-            offset_table[i] = ftell(file) - hdr.header_size;
-            JSON_Object* texture_entry = json_array_get_object(json_textures_array, i);
-            g1t_tex_header tex = { 0 };
-            tex.type = json_object_get_uint8(texture_entry, "type");
-            tex.z_mipmaps = json_object_get_uint8(texture_entry, "z_mipmaps");
-            const char* depth_str = json_object_get_string(texture_entry, "depth");
-            float depth = (depth_str == NULL) ? 0.0f : (float)atof(depth_str);
-            uint64_t flags[2];
-            json_to_flags(flags, json_object_get_array(texture_entry, "flags"));
-            for (size_t j = 0; j < array_size(tex.flags); j++)
-                tex.flags[array_size(tex.flags) - j - 1] = (uint8_t)(flags[0] >> (8 * j));
-            flag_table[i] = (uint32_t)(flags[0] >> 40);
-            uint32_t nb_frames = json_object_get_uint32(texture_entry, "nb_frames");
-            flags[1] |= ((uint64_t)nb_frames & 0x0f) << 28 | ((uint64_t)nb_frames & 0xf0) << 12;
-            if (nb_frames == 0)
-                nb_frames = 1;
-            // Read the DDS file
-            snprintf(path, sizeof(path), "%s%s%c%s", dir, _basename(argv[argc - 1]), PATH_SEP,
-                json_object_get_string(texture_entry, "name"));
-            uint32_t texture_size = read_file(path, &buf);
-            if (texture_size == UINT32_MAX)
-                goto out;
-            if (texture_size <= sizeof(DDS_HEADER)) {
-                fprintf(stderr, "ERROR: '%s' is too small\n", path);
-                goto out;
-            }
-            if (*((uint32_t*)buf) != DDS_MAGIC) {
-                fprintf(stderr, "ERROR: '%s' is not a DDS file\n", path);
+        for (uint32_t i = 0; i < nb_textures; i++) {
+            if (fwrite(created_textures[i].data, 1, created_textures[i].size, file) != created_textures[i].size) {
+                fprintf(stderr, "ERROR: Can't write texture data\n");
                 goto out;
             }
-            DDS_HEADER* dds_header = (DDS_HEADER*)&buf[sizeof(uint32_t)];
-            texture_size -= sizeof(uint32_t) + sizeof(DDS_HEADER);
-            uint8_t* dds_payload = (uint8_t*)&buf[sizeof(uint32_t) + sizeof(DDS_HEADER)];
-            // We may have a DXT10 additional header
-            if (dds_header->ddspf.fourCC == get_fourCC(DDS_FORMAT_DX10)) {
-                texture_size -= sizeof(DDS_HEADER_DXT10);
-                dds_payload = &dds_payload[sizeof(DDS_HEADER_DXT10)];
-            }
-            tex.mipmaps = json_object_get_uint8(texture_entry, "mipmaps");
-            if (tex.mipmaps == 0) {
-                tex.mipmaps = (uint8_t)dds_header->mipMapCount;
-            } else if ((uint8_t)dds_header->mipMapCount < tex.mipmaps) {
-                fprintf(stderr, "WARNING: Number of mipmaps from imported texture is smaller than original\n");
-                tex.mipmaps = (uint8_t)dds_header->mipMapCount;
-            } else if ((uint8_t)dds_header->mipMapCount > tex.mipmaps) {
-                fprintf(stderr, "NOTE: Truncating number of mipmaps from %d to %d\n", dds_header->mipMapCount, tex.mipmaps);
-            }
-            // Are both width and height a power of two?
-            // TODO: Also check if height/width are larger than what we can represent with dx/dy
-            bool po2_sizes = is_power_of_2(dds_header->width) && is_power_of_2(dds_header->height);
-            if (!po2_sizes && !(flags[0] & G1T_FLAG_EXTENDED_DATA)) {
-                fprintf(stderr, "ERROR: Extended data flag must be set for textures with dimensions that aren't a power of two\n");
-                goto out;
-            }
-            if (po2_sizes) {
-                tex.dx = (uint8_t)find_msb(dds_header->width);
-                tex.dy = (uint8_t)find_msb(dds_header->height);
-            }
-            if (data_endianness == big_endian) {
-                uint8_t swap_tmp = tex.dx;
-                tex.dx = tex.dy;
-                tex.dy = swap_tmp;
-                swap_tmp = tex.z_mipmaps;
-                tex.z_mipmaps = tex.mipmaps;
-                tex.mipmaps = swap_tmp;
-            } else {
-                for (size_t j = 0; j < array_size(tex.flags); j++)
-                    tex.flags[j] = tex.flags[j] >> 4 | tex.flags[j] << 4;
-            }
-            // Write texture header
-            if (fwrite(&tex, sizeof(tex), 1, file) != 1) {
-                fprintf(stderr, "ERROR: Can't write texture header\n");
-                goto out;
-            }
-            // Swap back tex.mipmaps for the rest of our processing
-            if (data_endianness != platform_endianness) {
-                uint8_t swap_tmp = tex.z_mipmaps;
-                tex.z_mipmaps = tex.mipmaps;
-                tex.mipmaps = swap_tmp;
-            }
-            // Write data
-            if (flags[0] & G1T_FLAG_EXTENDED_DATA) {
-                uint32_t data[5], data_size;
-                data[1] = getv32(*((uint32_t*)&depth));
-                setbe32(&data[2], (uint32_t)flags[1]);
-                data[3] = getv32(dds_header->width);
-                data[4] = getv32(dds_header->height);
-                if (!is_power_of_2(dds_header->width) || !is_power_of_2(dds_header->height))
-                    data_size = 5;
-                else
-                    data_size = 3;
-                data[0] = getv32(data_size * sizeof(uint32_t));
-                if (fwrite(data, sizeof(uint32_t), data_size, file) != data_size) {
-                    fprintf(stderr, "ERROR: Can't write extended data\n");
-                    goto out;
-                }
-            }
-
-            // Set the default ARGB format for the platform
-            uint32_t default_texture_format;
-            switch (hdr.platform) {
-            case NINTENDO_DS:
-            case NINTENDO_3DS:
-            case SONY_PS4:
-                default_texture_format = DDS_FORMAT_GRAB8;
-                break;
-            case SONY_PSV:
-            case NINTENDO_SWITCH:
-                default_texture_format = DDS_FORMAT_ARGB8;
-                break;
-            default:    // PC and other platforms
-                default_texture_format = DDS_FORMAT_RGBA8;
-                break;
-            }
-            uint32_t texture_format = default_texture_format;
-            bool swizzled = false;
-            switch (tex.type) {
-            case 0x00: break;   // ???
-            case 0x01: break;   // ???
-            case 0x02: break;   // ???
-            case 0x03: texture_format = DDS_FORMAT_ARGB16; break;
-            case 0x04: texture_format = DDS_FORMAT_ARGB32; break;
-            case 0x06: texture_format = DDS_FORMAT_DXT1; break; // PS2??, PS3
-            case 0x07: texture_format = DDS_FORMAT_DXT3; break;
-            case 0x08: texture_format = DDS_FORMAT_DXT5; break; // PS3
-            case 0x09: swizzled = true; break;  // PS4
-//            case 0x0A: swizzled = true; break;
-            case 0x10: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;    // PSV
-            case 0x11: texture_format = DDS_FORMAT_DXT3; swizzled = true; break;    // PSV
-            case 0x12: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;    // PSV
-            case 0x21: break;   // Switch
-            // 0x3C and 0x3D are definitely 16bpp, but after that...
-            case 0x3C: texture_format = DDS_FORMAT_ARGB4; break; // 3DS
-            case 0x3D: texture_format = DDS_FORMAT_ARGB4; break; // 3DS
-            case 0x45: texture_format = DDS_FORMAT_BGR8; swizzled = true; break; // 3DS
-            case 0x59: texture_format = DDS_FORMAT_DXT1; break; // Win
-            case 0x5A: texture_format = DDS_FORMAT_DXT3; break; // Win
-            case 0x5B: texture_format = DDS_FORMAT_DXT5; break; // Win
-            case 0x5C: texture_format = DDS_FORMAT_BC4; break;  // Win
-//            case 0x5D: texture_format = DDS_FORMAT_ATI1; break;
-            case 0x5E: texture_format = DDS_FORMAT_BC6H; break; // Win
-            case 0x5F: texture_format = DDS_FORMAT_BC7; break;  // Win
-            case 0x60: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;    // PS4
-            case 0x61: texture_format = DDS_FORMAT_DXT3; swizzled = true; break;    // PS4
-            case 0x62: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;    // PS4
-//            case 0x63: texture_format = DDS_FORMAT_BC4; swizzled = true; break;
-//            case 0x64: texture_format = DDS_FORMAT_BC5; swizzled = true; break;
-//            case 0x65: texture_format = DDS_FORMAT_BC6; swizzled = true; break;
-//            case 0x66: texture_format = DDS_FORMAT_BC7; swizzled = true; break;
-            case 0x72: texture_format = DDS_FORMAT_BC7; break;   // Win
-            default:
-                fprintf(stderr, "ERROR: Unsupported texture type 0x%02x\n", tex.type);
-                goto out;
-            }
-
-            uint32_t expected_texture_size = 0;
-            uint32_t min_mipmap_size = dds_bpb(texture_format);
-            if (hdr.platform == NINTENDO_WIIU)
-                min_mipmap_size = 0x40 * dds_bpb(texture_format);
-            for (int j = 0; j < tex.mipmaps; j++)
-                expected_texture_size += MIPMAP_SIZE(texture_format, j, dds_header->width, dds_header->height);
-            expected_texture_size *= nb_frames;
-            bool cubemap = dds_header->caps & DDS_SURFACE_FLAGS_CUBEMAP && dds_header->caps2 & DDS_CUBEMAP_ALLFACES;
-            if (cubemap) {
-                if ((dds_header->caps2 & DDS_CUBEMAP_ALLFACES) != DDS_CUBEMAP_ALLFACES) {
-                    fprintf(stderr, "ERROR: Cannot handle cube maps with missing faces\n");
-                    goto out;
-                }
-                expected_texture_size *= 6;
-            }
-            if (expected_texture_size > texture_size) {
-                fprintf(stderr, "ERROR: expected_texture_size %8x > %8x\n", expected_texture_size, texture_size);
-                goto out;
-            }
-            if ((texture_size * 8) % dds_bpp(texture_format) != 0) {
-                fprintf(stderr, "ERROR: Texture size should be a multiple of %d bits\n", dds_bpp(texture_format));
-                goto out;
-            }
-            if (expected_texture_size < texture_size) {
-                // Only display the warning if we aren't truncating mipmaps
-                if ((uint8_t)dds_header->mipMapCount <= tex.mipmaps)
-                    fprintf(stderr, "WARNING: Reducing texture size\n");
-                texture_size = expected_texture_size;
-            }
-
-            switch (dds_header->ddspf.flags & (DDS_ALPHAPIXELS | DDS_FOURCC | DDS_RGB)) {
-            case DDS_RGBA:
-                if ((dds_header->ddspf.RGBBitCount != 16) && (dds_header->ddspf.RGBBitCount != 32) &&
-                    (dds_header->ddspf.RGBBitCount != 64) && (dds_header->ddspf.RGBBitCount != 128)) {
-                    fprintf(stderr, "ERROR: '%s' is not an ARGB texture we support\n", path);
-                    goto out;
-                }
-                break;
-            case DDS_RGB:
-                if ((dds_header->ddspf.RGBBitCount != 24) ||
-                    (dds_header->ddspf.RBitMask != 0x00ff0000) || (dds_header->ddspf.GBitMask != 0x0000ff00) ||
-                    (dds_header->ddspf.BBitMask != 0x000000ff) || (dds_header->ddspf.ABitMask != 0x00000000)) {
-                    fprintf(stderr, "ERROR: '%s' is not an RGB texture we support\n", path);
-                    goto out;
-                }
-            case DDS_FOURCC:
-                break;
-            default:
-                fprintf(stderr, "ERROR: '%s' is not a texture we support\n", path);
-                goto out;
-            }
-
-            if (flip_image || ((hdr.platform == NINTENDO_3DS) && (tex.type == 0x09 || tex.type == 0x45)))
-                flip(dds_bpp(texture_format), dds_payload, texture_size, dds_header->width);
-
-            if (swizzled) {
-                int16_t mo = 0;     // Morton order
-                uint32_t wf = 1;    // Width factor
-                uint32_t awf = 1;   // Additional width factor
-                switch (hdr.platform) {
-                case SONY_PS4:
-                case NINTENDO_3DS:
-                    mo = 3;
-                    wf = 2;
-                    break;
-                case NINTENDO_WIIU:
-                    mo = 1;        // Same for all mipmaps
-                    wf = 16 / dds_bpb(texture_format);
-                    awf = 8;
-                    break;
-                default:
-                    mo = (int16_t)log2(min(dds_header->width / dds_bwh(texture_format) / wf,
-                            dds_header->height / dds_bwh(texture_format)));
-                    break;
-                }
-                uint32_t offset = 0;
-                assert(mo != 0);
-                // TODO: We'll need to handle morton for texture arrays & cubemaps
-                for (int j = 0; j < tex.mipmaps && mo != 0; j++) {
-                    uint32_t mipmap_size = MIPMAP_SIZE(texture_format, j, dds_header->width, dds_header->height);
-                    uint32_t mw = max(awf * dds_bwh(texture_format), dds_header->width / (1 << j));
-                    uint32_t mh = max(awf * dds_bwh(texture_format), dds_header->height / (1 << j));
-                    uint8_t* mipmap_buf = calloc(max(mipmap_size, min_mipmap_size), 1);
-                    if (mipmap_buf == NULL)
-                        goto out;
-                    memcpy(mipmap_buf, &dds_payload[offset], mipmap_size);
-                    if (dds_header->width / (1 << j) < mw)
-                        untile(texture_format, dds_header->width / (1 << j), mw, mipmap_buf, max(min_mipmap_size, mipmap_size));
-                    mortonize(texture_format, mo, mw, mh, mipmap_buf, max(mipmap_size, min_mipmap_size), wf);
-                    memcpy(&dds_payload[offset], mipmap_buf, mipmap_size);
-                    free(mipmap_buf);
-                    offset += mipmap_size;
-                    if (hdr.platform != NINTENDO_WIIU)
-                        mo += (mo > 0) ? -1 : +1;
-                }
-            }
-            if (texture_format >= DDS_FORMAT_ABGR4 && texture_format <= DDS_FORMAT_RGBA8)
-                rgba_convert(texture_format, "ARGB", argb_name[texture_format], dds_payload, texture_size);
-
-            char dims[16] = { 0 }, props[8] = { 0 };
-            snprintf(dims, sizeof(dims), "%dx%d", dds_header->width, dds_header->height);
-            if (nb_frames > 1)
-                strcat(props, "A");     // Array
-            if (data_endianness == big_endian)
-                strcat(props, "B");
-            if (cubemap)
-                strcat(props, "C");     // Cubemap
-            if (depth != 0.0f)
-                strcat(props, "D");
-            if (props[0] == 0)
-                props[0] = '-';
-            printf("0x%02x 0x%08x 0x%08x %s %-10s %-7d %s\n", tex.type, getv32(hdr.header_size) + offset_table[i],
-                (uint32_t)ftell(file) - offset_table[i] - getv32(hdr.header_size) - (uint32_t)sizeof(g1t_tex_header),
-                path, dims, tex.mipmaps, props);
-
-            if (cubemap)
-                nb_frames *= 6;     // Adjust effective nb_frames for cubemaps
-            // Inverse operation from the one we carry when extracting DDS
-            uint32_t f_size = texture_size / nb_frames;
-            for (uint32_t l = 0, offset = 0; l < tex.mipmaps; l++) {
-                uint32_t mipmap_size = MIPMAP_SIZE(texture_format, l, dds_header->width, dds_header->height);
-                for (uint32_t f = 0; f < nb_frames; f++) {
-                    if (fwrite(&dds_payload[f * f_size + offset], mipmap_size, 1, file) != 1) {
-                        fprintf(stderr, "ERROR: Can't write DDS data\n");
-                        goto out;
-                    }
-                    if (mipmap_size < min_mipmap_size) {
-                        uint8_t* completion_buf = calloc(min_mipmap_size - mipmap_size, 1);
-                        if (completion_buf == NULL)
-                            goto out;
-                        if (fwrite(completion_buf, min_mipmap_size - mipmap_size, 1, file) != 1) {
-                            fprintf(stderr, "ERROR: Can't write DDS data\n");
-                            goto out;
-                        }
-                        free(completion_buf);
-                    }
-                }
-                offset += mipmap_size;
-            }
-            free(buf);
-            buf = NULL;
-        }
-        // Update total size
-        uint32_t total_size = getv32(ftell(file));
-        fseek(file, 2 * sizeof(uint32_t), SEEK_SET);
-        if (fwrite(&total_size, sizeof(uint32_t), 1, file) != 1) {
-            fprintf(stderr, "ERROR: Can't update total size\n");
-            goto out;
-        }
-        // Update flag and offset tables
-        fseek(file, sizeof(hdr), SEEK_SET);
-        fix_endian32(flag_table, hdr.nb_textures);
-        if (fwrite(flag_table, sizeof(uint32_t), hdr.nb_textures, file) != hdr.nb_textures) {
-            fprintf(stderr, "ERROR: Can't update global flags\n");
-            goto out;
-        }
-        fix_endian32(offset_table, hdr.nb_textures);
-        if (fwrite(offset_table, sizeof(uint32_t), hdr.nb_textures, file) != hdr.nb_textures) {
-            fprintf(stderr, "ERROR: Can't update texture offsets\n");
-            goto out;
         }
+        stats_stop("write", start, hdr.total_size);
         r = 0;
     } else {
-        printf("%s '%s'...\n", list_only ? "Listing" : "Extracting", argv[argc - 1]);
-        size_t len = strlen(argv[argc - 1]);
-        if ((len < 4) || (argv[argc - 1][len - 4] != '.') || (argv[argc - 1][len - 3] != 'g') ||
-            ((argv[argc - 1][len - 2] != '1') && (argv[argc - 1][len - 2] != 't')) ||
-            ((argv[argc - 1][len - 1] != '1') && (argv[argc - 1][len - 1] != 't')) ) {
+        printf("%s '%s'...\n", list_only ? "Listing" : "Extracting", input);
+        size_t len = strlen(input);
+        if ((len < 4) || (input[len - 4] != '.') || (input[len - 3] != 'g') ||
+            ((input[len - 2] != '1') && (input[len - 2] != 't')) ||
+            ((input[len - 1] != '1') && (input[len - 1] != 't')) ) {
             fprintf(stderr, "ERROR: File should have a '.g1t' or 'gt1' extension\n");
             goto out;
         }
-        char* g1t_pos = &argv[argc - 1][len - 4];
-        file = fopen_utf8(argv[argc - 1], "rb");
+        char* g1t_pos = &input[len - 4];
+        file = fopen_utf8(input, "rb");
         if (file == NULL) {
-            fprintf(stderr, "ERROR: Can't open file '%s'\n", argv[argc - 1]);
+            fprintf(stderr, "ERROR: Can't open file '%s'\n", input);
             goto out;
         }
 
         if (fread(&magic, sizeof(magic), 1, file) != 1) {
-            fprintf(stderr, "ERROR: Can't read from '%s'\n", argv[argc - 1]);
+            fprintf(stderr, "ERROR: Can't read from '%s'\n", input);
             goto out;
         }
         if ((magic != G1TG_MAGIC) && (magic != bswap_uint32(G1TG_MAGIC))) {
@@ -1053,10 +1691,12 @@ int main_utf8(int argc, char** argv)
         buf = malloc(g1t_size);
         if (buf == NULL)
             goto out;
+        uint64_t start = stats_start();
         if (fread(buf, 1, g1t_size, file) != g1t_size) {
             fprintf(stderr, "ERROR: Can't read file\n");
             goto out;
         }
+        stats_stop("read", start, g1t_size);
 
         g1t_header* hdr = (g1t_header*)buf;
         fix_endian32(hdr, sizeof(g1t_header) / sizeof(uint32_t));
@@ -1084,329 +1724,161 @@ int main_utf8(int argc, char** argv)
             goto out;
         }
 
-        uint32_t* x_offset_table = (uint32_t*)&buf[hdr->header_size];
-
-        // Keep the information required to recreate the archive in a JSON file
-        json = json_value_init_object();
-        json_object_set_number(json_object(json), "json_version", JSON_VERSION);
-        json_object_set_string(json_object(json), "name", _basename(argv[argc - 1]));
-        json_object_set_number(json_object(json), "version", version);
-        if (platform_to_name(hdr->platform) != NULL)
-            json_object_set_string(json_object(json), "platform", platform_to_name(hdr->platform));
-        else
-            json_object_set_number(json_object(json), "platform", hdr->platform);
-        if (flip_image)
-            json_object_set_boolean(json_object(json), "flip", true);
-
+        g1t_name = strdup(_basename(input));
         g1t_pos[0] = 0;
-        if (!list_only && !create_path(argv[argc - 1]))
+        if (g1t_name == NULL) {
+            fprintf(stderr, "ERROR: Alloc error\n");
+            goto out;
+        }
+        if (!list_only && !create_path(input))
             goto out;
-
-        JSON_Value* json_extra_data_array = json_value_init_array();
-        JSON_Value* json_textures_array = json_value_init_array();
-
-        for (uint16_t i = 0; i < hdr->extra_size; i += sizeof(uint16_t))
-            json_array_append_number(json_array(json_extra_data_array),
-                getp16(&buf[hdr->header_size + hdr->nb_textures * sizeof(uint32_t) + i]));
 
         printf("TYPE OFFSET     SIZE       NAME");
-        for (size_t i = 0; i < strlen(_basename(argv[argc - 1])); i++)
+        for (size_t i = 0; i < strlen(_basename(input)); i++)
             putchar(' ');
         printf("     DIMENSIONS MIPMAPS PROPS\n");
-        dir = strdup(argv[argc - 1]);
-        if (dir == NULL) {
+        dir = strdup(input);
+        base_name = strdup(_basename(input));
+        if (dir == NULL || base_name == NULL) {
             fprintf(stderr, "ERROR: Alloc error\n");
             goto out;
         }
         dir[get_trailing_slash(dir)] = 0;
 
-        // Set the default RGBA texture format for the platform
-        uint32_t default_texture_format;
-        switch (hdr->platform) {
-        case NINTENDO_DS:
-        case NINTENDO_3DS:
-        case SONY_PS4:
-            default_texture_format = DDS_FORMAT_GRAB8;
-            break;
-        case SONY_PSV:
-        case NINTENDO_SWITCH:
-            default_texture_format = DDS_FORMAT_ARGB8;
-            break;
-        default:    // PC and other platforms
-            default_texture_format = DDS_FORMAT_RGBA8;
-            break;
+        // Decode and write the textures concurrently, then report them in order
+        nb_textures = hdr->nb_textures;
+        nb_arenas = max(min(nb_threads, nb_textures), 1);
+        arenas = calloc(nb_arenas, sizeof(scratch_arena));
+        extracted_textures = calloc(max(nb_textures, 1), sizeof(extracted_texture));
+        if (arenas == NULL || extracted_textures == NULL) {
+            fprintf(stderr, "ERROR: Alloc error\n");
+            goto out;
         }
-
+        extract_ctx ctx = { buf, g1t_size, hdr, dir, base_name, data_endianness, flip_image, list_only,
+            arenas, extracted_textures };
+        run_jobs(nb_threads, nb_textures, extract_texture, &ctx);
         uint32_t i;
-        for (i = 0; i < hdr->nb_textures; i++) {
-            uint32_t nb_frames = 0, pos = hdr->header_size + getv32(x_offset_table[i]);
-            g1t_tex_header* tex = (g1t_tex_header*)&buf[pos];
-            float depth = 0.0f;
-            if (data_endianness == big_endian) {
-                uint8_t swap_tmp = tex->dx;
-                tex->dx = tex->dy;
-                tex->dy = swap_tmp;
-                swap_tmp = tex->z_mipmaps;
-                tex->z_mipmaps = tex->mipmaps;
-                tex->mipmaps = swap_tmp;
-            } else {
-                for (size_t j = 0; j < array_size(tex->flags); j++)
-                    tex->flags[j] = tex->flags[j] >> 4 | tex->flags[j] << 4;
-            }
-            if (tex->mipmaps == 0) {
-                fprintf(stderr, "ERROR: Number of mipmaps is 0\n");
-                fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-                break;
-            }
-            // We're going to assume that the global flags (the ones after the G1T global header)
-            // never see a value higher than 0x00ffffff, so that we can concatenate all the main
-            // texture flags together. We're also going to assume that the 4 bytes in the extra
-            // data (after the extra data size and the depth) are additionnal flags in big-endian.
-            uint64_t flags[2] = { 0 };
-            flags[0] = (uint64_t)getp32(&buf[(uint32_t)sizeof(g1t_header) + 4 * i]);
-            if (flags[0] & 0xff000000ULL) {
-                fprintf(stderr, "ERROR: Global flags 0x%08x don't match our assertion\n", (uint32_t)flags[0]);
-                fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-                break;
-            }
-            for (size_t j = 0; j < array_size(tex->flags); j++)
-                flags[0] = flags[0] << 8 | (uint64_t)tex->flags[j];
-            pos += sizeof(g1t_tex_header);
-            uint32_t width = 1 << tex->dx;
-            uint32_t height = 1 << tex->dy;
-            uint32_t data_size = (flags[0] & G1T_FLAG_EXTENDED_DATA) ? getp32(&buf[pos]) : 0;
-            if (data_size != 0 && data_size != 0x0c && data_size != 0x10 && data_size != 0x14) {
-                fprintf(stderr, "ERROR: Extra flags size of 0x%x doesn't match our assertion\n", data_size);
-                fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-                break;
-            }
-            // Extra flags, including the number of frames, may be provided
-            if (data_size >= 0x0c) {
-                uint32_t _depth = getp32(&buf[pos + 4]);
-                depth = *((float*)&_depth);
-                flags[1] = getbe32(&buf[pos + 8]);
-                nb_frames = GET_NB_FRAMES(flags[1]);
-            }
-            if (nb_frames == 0)
-                nb_frames = 1;
-            // Non power-of-two width and height may be provided in the data
-            if (data_size >= 0x10)
-                width = getp32(&buf[pos + 0x0c]);
-            if (data_size >= 0x14)
-                height = getp32(&buf[pos + 0x10]);
-
-            JSON_Value* json_texture = json_value_init_object();
-            snprintf(path, sizeof(path), "%03d.dds", i);
-            json_object_set_string(json_object(json_texture), "name", path);
-            json_object_set_number(json_object(json_texture), "type", tex->type);
-            if (tex->mipmaps != 1)
-                json_object_set_number(json_object(json_texture), "mipmaps", tex->mipmaps);
-            if (tex->z_mipmaps != 0)
-                json_object_set_number(json_object(json_texture), "z_mipmaps", tex->z_mipmaps);
-            if (nb_frames > 1)
-                json_object_set_number(json_object(json_texture), "nb_frames", nb_frames);
-            if (depth != 0.0f) {
-                char depth_str[16];
-                snprintf(depth_str, sizeof(depth_str), "%f", depth);
-                json_object_set_string(json_object(json_texture), "depth", depth_str);
-            }
-            uint32_t texture_format = default_texture_format;
-            bool swizzled = false;
-            switch (tex->type) {
-            case 0x00: break;
-            case 0x01: break;
-            case 0x02: break;
-            case 0x03: texture_format = DDS_FORMAT_ARGB16; break;
-            case 0x04: texture_format = DDS_FORMAT_ARGB32; break;
-            case 0x06: texture_format = DDS_FORMAT_DXT1; break;
-//            case 0x07: texture_format = DDS_FORMAT_DXT3; break;
-            case 0x08: texture_format = DDS_FORMAT_DXT5; break;
-            case 0x09: swizzled = true; break;
-//            case 0x0A: swizzled = true; break;
-            case 0x10: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;
-            case 0x12: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;
-            case 0x21: break;
-            case 0x3C: texture_format = DDS_FORMAT_ARGB4; break;
-            case 0x3D: texture_format = DDS_FORMAT_ARGB4; break;
-            case 0x45: texture_format = DDS_FORMAT_BGR8; swizzled = true; break;
-            case 0x59: texture_format = DDS_FORMAT_DXT1; break;
-            case 0x5B: texture_format = DDS_FORMAT_DXT5; break;
-            case 0x5C: texture_format = DDS_FORMAT_BC4; break;
-//            case 0x5D: texture_format = DDS_FORMAT_ATI1; break;
-            case 0x5E: texture_format = DDS_FORMAT_BC6H; break;
-            case 0x5F: texture_format = DDS_FORMAT_BC7; break;
-            case 0x60: texture_format = DDS_FORMAT_DXT1; swizzled = true; break;
-            case 0x62: texture_format = DDS_FORMAT_DXT5; swizzled = true; break;
-//            case 0x63: texture_format = DDS_FORMAT_BC4; swizzled = true; break;
-//            case 0x64: texture_format = DDS_FORMAT_BC5; swizzled = true; break;
-//            case 0x65: texture_format = DDS_FORMAT_BC6; swizzled = true; break;
-//            case 0x66: texture_format = DDS_FORMAT_BC7; swizzled = true; break;
-            // 0x72 is not actually BC7, but that's the closest we get to semi-recognizable output
-            case 0x72: texture_format = DDS_FORMAT_BC7; break;
-            default:
-                fprintf(stderr, "ERROR: Unsupported texture type (0x%02X)\n", tex->type);
-                fprintf(stderr, "Please visit: https://github.com/VitaSmith/gust_tools/issues/51\n");
-                goto out;
-            }
-            uint32_t expected_texture_size = 0;
-            uint32_t min_mipmap_size = dds_bpb(texture_format);
-            if (hdr->platform == NINTENDO_WIIU)
-                min_mipmap_size = 0x40 * dds_bpb(texture_format);
-            for (int j = 0; j < tex->mipmaps; j++)
-                expected_texture_size += nb_frames * max(MIPMAP_SIZE(texture_format, j, width, height), min_mipmap_size);
-            uint32_t texture_size = ((i + 1 == hdr->nb_textures) ?
-                g1t_size - hdr->header_size : getv32(x_offset_table[i + 1])) - getv32(x_offset_table[i]);
-            texture_size -= (uint32_t)sizeof(g1t_tex_header);
-            if (flags[0] & G1T_FLAG_EXTENDED_DATA) {
-                assert(pos + data_size < g1t_size);
-                if ((data_size != 0x0c) && (data_size != 0x10) && (data_size != 0x14)) {
-                    fprintf(stderr, "ERROR: Can't handle local extra_data of size 0x%08x\n", data_size);
-                    break;
-                }
-                pos += data_size;
-                texture_size -= data_size;
-            }
-            if (texture_size < expected_texture_size) {
-                fprintf(stderr, "ERROR: Actual texture size is smaller than expected size\n");
+        for (i = 0; i < nb_textures; i++) {
+            printf("%s", extracted_textures[i].line);
+            if (!extracted_textures[i].done)
                 break;
-            } else if (texture_size > expected_texture_size) {
-                if (texture_size % expected_texture_size != 0) {
-                    fprintf(stderr, "WARNING: Actual texture size is larger than expected size by 0x%x\n",
-                        texture_size - expected_texture_size);
-                } else if (texture_size / expected_texture_size == 6) {
-                    // A cubemap is composed of one texture for each face
-                    flags[1] |= G1T_FLAG_CUBE_MAP;
-                } else {
-                    fprintf(stderr, "ERROR: Texture array with a factor of %d doesn't match our assertion\n",
-                        texture_size / expected_texture_size);
-                    fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-                    break;
-                }
-                expected_texture_size = texture_size;
-            }
-            json_object_set_value(json_object(json_texture), "flags", flags_to_json(flags));
-
-            snprintf(path, sizeof(path), "%s%s%c%03d.dds", dir, _basename(argv[argc - 1]), PATH_SEP, i);
-            char dims[16] = { 0 }, props[8] = { 0 };
-            snprintf(dims, sizeof(dims), "%dx%d", width, height);
-            if (flags[1] & G1T_FLAG_TEXTURE_ARRAY)
-                strcat(props, "A");
-            if (data_endianness == big_endian)
-                strcat(props, "B");
-            if (flags[1] & G1T_FLAG_CUBE_MAP)
-                strcat(props, "C");
-            if (depth != 0)
-                strcat(props, "D");
-            if (props[0] == 0)
-                props[0] = '-';
-            printf("0x%02x 0x%08x 0x%08x %s %-10s %-7d %s\n", tex->type,
-                hdr->header_size + hdr->extra_size + getv32(x_offset_table[i]),
-                texture_size, &path[strlen(dir)], dims, tex->mipmaps, props);
-            if (list_only) {
-                json_value_free(json_texture);
-                continue;
-            }
-            FILE* dst = fopen_utf8(path, "wb");
-            if (dst == NULL) {
-                fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
-                break;
-            }
-            uint32_t dds_magic = DDS_MAGIC;
-            if (fwrite(&dds_magic, sizeof(dds_magic), 1, dst) != 1) {
-                fprintf(stderr, "ERROR: Can't write magic\n");
-                fclose(dst);
-                r = -1;
-                break;
-            }
-            if (write_dds_header(dst, texture_format, width, height,
-                                 tex->mipmaps, flags) != 1) {
-                fprintf(stderr, "ERROR: Can't write DDS header\n");
-                fclose(dst);
-                break;
-            }
-
-            // Non ARGB textures require conversion to be applied, since
-            // tools like Visual Studio or PhotoShop can't be bothered
-            // to honour the pixel format from the DDS header and instead
-            // insist on using ARGB always...
-            if (texture_format >= DDS_FORMAT_ABGR4 && texture_format <= DDS_FORMAT_RGBA8)
-                rgba_convert(texture_format, argb_name[texture_format], "ARGB", &buf[pos], expected_texture_size);
-            if (swizzled) {
-                int16_t mo = 0;     // Morton order
-                uint32_t wf = 1;    // Width factor
-                uint32_t awf = 1;   // Additional width factor
-                switch (hdr->platform) {
-                case SONY_PS4:
-                case NINTENDO_3DS:
-                    mo = -3;
-                    wf = 2;
-                    break;
-                case NINTENDO_WIIU:
-                    mo = -1;        // Same for all mipmaps
-                    wf = 16 / dds_bpb(texture_format);
-                    awf = 8;
-                    break;
-                default:
-                    mo = -1 * (int16_t)log2(min(width / dds_bwh(texture_format) / wf,
-                        height / dds_bwh(texture_format)));
-                    break;
-                }
-                uint32_t offset = 0;
-                assert(mo != 0);
-                for (int j = 0; j < tex->mipmaps && mo != 0; j++) {
-                    uint32_t mipmap_size = max(MIPMAP_SIZE(texture_format, j, width, height), min_mipmap_size);
-                    uint32_t mw = max(awf * dds_bwh(texture_format), width / (1 << j));
-                    uint32_t mh = max(awf * dds_bwh(texture_format), height / (1 << j));
-                    mortonize(texture_format, mo, mw, mh, &buf[pos + offset], mipmap_size, wf);
-                    if (width / (1 << j) < mw)
-                        tile(texture_format, width / (1 << j), mw, &buf[pos + offset], mipmap_size);
-                    offset += mipmap_size;
-                    if (hdr->platform != NINTENDO_WIIU)
-                        mo += (mo > 0) ? -1 : +1;
-                }
-            }
-            if (flip_image || ((hdr->platform == NINTENDO_3DS) && (tex->type == 0x09 || tex->type == 0x45)))
-                flip(dds_bpp(texture_format), &buf[pos], expected_texture_size, width);
-            // DDS expects the mipmaps of a texture array or cubemap to immediately follow
-            // the main one, but G1T instead stores all mains, then all L1 mipmaps, then
-            // all L2 mipmaps and so on... Thus we need to manually reorder the mipmaps.
-            if (flags[1] & G1T_FLAG_CUBE_MAP)
-                nb_frames *= 6;     // Adjust effective nb_frames for cubemaps
-            for (uint32_t f = 0; f < nb_frames; f++) {
-                for (uint32_t l = 0, offset = 0; l < tex->mipmaps; l++) {
-                    uint32_t mipmap_size = max(MIPMAP_SIZE(texture_format, l, width, height), min_mipmap_size);
-                    offset += f * mipmap_size;
-                    if (fwrite(&buf[pos + offset], MIPMAP_SIZE(texture_format, l, width, height), 1, dst) != 1) {
-                        fprintf(stderr, "ERROR: Can't write DDS data\n");
-                        goto out;
-                    }
-                    offset += (nb_frames - f) * mipmap_size;
-                }
-            }
-            fclose(dst);
-            json_array_append_value(json_array(json_textures_array), json_texture);
         }
-        r = (i == hdr->nb_textures) ? 0 : -1;
+        if (i < nb_textures && extracted_textures[i].fatal)
+            goto out;
+        r = (i == nb_textures) ? 0 : -1;
+        if (list_only)
+            goto out;
 
-        json_object_set_value(json_object(json), "textures", json_textures_array);
-        if (hdr->extra_size)
-            json_object_set_value(json_object(json), "extra_data", json_extra_data_array);
+        // Keep the information required to recreate the archive in a JSON file, which
+        // gets written as we go, with the textures that were extracted
+        snprintf(path, sizeof(path), "%s%cg1t.json", input, PATH_SEP);
+        start = stats_start();
+        writer = json_writer_open(path);
+        json_writer_begin_object(writer, NULL);
+        json_writer_number(writer, "json_version", JSON_VERSION);
+        json_writer_string(writer, "name", g1t_name);
+        json_writer_number(writer, "version", version);
+        if (platform_to_name(hdr->platform) != NULL)
+            json_writer_string(writer, "platform", platform_to_name(hdr->platform));
         else
-            json_value_free(json_extra_data_array);
-        snprintf(path, sizeof(path), "%s%cg1t.json", argv[argc - 1], PATH_SEP);
-        if (!list_only)
-            json_serialize_to_file_pretty(json, path);
+            json_writer_number(writer, "platform", hdr->platform);
+        if (flip_image)
+            json_writer_boolean(writer, "flip", true);
+        json_writer_begin_array(writer, "textures");
+        for (uint32_t j = 0; j < i; j++) {
+            json_writer_value(writer, NULL, extracted_textures[j].json);
+            json_value_free(extracted_textures[j].json);
+            extracted_textures[j].json = NULL;
+        }
+        json_writer_end(writer);
+        if (hdr->extra_size) {
+            json_writer_begin_array(writer, "extra_data");
+            for (uint16_t j = 0; j < hdr->extra_size; j += sizeof(uint16_t))
+                json_writer_number(writer, NULL, getp16(&buf[hdr->header_size + hdr->nb_textures * sizeof(uint32_t) + j]));
+            json_writer_end(writer);
+        }
+        json_writer_end(writer);
+        JSON_Status status = json_writer_close(writer);
+        writer = NULL;
+        if (status != JSONSuccess) {
+            fprintf(stderr, "ERROR: Can't write '%s'\n", path);
+            r = -1;
+        }
+        stats_stop("json_write", start, 0);
     }
 
 out:
+    if (writer != NULL)
+        json_writer_close(writer);
     json_value_free(json);
+    for (uint32_t i = 0; arenas != NULL && i < nb_arenas; i++)
+        free_scratch(&arenas[i]);
+    free(arenas);
+    for (uint32_t i = 0; created_textures != NULL && i < nb_textures; i++)
+        free(created_textures[i].data);
+    free(created_textures);
+    for (uint32_t i = 0; extracted_textures != NULL && i < nb_textures; i++)
+        json_value_free(extracted_textures[i].json);
+    free(extracted_textures);
     free(buf);
+    free(input);
     free(dir);
+    free(base_name);
+    free(g1t_name);
     free(offset_table);
     free(flag_table);
     if (file != NULL)
         fclose(file);
+    return r;
+}
 
+int main_utf8(int argc, char** argv)
+{
+    int argi;
+    g1t_options opt = { false, false, 1 };
+    bool no_prompt = false, print_usage = false;
+
+    for (argi = 1; (argi < argc - 1) && (argv[argi][0] == '-') && !print_usage; argi++) {
+        switch (argv[argi][1]) {
+        case 'l':
+            opt.list_only = true;
+            break;
+        case 'f':
+            opt.flip_image = true;
+            break;
+        case 'y':
+            no_prompt = true;
+            break;
+        case 'j':
+            if (++argi >= argc - 1) {
+                print_usage = true;
+                break;
+            }
+            if (!parse_nb_threads(argv[argi], &opt.nb_threads))
+                print_usage = true;
+            break;
+        default:
+            print_usage = true;
+            break;
+        }
+    }
+
+    if ((argi != argc - 1) || print_usage) {
+        printf("%s %s (c) 2019-2022 VitaSmith\n\n"
+            "Usage: %s [-l] [-f] [-y] [-j N] <file or directory>\n\n"
+            "Extracts (file) or recreates (directory) a Gust .g1t texture archive.\n\n"
+            "Options:\n"
+            "  -l    List the content of the archive only\n"
+            "  -f    Flip the textures vertically\n"
+            "  -y    Don't prompt for a key on errors\n"
+            "  -j N  Convert the textures using N threads (0 = one thread per CPU)\n\n"
+            "Note: A backup (.bak) of the original is automatically created, when the target\n"
+            "is being overwritten for the first time.\n",
+            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]));
+        return 0;
+    }
+
+    int r = gust_g1t_process_file(argv[argc - 1], &opt);
     if (r != 0 && !no_prompt) {
         fflush(stdin);
         printf("\nPress any key to continue...");
@@ -1417,3 +1889,146 @@ out:
 }
 
 CALL_MAIN
+
+#if defined(GUST_BENCH)
+#include "bench.h"
+
+typedef struct {
+    enum DDS_FORMAT format;
+    uint32_t        width;          // Square texture, in pixels
+    uint32_t        size;
+    uint32_t        tile_size;
+    int16_t         morton_order;
+    uint8_t*        src;
+    uint8_t*        dst;
+    const char*     in;             // ARGB orders for rgba_convert()
+    const char*     out;
+    scratch_arena   arena;
+} g1t_bench;
+
+static bool bench_mortonize(void* _ctx)
+{
+    g1t_bench* ctx = (g1t_bench*)_ctx;
+    return mortonize(ctx->format, ctx->morton_order, ctx->width, ctx->width, ctx->dst, ctx->src,
+        ctx->size, 1, &ctx->arena);
+}
+
+static bool bench_unmortonize(void* _ctx)
+{
+    g1t_bench* ctx = (g1t_bench*)_ctx;
+    return mortonize(ctx->format, -ctx->morton_order, ctx->width, ctx->width, ctx->dst, ctx->src,
+        ctx->size, 1, &ctx->arena);
+}
+
+static bool bench_tile(void* _ctx)
+{
+    g1t_bench* ctx = (g1t_bench*)_ctx;
+    tile(ctx->format, ctx->tile_size, ctx->width, ctx->dst, ctx->src, ctx->size);
+    return true;
+}
+
+static bool bench_untile(void* _ctx)
+{
+    g1t_bench* ctx = (g1t_bench*)_ctx;
+    untile(ctx->format, ctx->tile_size, ctx->width, ctx->dst, ctx->src, ctx->size);
+    return true;
+}
+
+static bool bench_flip(void* _ctx)
+{
+    g1t_bench* ctx = (g1t_bench*)_ctx;
+    flip_copy(dds_bpp(ctx->format), ctx->dst, ctx->src, ctx->size, ctx->width, 0, ctx->size);
+    return true;
+}
+
+static bool bench_rgba_convert(void* _ctx)
+{
+    g1t_bench* ctx = (g1t_bench*)_ctx;
+    rgba_convert(ctx->format, ctx->in, ctx->out, ctx->src, ctx->size);
+    return true;
+}
+
+static bool bench_rgba_convert_generic(void* _ctx)
+{
+    g1t_bench* ctx = (g1t_bench*)_ctx;
+    rgba_swizzle swz;
+    get_rgba_swizzle(ctx->format, ctx->in, ctx->out, &swz);
+    rgba_convert_generic(ctx->src, ctx->size, &swz);
+    return true;
+}
+
+bool gust_g1t_bench(void)
+{
+    // Swizzling only depends on the size of the elements, so one format per size is enough
+    static const struct {
+        enum DDS_FORMAT format;
+        const char*     name;
+    } formats[] = {
+        { DDS_FORMAT_R8,    "R8" },
+        { DDS_FORMAT_ARGB4, "ARGB4" },
+        { DDS_FORMAT_ARGB8, "ARGB8" },
+        { DDS_FORMAT_DXT1,  "DXT1" },
+        { DDS_FORMAT_BC7,   "BC7" },
+        { DDS_FORMAT_ABGR4, "ABGR4" },
+        { DDS_FORMAT_GRAB4, "GRAB4" },
+        { DDS_FORMAT_RGBA4, "RGBA4" },
+        { DDS_FORMAT_ABGR8, "ABGR8" },
+        { DDS_FORMAT_GRAB8, "GRAB8" },
+        { DDS_FORMAT_RGBA8, "RGBA8" },
+    };
+    static const struct {
+        const char* name;
+        bench_fn    fn;
+    } kernels[] = {
+        { "mortonize",              bench_mortonize },
+        { "unmortonize",            bench_unmortonize },
+        { "tile",                   bench_tile },
+        { "untile",                 bench_untile },
+        { "flip",                   bench_flip },
+        { "rgba_convert",           bench_rgba_convert },
+        { "rgba_convert_generic",   bench_rgba_convert_generic },
+    };
+    // The results keep a pointer to the kernel names
+    static char names[array_size(formats) * array_size(kernels)][32];
+    bool r = true;
+    g1t_bench ctx = { 0 };
+    ctx.src = malloc(bench_size);
+    ctx.dst = malloc(bench_size);
+    if (ctx.src == NULL || ctx.dst == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate buffers\n");
+        r = false;
+    }
+    init_rgba_kernels();
+
+    for (uint32_t f = 0; f < array_size(formats) && r; f++) {
+        ctx.format = formats[f].format;
+        bool is_argb = (ctx.format >= DDS_FORMAT_ABGR4 && ctx.format <= DDS_FORMAT_RGBA8);
+        // Use the largest square texture that fits, with a full Morton order
+        uint32_t blocks = bench_size / dds_bpb(ctx.format), side = 1;
+        for (ctx.morton_order = 0; 4 * side * side <= blocks; ctx.morton_order++)
+            side *= 2;
+        ctx.width = side * dds_bwh(ctx.format);
+        ctx.size = side * side * dds_bpb(ctx.format);
+        ctx.tile_size = min(ctx.width, 32 * dds_bwh(ctx.format));
+        ctx.in = is_argb ? argb_name[ctx.format] : NULL;
+        ctx.out = (is_argb && strcmp(ctx.in, "ARGB") == 0) ? "ABGR" : "ARGB";
+        bench_fill(ctx.src, ctx.size, 4 + f, false);
+        for (uint32_t k = 0; k < array_size(kernels) && r; k++) {
+            bool swizzle = (kernels[k].fn != bench_rgba_convert && kernels[k].fn != bench_rgba_convert_generic);
+            // Swizzle the first formats, convert the ARGB ones, and only flip the formats without blocks
+            if ((swizzle && f >= 5) || (!swizzle && !is_argb) ||
+                (kernels[k].fn == bench_flip && dds_bwh(ctx.format) != 1) ||
+                (kernels[k].fn == bench_rgba_convert_generic && ctx.format != DDS_FORMAT_ABGR4 &&
+                 ctx.format != DDS_FORMAT_ABGR8))
+                continue;
+            char* name = names[f * array_size(kernels) + k];
+            snprintf(name, sizeof(names[0]), "%s/%s", kernels[k].name, formats[f].name);
+            r = bench_kernel(name, kernels[k].fn, &ctx, ctx.size);
+        }
+    }
+    free_scratch(&ctx.arena);
+    free(ctx.dst);
+    free(ctx.src);
+    return r;
+}
+#endif
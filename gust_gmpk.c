@@ -25,6 +25,7 @@
 #include "utf8.h"
 #include "util.h"
 #include "parson.h"
+#include "batch.h"
 
 #define JSON_VERSION            2
 #define GMPK_MAGIC              0x4B504D47  // 'GMPK'
@@ -115,15 +116,26 @@ typedef struct {
 
 #pragma pack(pop)
 
-static uint32_t *entry_data = NULL, entry_data_size, entry_data_count, files_count;
+// A file to add to a GMPK, as found when planning its layout
+typedef struct {
+    uint32_t    name_index;
+    uint32_t    extension;
+    uint32_t    size;
+} gmpk_file;
+
+static THREAD_LOCAL uint32_t *entry_data = NULL, entry_data_size, entry_data_count, files_count;
+// Names decoded from the NID, so that they can be looked up by entry index
+static THREAD_LOCAL char* nid_names = NULL;
+static THREAD_LOCAL uint32_t nid_names_count, nid_name_stride;
 
-JSON_Value* read_nid(uint8_t* buf, uint32_t size)
+// Validate a NID and write it as the "NID" member of the current JSON object
+static bool read_nid(uint8_t* buf, uint32_t size, JSON_Writer* writer)
 {
     char tag[9] = { 0 };
     nid1_header* hdr = (nid1_header*)buf;
     if (sizeof(nid1_header) > size) {
         fprintf(stderr, "ERROR: NID buffer is too small\n");
-        return NULL;
+        return false;
     }
     if (data_endianness != platform_endianness) {
         BSWAP_UINT32(hdr->magic);
@@ -134,15 +146,15 @@ JSON_Value* read_nid(uint8_t* buf, uint32_t size)
     // Endianness should have been detected when processing the SDP
     if (hdr->magic == NID1_BE_MAGIC) {
         fprintf(stderr, "ERROR: NID endianness mismatch\n");
-        return NULL;
+        return false;
     }
     if (hdr->magic != NID1_LE_MAGIC) {
         fprintf(stderr, "ERROR: Bad NID magic\n");
-        return NULL;
+        return false;
     }
     if (hdr->size != size) {
         fprintf(stderr, "ERROR: NID size mismatch\n");
-        return NULL;
+        return false;
     }
 
     memcpy(tag, hdr->tag, 8);
@@ -152,60 +164,71 @@ JSON_Value* read_nid(uint8_t* buf, uint32_t size)
         if (i == array_size(known_nid_tags) - 1) {
             fprintf(stderr, "ERROR: Unsupported SDP tag '%s'.\n", tag);
             fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-            return NULL;
+            return false;
         }
     }
 
-    JSON_Value* json_nid = json_value_init_object();
-    json_object_set_string(json_object(json_nid), "tag", (const char*)tag);
-    json_object_set_string(json_object(json_nid), "type", "NID1");
+    json_writer_begin_object(writer, "NID");
+    json_writer_string(writer, "tag", (const char*)tag);
+    json_writer_string(writer, "type", "NID1");
 
     // Process name entries
     size_t offset = sizeof(nid1_header);
     uint32_t* data = (uint32_t*)&buf[offset];
     // Move our offset to the string fragments
     offset += (size_t)hdr->count * 2 * sizeof(uint32_t);
-    JSON_Value* json_names_array = json_value_init_array();
-    char* str = calloc((size_t)hdr->max_name_len + 1, 1);
-    if (str == NULL)
-        return NULL;
+    json_writer_begin_array(writer, "names");
+    // Both fragments of a name may be up to max_name_len long
+    free(nid_names);
+    nid_names_count = 0;
+    nid_name_stride = 2 * hdr->max_name_len + 1;
+    nid_names = calloc((size_t)hdr->count, nid_name_stride);
+    if (nid_names == NULL)
+        return false;
     for (uint32_t i = 0; i < hdr->count; i++) {
-        JSON_Value* json_name = json_value_init_object();
-        json_object_set_number(json_object(json_name), "index", data[2 * i]);
-        json_object_set_number(json_object(json_name), "flags", data[2 * i + 1]);
+        json_writer_begin_object(writer, NULL);
+        json_writer_number(writer, "index", data[2 * i]);
+        json_writer_number(writer, "flags", data[2 * i + 1]);
+        char* str = &nid_names[(size_t)i * nid_name_stride];
         uint32_t k = 0, val = getp32(&data[2 * hdr->count + i]);
         uint8_t len = buf[offset + (val >> 16)];
         if (len > hdr->max_name_len) {
             fprintf(stderr, "ERROR: Fragment length (%d) is greater than %d.\n", len, hdr->max_name_len);
-            return NULL;
+            return false;
         }
         for (size_t j = 1; j <= len; j++)
             str[k++] = buf[offset + (val >> 16) + j];
-        json_object_set_number(json_object(json_name), "split", k);
+        json_writer_number(writer, "split", k);
         len = buf[offset + (val & 0xffff)];
+        if (len > hdr->max_name_len) {
+            fprintf(stderr, "ERROR: Fragment length (%d) is greater than %d.\n", len, hdr->max_name_len);
+            return false;
+        }
         for (size_t j = 1; j <= len; j++)
             str[k++] = buf[offset + (val & 0xffff) + j];
         str[k] = 0;
-        json_object_set_string(json_object(json_name), "name", str);
-        json_array_append_value(json_array(json_names_array), json_name);
+        json_writer_string(writer, "name", str);
+        json_writer_end(writer);
+        nid_names_count++;
     }
-    free(str);
-    json_object_set_value(json_object(json_nid), "names", json_names_array);
+    json_writer_end(writer);
+    json_writer_end(writer);
 
-    return json_nid;
+    return true;
 }
 
-JSON_Value* read_sdp(uint8_t* buf, uint32_t size)
+// Validate an SDP and write it as the `key` member of the current JSON object
+static bool read_sdp(uint8_t* buf, uint32_t size, JSON_Writer* writer, const char* key)
 {
     char tag[9] = { 0 };
     sdp1_header* hdr = (sdp1_header*)buf;
     if (sizeof(sdp1_header) > size) {
         fprintf(stderr, "ERROR: SDP buffer is too small\n");
-        return NULL;
+        return false;
     }
     if (hdr->magic != SDP1_LE_MAGIC && hdr->magic != SDP1_BE_MAGIC) {
         fprintf(stderr, "ERROR: Bad SDP magic\n");
-        return NULL;
+        return false;
     }
     if (getle32(&buf[8]) == SDP1_BE_MAGIC)
         data_endianness = big_endian;
@@ -223,12 +246,12 @@ JSON_Value* read_sdp(uint8_t* buf, uint32_t size)
     }
     if (hdr->size > size) {
         fprintf(stderr, "ERROR: SDP size mismatch\n");
-        return NULL;
+        return false;
     }
     if (hdr->size > MAX_HEADER_SIZE) {
         fprintf(stderr, "ERROR: SPD header is larger than %d KB.\n", MAX_HEADER_SIZE / 1024);
         fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-        return NULL;
+        return false;
     }
 
     memcpy(tag, hdr->tag, 8);
@@ -238,13 +261,13 @@ JSON_Value* read_sdp(uint8_t* buf, uint32_t size)
         if (i == array_size(known_sdp_tags) - 1) {
             fprintf(stderr, "ERROR: Unsupported SDP tag '%s'.\n", tag);
             fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-            return NULL;
+            return false;
         }
     }
 
-    JSON_Value* json_sdp = json_value_init_object();
-    json_object_set_string(json_object(json_sdp), "tag", (const char*)tag);
-    json_object_set_string(json_object(json_sdp), "type", "SDP1");
+    json_writer_begin_object(writer, key);
+    json_writer_string(writer, "tag", (const char*)tag);
+    json_writer_string(writer, "type", "SDP1");
 
     // Process data
     uint32_t offset = hdr->data_offset;
@@ -253,36 +276,34 @@ JSON_Value* read_sdp(uint8_t* buf, uint32_t size)
     if (data_size % (hdr->data_record_size * sizeof_32(uint32_t))) {
         fprintf(stderr, "ERROR: Computed data size is not a multiple of the record size.\n");
         fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-        return NULL;
+        return false;
     }
     if (data_count != hdr->data_count) {
         fprintf(stderr, "ERROR: Computed data_count (%d) does not match actual value (%d).\n",
             data_count, hdr->data_count);
         fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-        return NULL;
-    }
-    JSON_Value* json_data_array = json_value_init_array();
-    JSON_Value* json_data_record_array = NULL;
-    for (uint32_t i = 0; i < data_size / hdr->data_record_size; ) {
-        if (json_data_record_array == NULL)
-            json_data_record_array = json_value_init_array();
-        json_array_append_number(json_array(json_data_record_array),
-            getp32(&buf[offset + i * sizeof_32(uint32_t)]));
+        return false;
+    }
+    // Only complete records are written out
+    uint32_t data_values = data_size / hdr->data_record_size;
+    data_values -= data_values % hdr->data_record_size;
+    json_writer_begin_array(writer, "data");
+    for (uint32_t i = 0; i < data_values; ) {
+        if (i % hdr->data_record_size == 0)
+            json_writer_begin_array(writer, NULL);
+        json_writer_number(writer, NULL, getp32(&buf[offset + i * sizeof_32(uint32_t)]));
         i++;
-        if (i % hdr->data_record_size == 0) {
-            json_array_append_value(json_array(json_data_array), json_data_record_array);
-            json_data_record_array = NULL;
-        }
+        if (i % hdr->data_record_size == 0)
+            json_writer_end(writer);
     }
-    json_object_set_value(json_object(json_sdp), "data", json_data_array);
+    json_writer_end(writer);
 
     // If we are an EntryMap, validate that it matches our expectations
     if (strcmp(tag, known_sdp_tags[1]) == 0) {
         if (hdr->entry_record_size != 2 * hdr->data_count) {
             fprintf(stderr, "ERROR: Unexpected EntryMap record size\n");
             fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-            json_value_free(json_sdp);
-            return NULL;
+            return false;
         }
         model_entry* me = (model_entry*)&buf[hdr->entry_offset];
         if (getle32(&me->component[0].has_component) == 1) {
@@ -291,8 +312,7 @@ JSON_Value* read_sdp(uint8_t* buf, uint32_t size)
                 getle32(&(me->component[hdr->entry_record_size / 2 - 1].file_index)) != hdr->entry_count - 1)) {
                 fprintf(stderr, "ERROR: Unexpected EntryMap submodel count\n");
                 fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-                json_value_free(json_sdp);
-                return NULL;
+                return false;
             }
             for (uint32_t i = 1; i < hdr->entry_count; i++) {
                 me = (model_entry*)&buf[hdr->entry_offset + (i * hdr->entry_record_size * sizeof_32(uint32_t))];
@@ -300,8 +320,7 @@ JSON_Value* read_sdp(uint8_t* buf, uint32_t size)
                     me->component[hdr->entry_record_size / 2 - 1].file_index != 0xffffffff) {
                     fprintf(stderr, "ERROR: More than one level of EntryMap submodels\n");
                     fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-                    json_value_free(json_sdp);
-                    return NULL;
+                    return false;
                 }
             }
         }
@@ -309,27 +328,21 @@ JSON_Value* read_sdp(uint8_t* buf, uint32_t size)
 
     // Process optional EntryMap SDP
     if (hdr->entrymap_offset != 0) {
-        JSON_Value* json_entrymap = read_sdp(&buf[hdr->entrymap_offset], hdr->size - hdr->entrymap_offset);
-        if (json_entrymap == NULL) {
-            json_value_free(json_sdp);
-            return NULL;
-        }
-        const char* em_tag = json_object_get_string(json_object(json_entrymap), "tag");
+        if (!read_sdp(&buf[hdr->entrymap_offset], hdr->size - hdr->entrymap_offset, writer, "SDP"))
+            return false;
+        char em_tag[9] = { 0 };
+        memcpy(em_tag, ((sdp1_header*)&buf[hdr->entrymap_offset])->tag, 8);
         if (strcmp(em_tag, known_sdp_tags[1]) != 0) {
             fprintf(stderr, "ERROR: Unexpected EntryMap tag '%s'\n", em_tag);
             fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-            json_value_free(json_entrymap);
-            json_value_free(json_sdp);
-            return NULL;
+            return false;
         }
-        json_object_set_value(json_object(json_sdp), "SDP", json_entrymap);
 
         // Validate the EntryMap and look for the NameMap
         if (hdr->entry_count != 1 || hdr->entry_record_size < sizeof_32(root_entry) / sizeof_32(uint32_t)) {
             fprintf(stderr, "ERROR: Unexpected entry data for a root SDP\n");
             fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-            json_value_free(json_sdp);
-            return NULL;
+            return false;
         }
 
         root_entry* gmpk_root = (root_entry*)&buf[hdr->entry_offset];
@@ -346,50 +359,45 @@ JSON_Value* read_sdp(uint8_t* buf, uint32_t size)
         if (gmpk_root->entrymap_offset != hdr->entrymap_offset) {
             fprintf(stderr, "ERROR: EntryMap position mismatch\n");
             fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-            json_value_free(json_sdp);
-            return NULL;
+            return false;
         }
 
         // Process the NameMap
         if (hdr->size - gmpk_root->namemap_offset < gmpk_root->namemap_size) {
             fprintf(stderr, "ERROR: NameMap size is too small\n");
             fprintf(stderr, "Please report this error to %s.\n", REPORT_URL);
-            json_value_free(json_sdp);
-            return NULL;
-        }
-
-        JSON_Value* json_nid = read_nid(&buf[gmpk_root->namemap_offset], gmpk_root->namemap_size);
-        if (json_nid == NULL) {
-            json_value_free(json_sdp);
-            return NULL;
+            return false;
         }
 
-        json_object_set_value(json_object(json_sdp), "NID", json_nid);
+        if (!read_nid(&buf[gmpk_root->namemap_offset], gmpk_root->namemap_size, writer))
+            return false;
     }
+    json_writer_end(writer);
 
-    return json_sdp;
+    return true;
 }
 
-uint16_t get_fragment(uint8_t* fragments, uint16_t *fragments_size, char* str, uint16_t str_len)
+// Returns the offset of a string fragment, which gets appended if it doesn't already exist.
+// Known fragments are indexed in an open addressing hash table, holding their offset + 1.
+static uint16_t get_fragment(uint8_t* fragments, uint16_t *fragments_size, uint32_t* table, uint32_t table_size,
+                             const char* str, uint16_t str_len)
 {
-    uint16_t pos = 0;
-    while (pos < *fragments_size) {
-        bool match = (str_len == (uint16_t)fragments[pos]);
-        for (uint16_t i = 0; match && i < str_len; i++)
-            match = (fragments[pos + i + 1] == str[i]);
-        if (match)
+    uint32_t j = (uint32_t)xxhash64(str, str_len, 0) & (table_size - 1);
+    for (; table[j] != 0; j = (j + 1) & (table_size - 1)) {
+        uint16_t pos = (uint16_t)(table[j] - 1);
+        if (str_len == (uint16_t)fragments[pos] && memcmp(&fragments[pos + 1], str, str_len) == 0)
             return pos;
-        pos += (uint16_t)fragments[pos] + 1;
     }
     // Fragment was not found => insert it
-    pos = *fragments_size;
+    uint16_t pos = *fragments_size;
+    table[j] = (uint32_t)pos + 1;
     fragments[(*fragments_size)++] = (uint8_t)str_len;
     memcpy(&fragments[*fragments_size], str, str_len);
     *fragments_size += str_len;
     return pos;
 }
 
-uint32_t write_nid(JSON_Object* json_nid, uint8_t* buf, uint32_t size)
+static uint32_t write_nid(JSON_Object* json_nid, uint8_t* buf, uint32_t size)
 {
     uint32_t *data, written = 0;
     nid1_header* hdr = (nid1_header*)buf;
@@ -423,15 +431,23 @@ uint32_t write_nid(JSON_Object* json_nid, uint8_t* buf, uint32_t size)
     data = (uint32_t*)&buf[written];
     uint8_t* fragments = (uint8_t*)&buf[written + 3 * hdr->count * sizeof_32(uint32_t)];
     uint16_t pos, fragments_size = 0;
-    uint32_t split, len;
+    uint32_t split, len, table_size = 16;
+    // Each name has 2 fragments, and we keep the hash table at most half full
+    while (table_size < 4 * hdr->count)
+        table_size <<= 1;
+    uint32_t* table = calloc(table_size, sizeof(uint32_t));
+    if (table == NULL)
+        return 0;
     for (uint32_t i = 0; i < hdr->count; i++) {
         JSON_Object* json_name = json_array_get_object(json_names_array, i);
         data[2 * i] = json_object_get_uint32(json_name, "index");
         data[2 * i + 1] = json_object_get_uint32(json_name, "flags");
         split = json_object_get_uint32(json_name, "split");
         char c, *name = strdup(json_object_get_string(json_name, "name"));
-        if (name == NULL)
+        if (name == NULL) {
+            free(table);
             return 0xffff;
+        }
         len = (uint32_t)strlen(name);
         if (split == 0)
             split = len;
@@ -439,15 +455,17 @@ uint32_t write_nid(JSON_Object* json_nid, uint8_t* buf, uint32_t size)
         hdr->max_name_len = max(hdr->max_name_len, len);
         c = name[split];
         name[split] = 0;
-        pos = get_fragment(fragments, &fragments_size, name, (uint16_t)split);
+        pos = get_fragment(fragments, &fragments_size, table, table_size, name, (uint16_t)split);
         data[2 * hdr->count + i] = pos + hdr->count * sizeof_32(uint32_t);
         name[split] = c;
-        pos = get_fragment(fragments, &fragments_size, &name[split], (uint16_t)(len - split));
+        pos = get_fragment(fragments, &fragments_size, table, table_size, &name[split],
+            (uint16_t)(len - split));
         data[2 * hdr->count + i] <<= 16;
         data[2 * hdr->count + i] |= pos + hdr->count * sizeof_32(uint32_t);
         data[2 * hdr->count + i] = getv32(data[2 * hdr->count + i]);
         free(name);
     }
+    free(table);
     written += 3 * hdr->count * sizeof_32(uint32_t) + fragments_size;
     written = align_to_4(written);
     hdr->size = written;
@@ -460,7 +478,7 @@ uint32_t write_nid(JSON_Object* json_nid, uint8_t* buf, uint32_t size)
     return written;
 }
 
-uint32_t write_sdp(JSON_Object* json_sdp, uint8_t* buf, uint32_t size)
+static uint32_t write_sdp(JSON_Object* json_sdp, uint8_t* buf, uint32_t size)
 {
     sdp1_header* hdr = (sdp1_header*)buf;
     uint32_t* data, written = 0;
@@ -591,39 +609,44 @@ uint32_t write_sdp(JSON_Object* json_sdp, uint8_t* buf, uint32_t size)
     return written;
 }
 
-int main_utf8(int argc, char** argv)
+int gust_gmpk_process_file(const char* input_path, const gmpk_options* opt)
 {
-    char path[256], *dir = NULL;
+    char path[256], json_path[256] = { 0 }, *input = NULL, *dir = NULL;
     int r = -1;
     JSON_Value* json = NULL;
+    JSON_Writer* writer = NULL;
     FILE *file = NULL;
     uint8_t* buf = NULL;
-    bool list_only = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'l');
-    bool no_prompt = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'y');
+    gmpk_file* files = NULL;
+    file_view view = { 0 };
+    const bool list_only = opt->list_only;
 
-    if ((argc != 2) && !list_only && !no_prompt) {
-        printf("%s %s (c) 2021 VitaSmith\n\n"
-            "Usage: %s [-l] [-y] <file or directory>\n\n"
-            "Extracts (file) or recreates (directory) a Gust .gmpk model pack.\n\n"
-            "Note: A backup (.bak) of the original is automatically created, when the target\n"
-            "is being overwritten for the first time.\n",
-            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]));
-        return 0;
-    }
+    // We alter the path, and the endianness may remain from a previous file of this thread
+    input = strdup(input_path);
+    if (input == NULL)
+        goto out;
+    data_endianness = little_endian;
 
-    if (!is_directory(argv[argc - 1])) {
+    if (!is_directory(input)) {
         // Unpack a GMPK
-        printf("%s '%s'...\n", list_only ? "Listing" : "Extracting", argv[argc - 1]);
-        size_t len = strlen(argv[argc - 1]);
-        if (len < 5 || stricmp(&argv[argc - 1][len - 5], ".gmpk") != 0) {
+        printf("%s '%s'...\n", list_only ? "Listing" : "Extracting", input);
+        size_t len = strlen(input);
+        if (len < 5 || stricmp(&input[len - 5], ".gmpk") != 0) {
             fprintf(stderr, "ERROR: File should have a '.gmpk' extension\n");
             goto out;
         }
-        char* gmpk_pos = &argv[argc - 1][len - 5];
+        char* gmpk_pos = &input[len - 5];
 
-        uint32_t file_size = read_file(argv[argc - 1], &buf);
-        if (file_size == UINT32_MAX)
+        // Components are written straight from the mapped GMPK, which readers may
+        // alter (to fix endianness), since changes are never written back
+        if (!open_file_view(input, &view, true))
+            goto out;
+        if (view.size < sizeof(sdp1_header) || view.size >= UINT32_MAX) {
+            fprintf(stderr, "ERROR: Invalid GMPK size\n");
             goto out;
+        }
+        buf = view.data;
+        uint32_t file_size = (uint32_t)view.size;
 
         if (getle32(buf) != GMPK_MAGIC) {
             fprintf(stderr, "ERROR: Not a GMPK file (bad magic) or unsupported platform\n");
@@ -635,29 +658,49 @@ int main_utf8(int argc, char** argv)
             goto out;
         }
 
-        // Keep the information required to recreate the package in a JSON file
-        json = json_value_init_object();
-        json_object_set_number(json_object(json), "json_version", JSON_VERSION);
-        json_object_set_string(json_object(json), "name", _basename(argv[argc - 1]));
+        if (getle32(&buf[8]) == SDP1_BE_MAGIC)
+            data_endianness = big_endian;
 
-        gmpk_pos[0] = 0;
-        if (!list_only && !create_path(argv[argc - 1]))
+        // Keep the information required to recreate the package in a JSON file, which is
+        // written as the SDP gets validated, and only moved into place once we are done
+        char* gmpk_name = strdup(_basename(input));
+        if (gmpk_name == NULL) {
+            fprintf(stderr, "ERROR: Alloc error\n");
             goto out;
+        }
+        gmpk_pos[0] = 0;
+        if (!list_only) {
+            if (!create_path(input)) {
+                free(gmpk_name);
+                goto out;
+            }
+            snprintf(json_path, sizeof(json_path), "%s%cgmpk.json.tmp", input, PATH_SEP);
+            writer = json_writer_open(json_path);
+            if (writer == NULL) {
+                fprintf(stderr, "ERROR: Can't create '%s'\n", json_path);
+                free(gmpk_name);
+                goto out;
+            }
+        }
+        json_writer_begin_object(writer, NULL);
+        json_writer_number(writer, "json_version", JSON_VERSION);
+        json_writer_string(writer, "name", gmpk_name);
+        free(gmpk_name);
+        if (data_endianness == big_endian)
+            json_writer_boolean(writer, "big_endian", true);
 
-        dir = strdup(argv[argc - 1]);
+        dir = strdup(input);
         if (dir == NULL) {
             fprintf(stderr, "ERROR: Alloc error\n");
             goto out;
         }
         dir[get_trailing_slash(dir)] = 0;
 
-        JSON_Value* json_gmpk = read_sdp(buf, file_size);
-        if (json_gmpk == NULL)
+        uint64_t start = stats_start();
+        if (!read_sdp(buf, file_size, writer, "SDP"))
             goto out;
-
-        if (data_endianness == big_endian)
-            json_object_set_boolean(json_object(json), "big_endian", true);
-        json_object_set_value(json_object(json), "SDP", json_gmpk);
+        json_writer_end(writer);
+        stats_stop("sdp_read", start, ((sdp1_header*)buf)->size);
 
         sdp1_header* gmpk_sdp = (sdp1_header*)buf;
         assert(gmpk_sdp->entrymap_offset != 0);
@@ -666,8 +709,7 @@ int main_utf8(int argc, char** argv)
         uint32_t* fp = (uint32_t*)&buf[gmpk_sdp->entrymap_offset + entrymap_sdp->entry_offset];
         uint32_t offset = gmpk_sdp->size;
         file_entry* fe = (file_entry*)&buf[offset];
-        JSON_Array* json_names = json_object_dotget_array(json_object(json_gmpk), "NID.names");
-        if (json_array_get_count(json_names) == 0) {
+        if (nid_names_count == 0) {
             fprintf(stderr, "ERROR: NID names array was not found\n");
             goto out;
         }
@@ -682,7 +724,11 @@ int main_utf8(int argc, char** argv)
             goto out;
         }
         for (uint32_t i = 0; i < entrymap_sdp->entry_count; i++, fp = &fp[entrymap_sdp->entry_record_size]) {
-            const char* name = json_object_get_string(json_array_get_object(json_names, i), "name");
+            if (i >= nid_names_count) {
+                fprintf(stderr, "ERROR: Entry %d has no name\n", i);
+                goto out;
+            }
+            const char* name = &nid_names[(size_t)i * nid_name_stride];
             for (uint32_t j = 0; j < num_extensions_to_check; j++) {
                 if (getp32(&fp[2 * j]) == 1) {
                     uint32_t index = getp32(&fp[2 * j + 1]);
@@ -696,7 +742,7 @@ int main_utf8(int argc, char** argv)
                     uint32_t fe_offset = getp32(&fe[index].offset);
                     uint32_t fe_size = getp32(&fe[index].size);
                     snprintf(path, sizeof(path), "%s%s%c%s%s", dir,
-                       _basename(argv[argc - 1]), PATH_SEP, name, extension[j]);
+                       _basename(input), PATH_SEP, name, extension[j]);
                     printf("%08x %08x %s%s\n", offset + fe_offset, fe_size, name, extension[j]);
                     // More sanity checks
                     if (offset + fe_offset + fe_size > file_size) {
@@ -710,17 +756,10 @@ int main_utf8(int argc, char** argv)
                     extracted_files++;
                     if (list_only)
                         continue;
-                    FILE* dst = fopen_utf8(path, "wb");
-                    if (dst == NULL) {
-                        fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
-                        goto out;
-                    }
-                    if (fwrite(&buf[offset + fe_offset], 1, fe_size, dst) != fe_size) {
-                        fprintf(stderr, "ERROR: Can't write file '%s'\n", path);
-                        fclose(dst);
+                    start = stats_start();
+                    if (!write_output_file(&buf[offset + fe_offset], fe_size, path))
                         goto out;
-                    }
-                    fclose(dst);
+                    stats_stop("write", start, fe_size);
                 }
             }
         }
@@ -729,8 +768,17 @@ int main_utf8(int argc, char** argv)
             goto out;
         }
         if (!list_only) {
-            snprintf(path, sizeof(path), "%s%cgmpk.json", argv[argc - 1], PATH_SEP);
-            json_serialize_to_file_pretty(json, path);
+            start = stats_start();
+            JSON_Status status = json_writer_close(writer);
+            writer = NULL;
+            snprintf(path, sizeof(path), "%s%cgmpk.json", input, PATH_SEP);
+            remove_utf8(path);
+            if (status != JSONSuccess || rename_utf8(json_path, path) != 0) {
+                fprintf(stderr, "ERROR: Can't write '%s'\n", path);
+                goto out;
+            }
+            json_path[0] = 0;
+            stats_stop("json_write", start, 0);
         }
         if (extracted_files != files_count) {
             fprintf(stderr, "ERROR: Some files were not extracted\n");
@@ -743,16 +791,18 @@ int main_utf8(int argc, char** argv)
             fprintf(stderr, "ERROR: Option -l is not supported when creating an archive\n");
             goto out;
         }
-        snprintf(path, sizeof(path), "%s%cgmpk.json", argv[argc - 1], PATH_SEP);
+        snprintf(path, sizeof(path), "%s%cgmpk.json", input, PATH_SEP);
         if (!is_file(path)) {
             fprintf(stderr, "ERROR: '%s' does not exist\n", path);
             goto out;
         }
+        uint64_t start = stats_start();
         json = json_parse_file_with_comments(path);
         if (json == NULL) {
             fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", path);
             goto out;
         }
+        stats_stop("json_read", start, 0);
         const uint32_t json_version = json_object_get_uint32(json_object(json), "json_version");
         if (json_version != JSON_VERSION) {
             fprintf(stderr, "ERROR: This utility is not compatible with the JSON file provided.\n"
@@ -764,7 +814,7 @@ int main_utf8(int argc, char** argv)
         const char* filename = json_object_get_string(json_object(json), "name");
         if (filename == NULL)
             goto out;
-        strcpy(path, argv[argc - 1]);
+        strcpy(path, input);
         if (get_trailing_slash(path) != 0)
             path[get_trailing_slash(path)] = 0;
         else
@@ -773,12 +823,12 @@ int main_utf8(int argc, char** argv)
         path[sizeof(path) - 1] = 0;
         printf("Creating '%s'...\n", path);
         create_backup(path);
-        file = fopen_utf8(path, "wb+");
+        file = create_file(path, 0);
         if (file == NULL) {
             fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
             goto out;
         }
-        dir = strdup(argv[argc - 1]);
+        dir = strdup(input);
         if (dir == NULL) {
             fprintf(stderr, "ERROR: Alloc error\n");
             goto out;
@@ -798,11 +848,12 @@ int main_utf8(int argc, char** argv)
             fprintf(stderr, "ERROR: Invalid/missing NID JSON data\n");
             goto out;
         }
-        // Count the number of files we have available
+        // Count the number of files we have available, and get their sizes
         files_count = 0;
         entry_data_count = 0;
         entry_data = calloc(names_count * sizeof(model_entry), 1);
-        if (entry_data == NULL)
+        files = calloc((size_t)names_count * array_size(extension), sizeof(gmpk_file));
+        if (entry_data == NULL || files == NULL)
             goto out;
         // Note: We expect the EntryMap entry data to be as follows:
         // If we only have one set of .g1m/.g1t/.g1h, there is a single model_entry
@@ -821,8 +872,14 @@ int main_utf8(int argc, char** argv)
             model_entry* me = (model_entry*)&entry_data[entry_data_count];
             for (size_t j = 0; j < array_size(extension); j++) {
                 snprintf(path, sizeof(path), "%s%s%c%s%s", dir,
-                    _basename(argv[argc - 1]), PATH_SEP, name, extension[j]);
+                    _basename(input), PATH_SEP, name, extension[j]);
                 if (is_file(path)) {
+                    uint64_t file_size = get_file_size(path);
+                    if (file_size >= UINT32_MAX)
+                        goto out;
+                    files[files_count].name_index = (uint32_t)i;
+                    files[files_count].extension = (uint32_t)j;
+                    files[files_count].size = (uint32_t)file_size;
                     me->component[j].has_component = 1;
                     me->component[j].file_index = files_count++;
                 }
@@ -838,69 +895,103 @@ int main_utf8(int argc, char** argv)
         buf = calloc(MAX_HEADER_SIZE, 1);
         if (buf == NULL)
             goto out;
+        start = stats_start();
         uint32_t header_size = write_sdp(json_gmpk, buf, MAX_HEADER_SIZE);
         if (header_size == 0)
             goto out;
+        stats_stop("sdp_write", start, header_size);
 
-        // Create the file entry data section (we will fill the offsets/sizes later)
+        // Lay out the file entry data section, followed by the 16-byte aligned files
         file_entry* fe = (file_entry*)&buf[header_size];
         uint32_t fe_size = align_to_16((files_count + 1) * (uint32_t)sizeof(file_entry));
-        fwrite(buf, 1, (size_t)header_size + fe_size, file);
-
-        // Add file content to the GMPK
-        printf("OFFSET   SIZE     NAME\n");
-        uint32_t index = 0;
-        uint8_t padding_buf[0x10] = { 0 };
-        for (size_t i = 0; i < json_array_get_count(json_names_array); i++) {
-            const char* name = json_object_get_string(json_array_get_object(json_names_array, i), "name");
-            for (size_t j = 0; j < array_size(extension); j++) {
-                snprintf(path, sizeof(path), "%s%s%c%s%s", dir,
-                    _basename(argv[argc - 1]), PATH_SEP, name, extension[j]);
-                if (is_file(path)) {
-                    snprintf(path, sizeof(path), "%s%s%c%s%s", dir,
-                        _basename(argv[argc - 1]), PATH_SEP, name, extension[j]);
-                    uint8_t* src_buf = NULL;
-                    fe[index].offset = ftell(file) - header_size;
-                    assert(fe[index].offset % 0x10 == 0);
-                    fe[index].size = read_file(path, &src_buf);
-                    if (fe[index].size == UINT32_MAX)
-                        goto out;
-                    printf("%08x %08x %s%s\n", (uint32_t)ftell(file), fe[index].size, name, extension[j]);
-                    if (fwrite(src_buf, 1, fe[index].size, file) != fe[index].size) {
-                        fprintf(stderr, "ERROR: Can't add data from '%s'\n", path);
-                        free(src_buf);
-                        goto out;
-                    }
-                    free(src_buf);
-                    // Pad to 16 bytes
-                    if (fe[index].size % 0x10 != 0)
-                        fwrite(padding_buf, 1, 0x10 - (fe[index].size % 0x10), file);
-                    index++;
-                }
+        if (header_size + fe_size > MAX_HEADER_SIZE) {
+            fprintf(stderr, "ERROR: File entry data section is too large\n");
+            goto out;
+        }
+        uint64_t offset = fe_size;
+        for (uint32_t i = 0; i < files_count; i++) {
+            fe[i].offset = (uint32_t)offset;
+            fe[i].size = files[i].size;
+            offset = align_to_16(offset + files[i].size);
+            if (header_size + offset >= UINT32_MAX) {
+                fprintf(stderr, "ERROR: GMPK is too large\n");
+                goto out;
             }
         }
-
-        // Now overwrite the file entry data
-        fe[files_count].offset = ftell(file);
-        assert(fe[files_count].offset % 0x10 == 0);
+        fe[files_count].offset = header_size + (uint32_t)offset;
+        uint32_t total_size = fe[files_count].offset;
         for (uint32_t i = 0; i <= 2 * files_count; i++)
             ((uint32_t*)fe)[i] = getv32(((uint32_t*)fe)[i]);
-        fseek(file, header_size, SEEK_SET);
-        if (fwrite(fe, 1, fe_size, file) != fe_size) {
-            fprintf(stderr, "ERROR: Can't write file entry data section\n");
+
+        // Set the final size of the GMPK, which also zeroes the padding, and fill it
+        if (!preallocate_file(file, total_size) || !write_at(file, buf, (size_t)header_size + fe_size, 0)) {
+            fprintf(stderr, "ERROR: Can't write GMPK header\n");
             goto out;
         }
+        printf("OFFSET   SIZE     NAME\n");
+        for (uint32_t i = 0; i < files_count; i++) {
+            const char* name = json_object_get_string(json_array_get_object(json_names_array, files[i].name_index), "name");
+            const char* ext = extension[files[i].extension];
+            snprintf(path, sizeof(path), "%s%s%c%s%s", dir, _basename(input), PATH_SEP, name, ext);
+            uint32_t file_offset = header_size + getv32(fe[i].offset);
+            assert(file_offset % 0x10 == 0);
+            printf("%08x %08x %s%s\n", file_offset, files[i].size, name, ext);
+            FILE* src = fopen_utf8(path, "rb");
+            if (src == NULL) {
+                fprintf(stderr, "ERROR: Can't open '%s'\n", path);
+                goto out;
+            }
+            start = stats_start();
+            bool copied = copy_file_data(src, 0, file, file_offset, files[i].size);
+            fclose(src);
+            if (!copied) {
+                fprintf(stderr, "ERROR: Can't add data from '%s'\n", path);
+                goto out;
+            }
+            stats_stop("copy", start, files[i].size);
+        }
         r = 0;
     }
 
 out:
+    if (writer != NULL)
+        json_writer_close(writer);
+    if (json_path[0] != 0)
+        remove_utf8(json_path);
     json_value_free(json);
-    free(buf);
+    if (view.data != NULL)
+        close_file_view(&view);
+    else
+        free(buf);
+    free(input);
     free(dir);
     free(entry_data);
+    entry_data = NULL;
+    free(files);
+    free(nid_names);
+    nid_names = NULL;
+    nid_names_count = 0;
     if (file != NULL)
         fclose(file);
+    return r;
+}
+
+int main_utf8(int argc, char** argv)
+{
+    gmpk_options opt = { (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'l') };
+    bool no_prompt = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'y');
+
+    if ((argc != 2) && !opt.list_only && !no_prompt) {
+        printf("%s %s (c) 2021 VitaSmith\n\n"
+            "Usage: %s [-l] [-y] <file or directory>\n\n"
+            "Extracts (file) or recreates (directory) a Gust .gmpk model pack.\n\n"
+            "Note: A backup (.bak) of the original is automatically created, when the target\n"
+            "is being overwritten for the first time.\n",
+            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]));
+        return 0;
+    }
 
+    int r = gust_gmpk_process_file(argv[argc - 1], &opt);
     if (r != 0 && !no_prompt) {
         fflush(stdin);
         printf("\nPress any key to continue...");
@@ -911,3 +1002,66 @@ out:
 }
 
 CALL_MAIN
+
+#if defined(GUST_BENCH)
+#include "bench.h"
+
+// Fragments are addressed with 16-bit offsets, so the NameMaps we simulate stay small
+#define BENCH_FRAGMENTS     1024
+#define BENCH_LOOKUPS       8192
+#define BENCH_FRAGMENT_LEN  24
+
+typedef struct {
+    char        pool[BENCH_FRAGMENTS][BENCH_FRAGMENT_LEN];
+    uint16_t    len[BENCH_FRAGMENTS];
+    uint16_t    lookup[BENCH_LOOKUPS];
+    uint8_t     fragments[0x10000];
+    uint32_t*   table;
+    uint32_t    table_size;
+} gmpk_bench;
+
+static bool bench_get_fragment(void* _ctx)
+{
+    gmpk_bench* ctx = (gmpk_bench*)_ctx;
+    uint16_t fragments_size = 0;
+    memset(ctx->table, 0, ctx->table_size * sizeof(uint32_t));
+    for (uint32_t i = 0; i < BENCH_LOOKUPS; i++) {
+        uint16_t j = ctx->lookup[i];
+        get_fragment(ctx->fragments, &fragments_size, ctx->table, ctx->table_size, ctx->pool[j], ctx->len[j]);
+    }
+    return true;
+}
+
+bool gust_gmpk_bench(void)
+{
+    static const char* prefix[] = { "bone", "mesh", "body", "hair", "face", "eye", "cloth", "weapon" };
+    if (!bench_selected("get_fragment"))
+        return true;
+    gmpk_bench* ctx = calloc(1, sizeof(gmpk_bench));
+    if (ctx == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate buffers\n");
+        return false;
+    }
+    // Model names share a few prefixes, and each fragment is looked up several times
+    size_t size = 0;
+    for (uint32_t j = 0; j < BENCH_FRAGMENTS; j++)
+        ctx->len[j] = (uint16_t)snprintf(ctx->pool[j], BENCH_FRAGMENT_LEN, "%s_%0*x", prefix[j % array_size(prefix)],
+            (int)(2 + j % 7), (j * 2654435761U) >> 12);
+    bench_fill((uint8_t*)ctx->lookup, sizeof(ctx->lookup), 6, false);
+    for (uint32_t i = 0; i < BENCH_LOOKUPS; i++) {
+        ctx->lookup[i] %= BENCH_FRAGMENTS;
+        size += ctx->len[ctx->lookup[i]];
+    }
+    // Same sizing as write_nid(), with 2 fragments per name
+    ctx->table_size = 16;
+    while (ctx->table_size < 2 * BENCH_LOOKUPS)
+        ctx->table_size <<= 1;
+    ctx->table = calloc(ctx->table_size, sizeof(uint32_t));
+    if (ctx->table == NULL)
+        fprintf(stderr, "ERROR: Can't allocate hash table\n");
+    bool r = (ctx->table != NULL) && bench_kernel("get_fragment", bench_get_fragment, ctx, size);
+    free(ctx->table);
+    free(ctx);
+    return r;
+}
+#endif
@@ -1,482 +1,1569 @@
-/*
-  gust_pak - PAK archive unpacker for Gust (Koei/Tecmo) PC games
-  Copyright © 2019-2022 VitaSmith
-  Copyright © 2018 Yuri Hime (shizukachan)
-
-  This program is free software: you can redistribute it and/or modify
-  it under the terms of the GNU General Public License as published by
- the Free Software Foundation, either version 3 of the License, or
-  (at your option) any later version.
-
-  This program is distributed in the hope that it will be useful,
-  but WITHOUT ANY WARRANTY; without even the implied warranty of
-  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-  GNU General Public License for more details.
-
-  You should have received a copy of the GNU General Public License
-  along with this program.  If not, see <http://www.gnu.org/licenses/>.
-*/
-
-#include <stdint.h>
-#include <inttypes.h>
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-
-#include "utf8.h"
-#include "util.h"
-#include "parson.h"
-
-#define A17_KEY_SIZE        20
-#define A22_KEY_SIZE        32
-#define MAX_KEY_SIZE        32
-#define CURRENT_KEY_SIZE    (is_a22 ? A22_KEY_SIZE : A17_KEY_SIZE)
-#define FILENAME_SIZE       128
-
-#pragma pack(push, 1)
-typedef struct {
-    uint32_t version;
-    uint32_t nb_files;
-    uint32_t header_size;
-    uint32_t flags;
-} pak_header;
-
-typedef struct {
-    char     filename[FILENAME_SIZE];
-    uint32_t size;
-    uint8_t  key[A17_KEY_SIZE];
-    uint32_t data_offset;
-    uint32_t flags;
-} pak_entry32;
-
-typedef struct {
-    char     filename[FILENAME_SIZE];
-    uint32_t size;
-    uint8_t  key[A17_KEY_SIZE];
-    uint64_t data_offset;
-    uint64_t flags;
-} pak_entry64;
-
-typedef struct {
-    char     filename[FILENAME_SIZE];
-    uint32_t size;
-    uint8_t  key[A22_KEY_SIZE];
-    uint32_t extra;
-    uint64_t data_offset;
-    uint64_t flags;
-} pak_entry64_a22;
-#pragma pack(pop)
-
-#define MAX_PAK_ENTRY_SIZE  sizeof(pak_entry64_a22)
-#define CURRENT_ENTRY_SIZE  (is_pak64 ? (is_a22 ? sizeof(pak_entry64_a22) : sizeof(pak_entry64)) : sizeof(pak_entry32))
-
-//
-// Per-game master keys that are used to decrypt data for A23 and later games.
-//
-// Note that the key below was derived directly from the PAK data rather than
-// extracted from the game executable, where it also resides (and we will be
-// happy to submit *FORMAL PROOF* of this, if legally challenged).
-// As a result, because it was derived directly from the encrypted data, we
-// did not have to circumvent any means of copy protection or breach the
-// license agreement and therefore consider that there exist no legal barrier
-// to publishing it in this source, per "clean room design" rules.
-//
-static char* master_key[][2] = {
-    { "", "" },                                     // No master key
-    { "A23", "dGGKXLHLuCJwv8aBc3YQX6X6sREVPchs" },  // A23 master key
-};
-const char* mk;
-
-static __inline void decode(uint8_t* a, uint8_t* k, uint32_t size, uint32_t key_size)
-{
-    // We may call decode() multiple times so make sure we preserve the original key
-    uint8_t _k[MAX_KEY_SIZE];
-    if (mk[0] != 0) {
-        // XOR with the master key
-        for (uint32_t i = 0; i < key_size; i++)
-            _k[i] = k[i] ^ mk[i];
-        k = _k;
-    }
-    for (uint32_t i = 0; i < size; i++)
-        a[i] ^= k[i % key_size];
-}
-
-static char* key_to_string(uint8_t* key, uint32_t key_size)
-{
-    static char key_string[2 * MAX_KEY_SIZE + 1];
-    for (size_t i = 0; i < key_size; i++) {
-        key_string[2 * i] = ((key[i] >> 4) < 10) ? '0' + (key[i] >> 4) : 'a' + (key[i] >> 4) - 10;
-        key_string[2 * i + 1] = ((key[i] & 0xf) < 10) ? '0' + (key[i] & 0xf) : 'a' + (key[i] & 0xf) - 10;
-    }
-    key_string[2 * key_size] = 0;
-    return key_string;
-}
-
-static uint8_t* string_to_key(const char* str, uint32_t key_size)
-{
-    static uint8_t key[MAX_KEY_SIZE];
-    for (size_t i = 0; i < key_size; i++) {
-        key[i] = (str[2 * i] >= 'a') ? str[2 * i] - 'a' + 10 : str[2 * i] - '0';
-        key[i] <<= 4;
-        key[i] += (str[2 * i + 1] >= 'a') ? str[2 * i + 1] - 'a' + 10 : str[2 * i + 1] - '0';
-    }
-    return key;
-}
-
-uint32_t alphanum_score(const char* str, size_t len)
-{
-    uint32_t score = 0;
-    for (uint32_t i = 0; i < len; i++) {
-        char c = str[i];
-        if (c == 0 || c == '.' ||  (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || c == '\\' || (c >= 'a' && c <= 'z'))
-            continue;
-        score += (c > 0x7E) ? 0x1000 : 0x10;
-    }
-    return score;
-}
-
-char *randstring(int length) { // length should be qualified as const if you follow a rigorous standard
-
-    static char charset[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";    
-    char *randomString = NULL;   // initializing to NULL isn't necessary as malloc() returns NULL if it couldn't allocate memory as requested
-
-    if (length) {
-        randomString = malloc(length +1); // I removed your `sizeof(char) * (length +1)` as sizeof(char) == 1, cf. C99
-
-        if (randomString) {        
-            for (int n = 0;n < length;n++) {        
-                int key = rand() % (int) (sizeof(charset) -1);
-                randomString[n] = charset[key];
-            }
-
-            randomString[length] = '\0';
-        }
-    }
-
-    return randomString;
-}
-
-// To handle either 32 or 64 bit PAK entries
-#define entries32     ((pak_entry32*)entries)
-#define entries64     ((pak_entry64*)entries)
-#define entries64_a22 ((pak_entry64_a22*)entries)
-#define entry(i, m) (is_pak64 ? (is_a22 ? (entries64_a22[i]).m : (entries64[i]).m) : (entries32[i]).m)
-#define set_entry(i, m, v) do { if (is_pak64) { if (is_a22) (entries64_a22[i]).m = v; else (entries64[i]).m = v; } \
-                                else (entries32[i]).m = (uint32_t)(v);} while(0)
-
-int main_utf8(int argc, char** argv)
-{
-    int r = -1;
-    FILE* file = NULL;
-    uint8_t zero_key[MAX_KEY_SIZE] = { 0 }, *buf = NULL;
-    char path[PATH_MAX];
-    pak_header hdr = { 0 };
-    void* entries = NULL;
-    JSON_Value* json = NULL;
-    bool is_pak64 = false, is_a22 = false;
-    bool list_only = (argc == 3) && (argv[1][0] == '-') && (argv[1][1] == 'l');
-
-    if ((argc != 2) && !list_only) {
-        printf("%s %s (c) 2018-2022 Yuri Hime & VitaSmith\n\n"
-            "Usage: %s [-l] <Gust PAK file>\n\n"
-            "Extracts (.pak) or recreates (.json) a Gust .pak archive.\n\n",
-            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]));
-        return 0;
-    }
-
-    if (is_directory(argv[argc - 1])) {
-        fprintf(stderr, "ERROR: Directory packing is not supported.\n"
-            "To recreate a .pak you need to use the corresponding .json file.\n");
-    } else if (strstr(argv[argc - 1], ".json") != NULL) {
-        if (list_only) {
-            fprintf(stderr, "ERROR: Option -l is not supported when creating an archive\n");
-            goto out;
-        }
-        json = json_parse_file_with_comments(argv[argc - 1]);
-        if (json == NULL) {
-            fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", argv[argc - 1]);
-            goto out;
-        }
-        const char* filename = json_object_get_string(json_object(json), "name");
-        hdr.header_size = json_object_get_uint32(json_object(json), "header_size");
-        if ((filename == NULL) || (hdr.header_size != sizeof(pak_header))) {
-            fprintf(stderr, "ERROR: No filename/wrong header size\n");
-            goto out;
-        }
-        hdr.version = json_object_get_uint32(json_object(json), "version");
-        hdr.flags = json_object_get_uint32(json_object(json), "flags");
-        hdr.nb_files = json_object_get_uint32(json_object(json), "nb_files");
-        mk = json_object_get_string(json_object(json), "master_key");
-        if (mk == NULL)
-            mk = master_key[0][1];
-        is_pak64 = json_object_get_boolean(json_object(json), "64-bit");
-        is_a22 = json_object_get_boolean(json_object(json), "a22-extensions");
-        if (is_a22 && !is_pak64) {
-            fprintf(stderr, "ERROR: A22 extensions can only be used on 64-bit PAKs\n");
-            goto out;
-        }
-        snprintf(path, sizeof(path), "%s%c%s", _dirname(argv[argc - 1]), PATH_SEP, filename);
-        printf("Creating '%s'...\n", path);
-        create_backup(path);
-        file = fopen_utf8(path, "wb+");
-        if (file == NULL) {
-            fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
-            goto out;
-        }
-        if (fwrite(&hdr, sizeof(pak_header), 1, file) != 1) {
-            fprintf(stderr, "ERROR: Can't write PAK header\n");
-            goto out;
-        }
-        entries = calloc(hdr.nb_files, CURRENT_ENTRY_SIZE);
-        if (entries == NULL) {
-            fprintf(stderr, "ERROR: Can't allocate entries\n");
-            goto out;
-        }
-        // Write a dummy table for now
-        if (fwrite(entries, CURRENT_ENTRY_SIZE, hdr.nb_files, file) != hdr.nb_files) {
-            fprintf(stderr, "ERROR: Can't write initial PAK table\n");
-            goto out;
-        }
-        uint64_t file_data_offset = ftell64(file);
-
-        JSON_Array* json_files_array = json_object_get_array(json_object(json), "files");
-        printf("OFFSET    SIZE     NAME\n");
-        for (uint32_t i = 0; i < hdr.nb_files; i++) {
-            JSON_Object* file_entry = json_array_get_object(json_files_array, i);
-            uint8_t* key = string_to_key(json_object_get_string(file_entry, "key"), CURRENT_KEY_SIZE);
-            filename = json_object_get_string(file_entry, "name");
-            strncpy(entry(i, filename), filename, FILENAME_SIZE - 1);
-            snprintf(path, sizeof(path), "%s%c%s", _dirname(argv[argc - 1]), PATH_SEP, filename);
-            for (size_t n = 0; n < strlen(path); n++) {
-                if (path[n] == '\\')
-                    path[n] = PATH_SEP;
-            }
-            set_entry(i, size, read_file(path, &buf));
-            if (entry(i, size) == UINT32_MAX)
-                goto out;
-            bool skip_encode = true;
-            for (int j = 0; j < CURRENT_KEY_SIZE; j++) {
-                entry(i, key)[j] = key[j];
-                if (key[j] != 0)
-                    skip_encode = false;
-            }
-
-            set_entry(i, data_offset, ftell64(file) - file_data_offset);
-            uint64_t flags = json_object_get_uint64(file_entry, "flags");
-            if (is_pak64)
-                setbe64(is_a22 ? &(entries64_a22[i].flags) : &(entries64[i].flags), flags);
-            else
-                setbe32(&(entries32[i].flags), (uint32_t)flags);
-            if (is_a22)
-                setbe32(&(entries64_a22[i].extra), json_object_get_uint32(file_entry, "extra"));
-            printf("%09" PRIx64 " %08x %s%c\n", entry(i, data_offset) + file_data_offset,
-                entry(i, size), entry(i, filename), skip_encode ? '*' : ' ');
-            if (!skip_encode) {
-                decode((uint8_t*)entry(i, filename), entry(i, key), FILENAME_SIZE, CURRENT_KEY_SIZE);
-                decode(buf, entry(i, key), entry(i, size), CURRENT_KEY_SIZE);
-            }
-            if (fwrite(buf, 1, entry(i, size), file) != entry(i, size)) {
-                fprintf(stderr, "ERROR: Can't write data for '%s'\n", path);
-                goto out;
-            }
-            free(buf);
-            buf = NULL;
-        }
-        fseek64(file, sizeof(pak_header), SEEK_SET);
-        if (fwrite(entries, CURRENT_ENTRY_SIZE, hdr.nb_files, file) != hdr.nb_files) {
-            fprintf(stderr, "ERROR: Can't write PAK table\n");
-            goto out;
-        }
-        r = 0;
-    } else {
-        printf("%s '%s'...\n", list_only ? "Listing" : "Extracting", _basename(argv[argc - 1]));
-        file = fopen_utf8(argv[argc - 1], "rb");
-        if (file == NULL) {
-            fprintf(stderr, "ERROR: Can't open PAK file '%s'", argv[argc - 1]);
-            goto out;
-        }
-
-        if (fread(&hdr, sizeof(hdr), 1, file) != 1) {
-            fprintf(stderr, "ERROR: Can't read hdr");
-            goto out;
-        }
-
-        if ((hdr.version != 0x20000) || (hdr.header_size != sizeof(pak_header))) {
-            fprintf(stderr, "ERROR: Signature doesn't match expected PAK file format.\n");
-            goto out;
-        }
-        if (hdr.nb_files > 65536) {
-            fprintf(stderr, "ERROR: Too many entries (%d).\n", hdr.nb_files);
-            goto out;
-        }
-
-        entries = calloc(hdr.nb_files, MAX_PAK_ENTRY_SIZE);
-        if (entries == NULL) {
-            fprintf(stderr, "ERROR: Can't allocate entries\n");
-            goto out;
-        }
-
-        if (fread(entries, MAX_PAK_ENTRY_SIZE, hdr.nb_files, file) != hdr.nb_files) {
-            fprintf(stderr, "ERROR: Can't read PAK hdr\n");
-            goto out;
-        }
-
-        // Detect if we are dealing with 32 or 64-bit pak entries by checking
-        // the data_offsets at the expected 32 and 64-bit struct location and
-        // adding the absolute value of the difference with last data_offset.
-        // The sum that is closest to zero tells us if we are dealing with a
-        // 32 or 64-bit PAK archive, as well as if it uses A22 extensions.
-        uint64_t sum[3] = { 0, 0, 0 };
-        uint32_t val[3], last[3] = { 0, 0, 0 };
-        for (uint32_t i = 0; i < min(hdr.nb_files, 64); i++) {
-            val[0] = ((pak_entry32*)entries)[i].data_offset;
-            val[1] = (uint32_t)(((pak_entry64*)entries)[i].data_offset >> 32);
-            val[2] = (uint32_t)(((pak_entry64_a22*)entries)[i].data_offset >> 32);
-            for (int j = 0; j < 3; j++) {
-                sum[j] += (val[j] > last[j]) ? val[j] - last[j] : last[j] - val[j];
-                last[j] = val[j];
-            }
-        }
-        is_pak64 = min(sum[0], min(sum[1], sum[2])) == min(sum[1], sum[2]);
-        is_a22 = is_pak64 && (min(sum[1], sum[2]) == sum[2]);
-        printf("Detected %s PAK format\n", is_pak64 ? (is_a22 ? "A22/64-bit" : "A18/64-bit") : "A17/32-bit");
-
-        // Determine the master key that needs to be applied, if any
-        char filename[FILENAME_SIZE];
-        uint32_t weight[array_size(master_key)], best_score, best_weight, best_k, increment = 1;
-        memset(weight, 0, array_size(master_key) * sizeof(uint32_t));
-        // 128-255 entries should be enough for our detection
-        if (hdr.nb_files > 0x80)
-            increment = hdr.nb_files / (hdr.nb_files / 0x80);
-        for (uint32_t i = 0; i < hdr.nb_files; i += increment) {
-            bool skip_decode = (memcmp(zero_key, entry(i, key), CURRENT_KEY_SIZE) == 0);
-            if (!skip_decode) {
-                best_score = UINT32_MAX;
-                best_k = 0;
-                for (uint32_t k = 0; k < array_size(master_key); k++) {
-                    mk = master_key[k][1];
-                    memcpy(filename, entry(i, filename), FILENAME_SIZE);
-                    decode((uint8_t*)filename, entry(i, key), FILENAME_SIZE, CURRENT_KEY_SIZE);
-                    uint32_t score = alphanum_score(filename, strnlen(filename, 0x20));
-                    if (score < best_score) {
-                        best_score = score;
-                        best_k = k;
-                    }
-                }
-                weight[best_k]++;
-            }
-        }
-        best_k = 0;
-        best_weight = 0;
-        for (uint32_t k = 0; k < array_size(master_key); k++) {
-            if (weight[k] > best_weight) {
-                best_weight = weight[k];
-                best_k = k;
-            }
-        }
-        mk = master_key[best_k][1];
-        if (mk[0] != 0)
-            printf("Using %s master key\n", master_key[best_k][0]);
-        printf("\n");
-
-        // Store the data we'll need to reconstruct the archive to a JSON file
-        json = json_value_init_object();
-        json_object_set_string(json_object(json), "name", change_extension(_basename(argv[argc - 1]), ".pak"));
-        json_object_set_number(json_object(json), "version", hdr.version);
-        json_object_set_number(json_object(json), "header_size", hdr.header_size);
-        json_object_set_number(json_object(json), "flags", hdr.flags);
-        json_object_set_number(json_object(json), "nb_files", hdr.nb_files);
-        json_object_set_boolean(json_object(json), "64-bit", is_pak64);
-        if (is_a22)
-            json_object_set_boolean(json_object(json), "a22-extensions", true);
-        if (mk[0] != 0)
-            json_object_set_string(json_object(json), "master_key", mk);
-
-        uint64_t file_data_offset = sizeof(pak_header) + (uint64_t)hdr.nb_files * CURRENT_ENTRY_SIZE;
-        JSON_Value* json_files_array = json_value_init_array();
-        printf("OFFSET    SIZE     NAME\n");
-        for (uint32_t i = 0; i < hdr.nb_files; i++) {
-            bool skip_decode = (memcmp(zero_key, entry(i, key), CURRENT_KEY_SIZE) == 0);
-            if (!skip_decode) {
-                decode((uint8_t*)entry(i, filename), entry(i, key), FILENAME_SIZE, CURRENT_KEY_SIZE);
-                for (int j = 0; j < FILENAME_SIZE && entry(i, filename)[j] != 0; j++) {
-                    char c = entry(i, filename)[j];
-                    if (c == 0)
-                        break;
-                    if (c < 0x20 || c > 0x7e) {
-                        fprintf(stderr, "ERROR: Failed to decode filename for entry %d\n", i);
-                        goto out;
-                    }
-                }
-            }
-            for (size_t n = 0; n < strlen(entry(i, filename)); n++) {
-                if (entry(i, filename)[n] == '\\')
-                    entry(i, filename)[n] = PATH_SEP;
-            }
-            printf("%09" PRIx64 " %08x %s%c\n", entry(i, data_offset) + file_data_offset,
-                entry(i, size), entry(i, filename), skip_decode ? '*' : ' ');
-            if (list_only)
-                continue;
-            JSON_Value* json_file = json_value_init_object();
-            json_object_set_string(json_object(json_file), "name", entry(i, filename));
-            json_object_set_string(json_object(json_file), "key", key_to_string(entry(i, key), CURRENT_KEY_SIZE));
-            uint64_t flags = is_pak64 ? (is_a22 ?
-                getbe64(&entries64_a22[i].flags) : getbe64(&entries64[i].flags)): getbe32(&entries32[i].flags);
-            if (flags != 0)
-                json_object_set_number(json_object(json_file), "flags", (double)flags);
-            if (is_a22 && (getbe32(&entries64_a22[i].extra) != 0))
-                json_object_set_number(json_object(json_file), "extra", (double)getbe32(&entries64_a22[i].extra));
-
-            json_array_append_value(json_array(json_files_array), json_file);
-            snprintf(path, sizeof(path), "%s%c%s", _dirname(argv[argc - 1]), PATH_SEP, randstring(20));
-            if (!create_path(_dirname(path))) {
-                fprintf(stderr, "ERROR: Can't create path '%s'\n", _dirname(path));
-                goto out;
-            }
-            fseek64(file, entry(i, data_offset) + file_data_offset, SEEK_SET);
-            buf = malloc(entry(i, size));
-            if (buf == NULL) {
-                fprintf(stderr, "ERROR: Can't allocate entries\n");
-                goto out;
-            }
-            if (fread(buf, 1, entry(i, size), file) != entry(i, size)) {
-                fprintf(stderr, "ERROR: Can't read archive\n");
-                goto out;
-            }
-            if (!skip_decode)
-                decode(buf, entry(i, key), entry(i, size), CURRENT_KEY_SIZE);
-            if (!write_file(buf, entry(i, size), path, false))
-                goto out;
-            free(buf);
-            buf = NULL;
-        }
-
-        if (!list_only) {
-            json_object_set_value(json_object(json), "files", json_files_array);
-            snprintf(path, sizeof(path), "%s%c%s", _dirname(argv[argc - 1]), PATH_SEP,
-                change_extension(_basename(argv[argc - 1]), ".json"));
-            printf("Creating '%s'\n", path);
-            json_serialize_to_file_pretty(json, path);
-        } else {
-            json_value_free(json_files_array);
-        }
-        r = 0;
-    }
-
-out:
-    json_value_free(json);
-    free(buf);
-    free(entries);
-    if (file != NULL)
-        fclose(file);
-
-    if (r != 0) {
-        fflush(stdin);
-        printf("\nPress any key to continue...");
-        (void)getchar();
-    }
-
-    return r;
-}
-
-CALL_MAIN
+/*
+  gust_pak - PAK archive unpacker for Gust (Koei/Tecmo) PC games
+  Copyright © 2019-2022 VitaSmith
+  Copyright © 2018 Yuri Hime (shizukachan)
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "utf8.h"
+#include "util.h"
+#include "parson.h"
+#include "batch.h"
+
+#define A17_KEY_SIZE        20
+#define A22_KEY_SIZE        32
+#define MAX_KEY_SIZE        32
+#define CURRENT_KEY_SIZE    (is_a22 ? A22_KEY_SIZE : A17_KEY_SIZE)
+#define FILENAME_SIZE       128
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t version;
+    uint32_t nb_files;
+    uint32_t header_size;
+    uint32_t flags;
+} pak_header;
+
+typedef struct {
+    char     filename[FILENAME_SIZE];
+    uint32_t size;
+    uint8_t  key[A17_KEY_SIZE];
+    uint32_t data_offset;
+    uint32_t flags;
+} pak_entry32;
+
+typedef struct {
+    char     filename[FILENAME_SIZE];
+    uint32_t size;
+    uint8_t  key[A17_KEY_SIZE];
+    uint64_t data_offset;
+    uint64_t flags;
+} pak_entry64;
+
+typedef struct {
+    char     filename[FILENAME_SIZE];
+    uint32_t size;
+    uint8_t  key[A22_KEY_SIZE];
+    uint32_t extra;
+    uint64_t data_offset;
+    uint64_t flags;
+} pak_entry64_a22;
+
+// Optional sidecar index, holding the decoded names of a PAK in sorted order, along
+// with everything we need to extract an entry without processing the PAK table.
+typedef struct {
+    uint32_t    magic;
+    uint32_t    version;
+    uint64_t    pak_size;
+    int64_t     pak_mtime;
+    pak_header  hdr;
+    uint8_t     is_pak64;
+    uint8_t     is_a22;
+    uint16_t    master_key;     // Index in master_key[]
+    uint32_t    names_size;
+} pak_index_header;
+
+typedef struct {
+    uint64_t    data_offset;
+    uint32_t    size;
+    uint32_t    name_offset;    // Offset in the names block, that follows the entries
+    uint8_t     key[MAX_KEY_SIZE];
+} pak_index_entry;
+#pragma pack(pop)
+
+#define PAK_INDEX_MAGIC     0x58444950  // 'PIDX'
+#define PAK_INDEX_VERSION   1
+
+// Entries are created in chunks of this size, which is a multiple of all the key sizes
+#define STREAM_CHUNK_SIZE   (A17_KEY_SIZE * A22_KEY_SIZE * 1024)
+// Unless -j is specified, creation always uses at least 2 threads, so that the reading,
+// encoding and writing of successive chunks overlap, even on a single CPU
+#define MIN_CREATE_THREADS  2
+#define MAX_CREATE_THREADS  4
+
+// Master key detection only needs to look at the start of the names
+#define DETECT_PREFIX_SIZE  0x20
+#define DETECT_MIN_SAMPLES  16
+// The cache of detected master keys is restarted when it grows beyond this size
+#define KEY_CACHE_MAX_SIZE  (64 * 1024)
+
+#define MAX_PAK_ENTRY_SIZE  sizeof(pak_entry64_a22)
+#define CURRENT_ENTRY_SIZE  (is_pak64 ? (is_a22 ? sizeof(pak_entry64_a22) : sizeof(pak_entry64)) : sizeof(pak_entry32))
+
+//
+// Per-game master keys that are used to decrypt data for A23 and later games.
+//
+// Note that the key below was derived directly from the PAK data rather than
+// extracted from the game executable, where it also resides (and we will be
+// happy to submit *FORMAL PROOF* of this, if legally challenged).
+// As a result, because it was derived directly from the encrypted data, we
+// did not have to circumvent any means of copy protection or breach the
+// license agreement and therefore consider that there exist no legal barrier
+// to publishing it in this source, per "clean room design" rules.
+//
+static char* master_key[][2] = {
+    { "", "" },                                     // No master key
+    { "A23", "dGGKXLHLuCJwv8aBc3YQX6X6sREVPchs" },  // A23 master key
+};
+// Master key of the archive being processed (worker threads inherit it from their context)
+static THREAD_LOCAL const char* mk;
+
+// Reference implementation of the decoding, that is used to validate the optimized one
+static void decode_scalar(uint8_t* dst, const uint8_t* src, uint8_t* k, uint32_t size, uint32_t key_size)
+{
+    // We may call decode() multiple times so make sure we preserve the original key
+    uint8_t _k[MAX_KEY_SIZE];
+    if (mk[0] != 0) {
+        // XOR with the master key
+        for (uint32_t i = 0; i < key_size; i++)
+            _k[i] = k[i] ^ mk[i];
+        k = _k;
+    }
+    for (uint32_t i = 0; i < size; i++)
+        dst[i] = src[i] ^ k[i % key_size];
+}
+
+// The optimized decoder processes blocks of XOR_BLOCK_SIZE bytes, using a key that
+// has already been combined with the master key and repeated, so that the key data
+// for a block starting at any key position can be read directly from it.
+#define XOR_BLOCK_SIZE      64
+#define EXPANDED_KEY_SIZE   (MAX_KEY_SIZE + XOR_BLOCK_SIZE)
+
+// Returns the number of bytes that were processed, which is a multiple of XOR_BLOCK_SIZE
+typedef uint32_t(*xor_blocks_fn)(uint8_t* dst, const uint8_t* src, const uint8_t* ek,
+                                 uint32_t key_size, uint32_t size);
+
+static uint32_t xor_blocks_generic(uint8_t* dst, const uint8_t* src, const uint8_t* ek,
+                                   uint32_t key_size, uint32_t size)
+{
+    uint32_t i, p = 0;
+    for (i = 0; i + XOR_BLOCK_SIZE <= size; i += XOR_BLOCK_SIZE) {
+        for (uint32_t j = 0; j < XOR_BLOCK_SIZE; j += sizeof(uint64_t)) {
+            uint64_t v, k;
+            memcpy(&v, &src[i + j], sizeof(v));
+            memcpy(&k, &ek[p + j], sizeof(k));
+            v ^= k;
+            memcpy(&dst[i + j], &v, sizeof(v));
+        }
+        p = (p + XOR_BLOCK_SIZE) % key_size;
+    }
+    return i;
+}
+
+#if defined(USE_SSE2)
+#include <immintrin.h>
+
+static uint32_t xor_blocks_sse2(uint8_t* dst, const uint8_t* src, const uint8_t* ek,
+                                uint32_t key_size, uint32_t size)
+{
+    uint32_t i, p = 0;
+    for (i = 0; i + XOR_BLOCK_SIZE <= size; i += XOR_BLOCK_SIZE) {
+        for (uint32_t j = 0; j < XOR_BLOCK_SIZE; j += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)&src[i + j]);
+            __m128i k = _mm_loadu_si128((const __m128i*)&ek[p + j]);
+            _mm_storeu_si128((__m128i*)&dst[i + j], _mm_xor_si128(v, k));
+        }
+        p = (p + XOR_BLOCK_SIZE) % key_size;
+    }
+    return i;
+}
+
+TARGET_AVX2 static uint32_t xor_blocks_avx2(uint8_t* dst, const uint8_t* src, const uint8_t* ek,
+                                            uint32_t key_size, uint32_t size)
+{
+    uint32_t i, p = 0;
+    for (i = 0; i + XOR_BLOCK_SIZE <= size; i += XOR_BLOCK_SIZE) {
+        for (uint32_t j = 0; j < XOR_BLOCK_SIZE; j += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i*)&src[i + j]);
+            __m256i k = _mm256_loadu_si256((const __m256i*)&ek[p + j]);
+            _mm256_storeu_si256((__m256i*)&dst[i + j], _mm256_xor_si256(v, k));
+        }
+        p = (p + XOR_BLOCK_SIZE) % key_size;
+    }
+    return i;
+}
+#elif defined(USE_NEON)
+#include <arm_neon.h>
+
+static uint32_t xor_blocks_neon(uint8_t* dst, const uint8_t* src, const uint8_t* ek,
+                                uint32_t key_size, uint32_t size)
+{
+    uint32_t i, p = 0;
+    for (i = 0; i + XOR_BLOCK_SIZE <= size; i += XOR_BLOCK_SIZE) {
+        for (uint32_t j = 0; j < XOR_BLOCK_SIZE; j += 16)
+            vst1q_u8(&dst[i + j], veorq_u8(vld1q_u8(&src[i + j]), vld1q_u8(&ek[p + j])));
+        p = (p + XOR_BLOCK_SIZE) % key_size;
+    }
+    return i;
+}
+#endif
+
+static xor_blocks_fn xor_blocks = xor_blocks_generic;
+
+static void decode_with(xor_blocks_fn kernel, uint8_t* dst, const uint8_t* src, uint8_t* k,
+                        uint32_t size, uint32_t key_size)
+{
+    uint8_t ek[EXPANDED_KEY_SIZE];
+    for (uint32_t i = 0; i < EXPANDED_KEY_SIZE; i++)
+        ek[i] = k[i % key_size] ^ ((mk[0] != 0) ? (uint8_t)mk[i % key_size] : 0);
+    uint32_t i = kernel(dst, src, ek, key_size, size);
+    for (uint32_t p = i % key_size; i < size; i++) {
+        dst[i] = src[i] ^ ek[p];
+        if (++p == key_size)
+            p = 0;
+    }
+}
+
+// Decode size bytes from src into dst, which may be the same buffer
+#define decode_to(dst, src, k, size, key_size) decode_with(xor_blocks, dst, src, k, size, key_size)
+
+// Select the fastest XOR kernel for this platform, after validating it against the scalar version.
+// This is only done once per process, even when multiple archives are processed concurrently.
+static mutex_t decode_lock = MUTEX_INITIALIZER;
+static bool decode_initialized = false;
+static void init_decode(void)
+{
+    lock_mutex(&decode_lock);
+    if (decode_initialized) {
+        unlock_mutex(&decode_lock);
+        return;
+    }
+    xor_blocks_fn candidates[3] = { NULL, NULL, xor_blocks_generic };
+#if defined(USE_SSE2)
+    if (cpu_has_avx2())
+        candidates[0] = xor_blocks_avx2;
+    candidates[1] = xor_blocks_sse2;
+#elif defined(USE_NEON)
+    candidates[1] = xor_blocks_neon;
+#endif
+    const char* saved_mk = mk;
+    uint8_t src[3 * XOR_BLOCK_SIZE + 7], ref[sizeof(src)], out[sizeof(src)], key[MAX_KEY_SIZE];
+    for (uint32_t i = 0; i < sizeof(src); i++)
+        src[i] = (uint8_t)(i * 0x9d + 0x3b);
+    for (uint32_t i = 0; i < MAX_KEY_SIZE; i++)
+        key[i] = (uint8_t)(i * 0x47 + 0x11);
+    for (uint32_t c = 0; c < array_size(candidates); c++) {
+        if (candidates[c] == NULL)
+            continue;
+        bool valid = true;
+        for (uint32_t m = 0; m < array_size(master_key) && valid; m++) {
+            mk = master_key[m][1];
+            for (uint32_t key_size = A17_KEY_SIZE; key_size <= A22_KEY_SIZE && valid;
+                 key_size += A22_KEY_SIZE - A17_KEY_SIZE) {
+                // Use different sizes and alignments, to exercise both the blocks and the tail
+                for (uint32_t size = 0; size <= sizeof(src) - 7 && valid; size += 13) {
+                    uint32_t offset = size % 7;
+                    decode_scalar(ref, &src[offset], key, size, key_size);
+                    decode_with(candidates[c], out, &src[offset], key, size, key_size);
+                    valid = (memcmp(ref, out, size) == 0);
+                }
+            }
+        }
+        if (valid) {
+            xor_blocks = candidates[c];
+            break;
+        }
+    }
+    mk = saved_mk;
+    decode_initialized = true;
+    unlock_mutex(&decode_lock);
+}
+
+#define decode(a, k, size, key_size) decode_to(a, a, k, size, key_size)
+
+static char* key_to_string(uint8_t* key, uint32_t key_size)
+{
+    static THREAD_LOCAL char key_string[2 * MAX_KEY_SIZE + 1];
+    for (size_t i = 0; i < key_size; i++) {
+        key_string[2 * i] = ((key[i] >> 4) < 10) ? '0' + (key[i] >> 4) : 'a' + (key[i] >> 4) - 10;
+        key_string[2 * i + 1] = ((key[i] & 0xf) < 10) ? '0' + (key[i] & 0xf) : 'a' + (key[i] & 0xf) - 10;
+    }
+    key_string[2 * key_size] = 0;
+    return key_string;
+}
+
+static char* hash_to_string(uint64_t hash)
+{
+    static THREAD_LOCAL char hash_string[17];
+    snprintf(hash_string, sizeof(hash_string), "%016" PRIx64, hash);
+    return hash_string;
+}
+
+static uint8_t* string_to_key(const char* str, uint32_t key_size)
+{
+    static THREAD_LOCAL uint8_t key[MAX_KEY_SIZE];
+    for (size_t i = 0; i < key_size; i++) {
+        key[i] = (str[2 * i] >= 'a') ? str[2 * i] - 'a' + 10 : str[2 * i] - '0';
+        key[i] <<= 4;
+        key[i] += (str[2 * i + 1] >= 'a') ? str[2 * i + 1] - 'a' + 10 : str[2 * i + 1] - '0';
+    }
+    return key;
+}
+
+static uint32_t alphanum_score(const char* str, size_t len)
+{
+    uint32_t score = 0;
+    for (uint32_t i = 0; i < len; i++) {
+        char c = str[i];
+        if (c == 0 || c == '.' ||  (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || c == '\\' || (c >= 'a' && c <= 'z'))
+            continue;
+        score += (c > 0x7E) ? 0x1000 : 0x10;
+    }
+    return score;
+}
+
+static char *randstring(int length) { // length should be qualified as const if you follow a rigorous standard
+
+    static char charset[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";    
+    char *randomString = NULL;   // initializing to NULL isn't necessary as malloc() returns NULL if it couldn't allocate memory as requested
+
+    if (length) {
+        randomString = malloc(length +1); // I removed your `sizeof(char) * (length +1)` as sizeof(char) == 1, cf. C99
+
+        if (randomString) {        
+            for (int n = 0;n < length;n++) {        
+                int key = rand() % (int) (sizeof(charset) -1);
+                randomString[n] = charset[key];
+            }
+
+            randomString[length] = '\0';
+        }
+    }
+
+    return randomString;
+}
+
+// To handle either 32 or 64 bit PAK entries
+#define entries32     ((pak_entry32*)entries)
+#define entries64     ((pak_entry64*)entries)
+#define entries64_a22 ((pak_entry64_a22*)entries)
+#define entry(i, m) (is_pak64 ? (is_a22 ? (entries64_a22[i]).m : (entries64[i]).m) : (entries32[i]).m)
+#define set_entry(i, m, v) do { if (is_pak64) { if (is_a22) (entries64_a22[i]).m = v; else (entries64[i]).m = v; } \
+                                else (entries32[i]).m = (uint32_t)(v);} while(0)
+
+// Determine the master key that needs to be applied, if any, by scoring the names
+// that a sample of up to 255 entries decode to with each master key
+static uint32_t detect_master_key(void* entries, uint32_t nb_files, bool is_pak64, bool is_a22)
+{
+    uint8_t zero_key[MAX_KEY_SIZE] = { 0 };
+    char filename[DETECT_PREFIX_SIZE];
+    uint32_t weight[array_size(master_key)], nb_samples = 0, increment = 1, best_k = 0;
+    memset(weight, 0, sizeof(weight));
+    // 128-255 entries should be enough for our detection
+    if (nb_files > 0x80)
+        increment = nb_files / (nb_files / 0x80);
+    for (uint32_t i = 0; i < nb_files; i += increment) {
+        if (memcmp(zero_key, entry(i, key), CURRENT_KEY_SIZE) == 0)
+            continue;
+        uint32_t best_score = UINT32_MAX, k_score = 0;
+        for (uint32_t k = 0; k < array_size(master_key); k++) {
+            mk = master_key[k][1];
+            decode_to((uint8_t*)filename, (uint8_t*)entry(i, filename), entry(i, key),
+                DETECT_PREFIX_SIZE, CURRENT_KEY_SIZE);
+            uint32_t score = alphanum_score(filename, strnlen(filename, DETECT_PREFIX_SIZE));
+            if (score < best_score) {
+                best_score = score;
+                k_score = k;
+            }
+        }
+        weight[k_score]++;
+        nb_samples++;
+
+        // Stop as soon as the leading key can't be overtaken by the remaining samples,
+        // or leads by more than 3 standard deviations of an even split of the votes
+        uint32_t second_weight = 0;
+        best_k = 0;
+        for (uint32_t k = 1; k < array_size(master_key); k++) {
+            if (weight[k] > weight[best_k]) {
+                second_weight = weight[best_k];
+                best_k = k;
+            } else if (weight[k] > second_weight) {
+                second_weight = weight[k];
+            }
+        }
+        uint32_t lead = weight[best_k] - second_weight, remaining = (nb_files - 1 - i) / increment;
+        if (lead > remaining || (nb_samples >= DETECT_MIN_SAMPLES && lead * lead >= 9 * nb_samples))
+            break;
+    }
+    return best_k;
+}
+
+// Cache of the detected master keys, keyed by a hash of the PAK header and table,
+// so that repeated listings or extractions of the same archive can skip detection
+static mutex_t key_cache_lock = MUTEX_INITIALIZER;
+
+static uint32_t lookup_master_key(const char* cache_path, uint64_t hash)
+{
+    char line[64];
+    uint32_t k = UINT32_MAX;
+    lock_mutex(&key_cache_lock);
+    FILE* file = fopen_utf8(cache_path, "r");
+    if (file != NULL) {
+        while (fgets(line, sizeof(line), file) != NULL) {
+            uint64_t h;
+            uint32_t v;
+            if (sscanf(line, "%" SCNx64 " %u", &h, &v) == 2 && h == hash && v < array_size(master_key))
+                k = v;
+        }
+        fclose(file);
+    }
+    unlock_mutex(&key_cache_lock);
+    return k;
+}
+
+static void record_master_key(const char* cache_path, uint64_t hash, uint32_t k)
+{
+    lock_mutex(&key_cache_lock);
+    uint64_t size = is_file(cache_path) ? get_file_size(cache_path) : 0;
+    FILE* file = fopen_utf8(cache_path, (size < KEY_CACHE_MAX_SIZE) ? "a" : "w");
+    // Not being able to cache the key is not an error
+    if (file != NULL) {
+        fprintf(file, "%016" PRIx64 " %u\n", hash, k);
+        fclose(file);
+    }
+    unlock_mutex(&key_cache_lock);
+}
+
+// Data needed by the extraction workers
+typedef struct {
+    FILE*           file;
+    const uint8_t*  map;        // Mapped archive, or NULL if we use regular reads
+    uint64_t        map_size;
+    void*           entries;
+    char**          paths;
+    uint8_t**       bufs;       // Per-thread reusable data buffers
+    uint32_t*       buf_sizes;
+    uint64_t*       hashes;     // Hashes of the extracted data (optional)
+    JSON_Writer*    writer;     // Manifest, that the entries are added to once extracted (optional)
+    bool*           extracted;
+    uint32_t        next_write; // Index of the next entry to add to the manifest
+    uint32_t        nb_entries;
+    const char*     mk;
+    uint64_t        file_data_offset;
+    bool            is_pak64;
+    bool            is_a22;
+} extract_ctx;
+
+static mutex_t manifest_lock = MUTEX_INITIALIZER;
+
+// Add the data we'll need to reconstruct the archive for an entry, straight from the table
+static void write_manifest_entry(JSON_Writer* writer, void* entries, uint32_t i, uint64_t hash,
+                                 bool is_pak64, bool is_a22)
+{
+    json_writer_begin_object(writer, NULL);
+    json_writer_string(writer, "name", entry(i, filename));
+    json_writer_string(writer, "key", key_to_string(entry(i, key), CURRENT_KEY_SIZE));
+    uint64_t flags = is_pak64 ? (is_a22 ?
+        getbe64(&entries64_a22[i].flags) : getbe64(&entries64[i].flags)): getbe32(&entries32[i].flags);
+    if (flags != 0)
+        json_writer_number(writer, "flags", (double)flags);
+    if (is_a22 && (getbe32(&entries64_a22[i].extra) != 0))
+        json_writer_number(writer, "extra", (double)getbe32(&entries64_a22[i].extra));
+    json_writer_string(writer, "hash", hash_to_string(hash));
+    json_writer_end(writer);
+}
+
+static bool extract_entry_data(void* _ctx, uint32_t thread_index, uint32_t i)
+{
+    extract_ctx* ctx = (extract_ctx*)_ctx;
+    void* entries = ctx->entries;
+    mk = ctx->mk;
+    const bool is_pak64 = ctx->is_pak64, is_a22 = ctx->is_a22;
+    uint8_t zero_key[MAX_KEY_SIZE] = { 0 };
+
+    // Entries we don't need to extract have no path
+    if (ctx->paths[i] == NULL)
+        return true;
+    bool skip_decode = (memcmp(zero_key, entry(i, key), CURRENT_KEY_SIZE) == 0);
+    uint32_t size = entry(i, size);
+    uint64_t offset = entry(i, data_offset) + ctx->file_data_offset;
+    const uint8_t* src = NULL;
+    if (ctx->map != NULL) {
+        if (offset > ctx->map_size || size > ctx->map_size - offset) {
+            fprintf(stderr, "ERROR: Data for '%s' is out of bounds\n", entry(i, filename));
+            return false;
+        }
+        src = &ctx->map[offset];
+        // Unencrypted data can be written straight from the mapping
+        if (skip_decode) {
+            uint64_t start = stats_start();
+            if (ctx->hashes != NULL) {
+                ctx->hashes[i] = xxhash64(src, size, 0);
+                stats_stop("hash", start, size);
+            }
+            start = stats_start();
+            bool r = write_file(src, size, ctx->paths[i], false);
+            stats_stop("write", start, size);
+            return r;
+        }
+    }
+    if (size > ctx->buf_sizes[thread_index]) {
+        uint8_t* buf = realloc(ctx->bufs[thread_index], size);
+        if (buf == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate entries\n");
+            return false;
+        }
+        ctx->bufs[thread_index] = buf;
+        ctx->buf_sizes[thread_index] = size;
+    }
+    uint8_t* buf = ctx->bufs[thread_index];
+    uint64_t start = stats_start();
+    if (src == NULL) {
+        if (!read_at(ctx->file, buf, size, offset)) {
+            fprintf(stderr, "ERROR: Can't read archive\n");
+            return false;
+        }
+        stats_stop("read", start, size);
+        src = buf;
+    }
+    if (!skip_decode) {
+        start = stats_start();
+        decode_to(buf, src, entry(i, key), size, CURRENT_KEY_SIZE);
+        stats_stop("decode", start, size);
+    }
+    if (ctx->hashes != NULL) {
+        start = stats_start();
+        ctx->hashes[i] = xxhash64(buf, size, 0);
+        stats_stop("hash", start, size);
+    }
+    start = stats_start();
+    bool r = write_file(buf, size, ctx->paths[i], false);
+    stats_stop("write", start, size);
+    return r;
+}
+
+static bool extract_entry(void* _ctx, uint32_t thread_index, uint32_t i)
+{
+    extract_ctx* ctx = (extract_ctx*)_ctx;
+    if (!extract_entry_data(_ctx, thread_index, i))
+        return false;
+    if (ctx->writer == NULL)
+        return true;
+    // Entries complete in any order, but the manifest lists them in table order, so add
+    // all the ones that are ready, since the last one that was added
+    lock_mutex(&manifest_lock);
+    uint64_t start = stats_start();
+    ctx->extracted[i] = true;
+    for (; ctx->next_write < ctx->nb_entries && ctx->extracted[ctx->next_write]; ctx->next_write++)
+        write_manifest_entry(ctx->writer, ctx->entries, ctx->next_write, ctx->hashes[ctx->next_write],
+            ctx->is_pak64, ctx->is_a22);
+    stats_stop("json_write", start, 0);
+    unlock_mutex(&manifest_lock);
+    return true;
+}
+
+// Extract the entries that have a path. If writer is not NULL, they are also added to
+// the manifest as they get extracted, in which case hashes must be provided.
+static bool extract_entries(FILE* file, void* entries, char** paths, uint64_t* hashes, JSON_Writer* writer,
+                            uint32_t nb_entries, uint64_t file_data_offset, bool is_pak64, bool is_a22,
+                            uint32_t nb_threads)
+{
+    extract_ctx ctx = { file, NULL, 0, entries, paths, NULL, NULL, hashes, writer, NULL, 0, nb_entries,
+                        mk, file_data_offset, is_pak64, is_a22 };
+    ctx.bufs = calloc(nb_threads, sizeof(uint8_t*));
+    ctx.buf_sizes = calloc(nb_threads, sizeof(uint32_t));
+    ctx.extracted = (writer == NULL) ? NULL : calloc(max(nb_entries, 1), sizeof(bool));
+    if (ctx.bufs == NULL || ctx.buf_sizes == NULL || (writer != NULL && ctx.extracted == NULL)) {
+        fprintf(stderr, "ERROR: Can't allocate buffers\n");
+        free(ctx.bufs);
+        free(ctx.buf_sizes);
+        free(ctx.extracted);
+        return false;
+    }
+    // Map the archive if we can, and fall back to regular reads otherwise
+    ctx.map = map_file(file, &ctx.map_size, false);
+    bool r = run_jobs(nb_threads, nb_entries, extract_entry, &ctx);
+    unmap_file(ctx.map, ctx.map_size);
+    for (uint32_t i = 0; i < nb_threads; i++)
+        free(ctx.bufs[i]);
+    free(ctx.bufs);
+    free(ctx.buf_sizes);
+    free(ctx.extracted);
+    return r;
+}
+
+// Create the path where the data for an entry is extracted
+static char* get_output_path(const char* pak_path)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%c%s", _dirname(pak_path), PATH_SEP, randstring(20));
+    if (!create_path_cached(_dirname(path))) {
+        fprintf(stderr, "ERROR: Can't create path '%s'\n", _dirname(path));
+        return NULL;
+    }
+    char* r = strdup(path);
+    if (r == NULL)
+        fprintf(stderr, "ERROR: Can't allocate path\n");
+    return r;
+}
+
+// Entries selected through the -x and -n options
+typedef struct {
+    const char**    globs;
+    const char**    names;
+    uint32_t        nb_globs;
+    uint32_t        nb_names;
+} pak_filter;
+
+static bool match_filter(const pak_filter* filter, const char* name)
+{
+    if (filter->nb_globs == 0 && filter->nb_names == 0)
+        return true;
+    for (uint32_t i = 0; i < filter->nb_names; i++)
+        if (compare_paths(filter->names[i], name) == 0)
+            return true;
+    for (uint32_t i = 0; i < filter->nb_globs; i++)
+        if (match_glob(filter->globs[i], name))
+            return true;
+    return false;
+}
+
+typedef struct {
+    const char* name;
+    uint32_t    index;
+} name_index;
+
+static THREAD_LOCAL const char* index_names;
+
+static int index_entry_cmp(const void* a, const void* b)
+{
+    return compare_paths(&index_names[((const pak_index_entry*)a)->name_offset],
+                         &index_names[((const pak_index_entry*)b)->name_offset]);
+}
+
+static bool get_pak_stat(const char* pak_path, uint64_t* size, int64_t* mtime)
+{
+    struct stat64_t st;
+    if (stat64_utf8(pak_path, &st) != 0)
+        return false;
+    *size = (uint64_t)st.st_size;
+    *mtime = (int64_t)st.st_mtime;
+    return true;
+}
+
+// Write the sidecar index for a PAK whose table has been fully decoded
+static bool write_index(const char* index_path, const char* pak_path, const pak_header* hdr,
+                        void* entries, bool is_pak64, bool is_a22, uint32_t mk_index)
+{
+    bool r = false;
+    pak_index_header ihdr = { PAK_INDEX_MAGIC, PAK_INDEX_VERSION, 0, 0, *hdr, is_pak64, is_a22, (uint16_t)mk_index, 0 };
+    for (uint32_t i = 0; i < hdr->nb_files; i++)
+        ihdr.names_size += (uint32_t)strlen(entry(i, filename)) + 1;
+    size_t size = sizeof(ihdr) + (size_t)hdr->nb_files * sizeof(pak_index_entry) + ihdr.names_size;
+    uint8_t* buf = calloc(size, 1);
+    if (buf == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate index\n");
+        return false;
+    }
+    if (!get_pak_stat(pak_path, &ihdr.pak_size, &ihdr.pak_mtime)) {
+        fprintf(stderr, "ERROR: Can't stat '%s'\n", pak_path);
+        goto out;
+    }
+    memcpy(buf, &ihdr, sizeof(ihdr));
+    pak_index_entry* ientries = (pak_index_entry*)&buf[sizeof(ihdr)];
+    char* names = (char*)&ientries[hdr->nb_files];
+    uint32_t pos = 0;
+    for (uint32_t i = 0; i < hdr->nb_files; i++) {
+        ientries[i].data_offset = entry(i, data_offset);
+        ientries[i].size = entry(i, size);
+        ientries[i].name_offset = pos;
+        memcpy(ientries[i].key, entry(i, key), CURRENT_KEY_SIZE);
+        strcpy(&names[pos], entry(i, filename));
+        pos += (uint32_t)strlen(entry(i, filename)) + 1;
+    }
+    index_names = names;
+    qsort(ientries, hdr->nb_files, sizeof(pak_index_entry), index_entry_cmp);
+    printf("Creating '%s'\n", index_path);
+    r = write_file(buf, (uint32_t)size, index_path, false);
+
+out:
+    free(buf);
+    return r;
+}
+
+// Read a sidecar index, and validate it against the PAK it was created for
+static uint8_t* read_index(const char* index_path, const char* pak_path, const pak_header* hdr)
+{
+    uint8_t* buf = NULL;
+    uint64_t pak_size;
+    int64_t pak_mtime;
+    if (!is_file(index_path) || !get_pak_stat(pak_path, &pak_size, &pak_mtime))
+        return NULL;
+    uint32_t size = read_file(index_path, &buf);
+    if (size == UINT32_MAX)
+        return NULL;
+    pak_index_header* ihdr = (pak_index_header*)buf;
+    if (size < sizeof(pak_index_header) || ihdr->magic != PAK_INDEX_MAGIC ||
+        ihdr->version != PAK_INDEX_VERSION || ihdr->pak_size != pak_size ||
+        ihdr->pak_mtime != pak_mtime || memcmp(&ihdr->hdr, hdr, sizeof(pak_header)) != 0 ||
+        ihdr->master_key >= array_size(master_key) || ihdr->names_size == 0 ||
+        size != sizeof(pak_index_header) + (uint64_t)hdr->nb_files * sizeof(pak_index_entry) + ihdr->names_size)
+        goto invalid;
+    pak_index_entry* ientries = (pak_index_entry*)&buf[sizeof(pak_index_header)];
+    if (buf[size - 1] != 0)
+        goto invalid;
+    for (uint32_t i = 0; i < hdr->nb_files; i++)
+        if (ientries[i].name_offset >= ihdr->names_size)
+            goto invalid;
+    return buf;
+
+invalid:
+    printf("Ignoring outdated index '%s'\n", index_path);
+    free(buf);
+    return NULL;
+}
+
+// List or extract the entries selected by filter, using the sidecar index
+static bool process_index(uint8_t* index, FILE* file, const char* pak_path, const pak_filter* filter,
+                          bool list_only, uint32_t nb_threads)
+{
+    bool r = false;
+    pak_index_header* ihdr = (pak_index_header*)index;
+    pak_index_entry* ientries = (pak_index_entry*)&index[sizeof(pak_index_header)];
+    const char* names = (const char*)&ientries[ihdr->hdr.nb_files];
+    const bool is_pak64 = ihdr->is_pak64, is_a22 = ihdr->is_a22;
+    const uint64_t file_data_offset = sizeof(pak_header) + (uint64_t)ihdr->hdr.nb_files * CURRENT_ENTRY_SIZE;
+    uint8_t zero_key[MAX_KEY_SIZE] = { 0 };
+    uint32_t nb_entries = 0, *selected = calloc(ihdr->hdr.nb_files, sizeof(uint32_t));
+    void* entries = NULL;
+    char** paths = NULL;
+
+    if (selected == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate entries\n");
+        return false;
+    }
+    mk = master_key[ihdr->master_key][1];
+    if (filter->nb_globs == 0) {
+        // Exact names only, so we can just look them up
+        for (uint32_t n = 0; n < filter->nb_names; n++) {
+            uint32_t lo = 0, hi = ihdr->hdr.nb_files;
+            while (lo < hi) {
+                uint32_t mid = lo + (hi - lo) / 2;
+                if (compare_paths(&names[ientries[mid].name_offset], filter->names[n]) < 0)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            for (; lo < ihdr->hdr.nb_files && compare_paths(&names[ientries[lo].name_offset], filter->names[n]) == 0; lo++) {
+                // Don't select the same entry twice
+                uint32_t i;
+                for (i = 0; i < nb_entries && selected[i] != lo; i++);
+                if (i == nb_entries)
+                    selected[nb_entries++] = lo;
+            }
+        }
+    } else {
+        for (uint32_t i = 0; i < ihdr->hdr.nb_files; i++)
+            if (match_filter(filter, &names[ientries[i].name_offset]))
+                selected[nb_entries++] = i;
+    }
+
+    entries = calloc(max(nb_entries, 1), CURRENT_ENTRY_SIZE);
+    paths = calloc(max(nb_entries, 1), sizeof(char*));
+    if (entries == NULL || paths == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate entries\n");
+        goto out;
+    }
+    printf("OFFSET    SIZE     NAME\n");
+    for (uint32_t i = 0; i < nb_entries; i++) {
+        pak_index_entry* ie = &ientries[selected[i]];
+        strncpy(entry(i, filename), &names[ie->name_offset], FILENAME_SIZE - 1);
+        set_entry(i, size, ie->size);
+        set_entry(i, data_offset, ie->data_offset);
+        memcpy(entry(i, key), ie->key, CURRENT_KEY_SIZE);
+        bool skip_decode = (memcmp(zero_key, entry(i, key), CURRENT_KEY_SIZE) == 0);
+        printf("%09" PRIx64 " %08x %s%c\n", entry(i, data_offset) + file_data_offset,
+            entry(i, size), entry(i, filename), skip_decode ? '*' : ' ');
+        if (list_only)
+            continue;
+        paths[i] = get_output_path(pak_path);
+        if (paths[i] == NULL)
+            goto out;
+    }
+    r = list_only || extract_entries(file, entries, paths, NULL, NULL, nb_entries, file_data_offset, is_pak64, is_a22, nb_threads);
+
+out:
+    if (paths != NULL) {
+        for (uint32_t i = 0; i < nb_entries; i++)
+            free(paths[i]);
+        free(paths);
+    }
+    free(entries);
+    free(selected);
+    return r;
+}
+
+// Reference archive, from which unchanged entries get copied during incremental repacking
+typedef struct {
+    FILE*       file;
+    void*       entries;
+    name_index* sorted;
+    uint32_t    nb_files;
+    uint64_t    file_data_offset;
+} pak_reference;
+
+static int name_index_cmp(const void* a, const void* b)
+{
+    return compare_paths(((const name_index*)a)->name, ((const name_index*)b)->name);
+}
+
+static void close_reference(pak_reference* ref)
+{
+    if (ref->file != NULL)
+        fclose(ref->file);
+    free(ref->entries);
+    free(ref->sorted);
+    memset(ref, 0, sizeof(*ref));
+}
+
+// Open the archive that the JSON was extracted from, which we validate through the
+// hash of its table, and decode its filenames so that entries can be looked up.
+static bool open_reference(pak_reference* ref, const char* path, const char* table_hash,
+                           bool is_pak64, bool is_a22)
+{
+    pak_header hdr;
+    uint8_t zero_key[MAX_KEY_SIZE] = { 0 };
+    void* entries = NULL;
+
+    memset(ref, 0, sizeof(*ref));
+    if (table_hash == NULL || !is_file(path))
+        return false;
+    ref->file = fopen_utf8(path, "rb");
+    if (ref->file == NULL || fread(&hdr, sizeof(hdr), 1, ref->file) != 1 ||
+        hdr.version != 0x20000 || hdr.header_size != sizeof(pak_header) || hdr.nb_files > 65536)
+        goto invalid;
+    entries = calloc(max(hdr.nb_files, 1), CURRENT_ENTRY_SIZE);
+    ref->entries = entries;
+    ref->sorted = calloc(max(hdr.nb_files, 1), sizeof(name_index));
+    if (entries == NULL || ref->sorted == NULL)
+        goto invalid;
+    if (fread(entries, CURRENT_ENTRY_SIZE, hdr.nb_files, ref->file) != hdr.nb_files ||
+        xxhash64(entries, (size_t)hdr.nb_files * CURRENT_ENTRY_SIZE, 0) != strtoull(table_hash, NULL, 16))
+        goto invalid;
+    for (uint32_t i = 0; i < hdr.nb_files; i++) {
+        if (memcmp(zero_key, entry(i, key), CURRENT_KEY_SIZE) != 0)
+            decode((uint8_t*)entry(i, filename), entry(i, key), FILENAME_SIZE, CURRENT_KEY_SIZE);
+        entry(i, filename)[FILENAME_SIZE - 1] = 0;
+        ref->sorted[i].name = entry(i, filename);
+        ref->sorted[i].index = i;
+    }
+    qsort(ref->sorted, hdr.nb_files, sizeof(name_index), name_index_cmp);
+    ref->nb_files = hdr.nb_files;
+    ref->file_data_offset = sizeof(pak_header) + (uint64_t)hdr.nb_files * CURRENT_ENTRY_SIZE;
+    printf("Using '%s' as reference for unchanged entries\n", path);
+    return true;
+
+invalid:
+    printf("Not using '%s' as reference, since it doesn't match the JSON data\n", path);
+    close_reference(ref);
+    return false;
+}
+
+// Returns the index of the reference entry holding the same data, or UINT32_MAX if none
+static uint32_t find_reference_entry(const pak_reference* ref, const char* name, const uint8_t* key,
+                                     const char* path, uint32_t size, const char* hash,
+                                     uint8_t* buf, bool is_pak64, bool is_a22)
+{
+    void* entries = ref->entries;
+    if (ref->file == NULL || hash == NULL)
+        return UINT32_MAX;
+    name_index target = { name, 0 };
+    name_index* match = bsearch(&target, ref->sorted, ref->nb_files, sizeof(name_index), name_index_cmp);
+    if (match == NULL)
+        return UINT32_MAX;
+    uint32_t i = match->index;
+    // The encoded data only matches if both the content and the key are the same
+    if (entry(i, size) != size || memcmp(entry(i, key), key, CURRENT_KEY_SIZE) != 0)
+        return UINT32_MAX;
+    FILE* file = fopen_utf8(path, "rb");
+    if (file == NULL)
+        return UINT32_MAX;
+    xxhash64_state state;
+    xxhash64_init(&state, 0);
+    for (uint32_t pos = 0; pos < size; pos += STREAM_CHUNK_SIZE) {
+        uint32_t chunk_size = min(size - pos, STREAM_CHUNK_SIZE);
+        if (fread(buf, 1, chunk_size, file) != chunk_size) {
+            fclose(file);
+            return UINT32_MAX;
+        }
+        xxhash64_update(&state, buf, chunk_size);
+    }
+    fclose(file);
+    return (xxhash64_digest(&state) == strtoull(hash, NULL, 16)) ? i : UINT32_MAX;
+}
+
+// A unit of work during archive creation: either a chunk of a new entry,
+// or a whole entry that is copied from the reference archive
+typedef struct {
+    uint32_t    index;
+    uint32_t    offset;
+} pak_chunk;
+
+// Data needed by the creation workers
+typedef struct {
+    FILE*           file;
+    void*           entries;
+    char**          paths;      // Source file of each entry
+    uint64_t*       ref_offsets;// Offset of the data in the reference archive, or UINT64_MAX
+    FILE*           ref_file;
+    pak_chunk*      chunks;
+    FILE**          sources;    // Per-thread source file, that is kept open across chunks
+    uint32_t*       source_index;
+    uint8_t**       bufs;       // Per-thread chunk buffers
+    const char*     mk;
+    uint64_t        file_data_offset;
+    bool            is_pak64;
+    bool            is_a22;
+} create_ctx;
+
+static bool create_chunk(void* _ctx, uint32_t thread_index, uint32_t c)
+{
+    create_ctx* ctx = (create_ctx*)_ctx;
+    void* entries = ctx->entries;
+    mk = ctx->mk;
+    const bool is_pak64 = ctx->is_pak64, is_a22 = ctx->is_a22;
+    uint8_t zero_key[MAX_KEY_SIZE] = { 0 };
+    const uint32_t i = ctx->chunks[c].index, offset = ctx->chunks[c].offset;
+    const uint64_t dst_offset = ctx->file_data_offset + entry(i, data_offset) + offset;
+
+    uint64_t start = stats_start();
+    if (ctx->ref_offsets[i] != UINT64_MAX) {
+        if (!copy_file_data(ctx->ref_file, ctx->ref_offsets[i], ctx->file, dst_offset, entry(i, size))) {
+            fprintf(stderr, "ERROR: Can't copy data for '%s'\n", ctx->paths[i]);
+            return false;
+        }
+        stats_stop("copy", start, entry(i, size));
+        return true;
+    }
+    if (ctx->source_index[thread_index] != i) {
+        if (ctx->sources[thread_index] != NULL)
+            fclose(ctx->sources[thread_index]);
+        ctx->source_index[thread_index] = i;
+        ctx->sources[thread_index] = fopen_utf8(ctx->paths[i], "rb");
+        if (ctx->sources[thread_index] == NULL) {
+            fprintf(stderr, "ERROR: Can't open '%s'\n", ctx->paths[i]);
+            return false;
+        }
+    }
+    uint32_t size = min(entry(i, size) - offset, STREAM_CHUNK_SIZE);
+    uint8_t* buf = ctx->bufs[thread_index];
+    if (!read_at(ctx->sources[thread_index], buf, size, offset)) {
+        fprintf(stderr, "ERROR: Can't read '%s'\n", ctx->paths[i]);
+        return false;
+    }
+    stats_stop("read", start, size);
+    // Chunks start on a key boundary, so they can be encoded independently
+    if (memcmp(zero_key, entry(i, key), CURRENT_KEY_SIZE) != 0) {
+        start = stats_start();
+        decode(buf, entry(i, key), size, CURRENT_KEY_SIZE);
+        stats_stop("encode", start, size);
+    }
+    start = stats_start();
+    if (!write_at(ctx->file, buf, size, dst_offset)) {
+        fprintf(stderr, "ERROR: Can't write data for '%s'\n", ctx->paths[i]);
+        return false;
+    }
+    stats_stop("write", start, size);
+    return true;
+}
+
+int gust_pak_process_file(const char* input, const pak_options* opt)
+{
+    int r = -1;
+    FILE* file = NULL;
+    uint8_t zero_key[MAX_KEY_SIZE] = { 0 }, *buf = NULL;
+    char path[PATH_MAX], **paths = NULL;
+    pak_header hdr = { 0 };
+    void* entries = NULL;
+    uint8_t* index = NULL;
+    JSON_Value* json = NULL, *json_file = NULL;
+    JSON_Reader* reader = NULL;
+    JSON_Writer* writer = NULL;
+    bool is_pak64 = false, is_a22 = false;
+    const bool list_only = opt->list_only, use_index = opt->use_index;
+    const bool incremental = opt->incremental, binary_manifest = opt->binary_manifest;
+    uint32_t nb_threads = opt->nb_threads;  // Unless specified, depends on whether we extract or create
+    const pak_filter filter = { opt->globs, opt->names, opt->nb_globs, opt->nb_names };
+    pak_reference ref = { 0 };
+    uint64_t *hashes = NULL, *ref_offsets = NULL;
+
+    init_decode();
+
+    if (incremental && strstr(input, ".json") == NULL) {
+        fprintf(stderr, "ERROR: Option -u is only supported when creating an archive\n");
+        goto out;
+    }
+
+    if (is_directory(input)) {
+        fprintf(stderr, "ERROR: Directory packing is not supported.\n"
+            "To recreate a .pak you need to use the corresponding .json file.\n");
+    } else if (strstr(input, ".json") != NULL) {
+        if (list_only || use_index || binary_manifest || filter.nb_globs != 0 || filter.nb_names != 0) {
+            fprintf(stderr, "ERROR: Options -l, -i, -b, -x and -n are not supported when creating an archive\n");
+            goto out;
+        }
+        // Only the archive properties are kept as a DOM, as the files are read one at a time.
+        // Since properties may follow the files, the latter are skipped during a first pass.
+        uint64_t start = stats_start();
+        reader = json_reader_open(input);
+        json = json_value_init_object();
+        if (reader == NULL || json == NULL) {
+            fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", input);
+            goto out;
+        }
+        const char* member;
+        while ((member = json_reader_next_name(reader)) != NULL) {
+            if (strcmp(member, "files") == 0)
+                continue;
+            JSON_Value* json_member = json_reader_get_value(reader);
+            if (json_member == NULL || json_object_set_value(json_object(json), member, json_member) != JSONSuccess) {
+                json_value_free(json_member);
+                break;
+            }
+        }
+        if (json_reader_rewind(reader) != JSONSuccess) {
+            fprintf(stderr, "ERROR: Can't parse JSON data from '%s'\n", input);
+            goto out;
+        }
+        while ((member = json_reader_next_name(reader)) != NULL && strcmp(member, "files") != 0);
+        if (member == NULL || json_reader_begin_array(reader) != JSONSuccess) {
+            fprintf(stderr, "ERROR: No files array in '%s'\n", input);
+            goto out;
+        }
+        stats_stop("json_read", start, 0);
+        const char* filename = json_object_get_string(json_object(json), "name");
+        hdr.header_size = json_object_get_uint32(json_object(json), "header_size");
+        if ((filename == NULL) || (hdr.header_size != sizeof(pak_header))) {
+            fprintf(stderr, "ERROR: No filename/wrong header size\n");
+            goto out;
+        }
+        hdr.version = json_object_get_uint32(json_object(json), "version");
+        hdr.flags = json_object_get_uint32(json_object(json), "flags");
+        hdr.nb_files = json_object_get_uint32(json_object(json), "nb_files");
+        mk = json_object_get_string(json_object(json), "master_key");
+        if (mk == NULL)
+            mk = master_key[0][1];
+        is_pak64 = json_object_get_boolean(json_object(json), "64-bit");
+        is_a22 = json_object_get_boolean(json_object(json), "a22-extensions");
+        if (is_a22 && !is_pak64) {
+            fprintf(stderr, "ERROR: A22 extensions can only be used on 64-bit PAKs\n");
+            goto out;
+        }
+        snprintf(path, sizeof(path), "%s%c%s", _dirname(input), PATH_SEP, filename);
+        printf("Creating '%s'...\n", path);
+        create_backup(path);
+        if (incremental) {
+            // The backup is the original archive, unless we failed to create it
+            char ref_path[PATH_MAX + 4];
+            snprintf(ref_path, sizeof(ref_path), "%s.bak", path);
+            open_reference(&ref, ref_path, json_object_get_string(json_object(json), "table_hash"), is_pak64, is_a22);
+        }
+        file = fopen_utf8(path, "wb+");
+        if (file == NULL) {
+            fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
+            goto out;
+        }
+        entries = calloc(max(hdr.nb_files, 1), CURRENT_ENTRY_SIZE);
+        paths = calloc(max(hdr.nb_files, 1), sizeof(char*));
+        ref_offsets = calloc(max(hdr.nb_files, 1), sizeof(uint64_t));
+        buf = malloc(STREAM_CHUNK_SIZE);
+        if (entries == NULL || paths == NULL || ref_offsets == NULL || buf == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate entries\n");
+            goto out;
+        }
+        uint64_t file_data_offset = sizeof(pak_header) + (uint64_t)hdr.nb_files * CURRENT_ENTRY_SIZE;
+
+        // Since the sizes of all the files are known up front, fill the whole table first
+        uint32_t nb_reused = 0, nb_chunks = 0;
+        uint64_t data_offset = 0;
+        printf("OFFSET    SIZE     NAME\n");
+        for (uint32_t i = 0; i < hdr.nb_files; i++) {
+            json_value_free(json_file);
+            start = stats_start();
+            json_file = json_reader_next_element(reader);
+            stats_stop("json_read", start, 0);
+            JSON_Object* file_entry = json_object(json_file);
+            if (file_entry == NULL || json_object_get_string(file_entry, "name") == NULL) {
+                fprintf(stderr, "ERROR: Can't read file entry %d from '%s'\n", i, input);
+                goto out;
+            }
+            uint8_t* key = string_to_key(json_object_get_string(file_entry, "key"), CURRENT_KEY_SIZE);
+            filename = json_object_get_string(file_entry, "name");
+            strncpy(entry(i, filename), filename, FILENAME_SIZE - 1);
+            snprintf(path, sizeof(path), "%s%c%s", _dirname(input), PATH_SEP, filename);
+            for (size_t n = 0; n < strlen(path); n++) {
+                if (path[n] == '\\')
+                    path[n] = PATH_SEP;
+            }
+            paths[i] = strdup(path);
+            if (paths[i] == NULL) {
+                fprintf(stderr, "ERROR: Can't allocate path\n");
+                goto out;
+            }
+            uint64_t size = get_file_size(path);
+            if (size >= UINT32_MAX) {
+                if (size != UINT32_MAX)
+                    fprintf(stderr, "ERROR: '%s' is too large\n", path);
+                goto out;
+            }
+            set_entry(i, size, (uint32_t)size);
+            bool skip_encode = true;
+            for (int j = 0; j < CURRENT_KEY_SIZE; j++) {
+                entry(i, key)[j] = key[j];
+                if (key[j] != 0)
+                    skip_encode = false;
+            }
+
+            set_entry(i, data_offset, data_offset);
+            data_offset += size;
+            uint64_t flags = json_object_get_uint64(file_entry, "flags");
+            if (is_pak64)
+                setbe64(is_a22 ? &(entries64_a22[i].flags) : &(entries64[i].flags), flags);
+            else
+                setbe32(&(entries32[i].flags), (uint32_t)flags);
+            if (is_a22)
+                setbe32(&(entries64_a22[i].extra), json_object_get_uint32(file_entry, "extra"));
+            printf("%09" PRIx64 " %08x %s%c\n", entry(i, data_offset) + file_data_offset,
+                entry(i, size), entry(i, filename), skip_encode ? '*' : ' ');
+            start = stats_start();
+            uint32_t j = find_reference_entry(&ref, entry(i, filename), entry(i, key), path, entry(i, size),
+                json_object_get_string(file_entry, "hash"), buf, is_pak64, is_a22);
+            if (ref.file != NULL)
+                stats_stop("reference_check", start, entry(i, size));
+            if (!skip_encode) {
+                start = stats_start();
+                decode((uint8_t*)entry(i, filename), entry(i, key), FILENAME_SIZE, CURRENT_KEY_SIZE);
+                stats_stop("table_encode", start, FILENAME_SIZE);
+            }
+            ref_offsets[i] = UINT64_MAX;
+            if (j != UINT32_MAX) {
+                // The already encoded data will be copied from the reference archive
+                void* ref_entries = ref.entries;
+                ref_offsets[i] = ref.file_data_offset + (is_pak64 ? (is_a22 ?
+                    ((pak_entry64_a22*)ref_entries)[j].data_offset : ((pak_entry64*)ref_entries)[j].data_offset) :
+                    ((pak_entry32*)ref_entries)[j].data_offset);
+                nb_reused++;
+                nb_chunks++;
+            } else {
+                nb_chunks += (uint32_t)((size + STREAM_CHUNK_SIZE - 1) / STREAM_CHUNK_SIZE);
+            }
+        }
+        if (!preallocate_file(file, file_data_offset + data_offset) ||
+            !write_at(file, &hdr, sizeof(pak_header), 0) ||
+            !write_at(file, entries, (size_t)hdr.nb_files * CURRENT_ENTRY_SIZE, sizeof(pak_header))) {
+            fprintf(stderr, "ERROR: Can't write PAK table\n");
+            goto out;
+        }
+
+        // Now process the data in chunks, so that memory usage is bounded and,
+        // when using multiple threads, reading, encoding and writing overlap
+        create_ctx ctx = { file, entries, paths, ref_offsets, ref.file, NULL, NULL, NULL, NULL,
+                           mk, file_data_offset, is_pak64, is_a22 };
+        if (nb_threads == 0)
+            nb_threads = max(MIN_CREATE_THREADS, min(get_nb_cpus(), MAX_CREATE_THREADS));
+        nb_threads = max(1, min(nb_threads, nb_chunks));
+        ctx.chunks = calloc(max(nb_chunks, 1), sizeof(pak_chunk));
+        ctx.sources = calloc(nb_threads, sizeof(FILE*));
+        ctx.source_index = calloc(nb_threads, sizeof(uint32_t));
+        ctx.bufs = calloc(nb_threads, sizeof(uint8_t*));
+        bool success = (ctx.chunks != NULL && ctx.sources != NULL && ctx.source_index != NULL && ctx.bufs != NULL);
+        for (uint32_t t = 0; success && t < nb_threads; t++) {
+            ctx.source_index[t] = UINT32_MAX;
+            ctx.bufs[t] = (t == 0) ? buf : malloc(STREAM_CHUNK_SIZE);
+            success = (ctx.bufs[t] != NULL);
+        }
+        if (!success) {
+            fprintf(stderr, "ERROR: Can't allocate buffers\n");
+        } else {
+            uint32_t c = 0;
+            for (uint32_t i = 0; i < hdr.nb_files; i++) {
+                uint32_t n = (ref_offsets[i] != UINT64_MAX) ? 1 :
+                    (uint32_t)(((uint64_t)entry(i, size) + STREAM_CHUNK_SIZE - 1) / STREAM_CHUNK_SIZE);
+                for (uint32_t k = 0; k < n; k++, c++) {
+                    ctx.chunks[c].index = i;
+                    ctx.chunks[c].offset = k * STREAM_CHUNK_SIZE;
+                }
+            }
+            success = run_jobs(nb_threads, nb_chunks, create_chunk, &ctx);
+        }
+        for (uint32_t t = 0; t < nb_threads; t++) {
+            if (ctx.sources != NULL && ctx.sources[t] != NULL)
+                fclose(ctx.sources[t]);
+            if (ctx.bufs != NULL && t != 0)
+                free(ctx.bufs[t]);
+        }
+        free(ctx.chunks);
+        free(ctx.sources);
+        free(ctx.source_index);
+        free(ctx.bufs);
+        if (!success)
+            goto out;
+        if (incremental)
+            printf("\nCopied %d unchanged entries out of %d\n", nb_reused, hdr.nb_files);
+        r = 0;
+    } else {
+        printf("%s '%s'...\n", list_only ? "Listing" : "Extracting", _basename(input));
+        if (nb_threads == 0)
+            nb_threads = 1;
+        file = fopen_utf8(input, "rb");
+        if (file == NULL) {
+            fprintf(stderr, "ERROR: Can't open PAK file '%s'", input);
+            goto out;
+        }
+
+        if (fread(&hdr, sizeof(hdr), 1, file) != 1) {
+            fprintf(stderr, "ERROR: Can't read hdr");
+            goto out;
+        }
+
+        if ((hdr.version != 0x20000) || (hdr.header_size != sizeof(pak_header))) {
+            fprintf(stderr, "ERROR: Signature doesn't match expected PAK file format.\n");
+            goto out;
+        }
+        if (hdr.nb_files > 65536) {
+            fprintf(stderr, "ERROR: Too many entries (%d).\n", hdr.nb_files);
+            goto out;
+        }
+
+        // If we only need some of the entries, a valid index saves us from processing the table
+        char index_path[PATH_MAX];
+        snprintf(index_path, sizeof(index_path), "%s%c%s", _dirname(input), PATH_SEP,
+            change_extension(_basename(input), ".idx"));
+        if (use_index && (filter.nb_globs != 0 || filter.nb_names != 0)) {
+            index = read_index(index_path, input, &hdr);
+            if (index != NULL) {
+                printf("Using index '%s'\n\n", index_path);
+                if (process_index(index, file, input, &filter, list_only, nb_threads))
+                    r = 0;
+                goto out;
+            }
+        }
+
+        entries = calloc(hdr.nb_files, MAX_PAK_ENTRY_SIZE);
+        if (entries == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate entries\n");
+            goto out;
+        }
+
+        uint64_t start = stats_start();
+        if (fread(entries, MAX_PAK_ENTRY_SIZE, hdr.nb_files, file) != hdr.nb_files) {
+            fprintf(stderr, "ERROR: Can't read PAK hdr\n");
+            goto out;
+        }
+        stats_stop("table_read", start, (uint64_t)hdr.nb_files * MAX_PAK_ENTRY_SIZE);
+
+        // Detect if we are dealing with 32 or 64-bit pak entries by checking
+        // the data_offsets at the expected 32 and 64-bit struct location and
+        // adding the absolute value of the difference with last data_offset.
+        // The sum that is closest to zero tells us if we are dealing with a
+        // 32 or 64-bit PAK archive, as well as if it uses A22 extensions.
+        uint64_t sum[3] = { 0, 0, 0 };
+        uint32_t val[3], last[3] = { 0, 0, 0 };
+        for (uint32_t i = 0; i < min(hdr.nb_files, 64); i++) {
+            val[0] = ((pak_entry32*)entries)[i].data_offset;
+            val[1] = (uint32_t)(((pak_entry64*)entries)[i].data_offset >> 32);
+            val[2] = (uint32_t)(((pak_entry64_a22*)entries)[i].data_offset >> 32);
+            for (int j = 0; j < 3; j++) {
+                sum[j] += (val[j] > last[j]) ? val[j] - last[j] : last[j] - val[j];
+                last[j] = val[j];
+            }
+        }
+        is_pak64 = min(sum[0], min(sum[1], sum[2])) == min(sum[1], sum[2]);
+        is_a22 = is_pak64 && (min(sum[1], sum[2]) == sum[2]);
+        printf("Detected %s PAK format\n", is_pak64 ? (is_a22 ? "A22/64-bit" : "A18/64-bit") : "A17/32-bit");
+
+        // Determine the master key that needs to be applied, if any
+        uint64_t table_hash = xxhash64(entries, (size_t)hdr.nb_files * CURRENT_ENTRY_SIZE, 0);
+        uint64_t key_hash = xxhash64(&hdr, sizeof(hdr), table_hash);
+        char cache_path[PATH_MAX];
+        snprintf(cache_path, sizeof(cache_path), "%s%c%s.cache", _dirname(opt->app_path), PATH_SEP, _appname(opt->app_path));
+        uint32_t best_k = lookup_master_key(cache_path, key_hash);
+        if (best_k == UINT32_MAX) {
+            start = stats_start();
+            best_k = detect_master_key(entries, hdr.nb_files, is_pak64, is_a22);
+            stats_stop("key_detection", start, 0);
+            record_master_key(cache_path, key_hash, best_k);
+        }
+        mk = master_key[best_k][1];
+        if (mk[0] != 0)
+            printf("Using %s master key\n", master_key[best_k][0]);
+        printf("\n");
+
+        uint64_t file_data_offset = sizeof(pak_header) + (uint64_t)hdr.nb_files * CURRENT_ENTRY_SIZE;
+        paths = calloc(hdr.nb_files, sizeof(char*));
+        if (paths == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate paths\n");
+            goto out;
+        }
+        printf("OFFSET    SIZE     NAME\n");
+        for (uint32_t i = 0; i < hdr.nb_files; i++) {
+            bool skip_decode = (memcmp(zero_key, entry(i, key), CURRENT_KEY_SIZE) == 0);
+            if (!skip_decode) {
+                start = stats_start();
+                decode((uint8_t*)entry(i, filename), entry(i, key), FILENAME_SIZE, CURRENT_KEY_SIZE);
+                stats_stop("table_decode", start, FILENAME_SIZE);
+                for (int j = 0; j < FILENAME_SIZE && entry(i, filename)[j] != 0; j++) {
+                    char c = entry(i, filename)[j];
+                    if (c == 0)
+                        break;
+                    if (c < 0x20 || c > 0x7e) {
+                        fprintf(stderr, "ERROR: Failed to decode filename for entry %d\n", i);
+                        goto out;
+                    }
+                }
+            }
+            for (size_t n = 0; n < strlen(entry(i, filename)); n++) {
+                if (entry(i, filename)[n] == '\\')
+                    entry(i, filename)[n] = PATH_SEP;
+            }
+            if (!match_filter(&filter, entry(i, filename)))
+                continue;
+            printf("%09" PRIx64 " %08x %s%c\n", entry(i, data_offset) + file_data_offset,
+                entry(i, size), entry(i, filename), skip_decode ? '*' : ' ');
+            if (list_only)
+                continue;
+            paths[i] = get_output_path(input);
+            if (paths[i] == NULL)
+                goto out;
+        }
+
+        if (use_index && !write_index(index_path, input, &hdr, entries, is_pak64, is_a22, best_k))
+            goto out;
+
+        if (!list_only) {
+            hashes = calloc(max(hdr.nb_files, 1), sizeof(uint64_t));
+            if (hashes == NULL) {
+                fprintf(stderr, "ERROR: Can't allocate hashes\n");
+                goto out;
+            }
+        }
+        if (!list_only && filter.nb_globs == 0 && filter.nb_names == 0) {
+            // Store the data we'll need to reconstruct the archive. The entries are added
+            // as they get extracted, so that we never hold the whole manifest in memory.
+            snprintf(path, sizeof(path), "%s%c%s", _dirname(input), PATH_SEP,
+                change_extension(_basename(input), binary_manifest ? ".jsonb" : ".json"));
+            printf("Creating '%s'\n", path);
+            start = stats_start();
+            writer = binary_manifest ? json_writer_open_binary(path) : json_writer_open(path);
+            if (writer == NULL) {
+                fprintf(stderr, "ERROR: Can't create '%s'\n", path);
+                goto out;
+            }
+            json_writer_begin_object(writer, NULL);
+            json_writer_string(writer, "name", change_extension(_basename(input), ".pak"));
+            json_writer_number(writer, "version", hdr.version);
+            json_writer_number(writer, "header_size", hdr.header_size);
+            json_writer_number(writer, "flags", hdr.flags);
+            json_writer_number(writer, "nb_files", hdr.nb_files);
+            json_writer_boolean(writer, "64-bit", is_pak64);
+            if (is_a22)
+                json_writer_boolean(writer, "a22-extensions", true);
+            if (mk[0] != 0)
+                json_writer_string(writer, "master_key", mk);
+            // Used to validate the archive as a reference for incremental repacking
+            json_writer_string(writer, "table_hash", hash_to_string(table_hash));
+            json_writer_begin_array(writer, "files");
+            stats_stop("json_write", start, 0);
+        }
+        if (!list_only) {
+            // Now that the table has been processed, read, decode and write the file data
+            if (!extract_entries(file, entries, paths, hashes, writer, hdr.nb_files, file_data_offset,
+                                 is_pak64, is_a22, nb_threads))
+                goto out;
+        }
+        if (writer != NULL) {
+            start = stats_start();
+            json_writer_end(writer);
+            json_writer_end(writer);
+            JSON_Status status = json_writer_close(writer);
+            writer = NULL;
+            if (status != JSONSuccess) {
+                fprintf(stderr, "ERROR: Can't write '%s'\n", path);
+                goto out;
+            }
+            stats_stop("json_write", start, 0);
+        }
+        r = 0;
+    }
+
+out:
+    if (writer != NULL)
+        json_writer_close(writer);
+    json_reader_close(reader);
+    json_value_free(json_file);
+    json_value_free(json);
+    free(buf);
+    free(index);
+    free(hashes);
+    free(ref_offsets);
+    close_reference(&ref);
+    if (paths != NULL) {
+        for (uint32_t i = 0; i < hdr.nb_files; i++)
+            free(paths[i]);
+        free(paths);
+    }
+    free(entries);
+    if (file != NULL)
+        fclose(file);
+    return r;
+}
+
+int main_utf8(int argc, char** argv)
+{
+    int r = -1, argi;
+    bool print_usage = false;
+    pak_options opt = { argv[0], false, false, false, false, 0, NULL, NULL, 0, 0 };
+
+    opt.globs = calloc(argc, sizeof(char*));
+    opt.names = calloc(argc, sizeof(char*));
+    if (opt.globs == NULL || opt.names == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate filters\n");
+        goto out;
+    }
+
+    for (argi = 1; (argi < argc - 1) && (argv[argi][0] == '-') && !print_usage; argi++) {
+        switch (argv[argi][1]) {
+        case 'l':
+            opt.list_only = true;
+            break;
+        case 'i':
+            opt.use_index = true;
+            break;
+        case 'u':
+            opt.incremental = true;
+            break;
+        case 'b':
+            opt.binary_manifest = true;
+            break;
+        case 'x':
+        case 'n':
+            if (++argi >= argc - 1) {
+                print_usage = true;
+                break;
+            }
+            if (argv[argi - 1][1] == 'x')
+                opt.globs[opt.nb_globs++] = argv[argi];
+            else
+                opt.names[opt.nb_names++] = argv[argi];
+            break;
+        case 'j':
+            if (++argi >= argc - 1) {
+                print_usage = true;
+                break;
+            }
+            if (!parse_nb_threads(argv[argi], &opt.nb_threads))
+                print_usage = true;
+            break;
+        default:
+            print_usage = true;
+            break;
+        }
+    }
+
+    if ((argi != argc - 1) || print_usage) {
+        printf("%s %s (c) 2018-2022 Yuri Hime & VitaSmith\n\n"
+            "Usage: %s [-l] [-i] [-b] [-j N] [-x <glob>] [-n <name>] <Gust PAK file>\n"
+            "       %s [-j N] [-u] <JSON file>\n\n"
+            "Extracts (.pak) or recreates (.json or .jsonb) a Gust .pak archive.\n\n"
+            "Options:\n"
+            "  -l         List the content of the archive only\n"
+            "  -b         Create a compact binary manifest (.jsonb), instead of a .json\n"
+            "  -i         Create or use a sidecar index (.idx), to speed up selective extraction\n"
+            "  -j N       Extract or create using N threads (0 = one thread per CPU). The default\n"
+            "             is 1 when extracting, and 2 to 4 when creating, to overlap disk accesses\n"
+            "  -x <glob>  Only process the entries matching <glob> (e.g. \"*.g1t\")\n"
+            "  -n <name>  Only process the entry named <name>\n"
+            "  -u         Copy unchanged entries from the original archive (.pak.bak or .pak)\n"
+            "Options -x and -n can be repeated. Note that no .json is created when they are used.\n\n",
+            _appname(argv[0]), GUST_TOOLS_VERSION_STR, _appname(argv[0]), _appname(argv[0]));
+        r = 0;
+        goto out;
+    }
+
+    r = gust_pak_process_file(argv[argc - 1], &opt);
+
+out:
+    free(opt.globs);
+    free(opt.names);
+    if (r != 0) {
+        fflush(stdin);
+        printf("\nPress any key to continue...");
+        (void)getchar();
+    }
+
+    return r;
+}
+
+CALL_MAIN
+
+#if defined(GUST_BENCH)
+#include "bench.h"
+
+typedef struct {
+    uint8_t*    buf;
+    uint8_t     key[MAX_KEY_SIZE];
+    uint32_t    key_size;
+    bool        scalar;
+} decode_bench;
+
+static bool bench_decode(void* _ctx)
+{
+    decode_bench* ctx = (decode_bench*)_ctx;
+    if (ctx->scalar)
+        decode_scalar(ctx->buf, ctx->buf, ctx->key, bench_size, ctx->key_size);
+    else
+        decode(ctx->buf, ctx->key, bench_size, ctx->key_size);
+    return true;
+}
+
+bool gust_pak_bench(void)
+{
+    static const struct {
+        const char* name;
+        uint32_t    key_size;
+        uint32_t    master_key;
+        bool        scalar;
+    } kernels[] = {
+        { "decode/a17",         A17_KEY_SIZE,   0,  false },
+        { "decode/a22",         A22_KEY_SIZE,   0,  false },
+        { "decode/a23",         A22_KEY_SIZE,   1,  false },
+        { "decode_scalar/a22",  A22_KEY_SIZE,   0,  true },
+    };
+    decode_bench ctx = { malloc(bench_size), { 0 }, 0, false };
+    if (ctx.buf == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate buffer\n");
+        return false;
+    }
+    bench_fill(ctx.buf, bench_size, 1, false);
+    bench_fill(ctx.key, MAX_KEY_SIZE, 2, false);
+    init_decode();
+
+    bool r = true;
+    for (uint32_t i = 0; i < array_size(kernels) && r; i++) {
+        mk = master_key[kernels[i].master_key][1];
+        ctx.key_size = kernels[i].key_size;
+        ctx.scalar = kernels[i].scalar;
+        r = bench_kernel(kernels[i].name, bench_decode, &ctx, bench_size);
+    }
+    free(ctx.buf);
+    return r;
+}
+#endif
@@ -2096,6 +2096,839 @@ int json_boolean(const JSON_Value *value) {
     return json_value_get_boolean(value);
 }
 
+/* Streaming serialization */
+#define WRITER_MAX_NESTING 64
+
+/* Compact binary format, used by json_writer_open_binary(). Each value starts with a tag,
+   followed by its name for object members, and then by its payload. Names, string lengths
+   and unsigned integers are stored as LEB128, and other numbers as little endian doubles.
+   Objects and arrays hold their values, until a BINARY_TAG_END. */
+#define BINARY_MAGIC       "JSNB\x01"
+#define BINARY_MAGIC_SIZE  5
+#define BINARY_TAG_OBJECT  '{'
+#define BINARY_TAG_ARRAY   '['
+#define BINARY_TAG_END     '}'
+#define BINARY_TAG_STRING  's'
+#define BINARY_TAG_UINT    'u'
+#define BINARY_TAG_DOUBLE  'd'
+#define BINARY_TAG_TRUE    't'
+#define BINARY_TAG_FALSE   'f'
+#define BINARY_TAG_NULL    'n'
+#define BINARY_MAX_UINT    9007199254740992.0 /* 2^53, above which doubles aren't all integers */
+
+struct json_writer_t {
+    FILE   *fp;
+    int     binary;
+    char   *buf;        /* reused to serialize strings and values */
+    size_t  buf_size;
+    int     level;
+    size_t  count[WRITER_MAX_NESTING];    /* number of values written at each level */
+    char    end[WRITER_MAX_NESTING];      /* closing character of each level */
+    int     failed;
+};
+
+static JSON_Status json_writer_value_r(JSON_Writer *writer, const char *name, const JSON_Value *value);
+
+static char * json_writer_get_buffer(JSON_Writer *writer, size_t size) {
+    if (size > writer->buf_size) {
+        char *new_buf = (char*)parson_malloc(size);
+        if (new_buf == NULL) {
+            return NULL;
+        }
+        parson_free(writer->buf);
+        writer->buf = new_buf;
+        writer->buf_size = size;
+    }
+    return writer->buf;
+}
+
+static JSON_Status json_writer_puts(JSON_Writer *writer, const char *string, size_t len) {
+    if (fwrite(string, 1, len, writer->fp) != len) {
+        writer->failed = 1;
+        return JSONFailure;
+    }
+    return JSONSuccess;
+}
+
+static JSON_Status json_writer_put_uint(JSON_Writer *writer, unsigned long long value) {
+    char buf[10];
+    size_t len = 0;
+    do {
+        buf[len] = (char)(value & 0x7f);
+        value >>= 7;
+        if (value != 0) {
+            buf[len] |= 0x80;
+        }
+        len++;
+    } while (value != 0);
+    return json_writer_puts(writer, buf, len);
+}
+
+static JSON_Status json_writer_put_binary_string(JSON_Writer *writer, const char *string) {
+    size_t len = strlen(string);
+    if (json_writer_put_uint(writer, len) != JSONSuccess) {
+        return JSONFailure;
+    }
+    return json_writer_puts(writer, string, len);
+}
+
+static JSON_Status json_writer_serialize_string(JSON_Writer *writer, const char *string) {
+    int len = json_serialize_string(string, NULL);
+    char *buf = json_writer_get_buffer(writer, (size_t)len + 1);
+    if (len < 0 || buf == NULL) {
+        writer->failed = 1;
+        return JSONFailure;
+    }
+    json_serialize_string(string, buf);
+    return json_writer_puts(writer, buf, (size_t)len);
+}
+
+/* Same separators and indentation as json_serialize_to_buffer_r(). The tag is only used in binary mode. */
+static JSON_Status json_writer_begin_value(JSON_Writer *writer, const char *name, char tag) {
+    int i;
+    if (writer == NULL || writer->fp == NULL) {
+        return JSONFailure;
+    }
+    if (writer->level == 0) {
+        if (name != NULL || writer->count[0] != 0) {
+            return JSONFailure;
+        }
+    } else if ((writer->end[writer->level] == '}') != (name != NULL)) {
+        return JSONFailure;
+    }
+    writer->count[writer->level]++;
+    if (writer->binary) {
+        if (json_writer_puts(writer, &tag, 1) != JSONSuccess ||
+            (name != NULL && json_writer_put_binary_string(writer, name) != JSONSuccess)) {
+            return JSONFailure;
+        }
+        return JSONSuccess;
+    }
+    if (writer->level > 0) {
+        if (json_writer_puts(writer, (writer->count[writer->level] > 1) ? ",\n" : "\n",
+                             (writer->count[writer->level] > 1) ? 2 : 1) != JSONSuccess) {
+            return JSONFailure;
+        }
+        for (i = 0; i < writer->level; i++) {
+            if (json_writer_puts(writer, "    ", 4) != JSONSuccess) {
+                return JSONFailure;
+            }
+        }
+    }
+    if (name != NULL) {
+        if (json_writer_serialize_string(writer, name) != JSONSuccess ||
+            json_writer_puts(writer, ": ", 2) != JSONSuccess) {
+            return JSONFailure;
+        }
+    }
+    return JSONSuccess;
+}
+
+static JSON_Status json_writer_begin(JSON_Writer *writer, const char *name, char begin, char end) {
+    if (writer != NULL && writer->level + 1 >= WRITER_MAX_NESTING) {
+        return JSONFailure;
+    }
+    if (json_writer_begin_value(writer, name, begin) != JSONSuccess ||
+        (!writer->binary && json_writer_puts(writer, &begin, 1) != JSONSuccess)) {
+        return JSONFailure;
+    }
+    writer->level++;
+    writer->count[writer->level] = 0;
+    writer->end[writer->level] = end;
+    return JSONSuccess;
+}
+
+static JSON_Writer * json_writer_open_mode(const char *filename, int binary) {
+    JSON_Writer *writer = (JSON_Writer*)parson_malloc(sizeof(JSON_Writer));
+    if (writer == NULL) {
+        return NULL;
+    }
+    memset(writer, 0, sizeof(JSON_Writer));
+    writer->binary = binary;
+    writer->fp = fopen_utf8(filename, binary ? "wb" : "w");
+    if (writer->fp == NULL) {
+        parson_free(writer);
+        return NULL;
+    }
+    if (binary) {
+        json_writer_puts(writer, BINARY_MAGIC, BINARY_MAGIC_SIZE);
+    }
+    return writer;
+}
+
+JSON_Writer * json_writer_open(const char *filename) {
+    return json_writer_open_mode(filename, 0);
+}
+
+JSON_Writer * json_writer_open_binary(const char *filename) {
+    return json_writer_open_mode(filename, 1);
+}
+
+JSON_Status json_writer_close(JSON_Writer *writer) {
+    JSON_Status return_code = JSONSuccess;
+    if (writer == NULL) {
+        return JSONFailure;
+    }
+    if (writer->failed || writer->level != 0 || writer->count[0] != 1) {
+        return_code = JSONFailure;
+    }
+    if (fclose(writer->fp) == EOF) {
+        return_code = JSONFailure;
+    }
+    parson_free(writer->buf);
+    parson_free(writer);
+    return return_code;
+}
+
+JSON_Status json_writer_begin_object(JSON_Writer *writer, const char *name) {
+    return json_writer_begin(writer, name, '{', '}');
+}
+
+JSON_Status json_writer_begin_array(JSON_Writer *writer, const char *name) {
+    return json_writer_begin(writer, name, '[', ']');
+}
+
+JSON_Status json_writer_end(JSON_Writer *writer) {
+    int i;
+    char tag = BINARY_TAG_END;
+    if (writer == NULL || writer->level == 0) {
+        return JSONFailure;
+    }
+    if (writer->binary) {
+        if (json_writer_puts(writer, &tag, 1) != JSONSuccess) {
+            return JSONFailure;
+        }
+        writer->level--;
+        return JSONSuccess;
+    }
+    if (writer->count[writer->level] > 0) {
+        if (json_writer_puts(writer, "\n", 1) != JSONSuccess) {
+            return JSONFailure;
+        }
+        for (i = 0; i < writer->level - 1; i++) {
+            if (json_writer_puts(writer, "    ", 4) != JSONSuccess) {
+                return JSONFailure;
+            }
+        }
+    }
+    if (json_writer_puts(writer, &writer->end[writer->level], 1) != JSONSuccess) {
+        return JSONFailure;
+    }
+    writer->level--;
+    return JSONSuccess;
+}
+
+JSON_Status json_writer_string(JSON_Writer *writer, const char *name, const char *string) {
+    if (string == NULL || !is_valid_utf8(string, strlen(string))) {
+        return JSONFailure;
+    }
+    if (json_writer_begin_value(writer, name, BINARY_TAG_STRING) != JSONSuccess) {
+        return JSONFailure;
+    }
+    if (writer->binary) {
+        return json_writer_put_binary_string(writer, string);
+    }
+    return json_writer_serialize_string(writer, string);
+}
+
+JSON_Status json_writer_number(JSON_Writer *writer, const char *name, double number) {
+    char num_buf[NUM_BUF_SIZE];
+    int written = -1, is_uint = 0, i;
+    unsigned long long bits = 0;
+    if (IS_NUMBER_INVALID(number)) {
+        return JSONFailure;
+    }
+    is_uint = (number >= 0.0 && number <= BINARY_MAX_UINT && number == (double)(unsigned long long)number);
+    if (json_writer_begin_value(writer, name, is_uint ? BINARY_TAG_UINT : BINARY_TAG_DOUBLE) != JSONSuccess) {
+        return JSONFailure;
+    }
+    if (writer->binary) {
+        if (is_uint) {
+            return json_writer_put_uint(writer, (unsigned long long)number);
+        }
+        memcpy(&bits, &number, sizeof(bits));
+        for (i = 0; i < 8; i++) {
+            num_buf[i] = (char)((bits >> (8 * i)) & 0xff);
+        }
+        return json_writer_puts(writer, num_buf, 8);
+    }
+#if defined(PARSON_FORCE_HEX)
+    written = sprintf(num_buf, HEX_FORMAT, (unsigned long long)number);
+#else
+    written = sprintf(num_buf, FLOAT_FORMAT, number);
+#endif
+    if (written < 0) {
+        writer->failed = 1;
+        return JSONFailure;
+    }
+    return json_writer_puts(writer, num_buf, (size_t)written);
+}
+
+JSON_Status json_writer_boolean(JSON_Writer *writer, const char *name, int boolean) {
+    if (json_writer_begin_value(writer, name, boolean ? BINARY_TAG_TRUE : BINARY_TAG_FALSE) != JSONSuccess) {
+        return JSONFailure;
+    }
+    if (writer->binary) {
+        return JSONSuccess;
+    }
+    return boolean ? json_writer_puts(writer, "true", 4) : json_writer_puts(writer, "false", 5);
+}
+
+static JSON_Status json_writer_value_r(JSON_Writer *writer, const char *name, const JSON_Value *value) {
+    JSON_Object *object = NULL;
+    JSON_Array *array = NULL;
+    size_t i;
+    switch (json_value_get_type(value)) {
+        case JSONObject:
+            object = json_value_get_object(value);
+            if (json_writer_begin_object(writer, name) != JSONSuccess) {
+                return JSONFailure;
+            }
+            for (i = 0; i < json_object_get_count(object); i++) {
+                if (json_writer_value_r(writer, json_object_get_name(object, i),
+                                        json_object_get_value_at(object, i)) != JSONSuccess) {
+                    return JSONFailure;
+                }
+            }
+            return json_writer_end(writer);
+        case JSONArray:
+            array = json_value_get_array(value);
+            if (json_writer_begin_array(writer, name) != JSONSuccess) {
+                return JSONFailure;
+            }
+            for (i = 0; i < json_array_get_count(array); i++) {
+                if (json_writer_value_r(writer, NULL, json_array_get_value(array, i)) != JSONSuccess) {
+                    return JSONFailure;
+                }
+            }
+            return json_writer_end(writer);
+        case JSONString:
+            return json_writer_string(writer, name, json_value_get_string(value));
+        case JSONNumber:
+            return json_writer_number(writer, name, json_value_get_number(value));
+        case JSONBoolean:
+            return json_writer_boolean(writer, name, json_value_get_boolean(value));
+        case JSONNull:
+            if (json_writer_begin_value(writer, name, BINARY_TAG_NULL) != JSONSuccess) {
+                return JSONFailure;
+            }
+            return writer->binary ? JSONSuccess : json_writer_puts(writer, "null", 4);
+        default:
+            return JSONFailure;
+    }
+}
+
+JSON_Status json_writer_value(JSON_Writer *writer, const char *name, const JSON_Value *value) {
+    char num_buf[NUM_BUF_SIZE];
+    char *buf = NULL;
+    int len = -1;
+    if (value == NULL || writer == NULL) {
+        return JSONFailure;
+    }
+    if (writer->binary) {
+        return json_writer_value_r(writer, name, value);
+    }
+    len = json_serialize_to_buffer_r(value, NULL, writer->level, 1, num_buf);
+    if (len < 0) {
+        return JSONFailure;
+    }
+    if (json_writer_begin_value(writer, name, 0) != JSONSuccess) {
+        return JSONFailure;
+    }
+    buf = json_writer_get_buffer(writer, (size_t)len + 1);
+    if (buf == NULL || json_serialize_to_buffer_r(value, buf, writer->level, 1, NULL) < 0) {
+        writer->failed = 1;
+        return JSONFailure;
+    }
+    return json_writer_puts(writer, buf, (size_t)len);
+}
+
+/* Streaming parsing */
+enum {
+    READER_OBJECT,      /* expecting a member of the root object, or its end */
+    READER_VALUE,       /* a member name was returned, but its value wasn't read */
+    READER_ARRAY,       /* iterating over the elements of a member */
+    READER_END
+};
+
+struct json_reader_t {
+    char       *data;
+    const char *start;          /* first member of the root object */
+    const char *pos;
+    const char *end;
+    int         binary;
+    int         state;
+    int         has_values;     /* a separator is expected before the next text value */
+    char        tag;            /* tag of the pending binary value */
+    char       *name;
+    int         failed;
+};
+
+static JSON_Status json_reader_fail(JSON_Reader *reader) {
+    reader->failed = 1;
+    reader->state = READER_END;
+    return JSONFailure;
+}
+
+static int json_reader_get_byte(JSON_Reader *reader, char *c) {
+    if (reader->pos >= reader->end) {
+        return 0;
+    }
+    *c = *reader->pos++;
+    return 1;
+}
+
+static int json_reader_get_uint(JSON_Reader *reader, unsigned long long *value) {
+    char c = 0;
+    int shift = 0;
+    *value = 0;
+    do {
+        if (shift > 63 || !json_reader_get_byte(reader, &c)) {
+            return 0;
+        }
+        *value |= (unsigned long long)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    return 1;
+}
+
+/* Points to a binary string, that isn't NUL terminated */
+static const char * json_reader_get_string(JSON_Reader *reader, size_t *len) {
+    unsigned long long value = 0;
+    const char *string = NULL;
+    if (!json_reader_get_uint(reader, &value) || value > (unsigned long long)(reader->end - reader->pos)) {
+        return NULL;
+    }
+    string = reader->pos;
+    reader->pos += value;
+    *len = (size_t)value;
+    return string;
+}
+
+static JSON_Value * json_reader_parse_binary(JSON_Reader *reader, char tag, size_t nesting) {
+    JSON_Value *value = NULL, *new_value = NULL;
+    const char *string = NULL;
+    char *new_string = NULL;
+    unsigned long long bits = 0;
+    double number = 0.0;
+    size_t len = 0;
+    int i;
+    if (nesting > MAX_NESTING) {
+        return NULL;
+    }
+    switch (tag) {
+        case BINARY_TAG_OBJECT:
+        case BINARY_TAG_ARRAY:
+            value = (tag == BINARY_TAG_OBJECT) ? json_value_init_object() : json_value_init_array();
+            while (value != NULL) {
+                if (!json_reader_get_byte(reader, &tag)) {
+                    break;
+                }
+                if (tag == BINARY_TAG_END) {
+                    return value;
+                }
+                if (json_value_get_type(value) == JSONObject) {
+                    string = json_reader_get_string(reader, &len);
+                    new_value = (string == NULL) ? NULL : json_reader_parse_binary(reader, tag, nesting + 1);
+                    if (new_value != NULL &&
+                        json_object_addn(json_value_get_object(value), string, len, new_value) != JSONSuccess) {
+                        json_value_free(new_value);
+                        break;
+                    }
+                } else {
+                    new_value = json_reader_parse_binary(reader, tag, nesting + 1);
+                    if (new_value != NULL && json_array_add(json_value_get_array(value), new_value) != JSONSuccess) {
+                        json_value_free(new_value);
+                        break;
+                    }
+                }
+                if (new_value == NULL) {
+                    break;
+                }
+            }
+            json_value_free(value);
+            return NULL;
+        case BINARY_TAG_STRING:
+            string = json_reader_get_string(reader, &len);
+            if (string == NULL || !is_valid_utf8(string, len)) {
+                return NULL;
+            }
+            new_string = parson_strndup(string, len);
+            value = (new_string == NULL) ? NULL : json_value_init_string_no_copy(new_string);
+            if (value == NULL) {
+                parson_free(new_string);
+            }
+            return value;
+        case BINARY_TAG_UINT:
+            if (!json_reader_get_uint(reader, &bits)) {
+                return NULL;
+            }
+            return json_value_init_number((double)bits);
+        case BINARY_TAG_DOUBLE:
+            if (reader->end - reader->pos < 8) {
+                return NULL;
+            }
+            for (i = 0; i < 8; i++) {
+                bits |= (unsigned long long)(unsigned char)reader->pos[i] << (8 * i);
+            }
+            reader->pos += 8;
+            memcpy(&number, &bits, sizeof(number));
+            return json_value_init_number(number);
+        case BINARY_TAG_TRUE:
+        case BINARY_TAG_FALSE:
+            return json_value_init_boolean(tag == BINARY_TAG_TRUE);
+        case BINARY_TAG_NULL:
+            return json_value_init_null();
+        default:
+            return NULL;
+    }
+}
+
+/* Skip the next value without parsing it, which is much faster than parsing it, but doesn't validate it */
+static JSON_Status json_reader_skip_binary(JSON_Reader *reader, char tag, size_t nesting) {
+    unsigned long long value = 0;
+    size_t len = 0;
+    if (nesting > MAX_NESTING) {
+        return JSONFailure;
+    }
+    switch (tag) {
+        case BINARY_TAG_OBJECT:
+        case BINARY_TAG_ARRAY:
+            for (;;) {
+                char member_tag = 0;
+                if (!json_reader_get_byte(reader, &member_tag)) {
+                    return JSONFailure;
+                }
+                if (member_tag == BINARY_TAG_END) {
+                    return JSONSuccess;
+                }
+                if ((tag == BINARY_TAG_OBJECT && json_reader_get_string(reader, &len) == NULL) ||
+                    json_reader_skip_binary(reader, member_tag, nesting + 1) != JSONSuccess) {
+                    return JSONFailure;
+                }
+            }
+        case BINARY_TAG_STRING:
+            return (json_reader_get_string(reader, &len) == NULL) ? JSONFailure : JSONSuccess;
+        case BINARY_TAG_UINT:
+            return json_reader_get_uint(reader, &value) ? JSONSuccess : JSONFailure;
+        case BINARY_TAG_DOUBLE:
+            if (reader->end - reader->pos < 8) {
+                return JSONFailure;
+            }
+            reader->pos += 8;
+            return JSONSuccess;
+        case BINARY_TAG_TRUE:
+        case BINARY_TAG_FALSE:
+        case BINARY_TAG_NULL:
+            return JSONSuccess;
+        default:
+            return JSONFailure;
+    }
+}
+
+static JSON_Status json_reader_skip_value(JSON_Reader *reader) {
+    const char *value_start = NULL;
+    size_t depth = 0;
+    if (reader->binary) {
+        return (json_reader_skip_binary(reader, reader->tag, 1) == JSONSuccess) ? JSONSuccess : json_reader_fail(reader);
+    }
+    SKIP_WHITESPACES(&reader->pos);
+    value_start = reader->pos;
+    switch (*reader->pos) {
+        case '\"':
+            return (skip_quotes(&reader->pos) == JSONSuccess) ? JSONSuccess : json_reader_fail(reader);
+        case '{':
+        case '[':
+            break;
+        default:
+            while (*reader->pos != '\0' && *reader->pos != ',' && *reader->pos != '}' && *reader->pos != ']' &&
+                   !isspace((unsigned char)*reader->pos)) {
+                SKIP_CHAR(&reader->pos);
+            }
+            return (reader->pos != value_start) ? JSONSuccess : json_reader_fail(reader);
+    }
+    do {
+        switch (*reader->pos) {
+            case '\0':
+                return json_reader_fail(reader);
+            case '\"':
+                if (skip_quotes(&reader->pos) != JSONSuccess) {
+                    return json_reader_fail(reader);
+                }
+                continue;
+            case '{':
+            case '[':
+                depth++;
+                break;
+            case '}':
+            case ']':
+                depth--;
+                break;
+            default:
+                break;
+        }
+        SKIP_CHAR(&reader->pos);
+    } while (depth > 0);
+    return JSONSuccess;
+}
+
+/* Parse the next text or binary value. For binary, tag must have been read already. */
+static JSON_Value * json_reader_parse_value(JSON_Reader *reader, size_t nesting) {
+    JSON_Value *value = NULL;
+    if (reader->binary) {
+        value = json_reader_parse_binary(reader, reader->tag, nesting);
+    } else {
+        value = parse_value(&reader->pos, nesting);
+    }
+    if (value == NULL) {
+        json_reader_fail(reader);
+    }
+    return value;
+}
+
+/* Skip a text separator, if a value came before, and return the next character */
+static char json_reader_next_char(JSON_Reader *reader, char end) {
+    SKIP_WHITESPACES(&reader->pos);
+    if (*reader->pos != end && reader->has_values) {
+        if (*reader->pos != ',') {
+            return 0;
+        }
+        SKIP_CHAR(&reader->pos);
+        SKIP_WHITESPACES(&reader->pos);
+    }
+    return *reader->pos;
+}
+
+JSON_Reader * json_reader_open(const char *filename) {
+    JSON_Reader *reader = NULL;
+    FILE *fp = fopen_utf8(filename, "rb");
+    long size = 0;
+    if (fp == NULL) {
+        return NULL;
+    }
+    reader = (JSON_Reader*)parson_malloc(sizeof(JSON_Reader));
+    if (reader == NULL || fseek(fp, 0L, SEEK_END) != 0 || (size = ftell(fp)) < 0) {
+        goto error;
+    }
+    memset(reader, 0, sizeof(JSON_Reader));
+    rewind(fp);
+    reader->data = (char*)parson_malloc((size_t)size + 1);
+    if (reader->data == NULL || fread(reader->data, 1, (size_t)size, fp) != (size_t)size) {
+        goto error;
+    }
+    fclose(fp);
+    fp = NULL;
+    reader->data[size] = '\0';
+    reader->pos = reader->data;
+    reader->end = &reader->data[size];
+    if (size >= BINARY_MAGIC_SIZE && memcmp(reader->data, BINARY_MAGIC, BINARY_MAGIC_SIZE) == 0) {
+        reader->binary = 1;
+        reader->pos += BINARY_MAGIC_SIZE;
+        if (!json_reader_get_byte(reader, &reader->tag) || reader->tag != BINARY_TAG_OBJECT) {
+            goto error;
+        }
+    } else {
+        remove_comments(reader->data, "/*", "*/");
+        remove_comments(reader->data, "//", "\n");
+        if (reader->data[0] == '\xEF' && reader->data[1] == '\xBB' && reader->data[2] == '\xBF') {
+            reader->pos += 3; /* Support for UTF-8 BOM */
+        }
+        SKIP_WHITESPACES(&reader->pos);
+        if (*reader->pos != '{') {
+            goto error;
+        }
+        SKIP_CHAR(&reader->pos);
+    }
+    reader->start = reader->pos;
+    reader->state = READER_OBJECT;
+    return reader;
+error:
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    if (reader != NULL) {
+        parson_free(reader->data);
+        parson_free(reader);
+    }
+    return NULL;
+}
+
+JSON_Status json_reader_close(JSON_Reader *reader) {
+    JSON_Status return_code = JSONSuccess;
+    if (reader == NULL) {
+        return JSONFailure;
+    }
+    if (reader->failed) {
+        return_code = JSONFailure;
+    }
+    parson_free(reader->name);
+    parson_free(reader->data);
+    parson_free(reader);
+    return return_code;
+}
+
+JSON_Status json_reader_rewind(JSON_Reader *reader) {
+    if (reader == NULL || reader->failed) {
+        return JSONFailure;
+    }
+    parson_free(reader->name);
+    reader->name = NULL;
+    reader->pos = reader->start;
+    reader->state = READER_OBJECT;
+    reader->has_values = 0;
+    return JSONSuccess;
+}
+
+const char * json_reader_next_name(JSON_Reader *reader) {
+    size_t len = 0;
+    const char *string = NULL;
+    if (reader == NULL) {
+        return NULL;
+    }
+    /* Skip whatever the caller didn't read */
+    if (reader->state == READER_VALUE && json_reader_skip_value(reader) == JSONSuccess) {
+        reader->state = READER_OBJECT;
+        reader->has_values = 1;
+    }
+    while (reader->state == READER_ARRAY) {
+        if (reader->binary) {
+            if (!json_reader_get_byte(reader, &reader->tag)) {
+                json_reader_fail(reader);
+            } else if (reader->tag == BINARY_TAG_END) {
+                reader->state = READER_OBJECT;
+            } else {
+                json_reader_skip_value(reader);
+            }
+        } else {
+            switch (json_reader_next_char(reader, ']')) {
+                case ']':
+                    SKIP_CHAR(&reader->pos);
+                    reader->state = READER_OBJECT;
+                    break;
+                case '\0':
+                    json_reader_fail(reader);
+                    break;
+                default:
+                    json_reader_skip_value(reader);
+                    break;
+            }
+        }
+        reader->has_values = 1;
+    }
+    if (reader->state != READER_OBJECT) {
+        return NULL;
+    }
+    parson_free(reader->name);
+    reader->name = NULL;
+    if (reader->binary) {
+        if (!json_reader_get_byte(reader, &reader->tag)) {
+            json_reader_fail(reader);
+            return NULL;
+        }
+        if (reader->tag == BINARY_TAG_END) {
+            reader->state = READER_END;
+            return NULL;
+        }
+        string = json_reader_get_string(reader, &len);
+        reader->name = (string == NULL) ? NULL : parson_strndup(string, len);
+    } else {
+        switch (json_reader_next_char(reader, '}')) {
+            case '}':
+                reader->state = READER_END;
+                return NULL;
+            case '\"':
+                reader->name = get_quoted_string(&reader->pos);
+                if (reader->name == NULL) {
+                    break;
+                }
+                SKIP_WHITESPACES(&reader->pos);
+                if (*reader->pos != ':') {
+                    parson_free(reader->name);
+                    reader->name = NULL;
+                    break;
+                }
+                SKIP_CHAR(&reader->pos);
+                break;
+            default:
+                break;
+        }
+    }
+    if (reader->name == NULL) {
+        json_reader_fail(reader);
+        return NULL;
+    }
+    reader->state = READER_VALUE;
+    return reader->name;
+}
+
+JSON_Value * json_reader_get_value(JSON_Reader *reader) {
+    JSON_Value *value = NULL;
+    if (reader == NULL || reader->state != READER_VALUE) {
+        return NULL;
+    }
+    value = json_reader_parse_value(reader, 1);
+    if (value != NULL) {
+        reader->state = READER_OBJECT;
+        reader->has_values = 1;
+    }
+    return value;
+}
+
+JSON_Status json_reader_begin_array(JSON_Reader *reader) {
+    if (reader == NULL || reader->state != READER_VALUE) {
+        return JSONFailure;
+    }
+    if (reader->binary) {
+        if (reader->tag != BINARY_TAG_ARRAY) {
+            return json_reader_fail(reader);
+        }
+    } else {
+        SKIP_WHITESPACES(&reader->pos);
+        if (*reader->pos != '[') {
+            return json_reader_fail(reader);
+        }
+        SKIP_CHAR(&reader->pos);
+    }
+    reader->state = READER_ARRAY;
+    reader->has_values = 0;
+    return JSONSuccess;
+}
+
+JSON_Value * json_reader_next_element(JSON_Reader *reader) {
+    JSON_Value *value = NULL;
+    if (reader == NULL || reader->state != READER_ARRAY) {
+        return NULL;
+    }
+    if (reader->binary) {
+        if (!json_reader_get_byte(reader, &reader->tag)) {
+            json_reader_fail(reader);
+            return NULL;
+        }
+        if (reader->tag == BINARY_TAG_END) {
+            reader->state = READER_OBJECT;
+            return NULL;
+        }
+    } else {
+        switch (json_reader_next_char(reader, ']')) {
+            case ']':
+                SKIP_CHAR(&reader->pos);
+                reader->state = READER_OBJECT;
+                reader->has_values = 1;
+                return NULL;
+            case '\0':
+                json_reader_fail(reader);
+                return NULL;
+            default:
+                break;
+        }
+    }
+    value = json_reader_parse_value(reader, 2);
+    if (value != NULL) {
+        reader->has_values = 1;
+    }
+    return value;
+}
+
 void json_set_allocation_functions(JSON_Malloc_Function malloc_fun, JSON_Free_Function free_fun) {
     parson_malloc = malloc_fun;
     parson_free = free_fun;
@@ -38,6 +38,8 @@ extern "C"
 typedef struct json_object_t JSON_Object;
 typedef struct json_array_t  JSON_Array;
 typedef struct json_value_t  JSON_Value;
+typedef struct json_writer_t JSON_Writer;
+typedef struct json_reader_t JSON_Reader;
 
 enum json_value_type {
     JSONError   = -1,
@@ -95,6 +97,37 @@ char *      json_serialize_to_string_pretty(const JSON_Value *value);
 
 void        json_free_serialized_string(char *string); /* frees string from json_serialize_to_string and json_serialize_to_string_pretty */
 
+/* Streaming pretty serialization, that produces the same output as json_serialize_to_file_pretty(),
+   but writes values as they are added, rather than require the whole DOM to be built first.
+   name must be NULL for the root value and array elements, and non NULL for object members.
+   As with the DOM, strings that aren't valid UTF-8 and invalid numbers are not added.
+   Calls with a NULL writer do nothing, so that the same code can run without output. */
+JSON_Writer * json_writer_open         (const char *filename);
+JSON_Writer * json_writer_open_binary  (const char *filename); /* compact, machine only format */
+JSON_Status   json_writer_close        (JSON_Writer *writer); /* fails if any write failed */
+JSON_Status   json_writer_begin_object (JSON_Writer *writer, const char *name);
+JSON_Status   json_writer_begin_array  (JSON_Writer *writer, const char *name);
+JSON_Status   json_writer_end          (JSON_Writer *writer); /* ends the current object or array */
+JSON_Status   json_writer_string       (JSON_Writer *writer, const char *name, const char *string);
+JSON_Status   json_writer_number       (JSON_Writer *writer, const char *name, double number);
+JSON_Status   json_writer_boolean      (JSON_Writer *writer, const char *name, int boolean);
+JSON_Status   json_writer_value        (JSON_Writer *writer, const char *name, const JSON_Value *value);
+
+/* Streaming parsing of a file whose root is an object, from JSON with comments or from the binary
+   format of json_writer_open_binary(). Members are read one at a time, and the elements of an array
+   member can also be read one at a time, so that only the current value needs to be held as a DOM.
+   Values that the caller doesn't read are skipped, without being parsed or validated.
+   Note that the whole file is still read into memory when opening it, as the text parser needs
+   NUL terminated data with the comments removed, so the memory usage is that of the file size,
+   which remains much lower than that of the DOM that json_parse_file() builds. */
+JSON_Reader * json_reader_open         (const char *filename);
+JSON_Status   json_reader_close        (JSON_Reader *reader); /* fails if the data was invalid */
+const char  * json_reader_next_name    (JSON_Reader *reader); /* NULL at the end of the root object */
+JSON_Value  * json_reader_get_value    (JSON_Reader *reader); /* value of the current member */
+JSON_Status   json_reader_begin_array  (JSON_Reader *reader); /* current member must be an array */
+JSON_Value  * json_reader_next_element (JSON_Reader *reader); /* NULL at the end of the array */
+JSON_Status   json_reader_rewind       (JSON_Reader *reader); /* restart from the first member */
+
 /* Comparing */
 int  json_value_equals(const JSON_Value *a, const JSON_Value *b);
 
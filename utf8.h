@@ -102,6 +102,27 @@ static __inline int rename_utf8(const char* oldname, const char* newname)
     return r;
 }
 
+static __inline int remove_utf8(const char* path)
+{
+    wchar_t* path16 = utf8_to_utf16(path);
+    int r = _wremove(path16);
+    free(path16);
+    return r;
+}
+
+// Absolute path of an existing file or directory, that must be freed, or NULL on error
+static __inline char* realpath_utf8(const char* path)
+{
+    char* r = NULL;
+    wchar_t* path16 = utf8_to_utf16(path);
+    wchar_t* full_path16 = (path16 == NULL) ? NULL : _wfullpath(NULL, path16, 0);
+    if (full_path16 != NULL)
+        r = utf16_to_utf8(full_path16);
+    free(full_path16);
+    free(path16);
+    return r;
+}
+
 static __inline int stat64_utf8(const char* path, struct stat64* buffer)
 {
     int r;
@@ -126,7 +147,8 @@ static __inline BOOL CreateDirectory_utf8(const char* path, LPSECURITY_ATTRIBUTE
     if (argv == NULL) return EXIT_FAILURE;                  \
     for (int i = 0; i < argc; i++)                          \
         argv[i] = utf16_to_utf8(argv16[i]);                 \
-    int r = main_utf8(argc, argv);                          \
+    int r = main_utf8(parse_stats_option(argc, argv), argv);\
+    print_stats();                                          \
     for (int i = 0; i < argc; i++)                          \
         free(argv[i]);                                      \
     free(argv);                                             \
@@ -136,6 +158,8 @@ static __inline BOOL CreateDirectory_utf8(const char* path, LPSECURITY_ATTRIBUTE
 #else
 #define fopen_utf8 fopen
 #define rename_utf8 rename
+#define remove_utf8 remove
+#define realpath_utf8(path) realpath(path, NULL)
 #if defined(__APPLE__)
 #define stat64_utf8 stat
 #define stat64_t stat
@@ -144,6 +168,15 @@ static __inline BOOL CreateDirectory_utf8(const char* path, LPSECURITY_ATTRIBUTE
 #define stat64_t stat64
 #endif
 #define CALL_MAIN int main(int argc, char** argv) {         \
-    return main_utf8(argc, argv);                           \
+    int r = main_utf8(parse_stats_option(argc, argv), argv);\
+    print_stats();                                          \
+    return r;                                               \
 }
 #endif
+
+// The batch driver renames the main_utf8() of each tool it links with (see Makefile)
+// and provides its own entry point
+#if defined(GUST_BATCH)
+#undef CALL_MAIN
+#define CALL_MAIN
+#endif
@@ -17,14 +17,32 @@
 */
 
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#if defined(_WIN32)
+#include <io.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
 
 #include "utf8.h"
 #include "util.h"
+#if defined(_WIN32)
+#include <psapi.h>
+#endif
 
 // Flags to indicate the endianness of the data being processed as well as the platform
-endianness data_endianness = little_endian;
+THREAD_LOCAL endianness data_endianness = little_endian;
 const endianness platform_endianness = little_endian;
 
 bool create_path(char* path)
@@ -70,14 +88,124 @@ bool create_path(char* path)
     return result;
 }
 
+typedef struct {
+    char**      list;
+    uint32_t    nb_files;
+    uint32_t    max_files;
+} file_list;
+
+static bool add_file(file_list* files, const char* rel_path)
+{
+    if (files->nb_files == files->max_files) {
+        uint32_t new_max = max(256, 2 * files->max_files);
+        char** new_list = realloc(files->list, new_max * sizeof(char*));
+        if (new_list == NULL)
+            return false;
+        files->list = new_list;
+        files->max_files = new_max;
+    }
+    files->list[files->nb_files] = strdup(rel_path);
+    return (files->list[files->nb_files++] != NULL);
+}
+
+static bool list_files_rec(const char* root, const char* rel_dir, file_list* files)
+{
+    char path[2 * PATH_MAX], rel_path[PATH_MAX];
+    bool r = true;
+    if (rel_dir[0] == 0)
+        snprintf(path, sizeof(path), "%s", root);
+    else
+        snprintf(path, sizeof(path), "%s%c%s", root, PATH_SEP, rel_dir);
+#if defined(_WIN32)
+    WIN32_FIND_DATAW fd;
+    strncat(path, "\\*", sizeof(path) - strlen(path) - 1);
+    wchar_t* path16 = utf8_to_utf16(path);
+    HANDLE h = FindFirstFileW(path16, &fd);
+    free(path16);
+    if (h == INVALID_HANDLE_VALUE)
+        return false;
+    do {
+        if (wcscmp(fd.cFileName, L".") == 0 || wcscmp(fd.cFileName, L"..") == 0)
+            continue;
+        char* name = utf16_to_utf8(fd.cFileName);
+        if (name == NULL) {
+            r = false;
+            break;
+        }
+        if (rel_dir[0] == 0)
+            snprintf(rel_path, sizeof(rel_path), "%s", name);
+        else
+            snprintf(rel_path, sizeof(rel_path), "%s%c%s", rel_dir, PATH_SEP, name);
+        free(name);
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            r = list_files_rec(root, rel_path, files);
+        else
+            r = add_file(files, rel_path);
+    } while (r && FindNextFileW(h, &fd));
+    FindClose(h);
+#else
+    DIR* dir = opendir(path);
+    if (dir == NULL)
+        return false;
+    struct dirent* de;
+    while (r && (de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if (rel_dir[0] == 0)
+            snprintf(rel_path, sizeof(rel_path), "%s", de->d_name);
+        else
+            snprintf(rel_path, sizeof(rel_path), "%s%c%s", rel_dir, PATH_SEP, de->d_name);
+        snprintf(path, sizeof(path), "%s%c%s", root, PATH_SEP, rel_path);
+        struct stat64_t st;
+        if (stat64_utf8(path, &st) != 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+            r = list_files_rec(root, rel_path, files);
+        else if (S_ISREG(st.st_mode))
+            r = add_file(files, rel_path);
+    }
+    closedir(dir);
+#endif
+    return r;
+}
+
+static int strcmp_ptr(const void* a, const void* b)
+{
+    return strcmp(*(const char**)a, *(const char**)b);
+}
+
+uint32_t list_files(const char* dir, char*** list)
+{
+    file_list files = { NULL, 0, 0 };
+    *list = NULL;
+    if (!list_files_rec(dir, "", &files)) {
+        fprintf(stderr, "ERROR: Can't list the content of '%s'\n", dir);
+        free_file_list(files.list, files.nb_files);
+        return UINT32_MAX;
+    }
+    if (files.nb_files != 0)
+        qsort(files.list, files.nb_files, sizeof(char*), strcmp_ptr);
+    *list = files.list;
+    return files.nb_files;
+}
+
+void free_file_list(char** list, uint32_t nb_files)
+{
+    if (list == NULL)
+        return;
+    for (uint32_t i = 0; i < nb_files; i++)
+        free(list[i]);
+    free(list);
+}
+
 // dirname/basename, that *PRESERVE* the string parameter.
-// Note that these calls are not concurrent, meaning that you MUST be done
+// Note that these calls use a per-thread buffer, meaning that you MUST be done
 // using the returned string from a previous call before invoking again.
 #if defined(_WIN32)
 char* _basename_win32(const char* path, bool remove_extension)
 {
-    static char basename[128];
-    static char ext[64];
+    static THREAD_LOCAL char basename[128];
+    static THREAD_LOCAL char ext[64];
     ext[0] = 0;
     _splitpath_s(path, NULL, 0, NULL, 0, basename, sizeof(basename), ext, sizeof(ext));
     if ((ext[0] != 0) && !remove_extension)
@@ -88,8 +216,8 @@ char* _basename_win32(const char* path, bool remove_extension)
 // This call should behave pretty similar to UNIX' dirname
 char* _dirname_win32(const char* path)
 {
-    static char dir[PATH_MAX];
-    static char drive[4];
+    static THREAD_LOCAL char dir[PATH_MAX];
+    static THREAD_LOCAL char drive[4];
     int found_sep = 0;
     memset(drive, 0, sizeof(drive));
     _splitpath_s(path, drive, sizeof(drive), dir, sizeof(dir) - 3, NULL, 0, NULL, 0);
@@ -120,7 +248,7 @@ char* _dirname_win32(const char* path)
 #else
 char* _basename_unix(const char* path)
 {
-    static char path_copy[PATH_MAX];
+    static THREAD_LOCAL char path_copy[PATH_MAX];
     strncpy(path_copy, path, sizeof(path_copy));
     path_copy[PATH_MAX - 1] = 0;
     return basename(path_copy);
@@ -128,7 +256,7 @@ char* _basename_unix(const char* path)
 
 char* _dirname_unix(const char* path)
 {
-    static char path_copy[PATH_MAX];
+    static THREAD_LOCAL char path_copy[PATH_MAX];
     strncpy(path_copy, path, sizeof(path_copy));
     path_copy[PATH_MAX - 1] = 0;
     return dirname(path_copy);
@@ -149,7 +277,7 @@ bool is_directory(const char* path)
 
 char* change_extension(const char* path, const char* extension)
 {
-    static char new_path[PATH_MAX];
+    static THREAD_LOCAL char new_path[PATH_MAX];
     strncpy(new_path, _basename((char*)path), sizeof(new_path) - 1);
     for (size_t i = 0; i < sizeof(new_path); i++) {
         if (new_path[i] == '.')
@@ -168,29 +296,56 @@ size_t get_trailing_slash(const char* path)
     return (i == 0) ? 0: i + 1;
 }
 
+// Size of an open file, that isn't limited to 32-bit
+static bool get_open_file_size(FILE* file, uint64_t* size)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER li;
+    if (!GetFileSizeEx((HANDLE)_get_osfhandle(_fileno(file)), &li))
+        return false;
+    *size = (uint64_t)li.QuadPart;
+#else
+    struct stat64_t st;
+    if (fstat64(fileno(file), &st) != 0)
+        return false;
+    *size = (uint64_t)st.st_size;
+#endif
+    return true;
+}
+
 uint32_t read_file_max(const char* path, uint8_t** buf, uint32_t max_size)
 {
+    uint64_t file_size;
+    uint32_t size = UINT32_MAX;
+    *buf = NULL;
     FILE* file = fopen_utf8(path, "rb");
     if (file == NULL) {
         fprintf(stderr, "ERROR: Can't open '%s'\n", path);
         return UINT32_MAX;
     }
 
-    fseek(file, 0L, SEEK_END);
-    uint32_t size = (uint32_t)ftell(file);
-    fseek(file, 0L, SEEK_SET);
+    if (!get_open_file_size(file, &file_size)) {
+        fprintf(stderr, "ERROR: Can't get the size of '%s'\n", path);
+        goto out;
+    }
     if (max_size != 0)
-        size = min(size, max_size);
-
-    *buf = calloc(size, 1);
+        file_size = min(file_size, max_size);
+    if (file_size >= UINT32_MAX) {
+        fprintf(stderr, "ERROR: '%s' is too large\n", path);
+        goto out;
+    }
+    // The whole buffer gets overwritten, so there's no need to zero it
+    *buf = malloc(max((size_t)file_size, 1));
     if (*buf == NULL) {
-        size = UINT32_MAX;
+        fprintf(stderr, "ERROR: Can't allocate buffer for '%s'\n", path);
         goto out;
     }
-    if (fread(*buf, 1, size, file) != size) {
+    if (fread(*buf, 1, (size_t)file_size, file) != (size_t)file_size) {
         fprintf(stderr, "ERROR: Can't read '%s'\n", path);
-        size = UINT32_MAX;
+        goto out;
     }
+    size = (uint32_t)file_size;
+
 out:
     fclose(file);
     if (size == UINT32_MAX) {
@@ -202,16 +357,12 @@ out:
 
 uint64_t get_file_size(const char* path)
 {
-    FILE* file = fopen_utf8(path, "rb");
-    if (file == NULL) {
+    struct stat64_t st;
+    if (stat64_utf8(path, &st) != 0) {
         fprintf(stderr, "ERROR: Can't open '%s'\n", path);
         return UINT32_MAX;
     }
-
-    fseek(file, 0L, SEEK_END);
-    uint64_t size = ftell64(file);
-    fclose(file);
-    return size;
+    return (uint64_t)st.st_size;
 }
 
 void create_backup(const char* path)
@@ -242,9 +393,747 @@ bool write_file(const uint8_t* buf, const uint32_t size, const char* path, const
         fprintf(stderr, "ERROR: Can't create file '%s'\n", path);
         return false;
     }
-    bool r = (fwrite(buf, 1, size, file) == size);
+    // Only large files are worth the extra call to reserve their space
+    if (size >= PREALLOCATE_THRESHOLD)
+        reserve_file_space(file, size);
+    bool r = write_at(file, buf, size, 0);
     fclose(file);
     if (!r)
         fprintf(stderr, "ERROR: Can't write file '%s'\n", path);
     return r;
 }
+
+FILE* create_file(const char* path, uint64_t size_hint)
+{
+    FILE* file = fopen_utf8(path, "wb+");
+    if (file == NULL)
+        return NULL;
+    setvbuf(file, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+    if (size_hint >= PREALLOCATE_THRESHOLD)
+        reserve_file_space(file, size_hint);
+    return file;
+}
+
+// Cache of the directories that are known to exist
+static mutex_t dir_cache_lock = MUTEX_INITIALIZER;
+static char** dir_cache = NULL;
+static uint32_t dir_cache_size = 0, dir_cache_used = 0;
+
+static bool dir_cache_insert(char* dir, uint64_t hash)
+{
+    if (2 * (dir_cache_used + 1) > dir_cache_size) {
+        uint32_t new_size = max(64, 2 * dir_cache_size);
+        char** new_cache = calloc(new_size, sizeof(char*));
+        if (new_cache == NULL)
+            return false;
+        for (uint32_t i = 0; i < dir_cache_size; i++) {
+            if (dir_cache[i] == NULL)
+                continue;
+            uint32_t j = (uint32_t)xxhash64(dir_cache[i], strlen(dir_cache[i]), 0) & (new_size - 1);
+            while (new_cache[j] != NULL)
+                j = (j + 1) & (new_size - 1);
+            new_cache[j] = dir_cache[i];
+        }
+        free(dir_cache);
+        dir_cache = new_cache;
+        dir_cache_size = new_size;
+    }
+    uint32_t j = (uint32_t)hash & (dir_cache_size - 1);
+    while (dir_cache[j] != NULL)
+        j = (j + 1) & (dir_cache_size - 1);
+    dir_cache[j] = dir;
+    dir_cache_used++;
+    return true;
+}
+
+bool create_path_cached(const char* dir)
+{
+    size_t len = strlen(dir);
+    uint64_t hash = xxhash64(dir, len, 0);
+    bool r = true;
+
+    lock_mutex(&dir_cache_lock);
+    if (dir_cache_size != 0) {
+        for (uint32_t j = (uint32_t)hash & (dir_cache_size - 1); dir_cache[j] != NULL; j = (j + 1) & (dir_cache_size - 1)) {
+            if (strcmp(dir_cache[j], dir) == 0)
+                goto out;
+        }
+    }
+    char* copy = strdup(dir);
+    if (copy == NULL) {
+        r = false;
+        goto out;
+    }
+    // create_path() may alter its parameter, so give it a copy of its own
+    char path[PATH_MAX];
+    strncpy(path, dir, sizeof(path) - 1);
+    path[sizeof(path) - 1] = 0;
+    r = create_path(path);
+    if (!r || !dir_cache_insert(copy, hash))
+        free(copy);
+
+out:
+    unlock_mutex(&dir_cache_lock);
+    return r;
+}
+
+bool write_output_file(const uint8_t* buf, const uint32_t size, const char* path)
+{
+    char dir[PATH_MAX];
+    size_t pos = get_trailing_slash(path);
+    if (pos > 1 && pos < sizeof(dir)) {
+        memcpy(dir, path, pos - 1);
+        dir[pos - 1] = 0;
+        if (!create_path_cached(dir)) {
+            fprintf(stderr, "ERROR: Can't create path '%s'\n", dir);
+            return false;
+        }
+    }
+    return write_file(buf, size, path, false);
+}
+
+static __inline char glob_char(char c)
+{
+    if (c == '\\')
+        return '/';
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+int compare_paths(const char* a, const char* b)
+{
+    while (*a != 0 && glob_char(*a) == glob_char(*b)) {
+        a++;
+        b++;
+    }
+    return (int)(uint8_t)glob_char(*a) - (int)(uint8_t)glob_char(*b);
+}
+
+bool match_glob(const char* pattern, const char* str)
+{
+    const char *star = NULL, *backtrack = NULL;
+    while (*str != 0) {
+        if (*pattern == '*') {
+            // Remember where to resume from if the rest doesn't match
+            star = ++pattern;
+            backtrack = str;
+        } else if (*pattern == '?' || (*pattern != 0 && glob_char(*pattern) == glob_char(*str))) {
+            pattern++;
+            str++;
+        } else if (star != NULL) {
+            pattern = star;
+            str = ++backtrack;
+        } else {
+            return false;
+        }
+    }
+    while (*pattern == '*')
+        pattern++;
+    return (*pattern == 0);
+}
+
+bool read_at(FILE* file, void* buf, size_t size, uint64_t offset)
+{
+    uint8_t* p = (uint8_t*)buf;
+#if defined(_WIN32)
+    // ReadFile() moves the file pointer, even when given an offset, so we restore it
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(file));
+    LARGE_INTEGER pos, zero = { 0 };
+    if (!SetFilePointerEx(h, zero, &pos, FILE_CURRENT))
+        return false;
+#else
+    int fd = fileno(file);
+#endif
+    while (size > 0) {
+#if defined(_WIN32)
+        DWORD n = 0;
+        OVERLAPPED ov = { 0 };
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        if (!ReadFile(h, p, (DWORD)min(size, 0x40000000), &n, &ov) || n == 0)
+            break;
+#else
+        ssize_t n = pread(fd, p, size, (off_t)offset);
+        if (n <= 0)
+            break;
+#endif
+        p = &p[n];
+        size -= n;
+        offset += n;
+    }
+#if defined(_WIN32)
+    SetFilePointerEx(h, pos, NULL, FILE_BEGIN);
+#endif
+    return (size == 0);
+}
+
+bool write_at(FILE* file, const void* buf, size_t size, uint64_t offset)
+{
+    const uint8_t* p = (const uint8_t*)buf;
+#if defined(_WIN32)
+    // Same as ReadFile(), WriteFile() moves the file pointer
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(file));
+    LARGE_INTEGER pos, zero = { 0 };
+    if (!SetFilePointerEx(h, zero, &pos, FILE_CURRENT))
+        return false;
+#else
+    int fd = fileno(file);
+#endif
+    while (size > 0) {
+#if defined(_WIN32)
+        DWORD n = 0;
+        OVERLAPPED ov = { 0 };
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+        if (!WriteFile(h, p, (DWORD)min(size, 0x40000000), &n, &ov) || n == 0)
+            break;
+#else
+        ssize_t n = pwrite(fd, p, size, (off_t)offset);
+        if (n <= 0)
+            break;
+#endif
+        p = &p[n];
+        size -= n;
+        offset += n;
+    }
+#if defined(_WIN32)
+    SetFilePointerEx(h, pos, NULL, FILE_BEGIN);
+#endif
+    return (size == 0);
+}
+
+bool preallocate_file(FILE* file, uint64_t size)
+{
+    if (fflush(file) != 0)
+        return false;
+#if defined(_WIN32)
+    FILE_END_OF_FILE_INFO info;
+    info.EndOfFile.QuadPart = (LONGLONG)size;
+    return SetFileInformationByHandle((HANDLE)_get_osfhandle(_fileno(file)), FileEndOfFileInfo, &info, sizeof(info));
+#else
+#if defined(__linux__)
+    // Not all filesystems support this, in which case we just set the size
+    if (size != 0 && posix_fallocate(fileno(file), 0, (off_t)size) == 0)
+        return true;
+#endif
+    return (ftruncate(fileno(file), (off_t)size) == 0);
+#endif
+}
+
+bool reserve_file_space(FILE* file, uint64_t size)
+{
+    if (fflush(file) != 0)
+        return false;
+#if defined(_WIN32)
+    FILE_ALLOCATION_INFO info;
+    info.AllocationSize.QuadPart = (LONGLONG)size;
+    return SetFileInformationByHandle((HANDLE)_get_osfhandle(_fileno(file)), FileAllocationInfo, &info, sizeof(info));
+#elif defined(__linux__)
+    return (fallocate(fileno(file), FALLOC_FL_KEEP_SIZE, 0, (off_t)size) == 0);
+#else
+    (void)size;
+    return false;
+#endif
+}
+
+bool copy_file_data(FILE* src, uint64_t src_offset, FILE* dst, uint64_t dst_offset, uint64_t size)
+{
+    if (fflush(dst) != 0)
+        return false;
+#if defined(__linux__)
+    loff_t off_in = (loff_t)src_offset, off_out = (loff_t)dst_offset;
+    while (size > 0) {
+        ssize_t n = copy_file_range(fileno(src), &off_in, fileno(dst), &off_out, (size_t)min(size, 0x40000000), 0);
+        if (n <= 0)
+            break;
+        size -= n;
+    }
+    src_offset = (uint64_t)off_in;
+    dst_offset = (uint64_t)off_out;
+#endif
+    // Regular copy, for the platforms or filesystems where the above is not available
+    uint8_t* buf = NULL;
+    if (size > 0) {
+        buf = malloc((size_t)min(size, 0x100000));
+        if (buf == NULL)
+            return false;
+    }
+    while (size > 0) {
+        size_t n = (size_t)min(size, 0x100000);
+        if (!read_at(src, buf, n, src_offset) || !write_at(dst, buf, n, dst_offset))
+            break;
+        src_offset += n;
+        dst_offset += n;
+        size -= n;
+    }
+    free(buf);
+    return (size == 0);
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static __inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = XXH_ROTL64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static __inline uint64_t xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+void xxhash64_init(xxhash64_state* state, uint64_t seed)
+{
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = seed + XXH_PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - XXH_PRIME64_1;
+}
+
+void xxhash64_update(xxhash64_state* state, const void* data, size_t size)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = &p[size];
+
+    state->total_size += size;
+    if (state->mem_size + size < 32) {
+        memcpy(&state->mem[state->mem_size], p, size);
+        state->mem_size += (uint32_t)size;
+        return;
+    }
+    if (state->mem_size != 0) {
+        // Complete the pending stripe
+        memcpy(&state->mem[state->mem_size], p, 32 - state->mem_size);
+        p = &p[32 - state->mem_size];
+        for (int i = 0; i < 4; i++)
+            state->v[i] = xxh64_round(state->v[i], getle64(&state->mem[8 * i]));
+        state->mem_size = 0;
+    }
+    for (; p + 32 <= end; p = &p[32])
+        for (int i = 0; i < 4; i++)
+            state->v[i] = xxh64_round(state->v[i], getle64(&p[8 * i]));
+    memcpy(state->mem, p, end - p);
+    state->mem_size = (uint32_t)(end - p);
+}
+
+uint64_t xxhash64_digest(const xxhash64_state* state)
+{
+    const uint8_t* p = state->mem;
+    const uint8_t* end = &p[state->mem_size];
+    const uint64_t* v = state->v;
+    uint64_t h;
+
+    if (state->total_size >= 32) {
+        h = XXH_ROTL64(v[0], 1) + XXH_ROTL64(v[1], 7) + XXH_ROTL64(v[2], 12) + XXH_ROTL64(v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = xxh64_merge_round(h, v[i]);
+    } else {
+        h = state->seed + XXH_PRIME64_5;
+    }
+    h += state->total_size;
+    for (; p + 8 <= end; p = &p[8]) {
+        h ^= xxh64_round(0, getle64(p));
+        h = XXH_ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)getle32(p) * XXH_PRIME64_1;
+        h = XXH_ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p = &p[4];
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = XXH_ROTL64(h, 11) * XXH_PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t xxhash64(const void* data, size_t size, uint64_t seed)
+{
+    xxhash64_state state;
+    xxhash64_init(&state, seed);
+    xxhash64_update(&state, data, size);
+    return xxhash64_digest(&state);
+}
+
+uint8_t* map_file(FILE* file, uint64_t* size, bool copy_on_write)
+{
+    void* map = NULL;
+    *size = 0;
+#if defined(_WIN32)
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(file));
+    LARGE_INTEGER li;
+    if (!GetFileSizeEx(h, &li) || li.QuadPart == 0 || (uint64_t)li.QuadPart > SIZE_MAX)
+        return NULL;
+    HANDLE mapping = CreateFileMapping(h, NULL, copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+        return NULL;
+    map = MapViewOfFile(mapping, copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+    // The view keeps a reference to the mapping object
+    CloseHandle(mapping);
+    if (map == NULL)
+        return NULL;
+    *size = (uint64_t)li.QuadPart;
+#else
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || st.st_size == 0 || (uint64_t)st.st_size > SIZE_MAX)
+        return NULL;
+    map = mmap(NULL, (size_t)st.st_size, copy_on_write ? (PROT_READ | PROT_WRITE) : PROT_READ,
+        MAP_PRIVATE, fileno(file), 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    *size = (uint64_t)st.st_size;
+#endif
+    return (uint8_t*)map;
+}
+
+void unmap_file(const uint8_t* map, uint64_t size)
+{
+    if (map == NULL)
+        return;
+#if defined(_WIN32)
+    (void)size;
+    UnmapViewOfFile(map);
+#else
+    munmap((void*)map, (size_t)size);
+#endif
+}
+
+bool open_file_view(const char* path, file_view* view, bool copy_on_write)
+{
+    memset(view, 0, sizeof(*view));
+    FILE* file = fopen_utf8(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Can't open '%s'\n", path);
+        return false;
+    }
+    view->data = map_file(file, &view->size, copy_on_write);
+    view->mapped = (view->data != NULL);
+    if (!view->mapped) {
+        // Fall back to reading the file into a heap buffer
+        if (!get_open_file_size(file, &view->size) || view->size >= SIZE_MAX) {
+            fprintf(stderr, "ERROR: Can't get the size of '%s'\n", path);
+            goto error;
+        }
+        view->data = malloc(max((size_t)view->size, 1));
+        if (view->data == NULL) {
+            fprintf(stderr, "ERROR: Can't allocate buffer for '%s'\n", path);
+            goto error;
+        }
+        if (!read_at(file, view->data, (size_t)view->size, 0)) {
+            fprintf(stderr, "ERROR: Can't read '%s'\n", path);
+            goto error;
+        }
+    }
+    fclose(file);
+    return true;
+
+error:
+    fclose(file);
+    close_file_view(view);
+    return false;
+}
+
+void close_file_view(file_view* view)
+{
+    if (view->mapped)
+        unmap_file(view->data, view->size);
+    else
+        free(view->data);
+    memset(view, 0, sizeof(*view));
+}
+
+#if defined(USE_AVX2)
+bool cpu_has_avx2(void)
+{
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] < 7)
+        return false;
+    // Check that the OS saves the YMM registers, and that AVX and AVX2 are supported
+    __cpuid(regs, 1);
+    if ((regs[2] & 0x18000000) != 0x18000000 || (_xgetbv(0) & 0x06) != 0x06)
+        return false;
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & 0x20) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#if defined(_WIN32)
+#define atomic_inc(p) ((uint32_t)InterlockedIncrement(p) - 1)
+#define atomic_set(p) InterlockedExchange(p, 1)
+typedef volatile LONG atomic_t;
+#else
+#define atomic_inc(p) __sync_fetch_and_add(p, 1)
+#define atomic_set(p) __sync_lock_test_and_set(p, 1)
+typedef volatile uint32_t atomic_t;
+#endif
+
+typedef struct {
+    job_fn      fn;
+    void*       ctx;
+    uint32_t    nb_jobs;
+    atomic_t    next_job;
+    atomic_t    failed;
+} job_queue;
+
+typedef struct {
+    job_queue*  queue;
+    uint32_t    index;
+} job_worker;
+
+#if defined(_WIN32)
+static DWORD WINAPI worker_thread(LPVOID param)
+#else
+static void* worker_thread(void* param)
+#endif
+{
+    job_worker* worker = (job_worker*)param;
+    job_queue* queue = worker->queue;
+    while (!queue->failed) {
+        uint32_t job = atomic_inc(&queue->next_job);
+        if (job >= queue->nb_jobs)
+            break;
+        if (!queue->fn(queue->ctx, worker->index, job))
+            atomic_set(&queue->failed);
+    }
+    return 0;
+}
+
+uint32_t get_nb_cpus(void)
+{
+#if defined(_WIN32)
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return max(1, (uint32_t)si.dwNumberOfProcessors);
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n < 1) ? 1 : (uint32_t)n;
+#endif
+}
+
+bool parse_nb_threads(const char* str, uint32_t* nb_threads)
+{
+    char* end;
+    // strtoul() silently negates values starting with a minus sign
+    while (*str == ' ' || *str == '\t')
+        str++;
+    if (*str < '0' || *str > '9')
+        return false;
+    unsigned long n = strtoul(str, &end, 10);
+    if (*end != 0 || n > MAX_NB_THREADS)
+        return false;
+    *nb_threads = (n == 0) ? get_nb_cpus() : (uint32_t)n;
+    return true;
+}
+
+bool run_jobs(uint32_t nb_threads, uint32_t nb_jobs, job_fn fn, void* ctx)
+{
+    job_queue queue = { fn, ctx, nb_jobs, 0, 0 };
+    job_worker main_worker = { &queue, 0 };
+    nb_threads = min(nb_threads, nb_jobs);
+
+    // Don't bother with threads if we only need one
+    if (nb_threads <= 1) {
+        worker_thread(&main_worker);
+        return !queue.failed;
+    }
+
+    job_worker* workers = calloc(nb_threads, sizeof(job_worker));
+#if defined(_WIN32)
+    HANDLE* threads = calloc(nb_threads, sizeof(HANDLE));
+#else
+    pthread_t* threads = calloc(nb_threads, sizeof(pthread_t));
+#endif
+    if (workers == NULL || threads == NULL) {
+        fprintf(stderr, "ERROR: Can't allocate threads\n");
+        free(workers);
+        free(threads);
+        return false;
+    }
+    // The calling thread acts as worker 0
+    uint32_t nb_started = 1;
+    for (; nb_started < nb_threads; nb_started++) {
+        workers[nb_started].queue = &queue;
+        workers[nb_started].index = nb_started;
+#if defined(_WIN32)
+        threads[nb_started] = CreateThread(NULL, 0, worker_thread, &workers[nb_started], 0, NULL);
+        if (threads[nb_started] == NULL)
+            break;
+#else
+        if (pthread_create(&threads[nb_started], NULL, worker_thread, &workers[nb_started]) != 0)
+            break;
+#endif
+    }
+    worker_thread(&main_worker);
+    for (uint32_t i = 1; i < nb_started; i++) {
+#if defined(_WIN32)
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+    free(workers);
+    free(threads);
+    return !queue.failed;
+}
+
+// Instrumentation, with the phases listed in the order they were first seen
+#define MAX_STATS_PHASES    64
+
+typedef struct {
+    const char* name;
+    uint64_t    calls;
+    uint64_t    time;
+    uint64_t    bytes;
+} stats_phase;
+
+bool stats_enabled = false;
+static char stats_app[64];
+static const char* stats_path = NULL;
+static uint64_t stats_start_time;
+static stats_phase stats_phases[MAX_STATS_PHASES];
+static uint32_t nb_stats_phases = 0;
+static mutex_t stats_mutex = MUTEX_INITIALIZER;
+
+uint64_t get_time_ns(void)
+{
+#if defined(_WIN32)
+    static LARGE_INTEGER freq = { 0 };
+    LARGE_INTEGER count;
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000ULL +
+        (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000ULL / (uint64_t)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+uint64_t get_peak_rss(void)
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+        return 0;
+    return pmc.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#if defined(__APPLE__)
+    return (uint64_t)usage.ru_maxrss;
+#else
+    // Linux reports kilobytes
+    return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+int parse_stats_option(int argc, char** argv)
+{
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--stats", 7) != 0 || (argv[i][7] != 0 && argv[i][7] != '='))
+            continue;
+        if (argv[i][7] == '=' && argv[i][8] != 0)
+            stats_path = &argv[i][8];
+        snprintf(stats_app, sizeof(stats_app), "%s", _appname(argv[0]));
+        stats_enabled = true;
+        stats_start_time = get_time_ns();
+        // Keep the option at the end of argv, so that the caller can still free it
+        char* option = argv[i];
+        memmove(&argv[i], &argv[i + 1], (size_t)(argc - i - 1) * sizeof(char*));
+        argv[--argc] = option;
+        break;
+    }
+    return argc;
+}
+
+void add_stats(const char* phase, uint64_t start, uint64_t bytes)
+{
+    uint64_t time = get_time_ns() - start;
+    uint32_t i;
+    lock_mutex(&stats_mutex);
+    for (i = 0; i < nb_stats_phases && stats_phases[i].name != phase; i++);
+    if (i == nb_stats_phases) {
+        // Phases may also use different copies of the same name
+        for (i = 0; i < nb_stats_phases && strcmp(stats_phases[i].name, phase) != 0; i++);
+        if (i == nb_stats_phases) {
+            if (nb_stats_phases >= MAX_STATS_PHASES) {
+                unlock_mutex(&stats_mutex);
+                return;
+            }
+            stats_phases[nb_stats_phases++].name = phase;
+        }
+    }
+    stats_phases[i].calls++;
+    stats_phases[i].time += time;
+    stats_phases[i].bytes += bytes;
+    unlock_mutex(&stats_mutex);
+}
+
+static double get_mb_per_s(uint64_t bytes, uint64_t time)
+{
+    return (time == 0) ? 0.0 : ((double)bytes / (1024.0 * 1024.0)) / ((double)time / 1.0e9);
+}
+
+void print_stats(void)
+{
+    if (!stats_enabled)
+        return;
+    uint64_t wall_time = get_time_ns() - stats_start_time, peak_rss = get_peak_rss();
+
+    if (stats_path == NULL) {
+        fflush(stdout);
+        fprintf(stderr, "\n%-24s %10s %12s %14s %10s\n", "PHASE", "CALLS", "TIME (ms)", "BYTES", "MB/s");
+        for (uint32_t i = 0; i < nb_stats_phases; i++) {
+            stats_phase* p = &stats_phases[i];
+            fprintf(stderr, "%-24s %10" PRIu64 " %12.3f %14" PRIu64, p->name, p->calls, (double)p->time / 1.0e6, p->bytes);
+            if (p->bytes != 0)
+                fprintf(stderr, " %10.1f", get_mb_per_s(p->bytes, p->time));
+            fprintf(stderr, "\n");
+        }
+        fprintf(stderr, "%s: %.3f ms wall time, %.1f MB peak RSS (phase times add up across threads)\n",
+            stats_app, (double)wall_time / 1.0e6, (double)peak_rss / (1024.0 * 1024.0));
+        return;
+    }
+
+    FILE* file = fopen_utf8(stats_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Can't create '%s'\n", stats_path);
+        return;
+    }
+    fprintf(file, "{\n    \"tool\": \"%s\",\n    \"wall_time_ns\": %" PRIu64 ",\n"
+        "    \"peak_rss\": %" PRIu64 ",\n    \"phases\": [", stats_app, wall_time, peak_rss);
+    for (uint32_t i = 0; i < nb_stats_phases; i++) {
+        stats_phase* p = &stats_phases[i];
+        fprintf(file, "%s\n        { \"name\": \"%s\", \"calls\": %" PRIu64 ", \"time_ns\": %" PRIu64
+            ", \"bytes\": %" PRIu64 ", \"mb_per_s\": %.3f }", (i == 0) ? "" : ",",
+            p->name, p->calls, p->time, p->bytes, get_mb_per_s(p->bytes, p->time));
+    }
+    fprintf(file, "\n    ]\n}\n");
+    if (fclose(file) != 0)
+        fprintf(stderr, "ERROR: Can't write '%s'\n", stats_path);
+}
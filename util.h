@@ -31,9 +31,16 @@
 
 #pragma once
 
+// Storage for globals that must not be shared when processing files concurrently
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 // Flags to indicate whether the data being processed or the platform are Big Endian
 typedef enum { big_endian = 0, little_endian = !0 } endianness;
-extern endianness data_endianness;
+extern THREAD_LOCAL endianness data_endianness;
 extern const endianness platform_endianness;
 
 #define _STRINGIFY(x) #x
@@ -123,6 +130,21 @@ char* _dirname_unix(const char* path);
 #define bswap_uint64 __builtin_bswap64
 #endif
 
+// Vector extensions that can be selected at runtime. SSE2 and NEON are part of
+// the x64 and ARM64 baselines, so only AVX2 needs to be detected.
+#if defined(__x86_64__) || defined(_M_X64)
+#define USE_SSE2
+#define USE_AVX2
+#if defined(_MSC_VER)
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+bool cpu_has_avx2(void);
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define USE_NEON
+#endif
+
 #define BSWAP_UINT16(x) x = bswap_uint16(x)
 #define BSWAP_UINT32(x) x = bswap_uint32(x)
 #define BSWAP_UINT64(x) x = bswap_uint64(x)
@@ -326,8 +348,136 @@ size_t get_trailing_slash(const char* path);
 bool is_file(const char* path);
 bool is_directory(const char* path);
 
+// Recursively list the regular files under dir, as sorted paths relative to dir.
+// Returns the number of files, or UINT32_MAX on error.
+uint32_t list_files(const char* dir, char*** list);
+void free_file_list(char** list, uint32_t nb_files);
+
 uint32_t read_file_max(const char* path, uint8_t** buf, uint32_t max_size);
 #define read_file(path, buf) read_file_max(path, buf, 0)
 uint64_t get_file_size(const char* path);
 void create_backup(const char* path);
 bool write_file(const uint8_t* buf, const uint32_t size, const char* path, const bool backup);
+
+// Files we write that are larger than this get their disk space reserved up front
+#define PREALLOCATE_THRESHOLD   (1024 * 1024)
+#define WRITE_BUFFER_SIZE       (1024 * 1024)
+
+// Create a file for writing, with a large stdio buffer, and with size_hint bytes
+// of disk space reserved (without changing the actual file size).
+FILE* create_file(const char* path, uint64_t size_hint);
+
+// Same as create_path(), but remembers which directories have already been
+// created or checked, which speeds up the extraction of many files
+bool create_path_cached(const char* dir);
+
+// Write a file, after creating its parent directories if needed
+bool write_output_file(const uint8_t* buf, const uint32_t size, const char* path);
+
+// Whole file view, that is memory mapped if possible, or read into a heap buffer
+// otherwise. The data may only be modified if the view was opened as copy_on_write,
+// and changes are never written back.
+typedef struct {
+    uint8_t*    data;
+    uint64_t    size;
+    bool        mapped;
+} file_view;
+bool open_file_view(const char* path, file_view* view, bool copy_on_write);
+void close_file_view(file_view* view);
+
+// Case insensitive path comparison, where '/' and '\' are equivalent
+int compare_paths(const char* a, const char* b);
+// Case insensitive glob matching, supporting '*' and '?', and where '/' and '\' are equivalent
+bool match_glob(const char* pattern, const char* str);
+
+// Positional read/write, that don't alter (or depend on) the stdio position of the file.
+// On Windows, concurrent calls on the same file may however leave its position undefined.
+bool read_at(FILE* file, void* buf, size_t size, uint64_t offset);
+bool write_at(FILE* file, const void* buf, size_t size, uint64_t offset);
+
+// Reserve the disk space for a file we are about to write, and set its size
+bool preallocate_file(FILE* file, uint64_t size);
+// Reserve the disk space for a file, without changing its size
+bool reserve_file_space(FILE* file, uint64_t size);
+
+// Copy size bytes from src at src_offset, to dst at dst_offset. In-kernel copies
+// (which may use reflinks) are used when the platform supports them.
+bool copy_file_data(FILE* src, uint64_t src_offset, FILE* dst, uint64_t dst_offset, uint64_t size);
+
+// XXH64 hash, used to detect content changes, either in one go or incrementally
+typedef struct {
+    uint64_t    v[4];
+    uint64_t    total_size;
+    uint8_t     mem[32];
+    uint32_t    mem_size;
+    uint64_t    seed;
+} xxhash64_state;
+void xxhash64_init(xxhash64_state* state, uint64_t seed);
+void xxhash64_update(xxhash64_state* state, const void* data, size_t size);
+uint64_t xxhash64_digest(const xxhash64_state* state);
+uint64_t xxhash64(const void* data, size_t size, uint64_t seed);
+
+// Read-only memory mapping of a whole file. Returns NULL if the file can't be mapped
+// (e.g. empty or larger than the address space), in which case regular reads should
+// be used instead. A copy_on_write mapping can be modified, but its pages count
+// against the commit limit, so it should only be used when needed.
+uint8_t* map_file(FILE* file, uint64_t* size, bool copy_on_write);
+void unmap_file(const uint8_t* map, uint64_t size);
+
+// Simple worker pool: fn() is invoked once for each job index in [0, nb_jobs), from
+// up to nb_threads threads. Jobs are dispensed in order, but may complete in any order.
+// thread_index is in [0, nb_threads) and can be used to access per-thread resources.
+// Processing stops as soon as one of the jobs returns false.
+typedef bool (*job_fn)(void* ctx, uint32_t thread_index, uint32_t job_index);
+uint32_t get_nb_cpus(void);
+// Parse the number of threads of a -j option, where 0 means one thread per CPU
+#define MAX_NB_THREADS      1024
+bool parse_nb_threads(const char* str, uint32_t* nb_threads);
+bool run_jobs(uint32_t nb_threads, uint32_t nb_jobs, job_fn fn, void* ctx);
+
+// Lock for the state that is shared between worker threads, and condition variable
+// to wait for that state to change (e.g. for the previous job to be written out)
+#if defined(_WIN32)
+typedef SRWLOCK mutex_t;
+#define MUTEX_INITIALIZER   SRWLOCK_INIT
+#define lock_mutex(m)       AcquireSRWLockExclusive(m)
+#define unlock_mutex(m)     ReleaseSRWLockExclusive(m)
+typedef CONDITION_VARIABLE cond_t;
+#define COND_INITIALIZER    CONDITION_VARIABLE_INIT
+#define wait_cond(c, m)     SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define signal_cond(c)      WakeAllConditionVariable(c)
+#else
+#include <pthread.h>
+typedef pthread_mutex_t mutex_t;
+#define MUTEX_INITIALIZER   PTHREAD_MUTEX_INITIALIZER
+#define lock_mutex(m)       pthread_mutex_lock(m)
+#define unlock_mutex(m)     pthread_mutex_unlock(m)
+typedef pthread_cond_t cond_t;
+#define COND_INITIALIZER    PTHREAD_COND_INITIALIZER
+#define wait_cond(c, m)     pthread_cond_wait(c, m)
+#define signal_cond(c)      pthread_cond_broadcast(c)
+#endif
+
+// Optional instrumentation, enabled with --stats (text report on stderr) or with
+// --stats=FILE (JSON report). Phases are identified by a static name and can be
+// nested, or timed from several threads, in which case their times add up.
+// When disabled, timing a phase only costs a test of stats_enabled.
+extern bool stats_enabled;
+uint64_t get_time_ns(void);
+uint64_t get_peak_rss(void);
+// Remove the --stats option from argv (it is moved past the new argc) and return the new argc
+int parse_stats_option(int argc, char** argv);
+void add_stats(const char* phase, uint64_t start, uint64_t bytes);
+void print_stats(void);
+
+static __inline uint64_t stats_start(void)
+{
+    return stats_enabled ? get_time_ns() : 0;
+}
+
+// Account for the time since start, along with the number of bytes processed
+static __inline void stats_stop(const char* phase, uint64_t start, uint64_t bytes)
+{
+    if (stats_enabled)
+        add_stats(phase, start, bytes);
+}